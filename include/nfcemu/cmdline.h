@@ -17,16 +17,24 @@
 #ifndef nfcemu_cmdline_h
 #define nfcemu_cmdline_h
 
+struct nfcemu_ctx;
+
+int
+nfc_cmd_snep(struct nfcemu_ctx* ctx, char* args);
+
+int
+nfc_cmd_nci(struct nfcemu_ctx* ctx, char* args);
+
 int
-nfc_cmd_snep(char* args);
+nfc_cmd_llcp(struct nfcemu_ctx* ctx, char* args);
 
 int
-nfc_cmd_nci(char*  args);
+nfc_cmd_tag(struct nfcemu_ctx* ctx, char* args);
 
 int
-nfc_cmd_llcp(char* args);
+nfc_cmd_stats(struct nfcemu_ctx* ctx, char* args);
 
 int
-nfc_cmd_tag(char* args);
+nfc_cmd_log(struct nfcemu_ctx* ctx, char* args);
 
 #endif
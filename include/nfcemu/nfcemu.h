@@ -18,32 +18,224 @@
 #define nfcemu_nfcemu_h
 
 #include <sys/types.h>
+#include <sys/uio.h>
 #include "types.h"
 
+struct nfcemu_ctx;
+struct nfcemu_tag_image;
 struct nfc_device;
 union nci_packet;
 
+/* statistics of the buffer pool for queued LLCP PDUs */
+struct nfcemu_pdu_pool_stats {
+  size_t cap; /* max. number of buffers in use, 0 for no limit */
+  size_t nbufs; /* buffers allocated from the system */
+  size_t nused; /* buffers currently in use */
+  size_t hwm; /* high-water mark of buffers in use */
+  size_t nfails; /* allocations refused by the pool */
+};
+
+enum {
+  /* bucket 0 counts latencies below 256 ns, bucket i > 0 those
+   * in [2^(7+i), 2^(8+i)) ns; the last bucket is open-ended */
+  NFCEMU_CMD_STATS_BUCKETS = 11
+};
+
+enum nfcemu_cmd_type {
+  NFCEMU_CMD_NCI = 0,
+  NFCEMU_CMD_HCI
+};
+
+/* statistics of one command in one state of the controller */
+struct nfcemu_cmd_stats {
+  enum nfcemu_cmd_type type;
+  unsigned int state; /* controller state when the command arrived */
+  unsigned int gid; /* NCI GID, or HCI service */
+  unsigned int oid; /* NCI OID, or HCI command */
+  unsigned long ncalls;
+  unsigned long nerrs; /* commands answered with an error, or not at all */
+  unsigned long nsemerrs; /* commands answered with a semantic error */
+  uint64_t ns; /* total time spent processing the command */
+  unsigned long hist[NFCEMU_CMD_STATS_BUCKETS];
+};
+
+enum nfcemu_log_level {
+  NFCEMU_LOG_NONE = 0,
+  NFCEMU_LOG_ERR,
+  NFCEMU_LOG_WARN,
+  NFCEMU_LOG_INFO,
+  NFCEMU_LOG_DEBUG
+};
+
+/* Output buffer for batched NCI processing. The emulator appends
+ * packets at 'tail' and the host consumes them from 'head'. Both
+ * are free-running byte counts; byte i lives at buf[i % size].
+ */
+struct nfc_nci_ring {
+  uint8_t* buf;
+  size_t size;
+  size_t head;
+  size_t tail;
+};
+
+/* Passing NULL for all four timeout callbacks makes the context
+ * run its timeouts on an internal timer wheel with 1 ms resolution.
+ * Its clock only moves with nfcemu_advance_time(), so hosts can run
+ * the emulator in real time or in virtual time.
+ */
+struct nfcemu_ctx*
+nfcemu_ctx_create(void* opaque,
+                  void (*log_msg)(const char* fmtstr, ...),
+                  void (*log_err)(const char* fmtstr, ...),
+                  nfcemu_timeout* (*new_timeout)(void (*cb)(void*),
+                                                 void* data),
+                  void (*mod_timeout)(nfcemu_timeout* t, unsigned long ms),
+                  void (*del_timeout)(nfcemu_timeout* t),
+                  int (*timeout_is_pending)(nfcemu_timeout* t),
+                  int (*send_ntf)(void* opaque,
+                                  ssize_t (*create)(void*,
+                                                    struct nfc_device*,
+                                                    size_t,
+                                                    union nci_packet*),
+                                  void* data),
+                  int (*send_dta)(void* opaque,
+                                  ssize_t (*create)(void*,
+                                                    struct nfc_device*,
+                                                    size_t,
+                                                    union nci_packet*),
+                                  void* data),
+                  int (*recv_dta)(void* opaque,
+                                  ssize_t (*handle)(void*,
+                                                    struct nfc_device*),
+                                  void* data));
+
+void
+nfcemu_ctx_destroy(struct nfcemu_ctx* ctx);
+
+void*
+nfcemu_ctx_get_opaque(const struct nfcemu_ctx* ctx);
+
+/* Tag memory lives in immutable, reference-counted images that any
+ * number of contexts can share. A context copies a page of its tag's
+ * memory only when it writes to it.
+ */
+
+/* Copies a raw memory dump, laid out as for the tag's type, into a
+ * new image. The caller holds one reference. */
+struct nfcemu_tag_image*
+nfcemu_tag_image_create(const void* mem, size_t len);
+
+/* Maps a raw memory dump from a file into a new image without copying
+ * it; reads are served from the page cache. Writes to the tag stay
+ * private to the context; the file is never modified. The file must
+ * not be truncated while the image is in use. Sets errno on errors. */
+struct nfcemu_tag_image*
+nfcemu_tag_image_map(const char* path);
+
+void
+nfcemu_tag_image_unref(struct nfcemu_tag_image* img);
+
+/* Makes the image the memory of remote endpoint 're's tag. The
+ * context takes its own reference. Fails if the RE is not a tag,
+ * or if the image's size does not fit the tag's type. */
+int
+nfcemu_ctx_set_tag_image(struct nfcemu_ctx* ctx, unsigned long re,
+                         struct nfcemu_tag_image* img);
+
+/* Returns a reference to an image of the tag's current memory, e.g.,
+ * to share a tag that has been set up with 'tag set'. */
+struct nfcemu_tag_image*
+nfcemu_ctx_get_tag_image(struct nfcemu_ctx* ctx, unsigned long re);
+
+/* Formats the tag of remote endpoint 're' with room for at least
+ * 'capacity' bytes of NDEF data; 0 restores the default layout.
+ * Large capacities use the tag type's dynamic memory layout: up to
+ * 2025 bytes for Type 2 Tags, up to 65535 blocks for Type 3 Tags
+ * and 32766 bytes for Type 4 Tags. Type 1 Tags only support the
+ * default layout. */
+int
+nfcemu_ctx_format_tag(struct nfcemu_ctx* ctx, unsigned long re,
+                      size_t capacity);
+
+/* Stores an NDEF message on the tag of remote endpoint 're'. Fails
+ * if the message does not fit into the tag's memory. */
+int
+nfcemu_ctx_set_tag_ndef(struct nfcemu_ctx* ctx, unsigned long re,
+                        const void* msg, size_t len);
+
+/* Removes up to 'len' bytes from the data that the host sent to
+ * remote endpoint 're' and that the RE's protocol didn't consume,
+ * e.g., bytes after a tag command. Each RE buffers up to 64 KiB;
+ * the emulator drops data beyond that until the host reads some.
+ * Returns the number of bytes, or -1 if there is no such RE. */
+ssize_t
+nfcemu_ctx_read_re_data(struct nfcemu_ctx* ctx, unsigned long re,
+                        void* buf, size_t len);
+
+ssize_t
+nfcemu_ctx_readv_re_data(struct nfcemu_ctx* ctx, unsigned long re,
+                         const struct iovec* iov, size_t iovcnt);
+
+/* The functions below drive the internal timer wheel. */
+
+/* Advances the clock by 'ns' and runs the expired timeouts in order
+ * of expiry. Returns the number of timeouts that ran. */
+size_t
+nfcemu_advance_time(struct nfcemu_ctx* ctx, uint64_t ns);
+
+/* Stores the time until the next timeout expires in 'ns'. Returns
+ * -1 if no timeout is pending. */
 int
-nfcemu_init(void (*log_msg)(const char* fmtstr, ...),
-            void (*log_err)(const char* fmtstr, ...),
-            nfcemu_timeout* (*new_timeout)(void (*cb)(void*), void* data),
-            void (*mod_timeout)(nfcemu_timeout* t, unsigned long ms),
-            void (*del_timeout)(nfcemu_timeout* t),
-            int (*timeout_is_pending)(nfcemu_timeout* t),
-            int (*send_ntf)(ssize_t (*create)(void*, struct nfc_device*,
-                                              size_t, union nci_packet*),
-                            void* data),
-            int (*send_dta)(ssize_t (*create)(void*, struct nfc_device*,
-                                              size_t, union nci_packet*),
-                            void* data),
-            int (*recv_dta)(ssize_t (*handle)(void*, struct nfc_device*),
-                            void* data));
+nfcemu_next_timeout(const struct nfcemu_ctx* ctx, uint64_t* ns);
+
+/* Virtual time: jumps the clock straight to the next deadline and
+ * runs the timeouts that expire there. Returns 0 if no timeout is
+ * pending, or the number of timeouts that ran. */
+size_t
+nfcemu_advance_to_next_timeout(struct nfcemu_ctx* ctx);
+
+/* Returns the clock of the timer wheel in ns. */
+uint64_t
+nfcemu_get_time(const struct nfcemu_ctx* ctx);
+
+/* Limits the number of LLCP PDUs queued at the same time. PDUs
+ * beyond the limit are dropped. 0 removes the limit.
+ */
+void
+nfcemu_ctx_set_pdu_pool_cap(struct nfcemu_ctx* ctx, size_t cap);
+
+void
+nfcemu_ctx_get_pdu_pool_stats(const struct nfcemu_ctx* ctx,
+                              struct nfcemu_pdu_pool_stats* stats);
+
+/* Records all traffic between host and emulator into a binary
+ * trace file; see <nfcemu/trace.h> for the format.
+ */
+int
+nfcemu_ctx_start_trace(struct nfcemu_ctx* ctx, const char* path);
+
+int
+nfcemu_ctx_stop_trace(struct nfcemu_ctx* ctx);
 
 void
-nfcemu_uninit(void);
+nfcemu_ctx_set_log_level(struct nfcemu_ctx* ctx, enum nfcemu_log_level level);
+
+enum nfcemu_log_level
+nfcemu_ctx_get_log_level(const struct nfcemu_ctx* ctx);
+
+/* Removes up to 'n' messages from the context's log and hands them
+ * to 'func', along with their level and a monotonic time stamp in
+ * ns. This may run in another thread than the emulator, but only in
+ * one thread at a time. Returns the number of messages.
+ */
+size_t
+nfcemu_ctx_drain_log(struct nfcemu_ctx* ctx,
+                     void (*func)(void* data, enum nfcemu_log_level level,
+                                  uint64_t ts, const char* msg),
+                     void* data, size_t n);
 
 struct nfc_device*
-nfc_device_create(void);
+nfc_device_create(struct nfcemu_ctx* ctx);
 
 void
 nfc_device_destroy(struct nfc_device* nfc);
@@ -53,9 +245,57 @@ nfc_device_process_nci_msg(struct nfc_device* nfc,
                            const uint8_t* cmd, uint8_t* rsp,
                            struct nfc_delivery_cb* cb);
 
+/* Processes a sequence of NCI packets, one per iovec, in order and
+ * appends all responses, notifications and data packets to the ring,
+ * including the segments of long frames. Processing stops early at a
+ * malformed packet, or if the ring cannot hold the output of another
+ * packet; a data packet may need room for a frame of 4096 bytes with
+ * a 3-byte header per segment. Returns the number of processed
+ * packets.
+ *
+ * Notifications that the emulator sends on its own, such as RF field
+ * information, and timed data, such as the LLCP traffic of remote
+ * endpoints, still go through send_ntf and send_dta.
+ */
+size_t
+nfc_device_process_nci_batch(struct nfc_device* nfc,
+                             const struct iovec* in, size_t n,
+                             struct nfc_nci_ring* out);
+
 int
 nfc_device_process_hci_msg(struct nfc_device* nfc,
                            const uint8_t* cmd, uint8_t* rsp,
                            struct nfc_delivery_cb* cb);
 
+/* Copies the statistics of up to 'n' commands that have been
+ * processed since the last reset. Returns the number of commands
+ * with statistics, which may be larger than 'n'.
+ */
+size_t
+nfc_device_get_cmd_stats(const struct nfc_device* nfc,
+                         struct nfcemu_cmd_stats* stats, size_t n);
+
+void
+nfc_device_reset_cmd_stats(struct nfc_device* nfc);
+
+/* Serializes the device's state into 'buf': the controller and
+ * RF state, configuration and logical connections, the state and
+ * queued PDUs of all remote endpoints, and the tags' memory. The
+ * blob starts with the magic "NFCS" and a version byte. Returns the
+ * blob's length; if that is larger than 'len', the buffer's content
+ * is undefined. Pass a NULL buffer to query the length.
+ *
+ * Statistics, traces and log messages are not part of a snapshot.
+ */
+size_t
+nfcemu_snapshot(const struct nfc_device* nfc, void* buf, size_t len);
+
+/* Restores a snapshot that has been taken by the same build of the
+ * emulator. Pending link timeouts start over. On errors, the device
+ * and the remote endpoints are reset; tag memory may have been
+ * partially restored.
+ */
+int
+nfcemu_restore(struct nfc_device* nfc, const void* buf, size_t len);
+
 #endif
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef nfcemu_trace_h
+#define nfcemu_trace_h
+
+/* Binary trace format
+ *
+ * A trace file starts with an 8-byte header: the magic "NFCT", a
+ * version byte and three reserved bytes. Records follow back-to-back.
+ * Each record has an 11-byte header, followed by 'len' bytes of data:
+ *
+ *   uint8_t type;   enum nfc_trace_type
+ *   uint16_t len;   little endian
+ *   uint64_t ts;    little endian; ns since the trace started
+ *
+ * Packets from the host are recorded before they are processed. The
+ * emulator's answers are recorded in the order they are created.
+ * Timeouts are not recorded: a replayer reproduces them by letting
+ * its clock follow the records' timestamps.
+ */
+
+enum {
+  NFC_TRACE_VERSION = 1,
+  NFC_TRACE_FILE_HEADER_LENGTH = 8,
+  NFC_TRACE_RECORD_HEADER_LENGTH = 11
+};
+
+#define NFC_TRACE_MAGIC "NFCT"
+
+enum nfc_trace_type {
+  /* from the host */
+  NFC_TRACE_NCI_MSG = 0x01, /* NCI command or data packet */
+  NFC_TRACE_HCI_MSG = 0x02, /* HCI command */
+  NFC_TRACE_CMDLINE = 0x03, /* enum nfc_trace_cmdline, then the arguments */
+  /* from the emulator */
+  NFC_TRACE_NCI_RSP = 0x81, /* result of an NCI message; may be empty */
+  NFC_TRACE_HCI_RSP = 0x82, /* result of an HCI command; may be empty */
+  NFC_TRACE_DELIVERY = 0x83, /* packet created by the delivery callback */
+  NFC_TRACE_NTF = 0x84, /* packet sent with send_ntf */
+  NFC_TRACE_DTA = 0x85 /* packet sent with send_dta */
+};
+
+enum nfc_trace_cmdline {
+  NFC_TRACE_CMDLINE_SNEP = 0,
+  NFC_TRACE_CMDLINE_NCI,
+  NFC_TRACE_CMDLINE_LLCP,
+  NFC_TRACE_CMDLINE_TAG,
+  NFC_TRACE_CMDLINE_STATS,
+  NFC_TRACE_CMDLINE_LOG
+};
+
+#endif
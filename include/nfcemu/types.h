@@ -38,7 +38,8 @@ struct nfc_delivery_cb {
 };
 
 enum {
-  MAX_NCI_PAYLOAD_LENGTH = 256
+  MAX_NCI_PAYLOAD_LENGTH = 256,
+  MAX_NCI_PACKET_LENGTH = 3 + MAX_NCI_PAYLOAD_LENGTH
 };
 
 #endif
@@ -17,17 +17,22 @@
 LOCAL_PATH := $(call my-dir)
 
 nfcemu_SRC_FILES := base64.c\
-                    cb.c \
                     cmdline.c \
                     llcp.c \
                     llcp-snep.c \
                     ndef.c \
                     nfc.c \
                     nfc-hci.c \
+                    nfc-log.c \
                     nfc-nci.c \
                     nfc-re.c \
                     nfc-rf.c \
+                    nfc-ring.c \
+                    nfc-snapshot.c \
+                    nfc-stats.c \
                     nfc-tag.c \
+                    nfc-timer.c \
+                    nfc-trace.c \
                     nfcemu.c \
                     snep.c
 
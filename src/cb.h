@@ -33,15 +33,16 @@ struct nfcemu_cb {
   void (*del_timeout)(nfcemu_timeout* t);
   int (*timeout_is_pending)(nfcemu_timeout* t);
 
-  /* I/O callbacks */
-  int (*send_ntf)(ssize_t (*create)(void*, struct nfc_device*,
+  /* I/O callbacks; the first argument is the context's opaque pointer */
+  int (*send_ntf)(void* opaque,
+                  ssize_t (*create)(void*, struct nfc_device*,
                                     size_t, union nci_packet*),
                   void* data);
-  int (*send_dta)(ssize_t (*create)(void*, struct nfc_device*,
+  int (*send_dta)(void* opaque,
+                  ssize_t (*create)(void*, struct nfc_device*,
                                     size_t, union nci_packet*),
                   void* data);
-  int (*recv_dta)(ssize_t (*handle)(void*, struct nfc_device*),
+  int (*recv_dta)(void* opaque,
+                  ssize_t (*handle)(void*, struct nfc_device*),
                   void* data);
 };
-
-extern struct nfcemu_cb cb;
@@ -16,6 +16,8 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "ptr.h"
@@ -25,9 +27,10 @@
 #include "nfc-re.h"
 #include "nfc.h"
 #include "nfc-nci.h"
+#include "nfc-stats.h"
 #include "nfc-tag.h"
 #include "snep.h"
-#include "cb.h"
+#include "ctx.h"
 
 struct nfc_ndef_record_param {
     unsigned long flags;
@@ -47,7 +50,8 @@ struct nfc_ndef_record_param {
     }
 
 ssize_t
-build_ndef_msg(const struct nfc_ndef_record_param* record, size_t nrecords,
+build_ndef_msg(struct nfcemu_ctx* ctx,
+               const struct nfc_ndef_record_param* record, size_t nrecords,
                uint8_t* buf, size_t len)
 {
     size_t off;
@@ -100,8 +104,8 @@ build_ndef_msg(const struct nfc_ndef_record_param* record, size_t nrecords,
         if (res < 0) {
             return -1;
         } else if ((res > 255) && (flags & NDEF_FLAG_SR)) {
-            cb.log_err("KO: NDEF flag SR set for long payload of %zu bytes",
-                       res);
+            ctx->cb.log_err("KO: NDEF flag SR set for long payload of %zu bytes",
+                            res);
             return -1;
         }
         ndef_rec_set_payload_len(ndef, res);
@@ -110,15 +114,39 @@ build_ndef_msg(const struct nfc_ndef_record_param* record, size_t nrecords,
     return off;
 }
 
+/* Returns an upper bound for the length of the NDEF message that
+ * build_ndef_msg() creates from the records. */
+static size_t
+ndef_msg_maxlen(const struct nfc_ndef_record_param* record, size_t nrecords)
+{
+    size_t len;
+    size_t i;
+
+    assert(record || !nrecords);
+
+    len = 0;
+
+    for (i = 0; i < nrecords; ++i, ++record) {
+        /* each 4 base64 characters decode to 3 bytes */
+        len += sizeof(struct ndef_rec) + sizeof(struct ndef_rec_fields) +
+               ((strlen(record->type) + 3) / 4) * 3 +
+               ((strlen(record->id) + 3) / 4) * 3 +
+               ((strlen(record->payload) + 3) / 4) * 3;
+    }
+    return len;
+}
+
 struct nfc_snep_param {
+    struct nfcemu_ctx* ctx;
     long dsap;
     long ssap;
     size_t nrecords;
     struct nfc_ndef_record_param record[4];
 };
 
-#define NFC_SNEP_PARAM_INIT() \
+#define NFC_SNEP_PARAM_INIT(_ctx) \
     { \
+        .ctx = (_ctx), \
         .dsap = LLCP_SAP_LM, \
         .ssap = LLCP_SAP_LM, \
         .nrecords = 0, \
@@ -139,7 +167,7 @@ create_snep_cp(void *data, size_t len, struct snep* snep)
     param = data;
     assert(param);
 
-    res = build_ndef_msg(param->record, param->nrecords,
+    res = build_ndef_msg(param->ctx, param->record, param->nrecords,
                          snep->info, len-sizeof(*snep));
     if (res < 0) {
         return -1;
@@ -152,14 +180,17 @@ nfc_send_snep_put_cb(void* data,
                      struct nfc_device* nfc,
                      size_t maxlen, union nci_packet* ntf)
 {
+    struct nfcemu_ctx* ctx;
     struct nfc_snep_param* param;
     ssize_t res;
 
     param = data;
     assert(param);
 
+    ctx = param->ctx;
+
     if (!nfc->active_re) {
-        cb.log_err("KO: no active remote endpoint\n");
+        ctx->cb.log_err("KO: no active remote endpoint\n");
         return -1;
     }
     if ((param->dsap < 0) && (param->ssap < 0)) {
@@ -167,9 +198,12 @@ nfc_send_snep_put_cb(void* data,
         param->ssap = nfc->active_re->last_ssap;
     }
     res = nfc_re_send_snep_put(nfc->active_re, param->dsap, param->ssap,
+                               sizeof(struct snep) +
+                               ndef_msg_maxlen(param->record,
+                                               param->nrecords),
                                create_snep_cp, data);
     if (res < 0) {
-        cb.log_err("KO: 'snep put' failed\r\n");
+        ctx->cb.log_err("KO: 'snep put' failed\r\n");
         return -1;
     }
     return res;
@@ -179,15 +213,18 @@ static ssize_t
 nfc_recv_process_ndef_cb(void* data, size_t len, const struct ndef_rec* ndef)
 {
     const struct nfc_snep_param* param;
+    struct nfcemu_ctx* ctx;
     ssize_t remain;
     char base64[3][512];
 
     param = data;
     assert(param);
 
+    ctx = param->ctx;
+
     remain = len;
 
-    cb.log_msg("[");
+    ctx->cb.log_msg("[");
 
     while (remain) {
         size_t tlen, plen, ilen, reclen;
@@ -205,7 +242,7 @@ nfc_recv_process_ndef_cb(void* data, size_t len, const struct ndef_rec* ndef)
                              base64[2], sizeof(base64[2]));
 
         /* print NDEF message in JSON format */
-        cb.log_msg("{\"tnf\": %d,"
+        ctx->cb.log_msg("{\"tnf\": %d,"
                    " \"type\": \"%.*s\","
                    " \"id\": \"%.*s\","
                    " \"payload\": \"%.*s\"}",
@@ -217,24 +254,27 @@ nfc_recv_process_ndef_cb(void* data, size_t len, const struct ndef_rec* ndef)
         remain -= reclen;
         ndef = (const struct ndef_rec*)(((const unsigned char*)ndef) + reclen);
         if (remain) {
-          cb.log_msg(","); /* more to come */
+          ctx->cb.log_msg(","); /* more to come */
         }
     }
-    cb.log_msg("]\r\n");
+    ctx->cb.log_msg("]\r\n");
     return 0;
 }
 
 static ssize_t
 nfc_recv_snep_put_cb(void* data,  struct nfc_device* nfc)
 {
+    struct nfcemu_ctx* ctx;
     struct nfc_snep_param* param;
     ssize_t res;
 
     param = data;
     assert(param);
 
+    ctx = param->ctx;
+
     if (!nfc->active_re) {
-        cb.log_err("KO: no active remote endpoint\r\n");
+        ctx->cb.log_err("KO: no active remote endpoint\r\n");
         return -1;
     }
     if ((param->dsap < 0) && (param->ssap < 0)) {
@@ -244,14 +284,15 @@ nfc_recv_snep_put_cb(void* data,  struct nfc_device* nfc)
     res = nfc_re_recv_snep_put(nfc->active_re, param->dsap, param->ssap,
                                nfc_recv_process_ndef_cb, data);
     if (res < 0) {
-        cb.log_err("KO: 'snep put' failed\r\n");
+        ctx->cb.log_err("KO: 'snep put' failed\r\n");
         return -1;
     }
     return 0;
 }
 
 static const char*
-lex_token(const char* field, const char* delim, char** args)
+lex_token(struct nfcemu_ctx* ctx, const char* field, const char* delim,
+          char** args)
 {
     const char *tok;
 
@@ -259,27 +300,28 @@ lex_token(const char* field, const char* delim, char** args)
 
     tok = strsep(args, delim);
     if (!tok) {
-        cb.log_err("KO: no token %s given\r\n", field);
+        ctx->cb.log_err("KO: no token %s given\r\n", field);
         return NULL;
     }
     return tok;
 }
 
 static int
-parse_token_l(const char* field, const char* delim, char** args, long* val)
+parse_token_l(struct nfcemu_ctx* ctx, const char* field, const char* delim,
+              char** args, long* val)
 {
     const char* tok;
 
     assert(val);
 
-    tok = lex_token(field, delim, args);
+    tok = lex_token(ctx, field, delim, args);
     if (!tok) {
         return -1;
     }
     errno = 0;
     *val = strtol(tok, NULL, 0);
     if (errno) {
-        cb.log_err("KO: invalid value '%s' for token %s, error %d(%s)\r\n",
+        ctx->cb.log_err("KO: invalid value '%s' for token %s, error %d(%s)\r\n",
                    tok, field, errno, strerror(errno));
         return -1;
     }
@@ -287,21 +329,21 @@ parse_token_l(const char* field, const char* delim, char** args, long* val)
 }
 
 static int
-parse_token_ul(const char* field, const char* delim,
+parse_token_ul(struct nfcemu_ctx* ctx, const char* field, const char* delim,
                char** args, unsigned long* val)
 {
     const char* tok;
 
     assert(val);
 
-    tok = lex_token(field, delim, args);
+    tok = lex_token(ctx, field, delim, args);
     if (!tok) {
         return -1;
     }
     errno = 0;
     *val = strtoul(tok, NULL, 0);
     if (errno) {
-        cb.log_err("KO: invalid value '%s' for token %s, error %d(%s)\r\n",
+        ctx->cb.log_err("KO: invalid value '%s' for token %s, error %d(%s)\r\n",
                    tok, field, errno, strerror(errno));
         return -1;
     }
@@ -309,36 +351,37 @@ parse_token_ul(const char* field, const char* delim,
 }
 
 static int
-parse_token_s(const char* field, const char* delim,
+parse_token_s(struct nfcemu_ctx* ctx, const char* field, const char* delim,
               char** args, const char** val, int allow_empty)
 {
     // TODO: we could add support for escaped characters, if necessary
 
     assert(val);
 
-    *val = lex_token(field, delim, args);
+    *val = lex_token(ctx, field, delim, args);
     if (!*val) {
         return -1;
     }
     if (!allow_empty && !(*val)[0]) {
-        cb.log_err("KO: empty token %s\r\n", field);
+        ctx->cb.log_err("KO: empty token %s\r\n", field);
         return -1;
     }
     return 0;
 }
 
 static int
-parse_sap(const char* field, char** args, long* sap, int can_autodetect)
+parse_sap(struct nfcemu_ctx* ctx, const char* field, char** args, long* sap,
+          int can_autodetect)
 {
     assert(args);
     assert(sap);
 
-    if (parse_token_l(field, " ", args, sap) < 0) {
+    if (parse_token_l(ctx, field, " ", args, sap) < 0) {
         return -1;
     }
     if (((*sap == -1) && !can_autodetect) ||
          (*sap < -1) || !(*sap < LLCP_NUMBER_OF_SAPS)) {
-        cb.log_err("KO: invalid %s '%ld'\r\n",
+        ctx->cb.log_err("KO: invalid %s '%ld'\r\n",
                       field, *sap);
         return -1;
     }
@@ -350,7 +393,8 @@ parse_sap(const char* field, char** args, long* sap, int can_autodetect)
  * are given in base64url encoding.
  */
 static int
-parse_ndef_rec(char** args, struct nfc_ndef_record_param* record)
+parse_ndef_rec(struct nfcemu_ctx* ctx, char** args,
+               struct nfc_ndef_record_param* record)
 {
     const char* p;
     unsigned long tnf;
@@ -361,57 +405,58 @@ parse_ndef_rec(char** args, struct nfc_ndef_record_param* record)
     /* read opening bracket */
     p = strsep(args, "[");
     if (!p) {
-        cb.log_err("KO: no NDEF record given\r\n");
+        ctx->cb.log_err("KO: no NDEF record given\r\n");
         return -1;
     }
     /* read flags */
-    if (parse_token_ul("NDEF flags", " ,", args, &record->flags) < 0) {
+    if (parse_token_ul(ctx, "NDEF flags", " ,", args, &record->flags) < 0) {
         return -1;
     }
     if (record->flags & ~NDEF_FLAG_BITS) {
-        cb.log_err("KO: invalid NDEF flags '%u'\r\n",
+        ctx->cb.log_err("KO: invalid NDEF flags '%u'\r\n",
                       record->flags);
         return -1;
     }
     /* read TNF */
-    if (parse_token_ul("NDEF TNF", " ,", args, &tnf) < 0) {
+    if (parse_token_ul(ctx, "NDEF TNF", " ,", args, &tnf) < 0) {
         return -1;
     }
     if (!(tnf < NDEF_NUMBER_OF_TNFS)) {
-        cb.log_err("KO: invalid NDEF TNF '%u'\r\n",
+        ctx->cb.log_err("KO: invalid NDEF TNF '%u'\r\n",
                    record->tnf);
         return -1;
     }
     record->tnf = tnf;
     /* read type */
-    if (parse_token_s("NDEF type", " ,", args, &record->type, 0) < 0) {
+    if (parse_token_s(ctx, "NDEF type", " ,", args, &record->type, 0) < 0) {
         return -1;
     }
     /* read id; might by empty */
-    if (parse_token_s("NDEF id", " ,", args, &record->id, 1) < 0) {
+    if (parse_token_s(ctx, "NDEF id", " ,", args, &record->id, 1) < 0) {
         return -1;
     }
     /* read payload */
-    if (parse_token_s("NDEF payload", "]", args, &record->payload, 0) < 0) {
+    if (parse_token_s(ctx, "NDEF payload", "]", args, &record->payload, 0) < 0) {
         return -1;
     }
     return 0;
 }
 
 static ssize_t
-parse_ndef_msg(char** args, size_t nrecs, struct nfc_ndef_record_param* rec)
+parse_ndef_msg(struct nfcemu_ctx* ctx, char** args, size_t nrecs,
+               struct nfc_ndef_record_param* rec)
 {
     size_t i;
 
     assert(args);
 
     for (i = 0; i < nrecs && *args && strlen(*args); ++i) {
-        if (parse_ndef_rec(args, rec+i) < 0) {
+        if (parse_ndef_rec(ctx, args, rec+i) < 0) {
           return -1;
         }
     }
     if (*args && strlen(*args)) {
-        cb.log_err("KO: invalid characters near EOL: %s\r\n",
+        ctx->cb.log_err("KO: invalid characters near EOL: %s\r\n",
                    *args);
         return -1;
     }
@@ -419,105 +464,110 @@ parse_ndef_msg(char** args, size_t nrecs, struct nfc_ndef_record_param* rec)
 }
 
 static int
-parse_re_index(char** args, unsigned long nres, unsigned long* i)
+parse_re_index(struct nfcemu_ctx* ctx, char** args, unsigned long nres,
+               unsigned long* i)
 {
     assert(i);
 
-    if (parse_token_ul("remote endpoint", " ", args, i) < 0) {
+    if (parse_token_ul(ctx, "remote endpoint", " ", args, i) < 0) {
         return -1;
     }
     if (!(*i < nres)) {
-        cb.log_err("KO: unknown remote endpoint %lu\r\n", *i);
+        ctx->cb.log_err("KO: unknown remote endpoint %lu\r\n", *i);
         return -1;
     }
     return 0;
 }
 
 static int
-parse_nci_ntf_type(char** args, unsigned long* ntype)
+parse_nci_ntf_type(struct nfcemu_ctx* ctx, char** args, unsigned long* ntype)
 {
     assert(ntype);
 
-    if (parse_token_ul("discover notification type", " ", args, ntype) < 0) {
+    if (parse_token_ul(ctx, "discover notification type", " ", args, ntype) < 0) {
         return -1;
     }
     if (!(*ntype < NUMBER_OF_NCI_NOTIFICATION_TYPES)) {
-        cb.log_err("KO: unknown discover notification type %lu\r\n", *ntype);
+        ctx->cb.log_err("KO: unknown discover notification type %lu\r\n", *ntype);
         return -1;
     }
     return 0;
 }
 
 static int
-parse_rf_index(char** args, long* rf)
+parse_rf_index(struct nfcemu_ctx* ctx, char** args, long* rf)
 {
     assert(rf);
 
-    if (parse_token_l("rf index", " ", args, rf) < 0) {
+    if (parse_token_l(ctx, "rf index", " ", args, rf) < 0) {
         return -1;
     }
     if (*rf < -1 || *rf >= NUMBER_OF_SUPPORTED_NCI_RF_INTERFACES) {
-        cb.log_err("KO: unknown rf index %lu\r\n", *rf);
+        ctx->cb.log_err("KO: unknown rf index %lu\r\n", *rf);
         return -1;
     }
     return 0;
 }
 
 static int
-parse_nci_deactivate_ntf_type(char** args, unsigned long* dtype)
+parse_nci_deactivate_ntf_type(struct nfcemu_ctx* ctx, char** args,
+                              unsigned long* dtype)
 {
     assert(dtype);
 
-    if (parse_token_ul("deactivate notification type", " ", args, dtype) < 0) {
+    if (parse_token_ul(ctx, "deactivate notification type", " ", args, dtype) < 0) {
         return -1;
     }
     if (!(*dtype < NUMBER_OF_NCI_RF_DEACT_TYPE)) {
-        cb.log_err("KO: unknown deactivate notification type %lu\r\n", *dtype);
+        ctx->cb.log_err("KO: unknown deactivate notification type %lu\r\n", *dtype);
         return -1;
     }
     return 0;
 }
 
 static int
-parse_nci_deactivate_ntf_reason(char** args, unsigned long* dreason)
+parse_nci_deactivate_ntf_reason(struct nfcemu_ctx* ctx, char** args,
+                                unsigned long* dreason)
 {
     assert(dreason);
 
-    if (parse_token_ul("deactivate notification reason", " ", args, dreason) < 0) {
+    if (parse_token_ul(ctx, "deactivate notification reason", " ", args, dreason) < 0) {
         return -1;
     }
     if (!(*dreason < NUMBER_OF_NCI_RF_DEACT_REASON)) {
-        cb.log_err("KO: unknown deactivate notification reason %lu\r\n", *dreason);
+        ctx->cb.log_err("KO: unknown deactivate notification reason %lu\r\n", *dreason);
         return -1;
     }
     return 0;
 }
 
 int
-nfc_cmd_snep(char* args)
+nfc_cmd_snep(struct nfcemu_ctx* ctx, char* args)
 {
     char *p;
 
+    ctx_trace_cmdline(ctx, NFC_TRACE_CMDLINE_SNEP, args);
+
     if (!args) {
-        cb.log_err("KO: no arguments given\r\n");
+        ctx->cb.log_err("KO: no arguments given\r\n");
         return -1;
     }
 
     p = strsep(&args, " ");
     if (!p) {
-        cb.log_err("KO: no operation given\r\n");
+        ctx->cb.log_err("KO: no operation given\r\n");
         return -1;
     }
     if (!strcmp(p, "put")) {
         ssize_t nrecords;
-        struct nfc_snep_param param = NFC_SNEP_PARAM_INIT();
+        struct nfc_snep_param param = NFC_SNEP_PARAM_INIT(ctx);
 
         /* read DSAP */
-        if (parse_sap("DSAP", &args, &param.dsap, 1) < 0) {
+        if (parse_sap(ctx, "DSAP", &args, &param.dsap, 1) < 0) {
             return -1;
         }
         /* read SSAP */
-        if (parse_sap("SSAP", &args, &param.ssap, 1) < 0) {
+        if (parse_sap(ctx, "SSAP", &args, &param.ssap, 1) < 0) {
             return -1;
         }
         /* The emulator supports up to 4 records per NDEF
@@ -525,7 +575,7 @@ nfc_cmd_snep(char* args)
          * will print the current content of the LLCP data-
          * link buffer.
          */
-        nrecords = parse_ndef_msg(&args, ARRAY_SIZE(param.record),
+        nrecords = parse_ndef_msg(ctx, &args, ARRAY_SIZE(param.record),
                                   param.record);
         if (nrecords < 0) {
             return -1;
@@ -533,19 +583,19 @@ nfc_cmd_snep(char* args)
         param.nrecords = nrecords;
         if (param.nrecords) {
             /* put SNEP request onto SNEP server */
-            if (cb.send_dta(nfc_send_snep_put_cb, &param) < 0) {
+            if (ctx_send_dta(ctx, nfc_send_snep_put_cb, &param) < 0) {
                 /* error message generated in create function */
                 return -1;
             }
         } else {
             /* put SNEP request onto SNEP server */
-            if (cb.recv_dta(nfc_recv_snep_put_cb, &param) < 0) {
+            if (ctx_recv_dta(ctx, nfc_recv_snep_put_cb, &param) < 0) {
                 /* error message generated in create function */
                 return -1;
             }
         }
     } else {
-        cb.log_err("KO: invalid operation '%s'\r\n", p);
+        ctx->cb.log_err("KO: invalid operation '%s'\r\n", p);
         return -1;
     }
 
@@ -575,10 +625,11 @@ nfc_rf_discovery_ntf_cb(void* data,
                         union nci_packet* ntf)
 {
     ssize_t res;
+    struct nfcemu_ctx* ctx = nfc->ctx;
     const struct nfc_ntf_param* param = data;
     res = nfc_create_rf_discovery_ntf(param->re, param->ntype, nfc, ntf);
     if (res < 0) {
-        cb.log_err("KO: rf_discover_ntf failed\r\n");
+        ctx->cb.log_err("KO: rf_discover_ntf failed\r\n");
         return -1;
     }
     return res;
@@ -590,10 +641,11 @@ nfc_rf_intf_activated_ntf_cb(void* data,
                              union nci_packet* ntf)
 {
     ssize_t res;
+    struct nfcemu_ctx* ctx = nfc->ctx;
     struct nfc_ntf_param* param = data;
     if (!param->re) {
         if (!nfc->active_re) {
-            cb.log_err("KO: no active remote-endpoint\n");
+            ctx->cb.log_err("KO: no active remote-endpoint\n");
             return -1;
         }
         param->re = nfc->active_re;
@@ -607,7 +659,7 @@ nfc_rf_intf_activated_ntf_cb(void* data,
                                                           param->re->rfproto,
                                                           param->re->mode);
         if (!nfc->active_rf) {
-            cb.log_err("KO: no active rf interface\r\n");
+            ctx->cb.log_err("KO: no active rf interface\r\n");
             return -1;
         }
     } else {
@@ -616,7 +668,7 @@ nfc_rf_intf_activated_ntf_cb(void* data,
 
     res = nfc_create_rf_intf_activated_ntf(param->re, nfc, ntf);
     if (res < 0) {
-        cb.log_err("KO: rf_intf_activated_ntf failed\r\n");
+        ctx->cb.log_err("KO: rf_intf_activated_ntf failed\r\n");
         return -1;
     }
     return res;
@@ -628,51 +680,64 @@ nfc_rf_intf_deactivate_ntf_cb(void* data,
                               union nci_packet* ntf)
 {
     ssize_t res;
+    struct nfcemu_ctx* ctx;
     struct nfc_ntf_param* param = data;
 
     assert(data);
     assert(nfc);
 
+    ctx = nfc->ctx;
+
     res = nfc_create_deactivate_ntf(param->dtype, param->dreason, ntf);
     if (res < 0) {
-        cb.log_err("KO: rf_intf_deactivate_ntf failed\r\n");
+        ctx->cb.log_err("KO: rf_intf_deactivate_ntf failed\r\n");
         return -1;
     }
     return res;
 }
 
+static ssize_t
+nfc_set_credits_cb(void* data, struct nfc_device* nfc)
+{
+    nfc->ncredits = *(const unsigned long*)data;
+
+    return 0;
+}
+
 int
-nfc_cmd_nci(char*  args)
+nfc_cmd_nci(struct nfcemu_ctx* ctx, char* args)
 {
     char *p;
 
+    ctx_trace_cmdline(ctx, NFC_TRACE_CMDLINE_NCI, args);
+
     if (!args) {
-        cb.log_err("KO: no arguments given\r\n");
+        ctx->cb.log_err("KO: no arguments given\r\n");
         return -1;
     }
 
     /* read notification type */
     p = strsep(&args, " ");
     if (!p) {
-        cb.log_err("KO: no operation given\r\n");
+        ctx->cb.log_err("KO: no operation given\r\n");
         return -1;
     }
     if (!strcmp(p, "rf_discover_ntf")) {
         unsigned long i;
         struct nfc_ntf_param param = NFC_NTF_PARAM_INIT();
         /* read remote-endpoint index */
-        if (parse_re_index(&args, ARRAY_SIZE(nfc_res), &i) < 0) {
+        if (parse_re_index(ctx, &args, ARRAY_SIZE(ctx->res), &i) < 0) {
             return -1;
         }
-        param.re = nfc_res + i;
+        param.re = ctx->res + i;
 
         /* read discover notification type */
-        if (parse_nci_ntf_type(&args, &param.ntype) < 0) {
+        if (parse_nci_ntf_type(ctx, &args, &param.ntype) < 0) {
             return -1;
         }
 
         /* generate RF_DISCOVER_NTF */
-        if (cb.send_ntf(nfc_rf_discovery_ntf_cb, &param) < 0) {
+        if (ctx_send_ntf(ctx, nfc_rf_discovery_ntf_cb, &param) < 0) {
             /* error message generated in create function */
             return -1;
         }
@@ -681,14 +746,14 @@ nfc_cmd_nci(char*  args)
         if (args && *args) {
             unsigned long i;
             /* read remote-endpoint index */
-            if (parse_re_index(&args, ARRAY_SIZE(nfc_res), &i) < 0) {
+            if (parse_re_index(ctx, &args, ARRAY_SIZE(ctx->res), &i) < 0) {
                 return -1;
             }
-            param.re = nfc_res + i;
+            param.re = ctx->res + i;
 
             if (args && *args) {
                 /* read rf interface index */
-                if (parse_rf_index(&args, &param.rf) < 0) {
+                if (parse_rf_index(ctx, &args, &param.rf) < 0) {
                     return -1;
                 }
             } else {
@@ -700,7 +765,7 @@ nfc_cmd_nci(char*  args)
         }
         /* generate RF_INTF_ACTIVATED_NTF; if param.re == NULL,
          * active RE will be used */
-        if (cb.send_ntf(nfc_rf_intf_activated_ntf_cb, &param) < 0) {
+        if (ctx_send_ntf(ctx, nfc_rf_intf_activated_ntf_cb, &param) < 0) {
             /* error message generated in create function */
             return -1;
         }
@@ -708,23 +773,38 @@ nfc_cmd_nci(char*  args)
         struct nfc_ntf_param param = NFC_NTF_PARAM_INIT();
         if (args && *args) {
             /* read deactivate ntf type */
-            if (parse_nci_deactivate_ntf_type(&args, &param.dtype) < 0) {
+            if (parse_nci_deactivate_ntf_type(ctx, &args, &param.dtype) < 0) {
                 return -1;
             }
             /* read deactivate ntf reason */
-            if (parse_nci_deactivate_ntf_reason(&args, &param.dreason) < 0) {
+            if (parse_nci_deactivate_ntf_reason(ctx, &args, &param.dreason) < 0) {
                 return -1;
             }
         } else {
             param.dtype = NCI_RF_DEACT_DISCOVERY;
             param.dreason = NCI_RF_DEACT_RF_LINK_LOSS;
         }
-        if (cb.send_ntf(nfc_rf_intf_deactivate_ntf_cb, &param) < 0) {
+        if (ctx_send_ntf(ctx, nfc_rf_intf_deactivate_ntf_cb, &param) < 0) {
             /* error message generated in create function */
             return -1;
         }
+    } else if (!strcmp(p, "credits")) {
+        unsigned long ncredits;
+
+        /* read initial credits of new connections; 255
+         * disables flow control */
+        if (parse_token_ul(ctx, "credits", " ", &args, &ncredits) < 0) {
+            return -1;
+        }
+        if (!ncredits || (ncredits > NCI_CREDITS_UNLIMITED)) {
+            ctx->cb.log_err("KO: invalid credits '%lu'\r\n", ncredits);
+            return -1;
+        }
+        if (ctx_recv_dta(ctx, nfc_set_credits_cb, &ncredits) < 0) {
+            return -1;
+        }
     } else {
-        cb.log_err("KO: invalid operation '%s'\r\n", p);
+        ctx->cb.log_err("KO: invalid operation '%s'\r\n", p);
         return -1;
     }
 
@@ -746,11 +826,12 @@ static ssize_t
 nfc_llcp_connect_cb(void* data, struct nfc_device* nfc, size_t maxlen,
                     union nci_packet* packet)
 {
+    struct nfcemu_ctx* ctx = nfc->ctx;
     struct nfc_llcp_param* param = data;
     ssize_t res;
 
     if (!nfc->active_re) {
-        cb.log_err("KO: no active remote endpoint\n");
+        ctx->cb.log_err("KO: no active remote endpoint\n");
         return -1;
     }
     if ((param->dsap < 0) && (param->ssap < 0)) {
@@ -758,53 +839,191 @@ nfc_llcp_connect_cb(void* data, struct nfc_device* nfc, size_t maxlen,
         param->ssap = nfc->active_re->last_ssap;
     }
     if (!param->dsap) {
-        cb.log_err("KO: DSAP is 0\r\n");
+        ctx->cb.log_err("KO: DSAP is 0\r\n");
         return -1;
     }
     if (!param->ssap) {
-        cb.log_err("KO: SSAP is 0\r\n");
+        ctx->cb.log_err("KO: SSAP is 0\r\n");
         return -1;
     }
     res = nfc_re_send_llcp_connect(nfc->active_re, param->dsap, param->ssap);
     if (res < 0) {
-        cb.log_err("KO: LLCP connect failed\r\n");
+        ctx->cb.log_err("KO: LLCP connect failed\r\n");
         return -1;
     }
     return 0;
 }
 
+static int
+parse_symm_mode(struct nfcemu_ctx* ctx, char** args,
+                enum nfc_re_symm_mode* mode)
+{
+    static const char* const name[NUMBER_OF_NFC_RE_SYMM_MODES] = {
+        [NFC_RE_SYMM_DELAYED] = "delayed",
+        [NFC_RE_SYMM_IMMEDIATE] = "immediate",
+        [NFC_RE_SYMM_ADAPTIVE] = "adaptive"
+    };
+    const char* p;
+    size_t i;
+
+    if (parse_token_s(ctx, "SYMM mode", " ", args, &p, 0) < 0) {
+        return -1;
+    }
+    for (i = 0; i < ARRAY_SIZE(name); ++i) {
+        if (!strcmp(p, name[i])) {
+            *mode = i;
+            return 0;
+        }
+    }
+    ctx->cb.log_err("KO: unknown SYMM mode '%s'\r\n", p);
+    return -1;
+}
+
 int
-nfc_cmd_llcp(char* args)
+nfc_cmd_llcp(struct nfcemu_ctx* ctx, char* args)
 {
     char *p;
 
+    ctx_trace_cmdline(ctx, NFC_TRACE_CMDLINE_LLCP, args);
+
     if (!args) {
-        cb.log_err("KO: no arguments given\r\n");
+        ctx->cb.log_err("KO: no arguments given\r\n");
         return -1;
     }
 
     p = strsep(&args, " ");
     if (!p) {
-        cb.log_err("KO: no operation given\r\n");
+        ctx->cb.log_err("KO: no operation given\r\n");
         return -1;
     }
     if (!strcmp(p, "connect")) {
         struct nfc_llcp_param param = NFC_LLCP_PARAM_INIT();
 
         /* read DSAP */
-        if (parse_sap("DSAP", &args, &param.dsap, 1) < 0) {
+        if (parse_sap(ctx, "DSAP", &args, &param.dsap, 1) < 0) {
             return -1;
         }
         /* read SSAP */
-        if (parse_sap("SSAP", &args, &param.ssap, 1) < 0) {
+        if (parse_sap(ctx, "SSAP", &args, &param.ssap, 1) < 0) {
             return -1;
         }
-        if (cb.send_dta(nfc_llcp_connect_cb, &param) < 0) {
+        if (ctx_send_dta(ctx, nfc_llcp_connect_cb, &param) < 0) {
             /* error message generated in create function */
             return -1;
         }
+    } else if (!strcmp(p, "symm")) {
+        unsigned long i;
+        enum nfc_re_symm_mode mode;
+        struct nfc_re* re;
+
+        /* read remote-endpoint index */
+        if (parse_re_index(ctx, &args, ARRAY_SIZE(ctx->res), &i) < 0) {
+            return -1;
+        }
+        re = ctx->res + i;
+
+        if (parse_symm_mode(ctx, &args, &mode) < 0) {
+            return -1;
+        }
+        re->symm_mode = mode;
+
+        /* read turnaround time; optional */
+        if (args && *args) {
+            if (parse_token_ul(ctx, "turnaround", " ", &args,
+                               &re->turnaround) < 0) {
+                return -1;
+            }
+        }
+    } else if (!strcmp(p, "lto")) {
+        unsigned long i, lto;
+
+        /* read remote-endpoint index */
+        if (parse_re_index(ctx, &args, ARRAY_SIZE(ctx->res), &i) < 0) {
+            return -1;
+        }
+        /* read link timeout */
+        if (parse_token_ul(ctx, "LTO", " ", &args, &lto) < 0) {
+            return -1;
+        }
+        if (!lto || lto > 255) {
+            ctx->cb.log_err("KO: invalid LTO '%lu'\r\n", lto);
+            return -1;
+        }
+        ctx->res[i].lto = lto;
+    } else if (!strcmp(p, "rw")) {
+        unsigned long i, rw;
+
+        /* read remote-endpoint index */
+        if (parse_re_index(ctx, &args, ARRAY_SIZE(ctx->res), &i) < 0) {
+            return -1;
+        }
+        /* read receive window */
+        if (parse_token_ul(ctx, "RW", " ", &args, &rw) < 0) {
+            return -1;
+        }
+        if (rw > LLCP_RW_MAX) {
+            ctx->cb.log_err("KO: invalid RW '%lu'\r\n", rw);
+            return -1;
+        }
+        ctx->res[i].rw = rw;
+    } else if (!strcmp(p, "miu")) {
+        unsigned long i, miu;
+
+        /* read remote-endpoint index */
+        if (parse_re_index(ctx, &args, ARRAY_SIZE(ctx->res), &i) < 0) {
+            return -1;
+        }
+        /* read maximum information unit */
+        if (parse_token_ul(ctx, "MIU", " ", &args, &miu) < 0) {
+            return -1;
+        }
+        if ((miu < LLCP_MIU_DEFAULT) || (miu > LLCP_MIU_MAX)) {
+            ctx->cb.log_err("KO: invalid MIU '%lu'\r\n", miu);
+            return -1;
+        }
+        ctx->res[i].miu = miu;
+    } else if (!strcmp(p, "agf")) {
+        unsigned long i, agf;
+
+        /* read remote-endpoint index */
+        if (parse_re_index(ctx, &args, ARRAY_SIZE(ctx->res), &i) < 0) {
+            return -1;
+        }
+        /* read aggregation flag */
+        if (parse_token_ul(ctx, "AGF", " ", &args, &agf) < 0) {
+            return -1;
+        }
+        ctx->res[i].agf = !!agf;
+    } else if (!strcmp(p, "busy")) {
+        unsigned long i, busy;
+        long dsap, ssap;
+        struct llcp_data_link* dl;
+
+        /* read remote-endpoint index */
+        if (parse_re_index(ctx, &args, ARRAY_SIZE(ctx->res), &i) < 0) {
+            return -1;
+        }
+        /* read DSAP */
+        if (parse_sap(ctx, "DSAP", &args, &dsap, 0) < 0) {
+            return -1;
+        }
+        /* read SSAP */
+        if (parse_sap(ctx, "SSAP", &args, &ssap, 0) < 0) {
+            return -1;
+        }
+        /* read busy flag */
+        if (parse_token_ul(ctx, "busy", " ", &args, &busy) < 0) {
+            return -1;
+        }
+        dl = llcp_dl_map_find(&ctx->res[i].llcp_dl, dsap, ssap);
+        if (!dl) {
+            ctx->cb.log_err("KO: unknown data link\r\n");
+            return -1;
+        }
+        /* the next RR or RNR tells the remote */
+        dl->local_busy = !!busy;
     } else {
-        cb.log_err("KO: invalid operation '%s'\r\n", p);
+        ctx->cb.log_err("KO: invalid operation '%s'\r\n", p);
         return -1;
     }
 
@@ -812,18 +1031,20 @@ nfc_cmd_llcp(char* args)
 }
 
 int
-nfc_cmd_tag(char* args)
+nfc_cmd_tag(struct nfcemu_ctx* ctx, char* args)
 {
     char *p;
 
+    ctx_trace_cmdline(ctx, NFC_TRACE_CMDLINE_TAG, args);
+
     if (!args) {
-        cb.log_err("KO: no arguments given\r\n");
+        ctx->cb.log_err("KO: no arguments given\r\n");
         return -1;
     }
 
     p = strsep(&args, " ");
     if (!p) {
-        cb.log_err("KO: no operation given\r\n");
+        ctx->cb.log_err("KO: no operation given\r\n");
         return -1;
     }
     if (!strcmp(p, "set")) {
@@ -835,22 +1056,22 @@ nfc_cmd_tag(char* args)
         uint8_t buf[MAXIMUM_SUPPORTED_TAG_SIZE];
 
         /* read remote-endpoint index */
-        if (parse_re_index(&args, ARRAY_SIZE(nfc_res), &i) < 0) {
+        if (parse_re_index(ctx, &args, ARRAY_SIZE(ctx->res), &i) < 0) {
             return -1;
         }
-        re = nfc_res + i;
+        re = ctx->res + i;
 
         if (!re->tag) {
-            cb.log_err("KO: remote endpoint is not a tag\r\n");
+            ctx->cb.log_err("KO: remote endpoint is not a tag\r\n");
             return -1;
         }
 
-        nrecords = parse_ndef_msg(&args, ARRAY_SIZE(record), record);
+        nrecords = parse_ndef_msg(ctx, &args, ARRAY_SIZE(record), record);
         if (nrecords < 0) {
             return -1;
         }
 
-        res = build_ndef_msg(record, nrecords, buf, ARRAY_SIZE(buf));
+        res = build_ndef_msg(ctx, record, nrecords, buf, ARRAY_SIZE(buf));
         if (res < 0) {
             return -1;
         }
@@ -863,27 +1084,273 @@ nfc_cmd_tag(char* args)
         struct nfc_re* re;
 
         /* read remote-endpoint index */
-        if (parse_re_index(&args, ARRAY_SIZE(nfc_res), &i) < 0) {
+        if (parse_re_index(ctx, &args, ARRAY_SIZE(ctx->res), &i) < 0) {
             return -1;
         }
-        re = nfc_res + i;
+        re = ctx->res + i;
 
         if (nfc_tag_set_data(re->tag, NULL, 0) < 0) {
             return -1;
         }
     } else if (!strcmp(p, "format")) {
+        unsigned long i, capacity;
+        struct nfc_re* re;
+
+        /* read remote-endpoint index */
+        if (parse_re_index(ctx, &args, ARRAY_SIZE(ctx->res), &i) < 0) {
+            return -1;
+        }
+        re = ctx->res + i;
+
+        if (!re->tag) {
+            ctx->cb.log_err("KO: remote endpoint is not a tag\r\n");
+            return -1;
+        }
+
+        /* read NDEF capacity; optional */
+        if (args && *args) {
+            if (parse_token_ul(ctx, "capacity", " ", &args, &capacity) < 0) {
+                return -1;
+            }
+            if (nfc_tag_format_capacity(re->tag, capacity) < 0) {
+                ctx->cb.log_err("KO: unsupported capacity %lu\r\n", capacity);
+                return -1;
+            }
+        } else if (nfc_tag_format(re->tag) < 0) {
+            return -1;
+        }
+    } else if (!strcmp(p, "load")) {
         unsigned long i;
         struct nfc_re* re;
+        struct nfcemu_tag_image* img;
+        int res;
+
+        /* read remote-endpoint index */
+        if (parse_re_index(ctx, &args, ARRAY_SIZE(ctx->res), &i) < 0) {
+            return -1;
+        }
+        re = ctx->res + i;
+
+        if (!re->tag) {
+            ctx->cb.log_err("KO: remote endpoint is not a tag\r\n");
+            return -1;
+        }
+        /* the path is the remainder of the line */
+        if (!args || !*args) {
+            ctx->cb.log_err("KO: no file given\r\n");
+            return -1;
+        }
+
+        img = nfc_tag_image_map(args);
+        if (!img) {
+            ctx->cb.log_err("KO: cannot map '%s': %d (%s)\r\n",
+                            args, errno, strerror(errno));
+            return -1;
+        }
+        res = nfc_tag_set_image(re->tag, img);
+        nfc_tag_image_unref(img);
+        if (res < 0) {
+            ctx->cb.log_err("KO: '%s' does not match the tag's layout\r\n",
+                            args);
+            return -1;
+        }
+    } else if (!strcmp(p, "nb")) {
+        unsigned long i, nbr, nbw;
+        struct nfc_re* re;
 
         /* read remote-endpoint index */
-        if (parse_re_index(&args, ARRAY_SIZE(nfc_res), &i) < 0) {
+        if (parse_re_index(ctx, &args, ARRAY_SIZE(ctx->res), &i) < 0) {
+            return -1;
+        }
+        re = ctx->res + i;
+
+        if (!re->tag) {
+            ctx->cb.log_err("KO: remote endpoint is not a tag\r\n");
+            return -1;
+        }
+
+        /* read max. number of blocks per CHECK and UPDATE */
+        if (parse_token_ul(ctx, "NBr", " ", &args, &nbr) < 0) {
+            return -1;
+        }
+        if (parse_token_ul(ctx, "NBw", " ", &args, &nbw) < 0) {
+            return -1;
+        }
+        if (nfc_tag_set_t3t_nb(re->tag, nbr, nbw) < 0) {
+            ctx->cb.log_err("KO: unsupported NBr %lu or NBw %lu\r\n",
+                            nbr, nbw);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void
+nfc_dump_cmd_stats_cb(void* data, const struct nfcemu_cmd_stats* stats)
+{
+    static const char* const state[NUMBER_OF_NFC_FSM_STATES] = {
+        [NFC_FSM_STATE_IDLE] = "idle",
+        [NFC_FSM_STATE_RESET] = "reset",
+        [NFC_FSM_STATE_INITIALIZED] = "init"
+    };
+    struct nfcemu_ctx* ctx;
+    char hist[NFCEMU_CMD_STATS_BUCKETS * 21];
+    size_t i, off;
+
+    ctx = data;
+    assert(ctx);
+
+    for (off = 0, i = 0; i < ARRAY_SIZE(stats->hist); ++i) {
+        off += snprintf(hist + off, sizeof(hist) - off, "%s%lu",
+                        i ? "," : "", stats->hist[i]);
+    }
+
+    ctx->cb.log_msg("%s %s gid=0x%x oid=0x%02x calls=%lu errs=%lu"
+                    " semerrs=%lu avg=%lluns hist=%s\r\n",
+                    stats->type == NFCEMU_CMD_NCI ? "NCI" : "HCI",
+                    state[stats->state], stats->gid, stats->oid,
+                    stats->ncalls, stats->nerrs, stats->nsemerrs,
+                    (unsigned long long)(stats->ns / stats->ncalls), hist);
+}
+
+static ssize_t
+nfc_dump_stats_cb(void* data, struct nfc_device* nfc)
+{
+    struct nfcemu_ctx* ctx;
+
+    ctx = data;
+    assert(ctx);
+
+    if (!nfc->stats) {
+        ctx->cb.log_err("KO: no statistics available\r\n");
+        return -1;
+    }
+    nfc_stats_foreach(nfc->stats, nfc_dump_cmd_stats_cb, ctx);
+
+    return 0;
+}
+
+static ssize_t
+nfc_reset_stats_cb(void* data, struct nfc_device* nfc)
+{
+    if (nfc->stats) {
+        nfc_stats_reset(nfc->stats);
+    }
+    return 0;
+}
+
+int
+nfc_cmd_stats(struct nfcemu_ctx* ctx, char* args)
+{
+    char *p;
+
+    ctx_trace_cmdline(ctx, NFC_TRACE_CMDLINE_STATS, args);
+
+    if (!args) {
+        ctx->cb.log_err("KO: no arguments given\r\n");
+        return -1;
+    }
+
+    p = strsep(&args, " ");
+    if (!p) {
+        ctx->cb.log_err("KO: no operation given\r\n");
+        return -1;
+    }
+    if (!strcmp(p, "dump")) {
+        if (ctx_recv_dta(ctx, nfc_dump_stats_cb, ctx) < 0) {
+            /* error message generated in handle function */
             return -1;
         }
-        re = nfc_res + i;
+    } else if (!strcmp(p, "reset")) {
+        if (ctx_recv_dta(ctx, nfc_reset_stats_cb, ctx) < 0) {
+            return -1;
+        }
+    } else {
+        ctx->cb.log_err("KO: invalid operation '%s'\r\n", p);
+        return -1;
+    }
 
-        if (nfc_tag_format(re->tag) < 0) {
+    return 0;
+}
+
+static void
+nfc_print_log_cb(void* data, enum nfcemu_log_level level, uint64_t ts,
+                 const char* msg)
+{
+    static const char* const name[] = {
+        [NFCEMU_LOG_NONE] = "-",
+        [NFCEMU_LOG_ERR] = "E",
+        [NFCEMU_LOG_WARN] = "W",
+        [NFCEMU_LOG_INFO] = "I",
+        [NFCEMU_LOG_DEBUG] = "D"
+    };
+    struct nfcemu_ctx* ctx;
+
+    ctx = data;
+    assert(ctx);
+    assert(level < ARRAY_SIZE(name));
+
+    ctx->cb.log_msg("%llu.%09llu %s %s\r\n",
+                    (unsigned long long)(ts / 1000000000),
+                    (unsigned long long)(ts % 1000000000), name[level], msg);
+}
+
+static int
+parse_log_level(struct nfcemu_ctx* ctx, char** args,
+                enum nfcemu_log_level* level)
+{
+    static const char* const name[] = {
+        [NFCEMU_LOG_NONE] = "none",
+        [NFCEMU_LOG_ERR] = "err",
+        [NFCEMU_LOG_WARN] = "warn",
+        [NFCEMU_LOG_INFO] = "info",
+        [NFCEMU_LOG_DEBUG] = "debug"
+    };
+    const char* p;
+    size_t i;
+
+    if (parse_token_s(ctx, "log level", " ", args, &p, 0) < 0) {
+        return -1;
+    }
+    for (i = 0; i < ARRAY_SIZE(name); ++i) {
+        if (!strcmp(p, name[i])) {
+            *level = i;
+            return 0;
+        }
+    }
+    ctx->cb.log_err("KO: unknown log level '%s'\r\n", p);
+    return -1;
+}
+
+int
+nfc_cmd_log(struct nfcemu_ctx* ctx, char* args)
+{
+    char *p;
+
+    ctx_trace_cmdline(ctx, NFC_TRACE_CMDLINE_LOG, args);
+
+    if (!args) {
+        ctx->cb.log_err("KO: no arguments given\r\n");
+        return -1;
+    }
+
+    p = strsep(&args, " ");
+    if (!p) {
+        ctx->cb.log_err("KO: no operation given\r\n");
+        return -1;
+    }
+    if (!strcmp(p, "level")) {
+        enum nfcemu_log_level level;
+        if (parse_log_level(ctx, &args, &level) < 0) {
             return -1;
         }
+        nfc_log_set_level(&ctx->log, level);
+    } else if (!strcmp(p, "dump")) {
+        nfc_log_drain(&ctx->log, nfc_print_log_cb, ctx, SIZE_MAX);
+    } else {
+        ctx->cb.log_err("KO: invalid operation '%s'\r\n", p);
+        return -1;
     }
 
     return 0;
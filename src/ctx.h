@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+#include <nfcemu/types.h>
+#include <nfcemu/trace.h>
+#include "cb.h"
+#include "nfc-log.h"
+#include "nfc-re.h"
+#include "nfc-tag.h"
+
+struct nfc_timer_wheel;
+struct nfc_trace;
+
+/* An emulator context holds all state that is shared by the emulated
+ * NFC controller and its surroundings: the host callbacks, the remote
+ * endpoints in the field, their tags and the buffers for queued PDUs.
+ * Contexts are independent of each other, so many emulators can live
+ * in the same process.
+ */
+struct nfcemu_ctx {
+    struct nfcemu_cb cb;
+    void* opaque; /* handed to the I/O callbacks */
+
+    /* buffers for LLCP PDUs queued by the remote endpoints */
+    struct llcp_pdu_pool pdu_pool;
+
+    /* predefined NFC Remote Endpoints */
+    struct nfc_re res[NUMBER_OF_NFC_RES];
+    /* tags of the remote endpoints */
+    struct nfc_tag tags[NUMBER_OF_NFC_TAGS];
+
+    struct nfc_log log;
+
+    /* internal timers, or NULL if the host provides the timeouts */
+    struct nfc_timer_wheel* timers;
+
+    /* binary trace of the host's traffic, or NULL */
+    struct nfc_trace* trace;
+    /* delivery callback of the last traced NCI message */
+    struct nfc_delivery_cb trace_delivery;
+};
+
+/* The emulator sends packets to the host with these helpers, so
+ * that they show up in the trace. */
+
+int
+ctx_send_ntf(struct nfcemu_ctx* ctx,
+             ssize_t (*create)(void*, struct nfc_device*, size_t,
+                               union nci_packet*),
+             void* data);
+
+int
+ctx_send_dta(struct nfcemu_ctx* ctx,
+             ssize_t (*create)(void*, struct nfc_device*, size_t,
+                               union nci_packet*),
+             void* data);
+
+int
+ctx_recv_dta(struct nfcemu_ctx* ctx,
+             ssize_t (*handle)(void*, struct nfc_device*),
+             void* data);
+
+void
+ctx_trace_cmdline(struct nfcemu_ctx* ctx, enum nfc_trace_cmdline cmd,
+                  const char* args);
+
+/* Timeouts run on the host's callbacks or on the context's own
+ * timer wheel. */
+
+nfcemu_timeout*
+ctx_new_timeout(struct nfcemu_ctx* ctx, void (*cb)(void*), void* data);
+
+void
+ctx_mod_timeout(struct nfcemu_ctx* ctx, nfcemu_timeout* t, unsigned long ms);
+
+void
+ctx_del_timeout(struct nfcemu_ctx* ctx, nfcemu_timeout* t);
+
+int
+ctx_timeout_is_pending(struct nfcemu_ctx* ctx, nfcemu_timeout* t);
+
+/* Cancels and releases the timeout. */
+void
+ctx_free_timeout(struct nfcemu_ctx* ctx, nfcemu_timeout* t);
@@ -18,23 +18,23 @@
 #include <limits.h>
 #include "ptr.h"
 #include "bswap.h"
-#include "nfc-debug.h"
+#include "nfc-log.h"
 #include "llcp.h"
 #include "snep.h"
 #include "llcp-snep.h"
 
 static size_t
-process_req_put(const struct snep* snep, struct llcp_data_link* dl,
-                      struct snep* rsp)
+process_req_put(struct nfc_log* log, const struct snep* snep,
+                struct llcp_data_link* dl, struct snep* rsp)
 {
     uint32_t sneplen;
 
-    NFC_D("SNEP Put");
+    NFC_D(log, "SNEP Put");
 
     sneplen = be32_to_cpu(snep->len);
 
-    if (!(sneplen < sizeof(dl->rbuf))) {
-        NFC_D("SNEP responding 'Excess Data'");
+    if (!(sneplen <= dl->rbufsiz)) {
+        NFC_D(log, "SNEP responding 'Excess Data'");
         return snep_create_rsp_excess_data(rsp);
     }
 
@@ -45,10 +45,31 @@ process_req_put(const struct snep* snep, struct llcp_data_link* dl,
 }
 
 static size_t
-process_rsp_success(const struct snep* snep, struct llcp_data_link* dl,
-                          struct snep* rsp)
+process_rsp_continue(struct nfc_log* log, const struct snep* snep,
+                     struct llcp_data_link* dl, struct snep* rsp)
 {
-    NFC_D("SNEP Success");
+    NFC_D(log, "SNEP Continue");
+
+    if (dl->sbuf) {
+        dl->scontinue = 1;
+    }
+    return 0;
+}
+
+static size_t
+process_rsp_success(struct nfc_log* log, const struct snep* snep,
+                    struct llcp_data_link* dl, struct snep* rsp)
+{
+    NFC_D(log, "SNEP Success");
+
+    return 0;
+}
+
+static size_t
+process_rsp_reject(struct nfc_log* log, const struct snep* snep,
+                   struct llcp_data_link* dl, struct snep* rsp)
+{
+    NFC_D(log, "SNEP Reject");
 
     return 0;
 }
@@ -60,52 +81,170 @@ version_is_supported(unsigned char major, unsigned char minor)
            ((SNEP_VERSION_MAJOR << 4) | SNEP_VERSION_MINOR);
 }
 
+static size_t (* const process_msg_cb[])(struct nfc_log*,
+                                         const struct snep*,
+                                         struct llcp_data_link*,
+                                         struct snep*) = {
+    [SNEP_REQ_PUT]      = process_req_put,
+    [SNEP_RSP_CONTINUE] = process_rsp_continue,
+    [SNEP_RSP_SUCCESS]  = process_rsp_success,
+    [SNEP_RSP_REJECT]   = process_rsp_reject
+};
+
+/* Returns 0 if we can process the message, or -1 after creating
+ * an error response in 'rsp'. */
+static int
+check_msg(struct nfc_log* log, const struct snep* snep, struct snep* rsp,
+          size_t* rsplen)
+{
+    if (!version_is_supported(snep->ver.major, snep->ver.minor)) {
+        NFC_D(log, "SNEP responding 'Unsupported Version'");
+        *rsplen = snep_create_rsp_unsupported_version(rsp);
+        return -1;
+    }
+    if ((snep->msg >= ARRAY_SIZE(process_msg_cb)) ||
+        !process_msg_cb[snep->msg]) {
+        NFC_D(log, "SNEP responding 'Not Implemented'");
+        *rsplen = snep_create_rsp_not_implemented(rsp);
+        return -1;
+    }
+    return 0;
+}
+
 static size_t
-process_msg(const struct snep* snep, struct llcp_data_link* dl,
-                  struct snep* rsp)
+process_msg(struct nfc_log* log, const struct snep* snep,
+            struct llcp_data_link* dl, struct snep* rsp)
 {
-    static size_t (*const process[])(const struct snep*,
-                                           struct llcp_data_link*,
-                                           struct snep*) = {
-        [SNEP_REQ_PUT]     = process_req_put,
-        [SNEP_RSP_SUCCESS] = process_rsp_success
-    };
+    size_t len;
 
-    if (!version_is_supported(snep->ver.major, snep->ver.minor)) {
-        NFC_D("SNEP responding 'Unsupported Version'");
-        return snep_create_rsp_unsupported_version(rsp);
+    if (check_msg(log, snep, rsp, &len) < 0) {
+        return len;
+    }
+    if ((snep->msg & 0x80) && (snep->msg != SNEP_RSP_CONTINUE)) {
+        /* the remote ends an outgoing request with any
+         * response but 'Continue' */
+        llcp_dl_clear_sbuf(dl);
+    }
+    return process_msg_cb[snep->msg](log, snep, dl, rsp);
+}
+
+/* Starts reassembling a request from its first fragment. */
+static size_t
+process_first_fragment(struct nfc_log* log, struct llcp_data_link* dl,
+                       const uint8_t* info, size_t len, size_t msglen,
+                       struct snep* rsp)
+{
+    size_t rsplen;
+
+    if (check_msg(log, (const struct snep*)info, rsp, &rsplen) < 0) {
+        return rsplen;
+    }
+    if (((const struct snep*)info)->msg & 0x80) {
+        /* we never ask for anything that needs a long response */
+        NFC_D(log, "SNEP ignoring fragmented response");
+        return 0;
     }
-    if ((snep->msg >= ARRAY_SIZE(process)) || !process[snep->msg]) {
-        NFC_D("SNEP responding 'Not Implemented'");
-        return snep_create_rsp_not_implemented(rsp);
+    if (msglen > LLCP_SNEP_MAX_LENGTH) {
+        NFC_D(log, "SNEP responding 'Excess Data'");
+        return snep_create_rsp_excess_data(rsp);
+    }
+    dl->rlen = 0;
+    if (llcp_dl_append_rbuf(dl, len, info) < 0) {
+        NFC_D(log, "SNEP responding 'Reject'");
+        return snep_create_rsp_reject(rsp);
     }
-    return process[snep->msg](snep, dl, rsp);
+    dl->rmsglen = msglen;
+
+    NFC_D(log, "SNEP responding 'Continue'");
+    return snep_create_rsp_continue(rsp);
+}
+
+/* Appends a fragment to the request in 'dl->rbuf'. Fragments
+ * after the first one carry no SNEP header. */
+static size_t
+process_fragment(struct nfc_log* log, struct llcp_data_link* dl,
+                 const uint8_t* info, size_t len, struct snep* rsp)
+{
+    size_t msglen;
+
+    msglen = dl->rmsglen;
+
+    if (len > msglen - dl->rlen) {
+        NFC_D(log, "SNEP responding 'Bad Request'");
+        dl->rmsglen = 0;
+        dl->rlen = 0;
+        return snep_create_rsp_bad_request(rsp);
+    }
+    if (llcp_dl_append_rbuf(dl, len, info) < 0) {
+        NFC_D(log, "SNEP out of memory for fragment");
+        dl->rmsglen = 0;
+        dl->rlen = 0;
+        return snep_create_rsp_reject(rsp);
+    }
+    if (dl->rlen < msglen) {
+        return 0; /* more to come */
+    }
+    dl->rmsglen = 0;
+
+    return process_msg(log, (const struct snep*)dl->rbuf, dl, rsp);
 }
 
 size_t
-llcp_sap_snep(struct llcp_data_link* dl, const uint8_t* info, size_t len,
-              struct snep* rsp)
+llcp_sap_snep(struct nfc_log* log, struct llcp_data_link* dl,
+              const uint8_t* info, size_t len, struct snep* rsp)
 {
     const struct snep* snep;
     uint32_t sneplen;
 
     assert(dl);
     assert(info);
-    assert(len >= 6);
     assert(rsp);
 
+    if (dl->rmsglen) {
+        return process_fragment(log, dl, info, len, rsp);
+    }
+
     if (len < sizeof(*snep)) {
-        NFC_D("SNEP responding 'Bad Request'");
+        NFC_D(log, "SNEP responding 'Bad Request'");
         return snep_create_rsp_bad_request(rsp);
     }
 
     snep = (struct snep*)info;
     sneplen = be32_to_cpu(snep->len);
 
-    if (!(sneplen < (UINT32_MAX-sizeof(*snep))) ||
-         (sneplen+sizeof(*snep) != len)) {
-        NFC_D("SNEP responding 'Excess Data'");
+    if (!(sneplen < (UINT32_MAX-sizeof(*snep)))) {
+        NFC_D(log, "SNEP responding 'Excess Data'");
+        return snep_create_rsp_excess_data(rsp);
+    }
+    if (sneplen+sizeof(*snep) > len) {
+        return process_first_fragment(log, dl, info, len,
+                                      sneplen+sizeof(*snep), rsp);
+    }
+    if (sneplen+sizeof(*snep) != len) {
+        NFC_D(log, "SNEP responding 'Excess Data'");
         return snep_create_rsp_excess_data(rsp);
     }
-    return process_msg(snep, dl, rsp);
+    return process_msg(log, snep, dl, rsp);
+}
+
+void
+llcp_snep_process_rsp(struct nfc_log* log, struct llcp_data_link* dl,
+                      const uint8_t* info, size_t len)
+{
+    const struct snep* snep;
+
+    assert(dl);
+    assert(info);
+
+    snep = (const struct snep*)info;
+
+    if ((len < sizeof(*snep)) || !(snep->msg & 0x80)) {
+        return;
+    }
+    if (snep->msg == SNEP_RSP_CONTINUE) {
+        process_rsp_continue(log, snep, dl, NULL);
+    } else {
+        NFC_D(log, "SNEP response 0x%02x", snep->msg);
+        llcp_dl_clear_sbuf(dl);
+    }
 }
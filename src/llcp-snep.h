@@ -17,9 +17,19 @@
 #include <stddef.h>
 #include <stdint.h>
 
+enum {
+    LLCP_SNEP_MAX_LENGTH = 256 * 1024 /* max. length of a SNEP message */
+};
+
 struct llcp_data_link;
 struct snep;
+struct nfc_log;
 
 size_t
-llcp_sap_snep(struct llcp_data_link* dl, const uint8_t* info, size_t len,
-              struct snep* rsp);
+llcp_sap_snep(struct nfc_log* log, struct llcp_data_link* dl,
+              const uint8_t* info, size_t len, struct snep* rsp);
+
+/* handles the remote's responses on data links without SNEP server */
+void
+llcp_snep_process_rsp(struct nfc_log* log, struct llcp_data_link* dl,
+                      const uint8_t* info, size_t len);
@@ -18,7 +18,8 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
-#include "nfc-debug.h"
+#include "nfc-log.h"
+#include "nfc-snapshot.h"
 #include "llcp.h"
 
 /* magic numbers for bcm2079x */
@@ -68,6 +69,35 @@ llcp_create_pdu_i(struct llcp_pdu* llcp, unsigned char dsap,
   return llcp_create_pdu(llcp, dsap, LLCP_PTYPE_I, ssap) + 1;
 }
 
+size_t
+llcp_create_pdu_rr(struct llcp_pdu* llcp, unsigned char dsap,
+                   unsigned char ptype, unsigned char ssap, unsigned char nr)
+{
+  assert(llcp);
+  assert(ptype == LLCP_PTYPE_RR || ptype == LLCP_PTYPE_RNR);
+
+  llcp->info[0] = nr&0x0f;
+
+  return llcp_create_pdu(llcp, dsap, ptype, ssap) + 1;
+}
+
+size_t
+llcp_create_pdu_frmr(struct llcp_pdu* llcp, unsigned char dsap,
+                     unsigned char ssap, unsigned char flags,
+                     unsigned char ptype, unsigned char seq,
+                     const struct llcp_data_link* dl)
+{
+  assert(llcp);
+  assert(dl);
+
+  llcp->info[0] = ((flags&0x0f) << 4) | (ptype&0x0f);
+  llcp->info[1] = seq;
+  llcp->info[2] = (dl->v_s << 4) | dl->v_r;
+  llcp->info[3] = (dl->v_sa << 4) | dl->v_ra;
+
+  return llcp_create_pdu(llcp, dsap, LLCP_PTYPE_FRMR, ssap) + 4;
+}
+
 unsigned char
 llcp_ptype(const struct llcp_pdu* llcp)
 {
@@ -81,7 +111,7 @@ llcp_ptype(const struct llcp_pdu* llcp)
 }
 
 size_t
-llcp_create_param_tail(uint8_t* p)
+llcp_create_param_tail(uint8_t* p, uint8_t lto, size_t miu)
 {
     const uint8_t *beg = p;
 
@@ -100,35 +130,272 @@ llcp_create_param_tail(uint8_t* p)
     /* SYMM timeout */
     *p++ = LLCP_PARAM_LTO;
     *p++ = 1;
-    *p++ = 250;
+    *p++ = lto;
+
+    /* link MIU */
+    p += llcp_create_param_miux(p, miu);
 
     return p-beg;
 }
 
+size_t
+llcp_create_param_rw(uint8_t* p, uint8_t rw)
+{
+    assert(p);
+    assert(rw <= LLCP_RW_MAX);
+
+    p[0] = LLCP_PARAM_RW;
+    p[1] = 1;
+    p[2] = rw;
+
+    return 3;
+}
+
+size_t
+llcp_create_param_miux(uint8_t* p, size_t miu)
+{
+    size_t miux;
+
+    assert(p);
+    assert(miu <= LLCP_MIU_MAX);
+
+    if (miu <= LLCP_MIU_DEFAULT) {
+        return 0;
+    }
+    miux = miu - LLCP_MIU_DEFAULT;
+
+    p[0] = LLCP_PARAM_MIUX;
+    p[1] = 2;
+    p[2] = (miux >> 8) & 0x07;
+    p[3] = miux;
+
+    return 4;
+}
+
 /*
  * LLCP PDU handling
  */
 
+struct llcp_pdu_slab {
+    struct llcp_pdu_slab* next;
+    struct llcp_pdu_buf buf[];
+};
+
+void
+llcp_pdu_pool_init(struct llcp_pdu_pool* pool, size_t cap,
+                   struct nfc_log* log)
+{
+    assert(pool);
+    assert(log);
+
+    pool->cap = cap;
+    pool->nbufs = 0;
+    pool->nused = 0;
+    pool->hwm = 0;
+    pool->nfails = 0;
+    TAILQ_INIT(&pool->free_q[LLCP_PDU_BUF_SMALL]);
+    TAILQ_INIT(&pool->free_q[LLCP_PDU_BUF_LARGE]);
+    pool->slab = NULL;
+    pool->log = log;
+}
+
+void
+llcp_pdu_pool_uninit(struct llcp_pdu_pool* pool)
+{
+    assert(pool);
+    assert(!pool->nused);
+
+    while (pool->slab) {
+        struct llcp_pdu_slab* slab = pool->slab;
+        pool->slab = slab->next;
+        free(slab);
+    }
+    TAILQ_INIT(&pool->free_q[LLCP_PDU_BUF_SMALL]);
+    TAILQ_INIT(&pool->free_q[LLCP_PDU_BUF_LARGE]);
+    pool->nbufs = 0;
+}
+
+static const size_t pdu_buf_size[NUMBER_OF_LLCP_PDU_BUF_CLASSES] = {
+    [LLCP_PDU_BUF_SMALL] = LLCP_PDU_BUF_SMALL_SIZE,
+    [LLCP_PDU_BUF_LARGE] = LLCP_PDU_BUF_LARGE_SIZE
+};
+
+static const size_t pdu_slab_size[NUMBER_OF_LLCP_PDU_BUF_CLASSES] = {
+    [LLCP_PDU_BUF_SMALL] = LLCP_PDU_POOL_SLAB_SIZE,
+    [LLCP_PDU_BUF_LARGE] = LLCP_PDU_POOL_LARGE_SLAB_SIZE
+};
+
+/* A slab's buffer headers are followed by their PDU storage. A
+ * size class only grows while all of its buffers are in use, so
+ * neither class holds more than 'cap' buffers. */
+static int
+grow_pdu_pool(struct llcp_pdu_pool* pool, enum llcp_pdu_buf_class cls)
+{
+    struct llcp_pdu_slab* slab;
+    unsigned char* mem;
+    size_t nbufs, i;
+
+    nbufs = pdu_slab_size[cls];
+    if (pool->cap && (pool->cap - pool->nused) < nbufs) {
+        nbufs = pool->cap - pool->nused;
+    }
+    assert(nbufs);
+
+    slab = malloc(sizeof(*slab) +
+                  nbufs * (sizeof(slab->buf[0]) + pdu_buf_size[cls]));
+    if (!slab) {
+        NFC_E(pool->log, "malloc failed: %d (%s)", errno, strerror(errno));
+        return -1;
+    }
+    slab->next = pool->slab;
+    pool->slab = slab;
+
+    mem = (unsigned char*)(slab->buf + nbufs);
+
+    for (i = 0; i < nbufs; ++i) {
+        slab->buf[i].size = pdu_buf_size[cls];
+        slab->buf[i].pdu = mem + i * pdu_buf_size[cls];
+        TAILQ_INSERT_TAIL(&pool->free_q[cls], slab->buf + i, entry);
+    }
+    pool->nbufs += nbufs;
+
+    return 0;
+}
+
 struct llcp_pdu_buf*
-llcp_alloc_pdu_buf(void)
+llcp_alloc_pdu_buf(struct llcp_pdu_pool* pool, size_t len)
 {
+    enum llcp_pdu_buf_class cls;
     struct llcp_pdu_buf* buf;
 
-    buf = malloc(sizeof(*buf));
-    if (!buf) {
-        NFC_D("malloc failed: %d (%s)", errno, strerror(errno));
+    assert(pool);
+
+    if (len <= LLCP_PDU_BUF_SMALL_SIZE) {
+        cls = LLCP_PDU_BUF_SMALL;
+    } else if (len <= LLCP_PDU_BUF_LARGE_SIZE) {
+        cls = LLCP_PDU_BUF_LARGE;
+    } else {
+        NFC_W(pool->log, "LLCP PDU of %zu bytes too long", len);
+        ++pool->nfails;
+        return NULL;
+    }
+
+    if (pool->cap && pool->nused >= pool->cap) {
+        NFC_W(pool->log, "LLCP PDU pool exhausted: %zu buffers in use",
+              pool->nused);
+        ++pool->nfails;
         return NULL;
     }
+    if (TAILQ_EMPTY(&pool->free_q[cls]) && grow_pdu_pool(pool, cls) < 0) {
+        ++pool->nfails;
+        return NULL;
+    }
+
+    buf = TAILQ_FIRST(&pool->free_q[cls]);
+    TAILQ_REMOVE(&pool->free_q[cls], buf, entry);
+
+    ++pool->nused;
+    if (pool->nused > pool->hwm) {
+        pool->hwm = pool->nused;
+    }
+
     buf->entry.tqe_next = NULL;
     buf->entry.tqe_prev = NULL;
+    buf->create = NULL;
+    buf->data = NULL;
+    buf->ptype = LLCP_PTYPE_SYMM;
     buf->len = 0;
     return buf;
 }
 
 void
-llcp_free_pdu_buf(struct llcp_pdu_buf* buf)
+llcp_free_pdu_buf(struct llcp_pdu_pool* pool, struct llcp_pdu_buf* buf)
+{
+    assert(pool);
+
+    if (!buf) {
+        return;
+    }
+    assert(pool->nused);
+
+    /* recently used buffers are still cache-hot; reuse them first */
+    TAILQ_INSERT_HEAD(&pool->free_q[buf->size > LLCP_PDU_BUF_SMALL_SIZE],
+                      buf, entry);
+    --pool->nused;
+}
+
+void
+llcp_pdu_queue_snapshot(const struct llcp_pdu_queue* q,
+                        struct nfc_snapshot* snap)
+{
+    const struct llcp_pdu_buf* buf;
+    size_t n;
+
+    assert(q);
+
+    n = 0;
+    TAILQ_FOREACH(buf, q, entry) {
+        ++n;
+    }
+    nfc_snapshot_put_u32(snap, n);
+
+    TAILQ_FOREACH(buf, q, entry) {
+        nfc_snapshot_put_u8(snap, !!buf->create);
+        nfc_snapshot_put_u8(snap, buf->ptype);
+        nfc_snapshot_put_u8(snap, buf->dsap);
+        nfc_snapshot_put_u8(snap, buf->ssap);
+        nfc_snapshot_put_u16(snap, buf->len);
+        nfc_snapshot_put_mem(snap, buf->len, buf->pdu);
+    }
+}
+
+int
+llcp_pdu_queue_restore(struct llcp_pdu_queue* q, struct llcp_pdu_pool* pool,
+                       struct nfc_snapshot* snap,
+                       ssize_t (*create)(const struct llcp_pdu_buf*,
+                                         struct llcp_pdu*),
+                       void* data)
 {
-    free(buf);
+    size_t n;
+
+    assert(q);
+    assert(pool);
+
+    for (n = nfc_snapshot_get_u32(snap); n; --n) {
+        struct llcp_pdu_buf* buf;
+        int deferred;
+        unsigned char ptype, dsap, ssap;
+        uint16_t len;
+
+        deferred = nfc_snapshot_get_u8(snap);
+        ptype = nfc_snapshot_get_u8(snap);
+        dsap = nfc_snapshot_get_u8(snap);
+        ssap = nfc_snapshot_get_u8(snap);
+        len = nfc_snapshot_get_u16(snap);
+        if (snap->err || (deferred > 1) || (dsap >= LLCP_NUMBER_OF_SAPS) ||
+            (ssap >= LLCP_NUMBER_OF_SAPS)) {
+            return -1;
+        }
+
+        buf = llcp_alloc_pdu_buf(pool, len);
+        if (!buf) {
+            return -1;
+        }
+        TAILQ_INSERT_TAIL(q, buf, entry);
+
+        buf->ptype = ptype;
+        buf->dsap = dsap;
+        buf->ssap = ssap;
+        buf->len = len;
+        if (nfc_snapshot_get_mem(snap, buf->len, buf->pdu) < 0) {
+            return -1;
+        }
+        if (deferred) {
+            buf->create = create;
+            buf->data = data;
+        }
+    }
+    return snap->err ? -1 : 0;
 }
 
 /*
@@ -144,10 +411,15 @@ llcp_clear_data_link(struct llcp_data_link* dl)
     dl->v_sa = 0;
     dl->v_r = 0;
     dl->v_ra = 0;
-    dl->miu = 128;
-    dl->rw_l = 1;
-    dl->rw_r = 1;
+    dl->miu_l = LLCP_MIU_DEFAULT;
+    dl->miu_r = LLCP_MIU_DEFAULT;
+    dl->rw_l = LLCP_RW_DEFAULT;
+    dl->rw_r = LLCP_RW_DEFAULT;
+    dl->remote_busy = 0;
+    dl->local_busy = 0;
+    dl->rnr_sent = 0;
     dl->rlen = 0;
+    dl->rmsglen = 0;
 
     return dl;
 }
@@ -159,19 +431,146 @@ llcp_init_data_link(struct llcp_data_link* dl)
 
     dl->status = LLCP_DATA_LINK_DISCONNECTED;
     TAILQ_INIT(&dl->xmit_q);
+    TAILQ_INIT(&dl->sent_q);
+    dl->npending = 0;
+    dl->rbufsiz = 0;
+    dl->rbuf = NULL;
+    dl->sbuf = NULL;
+    dl->slen = 0;
+    dl->soff = 0;
+    dl->scontinue = 0;
 
     return llcp_clear_data_link(dl);
 }
 
+static void
+free_pdu_queue(struct llcp_pdu_queue* q, struct llcp_pdu_pool* pool)
+{
+    while (!TAILQ_EMPTY(q)) {
+        struct llcp_pdu_buf* buf = TAILQ_FIRST(q);
+        TAILQ_REMOVE(q, buf, entry);
+        llcp_free_pdu_buf(pool, buf);
+    }
+}
+
+void
+llcp_uninit_data_link(struct llcp_data_link* dl, struct llcp_pdu_pool* pool)
+{
+    llcp_flush_data_link(dl, pool);
+    free(dl->rbuf);
+}
+
+void
+llcp_flush_data_link(struct llcp_data_link* dl, struct llcp_pdu_pool* pool)
+{
+    assert(dl);
+
+    free_pdu_queue(&dl->xmit_q, pool);
+    free_pdu_queue(&dl->sent_q, pool);
+    dl->npending = 0;
+    llcp_dl_clear_sbuf(dl);
+    dl->rmsglen = 0;
+}
+
+int
+llcp_dl_window_is_open(const struct llcp_data_link* dl)
+{
+    unsigned int unacked;
+
+    assert(dl);
+
+    unacked = (dl->v_s - dl->v_sa) % LLCP_SEQ_MOD;
+
+    return !dl->remote_busy && (unacked + dl->npending < dl->rw_r);
+}
+
+int
+llcp_dl_nr_is_valid(const struct llcp_data_link* dl, unsigned char nr)
+{
+    assert(dl);
+
+    /* V(SA) <= N(R) <= V(S), modulo 16 */
+    return ((nr - dl->v_sa) % LLCP_SEQ_MOD) <=
+           ((dl->v_s - dl->v_sa) % LLCP_SEQ_MOD);
+}
+
+int
+llcp_dl_owes_ack(const struct llcp_data_link* dl)
+{
+    assert(dl);
+
+    return (dl->status == LLCP_DATA_LINK_CONNECTED) &&
+           ((dl->v_r != dl->v_ra) || (dl->rnr_sent != dl->local_busy));
+}
+
+int
+llcp_dl_set_local_miu(struct llcp_data_link* dl, size_t miu)
+{
+    assert(dl);
+    assert(miu >= LLCP_MIU_DEFAULT);
+    assert(miu <= LLCP_MIU_MAX);
+
+    if (miu > dl->rbufsiz) {
+        uint8_t* rbuf = realloc(dl->rbuf, miu);
+        if (!rbuf) {
+            return -1;
+        }
+        dl->rbuf = rbuf;
+        dl->rbufsiz = miu;
+    }
+    dl->miu_l = miu;
+    dl->rlen = 0;
+
+    return 0;
+}
+
+int
+llcp_dl_append_rbuf(struct llcp_data_link* dl, size_t len, const void* data)
+{
+    assert(dl);
+    assert(data || !len);
+
+    if (len > dl->rbufsiz - dl->rlen) {
+        size_t siz = dl->rbufsiz ? dl->rbufsiz : LLCP_MIU_DEFAULT;
+        uint8_t* rbuf;
+
+        while (siz < dl->rlen + len) {
+            siz *= 2;
+        }
+        rbuf = realloc(dl->rbuf, siz);
+        if (!rbuf) {
+            return -1;
+        }
+        dl->rbuf = rbuf;
+        dl->rbufsiz = siz;
+    }
+    memcpy(dl->rbuf + dl->rlen, data, len);
+    dl->rlen += len;
+
+    return 0;
+}
+
+void
+llcp_dl_clear_sbuf(struct llcp_data_link* dl)
+{
+    assert(dl);
+
+    free(dl->sbuf);
+    dl->sbuf = NULL;
+    dl->slen = 0;
+    dl->soff = 0;
+    dl->scontinue = 0;
+}
+
 size_t
 llcp_dl_write_rbuf(struct llcp_data_link* dl, size_t len, const void* data)
 {
     assert(dl);
-    assert(len < sizeof(dl->rbuf));
+    assert(len <= dl->rbufsiz);
     assert(data || !len);
 
     dl->rlen = len;
-    memcpy(dl->rbuf, data, len);
+    memmove(dl->rbuf, data, len);
 
     return dl->rlen;
 }
@@ -180,10 +579,321 @@ size_t
 llcp_dl_read_rbuf(const struct llcp_data_link* dl, size_t len, void* data)
 {
     assert(dl);
-    assert(len < sizeof(dl->rbuf));
 
     len = len < dl->rlen ? len : dl->rlen;
     memcpy(data, dl->rbuf, len);
 
     return len;
 }
+
+/*
+ * Data-link map
+ */
+
+enum {
+    LLCP_DL_MAP_MIN_SLOTS = 8
+};
+
+static size_t
+dl_map_hash(unsigned char dsap, unsigned char ssap, size_t nslots)
+{
+    uint32_t key = (dsap << 6) | ssap;
+
+    /* Fibonacci hashing; spreads neighboring SAPs over the table */
+    return ((key * 2654435761u) >> 16) & (nslots-1);
+}
+
+static struct llcp_data_link**
+dl_map_lookup(struct llcp_data_link** slot, size_t nslots,
+              unsigned char dsap, unsigned char ssap)
+{
+    size_t i;
+
+    for (i = dl_map_hash(dsap, ssap, nslots);
+         slot[i];
+         i = (i+1) & (nslots-1)) {
+        if (slot[i]->dsap == dsap && slot[i]->ssap == ssap) {
+            break;
+        }
+    }
+    return slot + i;
+}
+
+static int
+dl_map_grow(struct llcp_dl_map* map)
+{
+    struct llcp_data_link** slot;
+    size_t nslots, i;
+
+    nslots = map->nslots ? map->nslots*2 : LLCP_DL_MAP_MIN_SLOTS;
+
+    slot = calloc(nslots, sizeof(*slot));
+    if (!slot) {
+        NFC_E(map->pool->log, "calloc failed: %d (%s)", errno, strerror(errno));
+        return -1;
+    }
+    for (i = 0; i < map->nslots; ++i) {
+        struct llcp_data_link* dl = map->slot[i];
+        if (dl) {
+            *dl_map_lookup(slot, nslots, dl->dsap, dl->ssap) = dl;
+        }
+    }
+    free(map->slot);
+    map->slot = slot;
+    map->nslots = nslots;
+
+    return 0;
+}
+
+void
+llcp_dl_map_init(struct llcp_dl_map* map, struct llcp_pdu_pool* pool)
+{
+    assert(map);
+    assert(pool);
+
+    map->nslots = 0;
+    map->nlinks = 0;
+    map->slot = NULL;
+    map->pool = pool;
+}
+
+void
+llcp_dl_map_uninit(struct llcp_dl_map* map)
+{
+    llcp_dl_map_clear(map);
+    free(map->slot);
+    map->nslots = 0;
+    map->slot = NULL;
+}
+
+void
+llcp_dl_map_clear(struct llcp_dl_map* map)
+{
+    size_t i;
+
+    assert(map);
+
+    if (!map->nlinks) {
+        return;
+    }
+    for (i = 0; i < map->nslots; ++i) {
+        struct llcp_data_link* dl = map->slot[i];
+        if (dl) {
+            llcp_uninit_data_link(dl, map->pool);
+            free(dl);
+            map->slot[i] = NULL;
+        }
+    }
+    map->nlinks = 0;
+}
+
+struct llcp_data_link*
+llcp_dl_map_find(const struct llcp_dl_map* map,
+                 unsigned char dsap, unsigned char ssap)
+{
+    assert(map);
+    assert(dsap < LLCP_NUMBER_OF_SAPS);
+    assert(ssap < LLCP_NUMBER_OF_SAPS);
+
+    if (!map->nlinks) {
+        return NULL;
+    }
+    return *dl_map_lookup(map->slot, map->nslots, dsap, ssap);
+}
+
+struct llcp_data_link*
+llcp_dl_map_get(struct llcp_dl_map* map,
+                unsigned char dsap, unsigned char ssap)
+{
+    struct llcp_data_link** pos;
+    struct llcp_data_link* dl;
+
+    dl = llcp_dl_map_find(map, dsap, ssap);
+    if (dl) {
+        return dl;
+    }
+
+    /* keep the load factor at or below 1/2 */
+    if ((map->nlinks+1)*2 > map->nslots && dl_map_grow(map) < 0) {
+        return NULL;
+    }
+
+    dl = malloc(sizeof(*dl));
+    if (!dl) {
+        NFC_E(map->pool->log, "malloc failed: %d (%s)", errno, strerror(errno));
+        return NULL;
+    }
+    llcp_init_data_link(dl);
+    dl->dsap = dsap;
+    dl->ssap = ssap;
+
+    pos = dl_map_lookup(map->slot, map->nslots, dsap, ssap);
+    assert(!*pos);
+    *pos = dl;
+    ++map->nlinks;
+
+    return dl;
+}
+
+struct llcp_data_link*
+llcp_dl_map_next(const struct llcp_dl_map* map, size_t* i)
+{
+    assert(map);
+    assert(i);
+
+    while (*i < map->nslots) {
+        struct llcp_data_link* dl = map->slot[(*i)++];
+        if (dl) {
+            return dl;
+        }
+    }
+    return NULL;
+}
+
+void
+llcp_dl_map_snapshot(const struct llcp_dl_map* map,
+                     struct nfc_snapshot* snap)
+{
+    const struct llcp_data_link* dl;
+    size_t i;
+
+    assert(map);
+
+    nfc_snapshot_put_u32(snap, map->nlinks);
+
+    i = 0;
+
+    while ((dl = llcp_dl_map_next(map, &i))) {
+        nfc_snapshot_put_u8(snap, dl->dsap);
+        nfc_snapshot_put_u8(snap, dl->ssap);
+        nfc_snapshot_put_u8(snap, dl->status);
+        nfc_snapshot_put_u8(snap, dl->v_s);
+        nfc_snapshot_put_u8(snap, dl->v_sa);
+        nfc_snapshot_put_u8(snap, dl->v_r);
+        nfc_snapshot_put_u8(snap, dl->v_ra);
+        nfc_snapshot_put_u16(snap, dl->miu_l);
+        nfc_snapshot_put_u16(snap, dl->miu_r);
+        nfc_snapshot_put_u8(snap, dl->rw_l);
+        nfc_snapshot_put_u8(snap, dl->rw_r);
+        nfc_snapshot_put_u8(snap, dl->npending);
+        nfc_snapshot_put_u8(snap, dl->remote_busy);
+        nfc_snapshot_put_u8(snap, dl->local_busy);
+        nfc_snapshot_put_u8(snap, dl->rnr_sent);
+        nfc_snapshot_put_u32(snap, dl->rmsglen);
+        nfc_snapshot_put_u32(snap, dl->rlen);
+        nfc_snapshot_put_mem(snap, dl->rlen, dl->rbuf);
+        nfc_snapshot_put_u32(snap, dl->slen);
+        nfc_snapshot_put_u32(snap, dl->soff);
+        nfc_snapshot_put_u8(snap, dl->scontinue);
+        nfc_snapshot_put_mem(snap, dl->slen, dl->sbuf);
+        llcp_pdu_queue_snapshot(&dl->xmit_q, snap);
+        llcp_pdu_queue_snapshot(&dl->sent_q, snap);
+    }
+}
+
+/* The link's state has to be one that the protocol could have
+ * reached; the data path relies on it. */
+static int
+valid_data_link(const struct llcp_data_link* dl)
+{
+    return (dl->status <= LLCP_DATA_LINK_DISCONNECTING) &&
+           (dl->v_s < LLCP_SEQ_MOD) && (dl->v_sa < LLCP_SEQ_MOD) &&
+           (dl->v_r < LLCP_SEQ_MOD) && (dl->v_ra < LLCP_SEQ_MOD) &&
+           (dl->miu_r >= LLCP_MIU_DEFAULT) && (dl->miu_r <= LLCP_MIU_MAX) &&
+           (dl->rw_l <= LLCP_RW_MAX) && (dl->rw_r <= LLCP_RW_MAX) &&
+           (dl->npending <= LLCP_RW_MAX) && (dl->remote_busy <= 1) &&
+           (dl->local_busy <= 1) && (dl->rnr_sent <= 1);
+}
+
+static int
+restore_data_link(struct llcp_data_link* dl, struct llcp_dl_map* map,
+                  struct nfc_snapshot* snap,
+                  ssize_t (*create)(const struct llcp_pdu_buf*,
+                                    struct llcp_pdu*),
+                  void* data)
+{
+    const void* p;
+    size_t len;
+
+    dl->status = nfc_snapshot_get_u8(snap);
+    dl->v_s = nfc_snapshot_get_u8(snap);
+    dl->v_sa = nfc_snapshot_get_u8(snap);
+    dl->v_r = nfc_snapshot_get_u8(snap);
+    dl->v_ra = nfc_snapshot_get_u8(snap);
+    dl->miu_l = nfc_snapshot_get_u16(snap);
+    dl->miu_r = nfc_snapshot_get_u16(snap);
+    dl->rw_l = nfc_snapshot_get_u8(snap);
+    dl->rw_r = nfc_snapshot_get_u8(snap);
+    dl->npending = nfc_snapshot_get_u8(snap);
+    dl->remote_busy = nfc_snapshot_get_u8(snap);
+    dl->local_busy = nfc_snapshot_get_u8(snap);
+    dl->rnr_sent = nfc_snapshot_get_u8(snap);
+    dl->rmsglen = nfc_snapshot_get_u32(snap);
+
+    if (!valid_data_link(dl) ||
+        (dl->miu_l < LLCP_MIU_DEFAULT) || (dl->miu_l > LLCP_MIU_MAX) ||
+        (llcp_dl_set_local_miu(dl, dl->miu_l) < 0)) {
+        return -1;
+    }
+    len = nfc_snapshot_get_u32(snap);
+    p = nfc_snapshot_get_ptr(snap, len);
+    if (!p || (llcp_dl_append_rbuf(dl, len, p) < 0)) {
+        return -1;
+    }
+
+    dl->slen = nfc_snapshot_get_u32(snap);
+    dl->soff = nfc_snapshot_get_u32(snap);
+    dl->scontinue = nfc_snapshot_get_u8(snap);
+    p = nfc_snapshot_get_ptr(snap, dl->slen);
+    if (!p || (dl->soff > dl->slen) || (dl->scontinue > 1)) {
+        dl->slen = 0;
+        return -1;
+    }
+    if (dl->slen) {
+        dl->sbuf = malloc(dl->slen);
+        if (!dl->sbuf) {
+            dl->slen = 0;
+            return -1;
+        }
+        memcpy(dl->sbuf, p, dl->slen);
+    }
+
+    if ((llcp_pdu_queue_restore(&dl->xmit_q, map->pool, snap,
+                                create, data) < 0) ||
+        (llcp_pdu_queue_restore(&dl->sent_q, map->pool, snap,
+                                create, data) < 0)) {
+        return -1;
+    }
+    return 0;
+}
+
+int
+llcp_dl_map_restore(struct llcp_dl_map* map, struct nfc_snapshot* snap,
+                    ssize_t (*create)(const struct llcp_pdu_buf*,
+                                      struct llcp_pdu*),
+                    void* data)
+{
+    size_t n;
+
+    assert(map);
+
+    llcp_dl_map_clear(map);
+
+    for (n = nfc_snapshot_get_u32(snap); n; --n) {
+        struct llcp_data_link* dl;
+        unsigned char dsap, ssap;
+
+        dsap = nfc_snapshot_get_u8(snap);
+        ssap = nfc_snapshot_get_u8(snap);
+        if (snap->err || (dsap >= LLCP_NUMBER_OF_SAPS) ||
+            (ssap >= LLCP_NUMBER_OF_SAPS) ||
+            llcp_dl_map_find(map, dsap, ssap)) {
+            return -1;
+        }
+        dl = llcp_dl_map_get(map, dsap, ssap);
+        if (!dl || (restore_data_link(dl, map, snap, create, data) < 0)) {
+            return -1;
+        }
+    }
+    return snap->err ? -1 : 0;
+}
@@ -25,6 +25,9 @@
 #include <stdint.h>
 #include <sys/queue.h>
 
+struct nfc_log;
+struct nfc_snapshot;
+
 enum {
     LLCP_VERSION_MAJOR = 0x01,
     LLCP_VERSION_MINOR = 0x01
@@ -74,6 +77,12 @@ struct llcp_param_miux {
     uint16_t miux;
 };
 
+enum {
+    LLCP_MIU_DEFAULT = 128, /* MIU without MIUX extension */
+    LLCP_MIUX_MAX = 0x7ff,
+    LLCP_MIU_MAX = LLCP_MIU_DEFAULT + LLCP_MIUX_MAX
+};
+
 struct llcp_param_wks {
     uint8_t type;
     uint8_t len;
@@ -86,6 +95,15 @@ struct llcp_param_lto {
     uint16_t lto;
 };
 
+enum {
+    LLCP_LTO_UNIT_MS = 10 /* LTO is given in multiples of 10 ms */
+};
+
+enum {
+    LLCP_RW_DEFAULT = 1, /* RW if the parameter is absent */
+    LLCP_RW_MAX = 15
+};
+
 struct llcp_param_rw {
     uint8_t type;
     uint8_t len;
@@ -170,6 +188,26 @@ struct llcp_pdu {
     uint8_t info[0];
 };
 
+/* I PDUs are numbered modulo 16; [LLCP], Sec 5.6.1 */
+enum {
+    LLCP_SEQ_MOD = 16
+};
+
+/* [LLCP], Sec 4.3.9 */
+enum llcp_frmr_flag {
+    LLCP_FRMR_S = 0x1, /* invalid N(S) */
+    LLCP_FRMR_R = 0x2, /* invalid N(R) */
+    LLCP_FRMR_I = 0x4, /* information field too long */
+    LLCP_FRMR_W = 0x8 /* malformed or unexpected PDU */
+};
+
+/* [LLCP], Sec 4.3.8 */
+enum llcp_dm_reason {
+    LLCP_DM_DISC_RECEIVED = 0x00,
+    LLCP_DM_NO_ACTIVE_CONNECTION = 0x01,
+    LLCP_DM_CONNECT_REJECTED = 0x03
+};
+
 struct llcp_version {
     uint8_t ns:4;
     uint8_t nr:4;
@@ -187,12 +225,33 @@ size_t
 llcp_create_pdu_i(struct llcp_pdu* llcp, unsigned char dsap,
                   unsigned char ssap, unsigned char ns, unsigned char nr);
 
+/* creates RR or RNR */
+size_t
+llcp_create_pdu_rr(struct llcp_pdu* llcp, unsigned char dsap,
+                   unsigned char ptype, unsigned char ssap, unsigned char nr);
+
+struct llcp_data_link;
+
+size_t
+llcp_create_pdu_frmr(struct llcp_pdu* llcp, unsigned char dsap,
+                     unsigned char ssap, unsigned char flags,
+                     unsigned char ptype, unsigned char seq,
+                     const struct llcp_data_link* dl);
+
 unsigned char
 llcp_ptype(const struct llcp_pdu* llcp);
 
+size_t
+llcp_create_param_rw(uint8_t* p, uint8_t rw);
+
+/* Creates MIUX for an MIU above the default; returns 0
+ * otherwise. */
+size_t
+llcp_create_param_miux(uint8_t* p, size_t miu);
+
 /* used during link establishment */
 size_t
-llcp_create_param_tail(uint8_t* p);
+llcp_create_param_tail(uint8_t* p, uint8_t lto, size_t miu);
 
 /*
  * LLCP PDU handling
@@ -200,17 +259,89 @@ llcp_create_param_tail(uint8_t* p);
 
 struct llcp_pdu_buf {
     TAILQ_ENTRY(llcp_pdu_buf) entry;
-    unsigned char len;
-    unsigned char pdu[256];
+    /* Deferred builder; if set, the PDU is serialized by 'create'
+     * directly into the outgoing packet when it gets transmitted,
+     * and 'pdu' holds only the PDU's information field. */
+    ssize_t (*create)(const struct llcp_pdu_buf*, struct llcp_pdu*);
+    void* data;
+    unsigned char ptype; /* LLCP_PTYPE_I for I PDUs built by 'create' */
+    unsigned char dsap;
+    unsigned char ssap;
+    uint16_t len;
+    uint16_t size; /* capacity of 'pdu' */
+    unsigned char* pdu;
 };
 
 TAILQ_HEAD(llcp_pdu_queue, llcp_pdu_buf);
 
+/*
+ * LLCP PDU pool
+ */
+
+/* Queued PDUs are taken from a per-context pool. Buffers are
+ * allocated from the system in slabs and recycled through a
+ * free list, so steady-state traffic never calls malloc. No
+ * more than 'cap' buffers are handed out at the same time.
+ *
+ * Buffers come in two sizes. Control PDUs and I PDUs within the
+ * default MIU take small buffers; only I PDUs on links with a
+ * larger MIU need the large ones.
+ */
+
+enum llcp_pdu_buf_class {
+    LLCP_PDU_BUF_SMALL = 0,
+    LLCP_PDU_BUF_LARGE,
+    NUMBER_OF_LLCP_PDU_BUF_CLASSES
+};
+
+enum {
+    LLCP_PDU_BUF_SMALL_SIZE = 256,
+    /* an I PDU's header and sequence numbers, and a full MIU */
+    LLCP_PDU_BUF_LARGE_SIZE = 3 + LLCP_MIU_MAX,
+    LLCP_PDU_POOL_SLAB_SIZE = 16,
+    LLCP_PDU_POOL_LARGE_SLAB_SIZE = 4,
+    LLCP_PDU_POOL_DEFAULT_CAP = 256
+};
+
+struct llcp_pdu_slab;
+
+struct llcp_pdu_pool {
+    size_t cap; /* max. number of buffers in use, 0 for no limit */
+    size_t nbufs; /* buffers allocated from the system */
+    size_t nused; /* buffers currently handed out */
+    size_t hwm; /* high-water mark of nused */
+    size_t nfails; /* allocations refused */
+    struct llcp_pdu_queue free_q[NUMBER_OF_LLCP_PDU_BUF_CLASSES];
+    struct llcp_pdu_slab* slab;
+    struct nfc_log* log;
+};
+
+void
+llcp_pdu_pool_init(struct llcp_pdu_pool* pool, size_t cap,
+                   struct nfc_log* log);
+
+void
+llcp_pdu_pool_uninit(struct llcp_pdu_pool* pool);
+
+/* Returns a buffer for a PDU of up to 'len' bytes. */
 struct llcp_pdu_buf*
-llcp_alloc_pdu_buf(void);
+llcp_alloc_pdu_buf(struct llcp_pdu_pool* pool, size_t len);
 
 void
-llcp_free_pdu_buf(struct llcp_pdu_buf* buf);
+llcp_free_pdu_buf(struct llcp_pdu_pool* pool, struct llcp_pdu_buf* buf);
+
+void
+llcp_pdu_queue_snapshot(const struct llcp_pdu_queue* q,
+                        struct nfc_snapshot* snap);
+
+/* Appends the PDUs to the queue. Deferred builders cannot be stored,
+ * so buffers that had one get 'create' and 'data' instead. */
+int
+llcp_pdu_queue_restore(struct llcp_pdu_queue* q, struct llcp_pdu_pool* pool,
+                       struct nfc_snapshot* snap,
+                       ssize_t (*create)(const struct llcp_pdu_buf*,
+                                         struct llcp_pdu*),
+                       void* data);
 
 /*
  * LLCP data link
@@ -225,20 +356,40 @@ enum llcp_data_link_status {
 
 struct llcp_data_link {
     enum llcp_data_link_status status;
+    /* remote and local SAP of the connection */
+    uint8_t dsap;
+    uint8_t ssap;
     /* data-link connection state variables; [LLCP], Sec 5.6.1 */
     uint8_t v_s;
     uint8_t v_sa;
     uint8_t v_r;
     uint8_t v_ra;
     /* data-link connection parameters; [LLCP], Sec 5.6.2 */
-    uint8_t miu;
+    uint16_t miu_l;
+    uint16_t miu_r;
     uint8_t rw_l;
     uint8_t rw_r;
-    /* receive buffer for user data (e.g., NDEF records) */
-    uint8_t rlen;
-    uint8_t rbuf[256];
-    /* transmit queue for outgoing packets */
+    /* flow control */
+    uint8_t npending; /* I PDUs moved to the RE's xmit queue */
+    uint8_t remote_busy; /* remote sent RNR */
+    uint8_t local_busy; /* we acknowledge with RNR */
+    uint8_t rnr_sent;
+    /* receive buffer for user data (e.g., NDEF records); sized
+     * to the local MIU, grows for fragmented messages */
+    size_t rlen;
+    size_t rbufsiz;
+    uint8_t* rbuf;
+    size_t rmsglen; /* length of a fragmented message in rbuf, or 0 */
+    /* fragmented outgoing message */
+    uint8_t* sbuf;
+    size_t slen;
+    size_t soff; /* bytes queued so far */
+    int scontinue; /* true if the remote wants the other fragments */
+    /* I PDUs that wait for the connection, or for the remote's
+     * receive window to open */
     struct llcp_pdu_queue xmit_q;
+    /* sent I PDUs, until they are acknowledged */
+    struct llcp_pdu_queue sent_q;
 };
 
 struct llcp_data_link*
@@ -247,10 +398,92 @@ llcp_init_data_link(struct llcp_data_link* dl);
 struct llcp_data_link*
 llcp_clear_data_link(struct llcp_data_link* dl);
 
+void
+llcp_uninit_data_link(struct llcp_data_link* dl, struct llcp_pdu_pool* pool);
+
+/* Releases all queued and unacknowledged I PDUs. */
+void
+llcp_flush_data_link(struct llcp_data_link* dl, struct llcp_pdu_pool* pool);
+
+/* Returns true if we may send another I PDU. */
+int
+llcp_dl_window_is_open(const struct llcp_data_link* dl);
+
+/* Returns true if the remote's N(R) acknowledges sent I PDUs, or
+ * none. */
+int
+llcp_dl_nr_is_valid(const struct llcp_data_link* dl, unsigned char nr);
+
+/* Returns true if we owe the remote an RR or RNR. */
+int
+llcp_dl_owes_ack(const struct llcp_data_link* dl);
+
+/* Sets the local MIU and sizes the receive buffer to it. */
+int
+llcp_dl_set_local_miu(struct llcp_data_link* dl, size_t miu);
+
+/* Appends to the receive buffer, growing it if necessary. */
+int
+llcp_dl_append_rbuf(struct llcp_data_link* dl, size_t len, const void* data);
+
+/* Releases the fragmented outgoing message. */
+void
+llcp_dl_clear_sbuf(struct llcp_data_link* dl);
+
+/* 'data' may point into the receive buffer. */
 size_t
 llcp_dl_write_rbuf(struct llcp_data_link* dl, size_t len, const void* data);
 
 size_t
 llcp_dl_read_rbuf(const struct llcp_data_link* dl, size_t len, void* data);
 
+/*
+ * LLCP data-link map
+ */
+
+/* Only few of the 64x64 possible data links are ever used, so
+ * they are kept in a small open-addressed hash table, keyed by
+ * remote and local SAP. Links are allocated on first use and
+ * the table grows when it becomes half full.
+ */
+struct llcp_dl_map {
+    size_t nslots; /* 0 or a power of 2 */
+    size_t nlinks;
+    struct llcp_data_link** slot;
+    struct llcp_pdu_pool* pool; /* releases the links' queued PDUs */
+};
+
+void
+llcp_dl_map_init(struct llcp_dl_map* map, struct llcp_pdu_pool* pool);
+
+void
+llcp_dl_map_uninit(struct llcp_dl_map* map);
+
+void
+llcp_dl_map_clear(struct llcp_dl_map* map);
+
+struct llcp_data_link*
+llcp_dl_map_find(const struct llcp_dl_map* map,
+                 unsigned char dsap, unsigned char ssap);
+
+struct llcp_data_link*
+llcp_dl_map_get(struct llcp_dl_map* map,
+                unsigned char dsap, unsigned char ssap);
+
+/* Iterates over all data links; start with '*i' set to 0. Returns
+ * NULL at the end. */
+struct llcp_data_link*
+llcp_dl_map_next(const struct llcp_dl_map* map, size_t* i);
+
+void
+llcp_dl_map_snapshot(const struct llcp_dl_map* map,
+                     struct nfc_snapshot* snap);
+
+/* Replaces all data links; see llcp_pdu_queue_restore(). */
+int
+llcp_dl_map_restore(struct llcp_dl_map* map, struct nfc_snapshot* snap,
+                    ssize_t (*create)(const struct llcp_pdu_buf*,
+                                      struct llcp_pdu*),
+                    void* data);
+
 #endif
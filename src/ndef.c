@@ -130,17 +130,17 @@ ndef_rec_payload_len(const struct ndef_rec* ndef)
 }
 
 void
-ndef_rec_set_payload_len(struct ndef_rec* ndef, uint8_t plen)
+ndef_rec_set_payload_len(struct ndef_rec* ndef, uint32_t plen)
 {
     assert(ndef);
 
     if (ndef->flags & NDEF_FLAG_SR) {
         struct ndef_srec_fields* srf = (struct ndef_srec_fields*)(ndef->data);
+        assert(plen <= 255);
         srf->plen = plen;
     } else {
         struct ndef_rec_fields* rf = (struct ndef_rec_fields*)(ndef->data);
         rf->plen = cpu_to_be32(plen);
-
     }
 }
 
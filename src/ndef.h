@@ -100,7 +100,7 @@ uint32_t
 ndef_rec_payload_len(const struct ndef_rec* ndef);
 
 void
-ndef_rec_set_payload_len(struct ndef_rec* ndef, uint8_t plen);
+ndef_rec_set_payload_len(struct ndef_rec* ndef, uint32_t plen);
 
 size_t
 ndef_rec_payload_off(const struct ndef_rec* ndef);
@@ -16,9 +16,10 @@
 
 #include <assert.h>
 #include <string.h>
-#include "nfc-debug.h"
+#include "ctx.h"
 #include "nfc.h"
 #include "nfc-hci.h"
+#include "nfc-stats.h"
 
 static size_t
 create_evt(union hci_answer* rsp, enum hci_command cmd, unsigned char l)
@@ -78,11 +79,11 @@ idle_process_cmd(const union hci_packet* cmd, struct nfc_device* nfc,
                 len = idle_process_bcm2079x_write_sleep_mode_cmd(cmd, nfc, rsp);
                 break;
             default:
-                NFC_D("unknown command");
+                NFC_W(&nfc->ctx->log, "unknown HCI command %x", cmd->control.cmd);
                 return 0;
         }
     }
-    NFC_D("result length=%ld", (long)len);
+    NFC_D(&nfc->ctx->log, "result length=%ld", (long)len);
 
     return len;
 }
@@ -126,11 +127,11 @@ init_process_cmd(const union hci_packet* cmd, struct nfc_device* nfc,
                 len = init_process_bcm2079x_write_sleep_mode_cmd(cmd, nfc, rsp);
                 break;
             default:
-                NFC_D("unknown command");
+                NFC_W(&nfc->ctx->log, "unknown HCI command %x", cmd->control.cmd);
                 return 0;
         }
     }
-    NFC_D("result length=%ld", (long)len);
+    NFC_D(&nfc->ctx->log, "result length=%ld", (long)len);
 
     return len;
 }
@@ -145,12 +146,24 @@ nfc_process_hci_cmd(const union hci_packet* cmd, struct nfc_device* nfc,
         [NFC_FSM_STATE_RESET] = reset_process_cmd,
         [NFC_FSM_STATE_INITIALIZED] = init_process_cmd
     };
+    enum nfc_fsm_state state;
+    uint64_t t0;
+    size_t len;
 
-    NFC_D("HCI service=%x cmd=%x; NFC state=%d",
+    NFC_D(&nfc->ctx->log, "HCI service=%x cmd=%x; NFC state=%d",
           cmd->common.service, cmd->common.cmd, nfc->state);
 
     assert(nfc->state < NUMBER_OF_NFC_FSM_STATES);
     assert(process[nfc->state]);
 
-    return process[nfc->state](cmd, nfc, rsp);
+    if (!nfc->stats) {
+        return process[nfc->state](cmd, nfc, rsp);
+    }
+
+    state = nfc->state;
+    t0 = nfc_stats_now();
+    len = process[state](cmd, nfc, rsp);
+    nfc_stats_add_hci(nfc->stats, state, cmd, rsp, len, nfc_stats_now() - t0);
+
+    return len;
 }
@@ -0,0 +1,553 @@
+/*
+ * Copyright (C) 2013-2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <assert.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+#include "nfc-log.h"
+
+void
+nfc_log_init(struct nfc_log* log, enum nfcemu_log_level level)
+{
+    assert(log);
+
+    log->level = level;
+    log->ndrops = 0;
+    log->tail = 0;
+    log->head = 0;
+}
+
+void
+nfc_log_set_level(struct nfc_log* log, enum nfcemu_log_level level)
+{
+    assert(log);
+
+    __atomic_store_n(&log->level, level, __ATOMIC_RELAXED);
+}
+
+enum nfcemu_log_level
+nfc_log_get_level(const struct nfc_log* log)
+{
+    assert(log);
+
+    return __atomic_load_n(&log->level, __ATOMIC_RELAXED);
+}
+
+/*
+ * Messages
+ *
+ * A record stores the arguments of the message's conversions in
+ * their order. Integers, pointers and doubles take 8 bytes each,
+ * and '*' widths and precisions do, too. Strings take a length byte,
+ * followed by their characters.
+ */
+
+enum {
+    NFC_LOG_MSG_LENGTH = 256, /* of a formatted message */
+    NFC_LOG_SPEC_LENGTH = 32 /* of a rebuilt conversion specification */
+};
+
+enum {
+    LOG_SPEC_NONE = -1, /* no width or precision */
+    LOG_SPEC_ARG = -2 /* width or precision given as argument */
+};
+
+enum log_arg {
+    LOG_ARG_NONE,
+    LOG_ARG_INT,
+    LOG_ARG_UINT,
+    LOG_ARG_PTR,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_STR
+};
+
+/* a printf() conversion specification */
+struct log_spec {
+    const char* flags;
+    size_t nflags;
+    int width;
+    int prec;
+    char mod[3]; /* length modifier */
+    char conv;
+};
+
+static int
+parse_num(const char** p)
+{
+    int n;
+
+    if ((**p < '0') || (**p > '9')) {
+        return LOG_SPEC_NONE;
+    }
+    for (n = 0; (**p >= '0') && (**p <= '9'); ++(*p)) {
+        if (n < 1000) {
+            n = n * 10 + (**p - '0');
+        }
+    }
+    return n;
+}
+
+/* Parses the conversion specification after a '%'. Returns the
+ * first character behind it, or NULL if it isn't supported. */
+static const char*
+parse_spec(const char* p, struct log_spec* spec)
+{
+    size_t i;
+
+    spec->flags = p;
+    p += strspn(p, "-+ #0");
+    spec->nflags = p - spec->flags;
+
+    if (*p == '*') {
+        spec->width = LOG_SPEC_ARG;
+        ++p;
+    } else {
+        spec->width = parse_num(&p);
+    }
+    if (*p != '.') {
+        spec->prec = LOG_SPEC_NONE;
+    } else if (*++p == '*') {
+        spec->prec = LOG_SPEC_ARG;
+        ++p;
+    } else {
+        spec->prec = parse_num(&p);
+        if (spec->prec == LOG_SPEC_NONE) {
+            spec->prec = 0;
+        }
+    }
+    for (i = 0; *p && strchr("hlzjt", *p) && (i < 2); ++i) {
+        spec->mod[i] = *p++;
+    }
+    spec->mod[i] = '\0';
+
+    spec->conv = *p;
+    if (!*p || !strchr("diouxXcspeEfFgGaA%", *p) ||
+        (strchr("csp", *p) && i)) {
+        return NULL;
+    }
+    return p + 1;
+}
+
+static enum log_arg
+spec_arg(const struct log_spec* spec)
+{
+    switch (spec->conv) {
+        case '%':
+            return LOG_ARG_NONE;
+        case 'd':
+        case 'i':
+        case 'c':
+            return LOG_ARG_INT;
+        case 'o':
+        case 'u':
+        case 'x':
+        case 'X':
+            return LOG_ARG_UINT;
+        case 'p':
+            return LOG_ARG_PTR;
+        case 's':
+            return LOG_ARG_STR;
+        default:
+            return LOG_ARG_DOUBLE;
+    }
+}
+
+static int64_t
+va_arg_int(const char* mod, va_list* ap)
+{
+    if (!strcmp(mod, "l")) {
+        return va_arg(*ap, long);
+    } else if (!strcmp(mod, "ll")) {
+        return va_arg(*ap, long long);
+    } else if (!strcmp(mod, "z")) {
+        return va_arg(*ap, ssize_t);
+    } else if (!strcmp(mod, "j")) {
+        return va_arg(*ap, intmax_t);
+    } else if (!strcmp(mod, "t")) {
+        return va_arg(*ap, ptrdiff_t);
+    }
+    return va_arg(*ap, int); /* char and short are promoted */
+}
+
+static uint64_t
+va_arg_uint(const char* mod, va_list* ap)
+{
+    if (!strcmp(mod, "l")) {
+        return va_arg(*ap, unsigned long);
+    } else if (!strcmp(mod, "ll")) {
+        return va_arg(*ap, unsigned long long);
+    } else if (!strcmp(mod, "z")) {
+        return va_arg(*ap, size_t);
+    } else if (!strcmp(mod, "j")) {
+        return va_arg(*ap, uintmax_t);
+    } else if (!strcmp(mod, "t")) {
+        return va_arg(*ap, ptrdiff_t);
+    }
+    return va_arg(*ap, unsigned int);
+}
+
+static int
+put_arg(struct nfc_log_record* rec, const void* arg, size_t len)
+{
+    if (len > sizeof(rec->args) - rec->len) {
+        rec->truncated = 1;
+        return -1;
+    }
+    memcpy(rec->args + rec->len, arg, len);
+    rec->len += len;
+
+    return 0;
+}
+
+static int
+put_str(struct nfc_log_record* rec, const char* str, int prec)
+{
+    size_t len, left;
+
+    if (!str) {
+        str = "(null)";
+    }
+    len = strnlen(str, (prec < 0) || (prec > UINT8_MAX) ? UINT8_MAX : prec);
+
+    left = sizeof(rec->args) - rec->len;
+    if (!left) {
+        rec->truncated = 1;
+        return -1;
+    }
+    if (len > left - 1) {
+        len = left - 1;
+        rec->truncated = 1;
+    }
+    rec->args[rec->len++] = len;
+    memcpy(rec->args + rec->len, str, len);
+    rec->len += len;
+
+    return rec->truncated ? -1 : 0;
+}
+
+/* Stores the arguments of the format string's conversions. */
+static void
+put_args(struct nfc_log_record* rec, const char* fmt, va_list* ap)
+{
+    const char* p;
+
+    for (p = strchr(fmt, '%'); p; p = strchr(p, '%')) {
+        struct log_spec spec;
+        int64_t width, prec;
+        int64_t i;
+        uint64_t u;
+        void* ptr;
+        double d;
+
+        p = parse_spec(p + 1, &spec);
+        if (!p) {
+            rec->truncated = 1;
+            return;
+        }
+        width = spec.width;
+        prec = spec.prec;
+
+        if (spec.width == LOG_SPEC_ARG) {
+            width = va_arg(*ap, int);
+            if (put_arg(rec, &width, sizeof(width)) < 0) {
+                return;
+            }
+        }
+        if (spec.prec == LOG_SPEC_ARG) {
+            prec = va_arg(*ap, int);
+            if (put_arg(rec, &prec, sizeof(prec)) < 0) {
+                return;
+            }
+        }
+
+        switch (spec_arg(&spec)) {
+            case LOG_ARG_NONE:
+                break;
+            case LOG_ARG_INT:
+                i = va_arg_int(spec.mod, ap);
+                if (put_arg(rec, &i, sizeof(i)) < 0) {
+                    return;
+                }
+                break;
+            case LOG_ARG_UINT:
+                u = va_arg_uint(spec.mod, ap);
+                if (put_arg(rec, &u, sizeof(u)) < 0) {
+                    return;
+                }
+                break;
+            case LOG_ARG_PTR:
+                ptr = va_arg(*ap, void*);
+                u = (uintptr_t)ptr;
+                if (put_arg(rec, &u, sizeof(u)) < 0) {
+                    return;
+                }
+                break;
+            case LOG_ARG_DOUBLE:
+                d = va_arg(*ap, double);
+                if (put_arg(rec, &d, sizeof(d)) < 0) {
+                    return;
+                }
+                break;
+            case LOG_ARG_STR:
+                if (put_str(rec, va_arg(*ap, const char*), prec) < 0) {
+                    return;
+                }
+                break;
+        }
+    }
+}
+
+void
+nfc_log_printf(struct nfc_log* log, enum nfcemu_log_level level,
+               const char* fmt, ...)
+{
+    struct nfc_log_record* rec;
+    struct timespec ts;
+    size_t tail;
+    va_list ap;
+
+    assert(log);
+    assert(fmt);
+
+    tail = log->tail;
+
+    if (tail - __atomic_load_n(&log->head, __ATOMIC_ACQUIRE) ==
+            NFC_LOG_RING_LENGTH) {
+        __atomic_fetch_add(&log->ndrops, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    rec = log->rec + tail % NFC_LOG_RING_LENGTH;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    rec->ts = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    rec->fmt = fmt;
+    rec->level = level;
+    rec->truncated = 0;
+    rec->len = 0;
+
+    va_start(ap, fmt);
+    put_args(rec, fmt, &ap);
+    va_end(ap);
+
+    __atomic_store_n(&log->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static int
+get_arg(const struct nfc_log_record* rec, size_t* off, void* arg, size_t len)
+{
+    if (len > rec->len - *off) {
+        return -1;
+    }
+    memcpy(arg, rec->args + *off, len);
+    *off += len;
+
+    return 0;
+}
+
+static int
+format_int(char* buf, size_t len, const char* fmt, const char* mod,
+           int64_t i)
+{
+    if (!strcmp(mod, "l")) {
+        return snprintf(buf, len, fmt, (long)i);
+    } else if (!strcmp(mod, "ll")) {
+        return snprintf(buf, len, fmt, (long long)i);
+    } else if (!strcmp(mod, "z")) {
+        return snprintf(buf, len, fmt, (ssize_t)i);
+    } else if (!strcmp(mod, "j")) {
+        return snprintf(buf, len, fmt, (intmax_t)i);
+    } else if (!strcmp(mod, "t")) {
+        return snprintf(buf, len, fmt, (ptrdiff_t)i);
+    }
+    return snprintf(buf, len, fmt, (int)i);
+}
+
+static int
+format_uint(char* buf, size_t len, const char* fmt, const char* mod,
+            uint64_t u)
+{
+    if (!strcmp(mod, "l")) {
+        return snprintf(buf, len, fmt, (unsigned long)u);
+    } else if (!strcmp(mod, "ll")) {
+        return snprintf(buf, len, fmt, (unsigned long long)u);
+    } else if (!strcmp(mod, "z")) {
+        return snprintf(buf, len, fmt, (size_t)u);
+    } else if (!strcmp(mod, "j")) {
+        return snprintf(buf, len, fmt, (uintmax_t)u);
+    } else if (!strcmp(mod, "t")) {
+        return snprintf(buf, len, fmt, (ptrdiff_t)u);
+    }
+    return snprintf(buf, len, fmt, (unsigned int)u);
+}
+
+/* Formats one conversion with the record's next argument. Returns
+ * the length of the output, or -1 if the argument is missing. */
+static int
+format_arg(const struct nfc_log_record* rec, size_t* off,
+           const struct log_spec* spec, char* buf, size_t len)
+{
+    char fmt[NFC_LOG_SPEC_LENGTH];
+    int64_t width, prec, i;
+    uint64_t u;
+    uint8_t slen = 0;
+    double d;
+    int n;
+
+    width = spec->width;
+    prec = spec->prec;
+
+    if ((spec->width == LOG_SPEC_ARG) &&
+        (get_arg(rec, off, &width, sizeof(width)) < 0)) {
+        return -1;
+    }
+    if ((spec->prec == LOG_SPEC_ARG) &&
+        (get_arg(rec, off, &prec, sizeof(prec)) < 0)) {
+        return -1;
+    }
+    if (spec_arg(spec) == LOG_ARG_STR) {
+        /* the record holds exactly the characters to print */
+        if (get_arg(rec, off, &slen, sizeof(slen)) < 0) {
+            return -1;
+        }
+        if (slen > rec->len - *off) {
+            return -1;
+        }
+        prec = slen;
+    }
+
+    /* rebuild the specification with the actual width and precision */
+    n = snprintf(fmt, sizeof(fmt), "%%%.*s", (int)(spec->nflags < 8 ?
+                                                   spec->nflags : 8),
+                 spec->flags);
+    if (width != LOG_SPEC_NONE) {
+        n += snprintf(fmt + n, sizeof(fmt) - n, "%d", (int)width);
+    }
+    if (prec >= 0) {
+        n += snprintf(fmt + n, sizeof(fmt) - n, ".%d", (int)prec);
+    }
+    snprintf(fmt + n, sizeof(fmt) - n, "%s%c", spec->mod, spec->conv);
+
+    switch (spec_arg(spec)) {
+        case LOG_ARG_NONE:
+            return snprintf(buf, len, "%%");
+        case LOG_ARG_INT:
+            if (get_arg(rec, off, &i, sizeof(i)) < 0) {
+                return -1;
+            }
+            return format_int(buf, len, fmt, spec->mod, i);
+        case LOG_ARG_UINT:
+            if (get_arg(rec, off, &u, sizeof(u)) < 0) {
+                return -1;
+            }
+            return format_uint(buf, len, fmt, spec->mod, u);
+        case LOG_ARG_PTR:
+            if (get_arg(rec, off, &u, sizeof(u)) < 0) {
+                return -1;
+            }
+            return snprintf(buf, len, fmt, (void*)(uintptr_t)u);
+        case LOG_ARG_DOUBLE:
+            if (get_arg(rec, off, &d, sizeof(d)) < 0) {
+                return -1;
+            }
+            return snprintf(buf, len, fmt, d);
+        case LOG_ARG_STR:
+            n = snprintf(buf, len, fmt, (const char*)rec->args + *off);
+            *off += slen;
+            return n;
+    }
+    return -1;
+}
+
+/* Formats a record's message into 'msg', which holds at least
+ * NFC_LOG_MSG_LENGTH bytes. */
+static void
+format_record(const struct nfc_log_record* rec, char* msg)
+{
+    const char* p;
+    size_t off, n;
+
+    off = 0;
+    n = 0;
+
+    for (p = rec->fmt; *p && (n < NFC_LOG_MSG_LENGTH - 1);) {
+        struct log_spec spec;
+        const char* next;
+        int res;
+
+        if (*p != '%') {
+            msg[n++] = *p++;
+            continue;
+        }
+        next = parse_spec(p + 1, &spec);
+        if (!next) {
+            break;
+        }
+        res = format_arg(rec, &off, &spec, msg + n, NFC_LOG_MSG_LENGTH - n);
+        if (res < 0) {
+            break;
+        }
+        n += res;
+        if (n > NFC_LOG_MSG_LENGTH - 1) {
+            n = NFC_LOG_MSG_LENGTH - 1; /* truncated */
+        }
+        p = next;
+    }
+    msg[n] = '\0';
+
+    if (rec->truncated) {
+        strncat(msg, "...", NFC_LOG_MSG_LENGTH - 1 - n);
+    }
+}
+
+size_t
+nfc_log_drain(struct nfc_log* log,
+              void (*func)(void*, enum nfcemu_log_level, uint64_t,
+                           const char*),
+              void* data, size_t n)
+{
+    size_t head, tail, i;
+    unsigned long ndrops;
+
+    assert(log);
+    assert(func);
+
+    head = log->head;
+    tail = __atomic_load_n(&log->tail, __ATOMIC_ACQUIRE);
+
+    for (i = 0; i < n && head != tail; ++i, ++head) {
+        struct nfc_log_record rec = log->rec[head % NFC_LOG_RING_LENGTH];
+        char msg[NFC_LOG_MSG_LENGTH];
+
+        /* hand the record back before formatting and calling out */
+        __atomic_store_n(&log->head, head + 1, __ATOMIC_RELEASE);
+
+        format_record(&rec, msg);
+        func(data, rec.level, rec.ts, msg);
+    }
+    ndrops = __atomic_exchange_n(&log->ndrops, 0, __ATOMIC_RELAXED);
+    if (ndrops) {
+        char msg[64];
+        snprintf(msg, sizeof(msg), "%lu log messages dropped", ndrops);
+        func(data, NFCEMU_LOG_WARN, 0, msg);
+    }
+
+    return i;
+}
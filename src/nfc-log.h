@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2013-2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef nfc_log_h
+#define nfc_log_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <nfcemu/nfcemu.h>
+
+/* Log messages go into a ring of fixed-size records, which the host
+ * drains into text when it wants to. Messages above the log level are
+ * dropped by a single branch. The others only store their format
+ * string's address and their arguments; the drain formats them.
+ */
+
+enum {
+    NFC_LOG_RECORD_SIZE = 128,
+    NFC_LOG_RING_LENGTH = 256 /* power of 2 */
+};
+
+#if DEBUG
+#define NFC_LOG_DEFAULT_LEVEL NFCEMU_LOG_DEBUG
+#else
+#define NFC_LOG_DEFAULT_LEVEL NFCEMU_LOG_ERR
+#endif
+
+struct nfc_log_record {
+    uint64_t ts; /* monotonic time in ns */
+    const char* fmt; /* a string literal */
+    uint8_t level;
+    uint8_t truncated; /* true if some arguments didn't fit */
+    uint8_t len;
+    uint8_t args[NFC_LOG_RECORD_SIZE - 11 - sizeof(const char*)];
+};
+
+/* The emulator is the only writer; a single host thread may drain
+ * the ring at the same time. The indices are free-running counters
+ * that each side publishes with release semantics. */
+struct nfc_log {
+    int level;
+    unsigned long ndrops; /* messages lost to a full ring */
+    size_t tail; /* written by the emulator */
+    size_t head __attribute__((aligned(64))); /* written by the drain */
+    struct nfc_log_record rec[NFC_LOG_RING_LENGTH];
+};
+
+#define NFC_LOG_ENABLED(_log, _level) \
+    __builtin_expect((int)(_level) <= \
+                     __atomic_load_n(&(_log)->level, __ATOMIC_RELAXED), 0)
+
+#define NFC_LOG(_log, _level, ...) \
+    do { \
+        if (NFC_LOG_ENABLED((_log), (_level))) { \
+            nfc_log_printf((_log), (_level), __VA_ARGS__); \
+        } \
+    } while (0)
+
+#define NFC_E(_log, ...) NFC_LOG((_log), NFCEMU_LOG_ERR, __VA_ARGS__)
+#define NFC_W(_log, ...) NFC_LOG((_log), NFCEMU_LOG_WARN, __VA_ARGS__)
+#define NFC_I(_log, ...) NFC_LOG((_log), NFCEMU_LOG_INFO, __VA_ARGS__)
+#define NFC_D(_log, ...) NFC_LOG((_log), NFCEMU_LOG_DEBUG, __VA_ARGS__)
+
+void
+nfc_log_init(struct nfc_log* log, enum nfcemu_log_level level);
+
+void
+nfc_log_set_level(struct nfc_log* log, enum nfcemu_log_level level);
+
+enum nfcemu_log_level
+nfc_log_get_level(const struct nfc_log* log);
+
+/* Stores a message in the next free record. 'fmt' has to outlive
+ * the record, so only pass string literals; strings for %s are
+ * copied. Use the NFC_*() macros instead, which check the log level
+ * first. */
+void
+nfc_log_printf(struct nfc_log* log, enum nfcemu_log_level level,
+               const char* fmt, ...) __attribute__((format(printf, 3, 4)));
+
+size_t
+nfc_log_drain(struct nfc_log* log,
+              void (*func)(void*, enum nfcemu_log_level, uint64_t,
+                           const char*),
+              void* data, size_t n);
+
+#endif
@@ -18,11 +18,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include "bswap.h"
-#include "nfc-debug.h"
+#include "ptr.h"
 #include "nfc.h"
-#include "cb.h"
+#include "ctx.h"
 #include "nfc-re.h"
 #include "nfc-nci.h"
+#include "nfc-stats.h"
 
 /* first value is offset, second is number of bytes */
 static const uint8_t config_id_value[256][2] = {
@@ -70,7 +71,7 @@ nfc_nci_device_set(struct nfc_device* nfc, enum nci_config_param_id id,
     nfc_device_set(nfc, config_id_value[id][0], len, value);
 
     if ((id == NCI_CONFIG_PARAM_BCM2079x_I93_DATARATE) && (value[2] & 0x1)) {
-        cb.send_ntf(nfc_rf_field_info_ntf_cb, NULL);
+        ctx_send_ntf(nfc->ctx, nfc_rf_field_info_ntf_cb, NULL);
     }
 }
 
@@ -93,8 +94,6 @@ nfc_create_nci_dta(union nci_packet* rsp, enum nci_pbf pbf,
 {
     assert(rsp);
 
-    NFC_D("creating NCI data pbf=%d connid=%d length=%d", pbf, connid, l);
-
     rsp->data.mt = NCI_MT_DTA;
     rsp->data.pbf = pbf;
     rsp->data.connid = connid;
@@ -104,23 +103,189 @@ nfc_create_nci_dta(union nci_packet* rsp, enum nci_pbf pbf,
     return 3 + l;
 }
 
+size_t
+nfc_create_nci_dta_frame(struct nfc_device* nfc, uint8_t connid,
+                         const uint8_t* frame, size_t len,
+                         union nci_packet* dta)
+{
+    size_t maxpayload, first, nsegs, off;
+
+    assert(nfc);
+    assert(connid < ARRAY_SIZE(nfc->conn));
+    assert(frame || !len);
+    assert(dta);
+
+    maxpayload = nfc->conn[connid].maxpayload;
+
+    /* queued packets go first, so later ones have to wait */
+    first = nfc_ring_len(&nfc->dta_q) ? 0 : maxpayload;
+
+    if (len <= first) {
+        memmove(dta->data.payload, frame, len);
+        return nfc_create_nci_dta(dta, NCI_PBF_END, connid, len);
+    }
+
+    /* [NCI], Sec 3.4.2; the first segment goes into 'dta', the
+     * others wait in the queue. The last one has the PBF cleared. */
+    nsegs = (len - first + maxpayload - 1) / maxpayload;
+    if (len - first + 3 * nsegs >
+        NFC_DTA_QUEUE_LIMIT - nfc_ring_len(&nfc->dta_q)) {
+        NFC_W(&nfc->ctx->log, "NCI data queue full; dropping %zu bytes",
+              len);
+        return 0;
+    }
+    for (off = first; off < len; off += maxpayload) {
+        union nci_packet seg;
+        size_t l, seglen;
+
+        l = len - off > maxpayload ? maxpayload : len - off;
+        memcpy(seg.data.payload, frame + off, l);
+        seglen = nfc_create_nci_dta(&seg, off + l < len ? NCI_PBF_SEG
+                                                        : NCI_PBF_END,
+                                    connid, l);
+        nfc_ring_write(&nfc->dta_q, seglen, &seg);
+    }
+    nfc_device_send_dta_q(nfc);
+
+    if (!first) {
+        return 0;
+    }
+    memmove(dta->data.payload, frame, first);
+    return nfc_create_nci_dta(dta, NCI_PBF_SEG, connid, first);
+}
+
+/* Collects the segments of a frame. Returns the frame's length
+ * after the last segment, or 0 otherwise. */
+static size_t
+reassemble_nci_dta(const union nci_packet* dta, struct nfc_device* nfc)
+{
+    struct nfc_conn* conn;
+    size_t len;
+
+    conn = nfc->conn + dta->data.connid;
+
+    if (conn->rdrop) {
+        /* the frame is lost already */
+    } else if (dta->data.l > sizeof(conn->rbuf) - conn->rlen) {
+        NFC_W(&nfc->ctx->log, "NCI frame on connection %u too long",
+              dta->data.connid);
+        conn->rdrop = 1;
+    } else {
+        memcpy(conn->rbuf + conn->rlen, dta->data.payload, dta->data.l);
+        conn->rlen += dta->data.l;
+    }
+
+    if (dta->data.pbf == NCI_PBF_SEG) {
+        return 0;
+    }
+    len = conn->rdrop ? 0 : conn->rlen;
+    conn->rdrop = 0;
+    conn->rlen = 0;
+
+    return len;
+}
+
+/* Takes the host's credit for a data packet. Returns true if we
+ * should hand back credits. */
+static int
+consume_credit(struct nfc_device* nfc, uint8_t connid)
+{
+    struct nfc_conn* conn;
+
+    conn = nfc->conn + connid;
+
+    if (conn->maxcredits == NCI_CREDITS_UNLIMITED) {
+        return 0;
+    }
+    if (!conn->ncredits) {
+        NFC_W(&nfc->ctx->log, "NCI data on connection %u without credits",
+              connid);
+        return 0;
+    }
+    --conn->ncredits;
+    ++conn->nconsumed;
+
+    /* credits go back in bulk, once half of them are used up */
+    return conn->nconsumed >= (conn->maxcredits + 1) / 2;
+}
+
+static ssize_t
+nfc_delivery_conn_credits_cb(void* data, union nci_packet* pkt)
+{
+    return nfc_create_conn_credits_ntf(data, pkt);
+}
+
 static size_t
 process_nci_dta(const union nci_packet* dta, struct nfc_device* nfc,
-                union nci_packet* rsp)
+                union nci_packet* rsp, struct nfc_delivery_cb* cb)
 {
+    const struct nfc_conn* conn;
+    uint8_t frame[NFC_MAX_FRAME_LENGTH];
+    const uint8_t* data;
+    struct nfc_re* re;
     enum nfc_rfst rfst;
+    size_t len;
 
     assert(dta);
     assert(nfc);
 
-    rfst = nfc_rf_state_transition(&nfc->rf_state,
-                                   NFC_RFST_POLL_ACTIVE_BIT|
-                                   NFC_RFST_LISTEN_ACTIVE_BIT,
-                                   nfc->rf_state);
-    assert(rfst != NUMBER_OF_NFC_RFSTS);
+    conn = nfc->conn + dta->data.connid;
+
+    if (!conn->dest) {
+        NFC_W(&nfc->ctx->log, "NCI data on closed connection %u",
+              dta->data.connid);
+        return 0;
+    }
+
+    if (consume_credit(nfc, dta->data.connid)) {
+        /* the notification follows our response and
+         * covers all connections */
+        nfc_delivery_cb_setup(cb, NTFN_BUF, nfc,
+                              nfc_delivery_conn_credits_cb);
+    }
+
+    if ((dta->data.pbf == NCI_PBF_SEG) || conn->rlen || conn->rdrop) {
+        len = reassemble_nci_dta(dta, nfc);
+        if (!len) {
+            return 0;
+        }
+        data = conn->rbuf;
+    } else {
+        len = dta->data.l;
+        data = dta->data.payload;
+    }
 
-    /* data gets processed by RE */
-    return nfc_re_process_data(nfc->active_re, dta, rsp);
+    switch (conn->dest) {
+        case NCI_DEST_NFCC_LOOPBACK:
+            /* [NCI], Sec 4.4.2; we return the data as-is */
+            memcpy(frame, data, len);
+            break;
+        case NCI_DEST_REMOTE_NFC_ENDPOINT:
+            re = conn->re ? conn->re : nfc->active_re;
+            if (!re || (re != nfc->active_re)) {
+                NFC_W(&nfc->ctx->log, "NCI no active RE on connection %u",
+                      dta->data.connid);
+                return 0;
+            }
+            rfst = nfc_rf_state_transition(&nfc->ctx->log, &nfc->rf_state,
+                                           NFC_RFST_POLL_ACTIVE_BIT|
+                                           NFC_RFST_LISTEN_ACTIVE_BIT,
+                                           nfc->rf_state);
+            assert(rfst != NUMBER_OF_NFC_RFSTS);
+
+            /* data gets processed by RE */
+            len = nfc_re_process_data(re, data, len, frame,
+                                      conn->maxpayload);
+            break;
+        default:
+            assert(0);
+            len = 0;
+            break;
+    }
+    if (!len) {
+        return 0;
+    }
+    return nfc_create_nci_dta_frame(nfc, dta->data.connid, frame, len, rsp);
 }
 
 size_t
@@ -135,7 +300,7 @@ nfc_create_dta(const void* data, size_t len,
     assert(nci);
 
     /* RF state transition */
-    rfst = nfc_rf_state_transition(&nfc->rf_state,
+    rfst = nfc_rf_state_transition(&nfc->ctx->log, &nfc->rf_state,
                                    NFC_RFST_POLL_ACTIVE_BIT|
                                    NFC_RFST_LISTEN_ACTIVE_BIT,
                                    nfc->rf_state);
@@ -211,6 +376,7 @@ idle_process_oid_core_reset_cmd(const union nci_packet* cmd,
     if (cmd->control.payload[0]) {
         nfc->rf_state = NFC_RFST_IDLE;
     }
+    nfc_device_reset_conns(nfc);
 
     rsp->control.payload[0] = NCI_STATUS_OK;
     rsp->control.payload[1] = NCI_VERSION_1_0; /* Nexus 4 returns 0x0f here */
@@ -357,7 +523,7 @@ idle_process_cmd(const union nci_packet* cmd, struct nfc_device* nfc,
 
     assert(cmd);
 
-    NFC_D("gid=0x%x oid=0x%x", cmd->control.gid, cmd->control.oid);
+    NFC_D(&nfc->ctx->log, "gid=0x%x oid=0x%x", cmd->control.gid, cmd->control.oid);
 
     if (cmd->control.gid == NCI_GID_CORE) {
         process = core_oid[cmd->control.oid];
@@ -403,9 +569,9 @@ reset_process_oid_core_init_cmd(const union nci_packet* cmd,
         payload->rf[i] = nfc->rf[i].iface;
     }
 
-    payload->nconns = 0;
+    payload->nconns = ARRAY_SIZE(nfc->conn) - 1; /* w/o static RF */
     payload->maxrtabsize = cpu_to_le16(0x0);
-    payload->payloadsize = 255;
+    payload->payloadsize = nfc->maxctrlpayload;
     payload->maxlparamsize = cpu_to_le16(0x0);
     payload->vendor = 0x0;
     payload->device = cpu_to_le32(0x0);
@@ -460,7 +626,7 @@ reset_process_cmd(const union nci_packet* cmd, struct nfc_device* nfc,
 
     assert(cmd);
 
-    NFC_D("gid=0x%x oid=0x%x", cmd->control.gid, cmd->control.oid);
+    NFC_D(&nfc->ctx->log, "gid=0x%x oid=0x%x", cmd->control.gid, cmd->control.oid);
 
     if (cmd->control.gid == NCI_GID_CORE) {
         process = core_oid[cmd->control.oid];
@@ -498,6 +664,7 @@ init_process_oid_core_reset_cmd(const union nci_packet* cmd,
     if (cmd->control.payload[0]) {
         nfc->rf_state = NFC_RFST_IDLE;
     }
+    nfc_device_reset_conns(nfc);
 
     rsp->control.payload[0] = NCI_STATUS_OK;
     rsp->control.payload[1] = NCI_VERSION_1_0;
@@ -518,13 +685,13 @@ init_process_oid_core_set_config_cmd(const union nci_packet* cmd,
 
     payload = (struct nci_core_set_config_cmd*)cmd->control.payload;
 
-    NFC_D("number of params=%d", payload->nparams);
+    NFC_D(&nfc->ctx->log, "number of params=%d", payload->nparams);
 
     for (i = 0, off = 0; i < payload->nparams; ++i) {
         const struct nci_core_config_field* field =
             (const struct nci_core_config_field*)(payload->param+off);
 
-        NFC_D("  param%d: id=0x%x, len=%d", i, field->id, field->len);
+        NFC_D(&nfc->ctx->log, "  param%d: id=0x%x, len=%d", i, field->id, field->len);
 
         if (field->len) {
             nfc_nci_device_set(nfc, field->id, field->len, field->val);
@@ -543,6 +710,127 @@ init_process_oid_core_set_config_cmd(const union nci_packet* cmd,
                                                 cmd->control.oid, 2);
 }
 
+/* Returns the RE of a connection to a Remote NFC Endpoint. */
+static struct nfc_re*
+find_conn_re(struct nfc_device* nfc,
+             const struct nci_core_conn_create_cmd* payload, size_t len)
+{
+    const uint8_t* param;
+    struct nfc_re* re;
+
+    param = payload->params;
+
+    if ((payload->nparams != 1) || (len < sizeof(*payload) + 4) ||
+        (param[0] != NCI_DEST_PARAM_RF_DISCOVERY_ID) || (param[1] != 2)) {
+        return NULL;
+    }
+    if (!param[2] || (param[2] == 255)) {
+        return NULL; /* not a valid RF Discovery ID */
+    }
+    re = nfc_get_re_by_id(nfc->ctx, param[2]);
+    if (!re || (re->rfproto != param[3])) {
+        return NULL;
+    }
+    return re;
+}
+
+/* [NCI] 4.4.1 */
+static size_t
+init_process_oid_core_conn_create_cmd(const union nci_packet* cmd,
+                                      struct nfc_device* nfc,
+                                      union nci_packet* rsp,
+                                      struct nfc_delivery_cb* cb)
+{
+    const struct nci_core_conn_create_cmd* create;
+    struct nci_core_conn_create_rsp* payload;
+    struct nfc_re* re;
+    uint8_t connid;
+
+    assert(cmd);
+    assert(nfc);
+    assert(rsp);
+
+    create = (const struct nci_core_conn_create_cmd*)cmd->control.payload;
+
+    switch (create->desttype) {
+        case NCI_DEST_NFCC_LOOPBACK:
+            re = NULL;
+            break;
+        case NCI_DEST_REMOTE_NFC_ENDPOINT:
+            re = find_conn_re(nfc, create, cmd->control.l);
+            if (!re) {
+                return create_control_status_rsp(rsp, cmd->control.gid,
+                                                 cmd->control.oid,
+                                                 NCI_STATUS_INVALID_PARAM);
+            }
+            break;
+        case NCI_DEST_NFCEE:
+            /* we don't report any NFCEEs */
+            return create_control_status_rsp(rsp, cmd->control.gid,
+                                             cmd->control.oid,
+                                             NCI_STATUS_REJECTED);
+        default:
+            return create_control_status_rsp(rsp, cmd->control.gid,
+                                             cmd->control.oid,
+                                             NCI_STATUS_INVALID_PARAM);
+    }
+
+    /* take the first free Conn ID; the static RF connection
+     * has 0 */
+    for (connid = 1; connid < ARRAY_SIZE(nfc->conn); ++connid) {
+        if (!nfc->conn[connid].dest) {
+            break;
+        }
+    }
+    if (connid == ARRAY_SIZE(nfc->conn)) {
+        return create_control_status_rsp(rsp, cmd->control.gid,
+                                         cmd->control.oid,
+                                         NCI_STATUS_REJECTED);
+    }
+    nfc_device_open_conn(nfc, connid, create->desttype, re);
+    if (re) {
+        /* the RE sends spontaneous data on the new connection */
+        re->connid = connid;
+    }
+
+    payload = (struct nci_core_conn_create_rsp*)rsp->control.payload;
+    payload->status = NCI_STATUS_OK;
+    payload->maxpayloadsize = nfc->conn[connid].maxpayload;
+    payload->ncredits = nfc->conn[connid].maxcredits;
+    payload->connid = connid;
+
+    return create_control_rsp(rsp, NCI_PBF_END, cmd->control.gid,
+                              cmd->control.oid, sizeof(*payload));
+}
+
+/* [NCI] 4.4.3 */
+static size_t
+init_process_oid_core_conn_close_cmd(const union nci_packet* cmd,
+                                     struct nfc_device* nfc,
+                                     union nci_packet* rsp,
+                                     struct nfc_delivery_cb* cb)
+{
+    const struct nci_core_conn_close_cmd* payload;
+
+    assert(cmd);
+    assert(nfc);
+    assert(rsp);
+
+    payload = (const struct nci_core_conn_close_cmd*)cmd->control.payload;
+
+    if ((payload->connid == NFC_STATIC_RF_CONNID) ||
+        (payload->connid >= ARRAY_SIZE(nfc->conn)) ||
+        !nfc->conn[payload->connid].dest) {
+        return create_control_status_rsp(rsp, cmd->control.gid,
+                                         cmd->control.oid,
+                                         NCI_STATUS_REJECTED);
+    }
+    nfc_device_close_conn(nfc, payload->connid);
+
+    return create_control_status_rsp(rsp, cmd->control.gid,
+                                     cmd->control.oid, NCI_STATUS_OK);
+}
+
 static size_t
 init_process_oid_rf_discover_map_cmd(const union nci_packet* cmd,
                                      struct nfc_device* nfc,
@@ -554,12 +842,12 @@ init_process_oid_rf_discover_map_cmd(const union nci_packet* cmd,
 
     payload = (struct nci_rf_discover_map_cmd*)cmd->control.payload;
 
-    NFC_D("number of RF mappings=%d", payload->nmappings);
+    NFC_D(&nfc->ctx->log, "number of RF mappings=%d", payload->nmappings);
 
     for (i = 0; i < payload->nmappings; ++i) {
         const struct nci_rf_discover_mapping* mapping = payload->mapping+i;
 
-        NFC_D("  RF mapping %d: rfproto=0x%x, mode=%d, rfinterface=%d",
+        NFC_D(&nfc->ctx->log, "  RF mapping %d: rfproto=0x%x, mode=%d, rfinterface=%d",
               i, mapping->proto, mapping->mode, mapping->iface);
     }
 
@@ -579,18 +867,18 @@ init_process_oid_rf_discover_cmd(const union nci_packet* cmd,
     const struct nci_rf_discover_cmd *payload;
     unsigned char i;
 
-    rfst = nfc_rf_state_transition(&nfc->rf_state, NFC_RFST_IDLE_BIT,
-                                   NFC_RFST_DISCOVERY);
+    rfst = nfc_rf_state_transition(&nfc->ctx->log, &nfc->rf_state,
+                                   NFC_RFST_IDLE_BIT, NFC_RFST_DISCOVERY);
     assert(rfst != NUMBER_OF_NFC_RFSTS);
 
     payload = (struct nci_rf_discover_cmd*)cmd->control.payload;
 
-    NFC_D("number of discovery configs=%d", payload->nconfigs);
+    NFC_D(&nfc->ctx->log, "number of discovery configs=%d", payload->nconfigs);
 
     for (i = 0; i < payload->nconfigs; ++i) {
         const struct nci_rf_discover_config* config = payload->config+i;
 
-        NFC_D("  RF discovery config %d: rfmode=%x, freq=%x",
+        NFC_D(&nfc->ctx->log, "  RF discovery config %d: rfmode=%x, freq=%x",
               i, config->mode, config->freq);
     }
 
@@ -615,19 +903,19 @@ init_process_oid_rf_discover_select_cmd(const union nci_packet* cmd,
     payload = (struct nci_rf_discover_select_cmd*)cmd->control.payload;
 
     if (!payload->id || payload->id == 255) {
-        NFC_D("invalid payload id %d", payload->id);
+        NFC_W(&nfc->ctx->log, "invalid payload id %d", payload->id);
         goto status_rejected;
     }
 
-    re = nfc_get_re_by_id(payload->id);
+    re = nfc_get_re_by_id(nfc->ctx, payload->id);
 
     if (!re) {
-        NFC_D("couldn't find payload id %d", payload->id);
+        NFC_W(&nfc->ctx->log, "couldn't find payload id %d", payload->id);
         goto status_rejected;
     }
 
     if (payload->rfproto != re->rfproto) {
-        NFC_D("invalid RF protocol %d, expected %d", payload->rfproto, re->rfproto);
+        NFC_W(&nfc->ctx->log, "invalid RF protocol %d, expected %d", payload->rfproto, re->rfproto);
         goto status_rejected;
     }
 
@@ -638,7 +926,8 @@ init_process_oid_rf_discover_select_cmd(const union nci_packet* cmd,
     }
 
     /* RF state transition */
-    rfst = nfc_rf_state_transition(&nfc->rf_state, NFC_RFST_W4_HOST_SELECT_BIT,
+    rfst = nfc_rf_state_transition(&nfc->ctx->log, &nfc->rf_state,
+                                   NFC_RFST_W4_HOST_SELECT_BIT,
                                    NFC_RFST_W4_HOST_SELECT);
     assert(rfst != NUMBER_OF_NFC_RFSTS);
 
@@ -731,7 +1020,7 @@ init_process_oid_rf_deactivate_cmd(const union nci_packet* cmd,
             break;
     }
 
-    rfst = nfc_rf_state_transition(&nfc->rf_state, bits, rfst);
+    rfst = nfc_rf_state_transition(&nfc->ctx->log, &nfc->rf_state, bits, rfst);
     assert(rfst != NUMBER_OF_NFC_RFSTS);
 
     /* reset state */
@@ -739,8 +1028,8 @@ init_process_oid_rf_deactivate_cmd(const union nci_packet* cmd,
     nfc->active_re = NULL;
     nfc->active_rf = NULL;
 
-    for (i = 0; i < sizeof(nfc_res)/sizeof(nfc_res[0]); ++i) {
-        nfc_res[i].id = 0;
+    for (i = 0; i < ARRAY_SIZE(nfc->ctx->res); ++i) {
+        nfc->ctx->res[i].id = 0;
     }
 
     if (send_ntf) {
@@ -942,8 +1231,8 @@ init_process_cmd(const union nci_packet* cmd, struct nfc_device* nfc,
         [NCI_OID_CORE_INIT_CMD] = create_semantic_error_rsp,
         [NCI_OID_CORE_SET_CONFIG_CMD] = init_process_oid_core_set_config_cmd,
         [NCI_OID_CORE_GET_CONFIG_CMD] = NULL,
-        [NCI_OID_CORE_CONN_CREATE_CMD] = NULL,
-        [NCI_OID_CORE_CONN_CLOSE_CMD] = NULL
+        [NCI_OID_CORE_CONN_CREATE_CMD] = init_process_oid_core_conn_create_cmd,
+        [NCI_OID_CORE_CONN_CLOSE_CMD] = init_process_oid_core_conn_close_cmd
     };
     static size_t (* const rf_oid[NUMBER_OF_NCI_CMDS])
       (const union nci_packet*, struct nfc_device*, union nci_packet*,
@@ -977,7 +1266,7 @@ init_process_cmd(const union nci_packet* cmd, struct nfc_device* nfc,
 
     assert(cmd);
 
-    NFC_D("gid=0x%x oid=0x%x", cmd->control.gid, cmd->control.oid);
+    NFC_D(&nfc->ctx->log, "gid=0x%x oid=0x%x", cmd->control.gid, cmd->control.oid);
 
     if (cmd->control.gid == NCI_GID_CORE) {
         process = core_oid[cmd->control.oid];
@@ -1009,14 +1298,27 @@ process_nci_cmd(const union nci_packet* cmd, struct nfc_device* nfc,
         [NFC_FSM_STATE_RESET] = reset_process_cmd,
         [NFC_FSM_STATE_INITIALIZED] = init_process_cmd
     };
+    enum nfc_fsm_state state;
+    uint64_t t0;
+    size_t len;
 
-    NFC_D("NCI mt=%d pbf=%d unused=%d; NFC state=%d",
+    NFC_D(&nfc->ctx->log, "NCI mt=%d pbf=%d unused=%d; NFC state=%d",
           cmd->common.mt, cmd->common.pbf, cmd->common.unused, nfc->state);
 
     assert(nfc->state < NUMBER_OF_NFC_FSM_STATES);
     assert(process[nfc->state]);
 
-    return process[nfc->state](cmd, nfc, rsp, cb);
+    if (!nfc->stats) {
+        return process[nfc->state](cmd, nfc, rsp, cb);
+    }
+
+    /* commands can change the state; count them in the old one */
+    state = nfc->state;
+    t0 = nfc_stats_now();
+    len = process[state](cmd, nfc, rsp, cb);
+    nfc_stats_add_nci(nfc->stats, state, cmd, rsp, len, nfc_stats_now() - t0);
+
+    return len;
 }
 
 /*
@@ -1030,7 +1332,7 @@ nfc_process_nci_msg(const union nci_packet* pkt, struct nfc_device* nfc,
     assert(pkt);
 
     if (pkt->common.mt == NCI_MT_DTA) {
-        return process_nci_dta(pkt, nfc, rsp);
+        return process_nci_dta(pkt, nfc, rsp, cb);
     } else if (pkt->common.mt == NCI_MT_CMD) {
         return process_nci_cmd(pkt, nfc, rsp, cb);
     } else {
@@ -1048,8 +1350,6 @@ nfc_create_nci_ntf(union nci_packet* ntf, enum nci_pbf pbf,
 {
     assert(ntf);
 
-    NFC_D("NCI notification pbf=%d gid=%d oid=%d", pbf, gid, oid);
-
     ntf->control.mt = NCI_MT_NTF;
     ntf->control.pbf = pbf;
     ntf->control.gid = gid;
@@ -1112,7 +1412,7 @@ nfc_create_rf_discovery_ntf(struct nfc_re* re,
             break;
     }
 
-    rfst = nfc_rf_state_transition(&nfc->rf_state, bits, rfst);
+    rfst = nfc_rf_state_transition(&nfc->ctx->log, &nfc->rf_state, bits, rfst);
     assert(rfst != NUMBER_OF_NFC_RFSTS);
 
     return nfc_create_nci_ntf(ntf, NCI_PBF_END, NCI_GID_RF,
@@ -1151,8 +1451,8 @@ nfc_create_rf_intf_activated_ntf(struct nfc_re* re,
     payload->iface = nfc->active_rf->iface;
     payload->rfproto = re->rfproto;
     payload->actmode = nfc->active_rf->mode;
-    payload->maxpayload = 255;
-    payload->ncredits = 0xff; /* disable flow control */
+    payload->maxpayload = nfc->maxdtapayload;
+    payload->ncredits = nfc->ncredits;
     payload->nparams = nfc_re_create_rf_intf_activated_ntf_tech(
         payload->actmode, re, payload->param);
 
@@ -1189,7 +1489,7 @@ nfc_create_rf_intf_activated_ntf(struct nfc_re* re,
             break;
     }
 
-    rfst = nfc_rf_state_transition(&nfc->rf_state, bits, rfst);
+    rfst = nfc_rf_state_transition(&nfc->ctx->log, &nfc->rf_state, bits, rfst);
     assert(rfst != NUMBER_OF_NFC_RFSTS);
 
     /* update NFC */
@@ -1199,6 +1499,11 @@ nfc_create_rf_intf_activated_ntf(struct nfc_re* re,
     }
     assert(nfc->active_re == re);
 
+    /* data flows over the static RF connection */
+    nfc_device_open_conn(nfc, NFC_STATIC_RF_CONNID,
+                         NCI_DEST_REMOTE_NFC_ENDPOINT, NULL);
+    re->connid = NFC_STATIC_RF_CONNID;
+
     return nfc_create_nci_ntf(ntf, NCI_PBF_END, NCI_GID_RF,
                               NCI_OID_RF_INTF_ACTIVATED_NTF,
                               sizeof(*payload)+payload->nparams+
@@ -1275,3 +1580,40 @@ nfc_create_rf_field_info_ntf(struct nfc_device* nfc,
     return nfc_create_nci_ntf(ntf, NCI_PBF_END, NCI_GID_RF,
                               NCI_OID_RF_FIELD_INFO_NTF, sizeof(*payload));
 }
+
+size_t
+nfc_create_conn_credits_ntf(struct nfc_device* nfc,
+                            union nci_packet* ntf)
+{
+    struct nci_core_conn_credits_ntf* payload;
+    uint8_t i;
+
+    assert(nfc);
+    assert(ntf);
+
+    payload = (struct nci_core_conn_credits_ntf*)ntf->control.payload;
+    payload->nentries = 0;
+
+    for (i = 0; i < ARRAY_SIZE(nfc->conn); ++i) {
+        struct nfc_conn* conn = nfc->conn + i;
+        struct nci_core_conn_credits_entry* entry;
+
+        if (!conn->nconsumed) {
+            continue;
+        }
+        entry = payload->entry + payload->nentries++;
+        entry->connid = i;
+        entry->ncredits = conn->nconsumed;
+
+        conn->ncredits += conn->nconsumed;
+        conn->nconsumed = 0;
+    }
+    if (!payload->nentries) {
+        return 0;
+    }
+
+    return nfc_create_nci_ntf(ntf, NCI_PBF_END, NCI_GID_CORE,
+                              NCI_OID_CORE_CONN_CREDITS_NTF,
+                              sizeof(*payload) +
+                              payload->nentries * sizeof(payload->entry[0]));
+}
@@ -342,6 +342,19 @@ struct nci_core_get_config_rsp {
 
 /* NCI_CORE_CONN_CREATE */
 
+/* [NCI], Table 15 */
+enum nci_dest_type {
+    NCI_DEST_NFCC_LOOPBACK = 0x01,
+    NCI_DEST_REMOTE_NFC_ENDPOINT = 0x02,
+    NCI_DEST_NFCEE = 0x03
+};
+
+/* [NCI], Table 16 */
+enum nci_dest_param_type {
+    NCI_DEST_PARAM_RF_DISCOVERY_ID = 0x00,
+    NCI_DEST_PARAM_NFCEE_VALUE = 0x01
+};
+
 struct nci_core_conn_create_cmd {
     uint8_t desttype;
     uint8_t nparams;
@@ -367,9 +380,18 @@ struct nci_core_conn_close_rsp {
 
 /* NCI_CORE_CONN_CREDITS */
 
+enum {
+    NCI_CREDITS_UNLIMITED = 0xff /* flow control disabled */
+};
+
+struct nci_core_conn_credits_entry {
+    uint8_t connid;
+    uint8_t ncredits;
+};
+
 struct nci_core_conn_credits_ntf {
     uint8_t nentries;
-    uint8_t entries[];
+    struct nci_core_conn_credits_entry entry[];
 };
 
 /* NCI_CORE_GENERIC_ERROR */
@@ -557,6 +579,15 @@ size_t
 nfc_create_nci_dta(union nci_packet* rsp, enum nci_pbf pbf,
                    uint8_t connid, unsigned char l);
 
+/* Creates the data packets of a frame on a logical connection. If
+ * the frame doesn't fit into 'dta', the first segment goes there and
+ * the others are queued in the device; see nfc_device_send_dta_q().
+ * Returns 0 if the device's queue holds all of the frame. */
+size_t
+nfc_create_nci_dta_frame(struct nfc_device* nfc, uint8_t connid,
+                         const uint8_t* frame, size_t len,
+                         union nci_packet* dta);
+
 size_t
 nfc_create_nci_ntf(union nci_packet* ntf, enum nci_pbf pbf,
                    enum nci_gid gid, enum nci_oid oid, unsigned char l);
@@ -585,6 +616,12 @@ size_t
 nfc_create_rf_field_info_ntf(struct nfc_device* nfc,
                              union nci_packet* ntf);
 
+/* Returns the credits of all connections whose data has been
+ * consumed; 0 if there are none. */
+size_t
+nfc_create_conn_credits_ntf(struct nfc_device* nfc,
+                            union nci_packet* ntf);
+
 size_t
 nfc_create_dta(const void* data, size_t len,
                struct nfc_device* nfc,
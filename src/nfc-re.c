@@ -15,32 +15,56 @@
  */
 
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 #include "ptr.h"
-#include "nfc-debug.h"
 #include "nfc.h"
 #include "nfc-nci.h"
 #include "nfc-tag.h"
 #include "llcp.h"
 #include "snep.h"
 #include "llcp-snep.h"
-#include "cb.h"
+#include "ctx.h"
+#include "nfc-snapshot.h"
 #include "nfc-re.h"
 
+struct nfc_re_desc {
+    enum nci_rf_protocol rfproto;
+    enum nci_rf_tech_mode mode;
+    long tag; /* index into the context's tags, or -1 */
+    char nfcid1[10];
+    char nfcid2[8];
+};
+
+#define INIT_NFC_RE_DESC(desc_, rfproto_, mode_, tag_, nfcid_, nfcid2_) \
+    desc_ = { \
+        .rfproto = rfproto_, \
+        .mode = mode_, \
+        .tag = tag_, \
+        .nfcid1 = nfcid_, \
+        .nfcid2 = nfcid2_ \
+    }
+
 /* NFCID2 is defined in [Digital] Table44 */
-struct nfc_re nfc_res[6] = {
-    INIT_NFC_RE([0], NCI_RF_PROTOCOL_NFC_DEP, NCI_RF_NFC_F_PASSIVE_LISTEN_MODE,
-                NULL, "deadbeaf0", "\x01\xfe\x0\x0\x0\x0\x0", nfc_res+0),
-    INIT_NFC_RE([1], NCI_RF_PROTOCOL_NFC_DEP, NCI_RF_NFC_F_PASSIVE_LISTEN_MODE,
-                NULL, "deadbeaf1", "\x01\xfe\x0\x0\x0\x0\x1", nfc_res+1),
-    INIT_NFC_RE([2], NCI_RF_PROTOCOL_T1T, NCI_RF_NFC_A_PASSIVE_LISTEN_MODE,
-                nfc_tags+0, "deadbeaf2", "\x0\x0\x0\x0\x0\x0\x2", nfc_res+2),
-    INIT_NFC_RE([3], NCI_RF_PROTOCOL_T2T, NCI_RF_NFC_A_PASSIVE_LISTEN_MODE,
-                nfc_tags+1, "deadbeaf3", "\x0\x0\x0\x0\x0\x0\x3", nfc_res+3),
-    INIT_NFC_RE([4], NCI_RF_PROTOCOL_T3T, NCI_RF_NFC_F_PASSIVE_LISTEN_MODE,
-                nfc_tags+2, "deadbeaf4", "\x02\xfe\x0\x0\x0\x0\x4", nfc_res+4),
-    INIT_NFC_RE([5], NCI_RF_PROTOCOL_ISO_DEP, NCI_RF_NFC_A_PASSIVE_LISTEN_MODE,
-                nfc_tags+3, "deadbeaf5", "\x00\x0\x0\x0\x0\x0\x5", nfc_res+5)
+static const struct nfc_re_desc nfc_re_desc[NUMBER_OF_NFC_RES] = {
+    INIT_NFC_RE_DESC([0], NCI_RF_PROTOCOL_NFC_DEP,
+                     NCI_RF_NFC_F_PASSIVE_LISTEN_MODE,
+                     -1, "deadbeaf0", "\x01\xfe\x0\x0\x0\x0\x0"),
+    INIT_NFC_RE_DESC([1], NCI_RF_PROTOCOL_NFC_DEP,
+                     NCI_RF_NFC_F_PASSIVE_LISTEN_MODE,
+                     -1, "deadbeaf1", "\x01\xfe\x0\x0\x0\x0\x1"),
+    INIT_NFC_RE_DESC([2], NCI_RF_PROTOCOL_T1T,
+                     NCI_RF_NFC_A_PASSIVE_LISTEN_MODE,
+                     0, "deadbeaf2", "\x0\x0\x0\x0\x0\x0\x2"),
+    INIT_NFC_RE_DESC([3], NCI_RF_PROTOCOL_T2T,
+                     NCI_RF_NFC_A_PASSIVE_LISTEN_MODE,
+                     1, "deadbeaf3", "\x0\x0\x0\x0\x0\x0\x3"),
+    INIT_NFC_RE_DESC([4], NCI_RF_PROTOCOL_T3T,
+                     NCI_RF_NFC_F_PASSIVE_LISTEN_MODE,
+                     2, "deadbeaf4", "\x02\xfe\x0\x0\x0\x0\x4"),
+    INIT_NFC_RE_DESC([5], NCI_RF_PROTOCOL_ISO_DEP,
+                     NCI_RF_NFC_A_PASSIVE_LISTEN_MODE,
+                     3, "deadbeaf5", "\x00\x0\x0\x0\x0\x0\x5")
 };
 
 struct create_nci_dta_param {
@@ -62,13 +86,40 @@ create_nci_dta(void* data, struct nfc_device* nfc, size_t maxlen,
                union nci_packet* dta)
 {
     const struct create_nci_dta_param* param;
+    uint8_t frame[NFC_MAX_FRAME_LENGTH];
     ssize_t len;
 
     param = data;
     assert(param);
 
-    len = param->create(param->data, (struct llcp_pdu*)dta->data.payload);
-    return nfc_create_nci_dta(dta, NCI_PBF_END, param->re->connid, len);
+    len = param->create(param->data, (struct llcp_pdu*)frame);
+    if (len < 0) {
+        return -1;
+    }
+    return nfc_create_nci_dta_frame(nfc, param->re->connid, frame, len, dta);
+}
+
+/* Describes an outgoing LLCP PDU. 'create' builds the PDU in
+ * place, 'defer' sets up a deferred builder in a queue buffer
+ * for PDUs that have to wait for the next SYMM.
+ */
+struct llcp_pdu_builder {
+    ssize_t (*create)(void*, struct llcp_pdu*);
+    int (*defer)(void*, struct llcp_pdu_buf*);
+};
+
+#define LLCP_PDU_BUILDER_INIT(_create, _defer) \
+    { \
+        .create = (_create), \
+        .defer = (_defer) \
+    }
+
+static void
+cancel_xmit_timeout(struct nfc_re* re)
+{
+    if (re->xmit_timeout) {
+        ctx_del_timeout(re->ctx, re->xmit_timeout);
+    }
 }
 
 /* Sends an LLCP PDU from the RE to the guest. Sending
@@ -76,7 +127,7 @@ create_nci_dta(void* data, struct nfc_device* nfc, size_t maxlen,
  * directly or enqueued for later transmission.
  */
 static int
-send_pdu_from_re(ssize_t (*create)(void*, struct llcp_pdu*),
+send_pdu_from_re(const struct llcp_pdu_builder* builder,
                  void* data, struct nfc_re* re)
 {
     if (re->xmit_next) {
@@ -84,21 +135,24 @@ send_pdu_from_re(ssize_t (*create)(void*, struct llcp_pdu*),
          * immediately and cancel the possible timeout for
          * the SYMM PDU */
         struct create_nci_dta_param param =
-            CREATE_NCI_DTA_PARAM_INIT(create, data, re);
+            CREATE_NCI_DTA_PARAM_INIT(builder->create, data, re);
 
-        cb.send_dta(create_nci_dta, &param);
+        ctx_send_dta(re->ctx, create_nci_dta, &param);
         re->xmit_next = 0;
-        if (re->xmit_timeout) {
-            cb.del_timeout(re->xmit_timeout);
-        }
+        cancel_xmit_timeout(re);
     } else {
         /* we're waiting for the host to send a SYMM PDU, so
          * we queue up PDUs for later delivery */
-        struct llcp_pdu_buf* buf = llcp_alloc_pdu_buf();
+        /* deferred PDUs only carry parameters */
+        struct llcp_pdu_buf* buf = llcp_alloc_pdu_buf(&re->ctx->pdu_pool,
+                                                      LLCP_PDU_BUF_SMALL_SIZE);
         if (!buf) {
             return -1;
         }
-        buf->len = create(data, (struct llcp_pdu*)buf->pdu);
+        if (builder->defer(data, buf) < 0) {
+            llcp_free_pdu_buf(&re->ctx->pdu_pool, buf);
+            return -1;
+        }
         TAILQ_INSERT_TAIL(&re->xmit_q, buf, entry);
     }
     return 0;
@@ -110,6 +164,8 @@ send_pdu_from_re(ssize_t (*create)(void*, struct llcp_pdu*),
 static ssize_t
 fetch_pdu_from_re(struct llcp_pdu* llcp, struct nfc_re* re)
 {
+    struct llcp_pdu_buf* buf;
+    struct llcp_data_link* dl;
     ssize_t len;
 
     assert(llcp);
@@ -119,19 +175,109 @@ fetch_pdu_from_re(struct llcp_pdu* llcp, struct nfc_re* re)
         return 0;
     }
 
-    struct llcp_pdu_buf* buf;
     buf = TAILQ_FIRST(&re->xmit_q);
-    len = buf->len;
-    memcpy(llcp, buf->pdu, len);
     TAILQ_REMOVE(&re->xmit_q, buf, entry);
-    llcp_free_pdu_buf(buf);
+    if (buf->create) {
+        len = buf->create(buf, llcp);
+    } else {
+        len = buf->len;
+        memcpy(llcp, buf->pdu, len);
+    }
+
+    if (buf->ptype == LLCP_PTYPE_I) {
+        dl = llcp_dl_map_find(&re->llcp_dl, buf->dsap, buf->ssap);
+    } else {
+        dl = NULL;
+    }
+    if (dl && (len > 0)) {
+        /* keep I PDUs until the remote acknowledges them */
+        --dl->npending;
+        TAILQ_INSERT_TAIL(&dl->sent_q, buf, entry);
+    } else {
+        llcp_free_pdu_buf(&re->ctx->pdu_pool, buf);
+    }
 
     return len;
 }
 
+/* Returns the length of the PDU that a queue buffer produces. */
+static size_t
+queued_pdu_len(const struct llcp_pdu_buf* buf)
+{
+    if (buf->ptype == LLCP_PTYPE_I) {
+        /* header, sequence numbers and the SDU */
+        return sizeof(struct llcp_pdu) + 1 + buf->len;
+    }
+    return buf->len;
+}
+
+/* Fetches queued PDUs. If more than one of them fits into the
+ * remote's link MIU, they are packed into an AGF PDU; [LLCP],
+ * Sec 4.3.3.
+ */
+static ssize_t
+fetch_pdus_from_re(struct llcp_pdu* llcp, struct nfc_re* re)
+{
+    const struct llcp_pdu_buf* buf;
+    const struct llcp_pdu_buf* next;
+    size_t len, infolen;
+
+    assert(llcp);
+    assert(re);
+
+    buf = TAILQ_FIRST(&re->xmit_q);
+    if (!re->agf || !buf || !(next = TAILQ_NEXT(buf, entry)) ||
+        (2 + queued_pdu_len(buf) + 2 + queued_pdu_len(next) > re->miu_r)) {
+        return fetch_pdu_from_re(llcp, re);
+    }
+
+    len = llcp_create_pdu(llcp, LLCP_SAP_LM, LLCP_PTYPE_AGF, LLCP_SAP_LM);
+    infolen = 0;
+
+    while ((buf = TAILQ_FIRST(&re->xmit_q)) &&
+           (infolen + 2 + queued_pdu_len(buf) <= re->miu_r)) {
+        /* each PDU is preceded by its 2-byte length */
+        uint8_t* p = llcp->info + infolen;
+        ssize_t res = fetch_pdu_from_re((struct llcp_pdu*)(p+2), re);
+        if (res <= 0) {
+            continue; /* the PDU's data link is gone */
+        }
+        p[0] = res >> 8;
+        p[1] = res;
+        infolen += 2 + res;
+    }
+
+    return infolen ? len + infolen : 0;
+}
+
+/* Creates an RR or RNR PDU for the first data link that owes
+ * the remote an acknowledgement. Returns 0 if there is none.
+ */
+static ssize_t
+create_ack_pdu(struct llcp_pdu* llcp, struct nfc_re* re)
+{
+    struct llcp_data_link* dl;
+    unsigned char ptype;
+    size_t i;
+
+    i = 0;
+
+    while ((dl = llcp_dl_map_next(&re->llcp_dl, &i))) {
+        if (!llcp_dl_owes_ack(dl)) {
+            continue;
+        }
+        ptype = dl->local_busy ? LLCP_PTYPE_RNR : LLCP_PTYPE_RR;
+        dl->v_ra = dl->v_r;
+        dl->rnr_sent = dl->local_busy;
+
+        return llcp_create_pdu_rr(llcp, dl->dsap, ptype, dl->ssap, dl->v_r);
+    }
+    return 0;
+}
+
 /* Transmits a PDU from the RE to the guest. If there is
- * no queued PDU, a SYMM PDU is generated to fulfill LLCP
- * requirements.
+ * no queued PDU, an acknowledgement or a SYMM PDU is
+ * generated to fulfill LLCP requirements.
  */
 static ssize_t
 xmit_pdu_or_symm_from_re(struct llcp_pdu* llcp, struct nfc_re* re)
@@ -140,9 +286,13 @@ xmit_pdu_or_symm_from_re(struct llcp_pdu* llcp, struct nfc_re* re)
 
     assert(re);
 
-    /* either xmit a queued PDU or... */
-    len = fetch_pdu_from_re(llcp, re);
-    if (!len) {
+    /* either xmit queued PDUs or... */
+    len = fetch_pdus_from_re(llcp, re);
+    if (len <= 0) {
+        /* ...acknowledge received I PDUs or... */
+        len = create_ack_pdu(llcp, re);
+    }
+    if (len <= 0) {
         /* ...xmit a new SYMM PDU */
         len = llcp_create_pdu(llcp, LLCP_SAP_LM, LLCP_PTYPE_SYMM, LLCP_SAP_LM);
     }
@@ -151,6 +301,193 @@ xmit_pdu_or_symm_from_re(struct llcp_pdu* llcp, struct nfc_re* re)
     return len;
 }
 
+/*
+ * LLCP I PDUs
+ *
+ * I PDUs wait in their data link's xmit queue until the link
+ * is connected and the remote's receive window has room. Then
+ * they move to the RE's xmit queue. Sent PDUs are kept in the
+ * data link's sent queue until they are acknowledged.
+ */
+
+static ssize_t
+create_queued_i_pdu(const struct llcp_pdu_buf* buf, struct llcp_pdu* llcp)
+{
+    const struct nfc_re* re;
+    struct llcp_data_link* dl;
+    size_t len;
+
+    assert(buf);
+
+    re = buf->data;
+    assert(re);
+
+    dl = llcp_dl_map_find(&re->llcp_dl, buf->dsap, buf->ssap);
+    if (!dl || (dl->status != LLCP_DATA_LINK_CONNECTED)) {
+        return -1; /* data link has been cleared meanwhile */
+    }
+
+    /* sequence numbers are assigned in transmit order; N(R)
+     * acknowledges all received I PDUs */
+    len = llcp_create_pdu_i(llcp, buf->dsap, buf->ssap, dl->v_s, dl->v_r);
+    memcpy(llcp->info + (len-sizeof(*llcp)), buf->pdu, buf->len);
+    dl->v_s = (dl->v_s + 1) % LLCP_SEQ_MOD;
+    dl->v_ra = dl->v_r;
+
+    return len + buf->len;
+}
+
+static void
+init_i_pdu_buf(struct llcp_pdu_buf* buf, struct nfc_re* re,
+               const struct llcp_data_link* dl, size_t len)
+{
+    buf->create = create_queued_i_pdu;
+    buf->data = re;
+    buf->ptype = LLCP_PTYPE_I;
+    buf->dsap = dl->dsap;
+    buf->ssap = dl->ssap;
+    buf->len = len;
+}
+
+static struct llcp_pdu_buf*
+alloc_i_pdu_buf(struct nfc_re* re, const struct llcp_data_link* dl,
+                const void* data, size_t len)
+{
+    struct llcp_pdu_buf* buf;
+
+    buf = llcp_alloc_pdu_buf(&re->ctx->pdu_pool, len);
+    if (!buf) {
+        return NULL;
+    }
+    memcpy(buf->pdu, data, len);
+    init_i_pdu_buf(buf, re, dl, len);
+
+    return buf;
+}
+
+/* Creates the next I PDU of a fragmented message, if the remote
+ * asked for it. */
+static struct llcp_pdu_buf*
+alloc_next_fragment(struct nfc_re* re, struct llcp_data_link* dl)
+{
+    struct llcp_pdu_buf* buf;
+    size_t len;
+
+    if (!dl->scontinue) {
+        return NULL;
+    }
+    len = dl->slen - dl->soff;
+    if (len > dl->miu_r) {
+        len = dl->miu_r;
+    }
+    buf = alloc_i_pdu_buf(re, dl, dl->sbuf + dl->soff, len);
+    if (!buf) {
+        return NULL;
+    }
+    dl->soff += len;
+    if (dl->soff == dl->slen) {
+        llcp_dl_clear_sbuf(dl);
+    }
+    return buf;
+}
+
+static void
+move_pdu_queue(struct llcp_pdu_queue* from, struct llcp_pdu_queue* to)
+{
+    while (!TAILQ_EMPTY(from)) {
+        struct llcp_pdu_buf* buf = TAILQ_FIRST(from);
+        TAILQ_REMOVE(from, buf, entry);
+        TAILQ_INSERT_TAIL(to, buf, entry);
+    }
+}
+
+/* Moves a data link's I PDUs from the RE's xmit queue to the
+ * end of 'q'.
+ */
+static void
+take_i_pdus(struct nfc_re* re, const struct llcp_data_link* dl,
+            struct llcp_pdu_queue* q)
+{
+    struct llcp_pdu_buf* buf;
+    struct llcp_pdu_buf* next;
+
+    for (buf = TAILQ_FIRST(&re->xmit_q); buf; buf = next) {
+        next = TAILQ_NEXT(buf, entry);
+        if ((buf->ptype != LLCP_PTYPE_I) ||
+            (buf->dsap != dl->dsap) || (buf->ssap != dl->ssap)) {
+            continue;
+        }
+        TAILQ_REMOVE(&re->xmit_q, buf, entry);
+        TAILQ_INSERT_TAIL(q, buf, entry);
+    }
+}
+
+/* Releases waiting I PDUs as far as the remote's receive window
+ * allows.
+ */
+static void
+release_i_pdus(struct nfc_re* re, struct llcp_data_link* dl)
+{
+    while ((dl->status == LLCP_DATA_LINK_CONNECTED) &&
+           llcp_dl_window_is_open(dl)) {
+        struct llcp_pdu_buf* buf = TAILQ_FIRST(&dl->xmit_q);
+        if (buf) {
+            TAILQ_REMOVE(&dl->xmit_q, buf, entry);
+        } else {
+            /* continue a fragmented message */
+            buf = alloc_next_fragment(re, dl);
+            if (!buf) {
+                break;
+            }
+        }
+        TAILQ_INSERT_TAIL(&re->xmit_q, buf, entry);
+        ++dl->npending;
+    }
+}
+
+/* Handles the remote's N(R). The caller validated it. */
+static void
+ack_i_pdus(struct nfc_re* re, struct llcp_data_link* dl, unsigned char nr)
+{
+    while ((dl->v_sa != nr) && !TAILQ_EMPTY(&dl->sent_q)) {
+        struct llcp_pdu_buf* buf = TAILQ_FIRST(&dl->sent_q);
+        TAILQ_REMOVE(&dl->sent_q, buf, entry);
+        llcp_free_pdu_buf(&re->ctx->pdu_pool, buf);
+        dl->v_sa = (dl->v_sa + 1) % LLCP_SEQ_MOD;
+    }
+    dl->v_sa = nr;
+
+    release_i_pdus(re, dl);
+}
+
+/* Sends all unacknowledged I PDUs again, starting at V(SA). */
+static void
+retransmit_i_pdus(struct nfc_re* re, struct llcp_data_link* dl)
+{
+    struct llcp_pdu_queue q;
+
+    /* sent PDUs go first, then the released ones, then
+     * the ones still waiting */
+    TAILQ_INIT(&q);
+    move_pdu_queue(&dl->sent_q, &q);
+    take_i_pdus(re, dl, &q);
+    move_pdu_queue(&dl->xmit_q, &q);
+    move_pdu_queue(&q, &dl->xmit_q);
+
+    dl->v_s = dl->v_sa;
+    dl->npending = 0;
+
+    release_i_pdus(re, dl);
+}
+
+/* Drops all of a data link's I PDUs, e.g., on disconnecting. */
+static void
+drop_i_pdus(struct nfc_re* re, struct llcp_data_link* dl)
+{
+    take_i_pdus(re, dl, &dl->xmit_q);
+    llcp_flush_data_link(dl, &re->ctx->pdu_pool);
+}
+
 /* When we're in charge of sending, we need to xmit something
  * before the link timeout expires.
  */
@@ -158,26 +495,95 @@ static void
 prepare_xmit_timeout(struct nfc_re* re, void (*xmit_next_cb)(void*))
 {
     if (!re->xmit_timeout) {
-        re->xmit_timeout = cb.new_timeout(xmit_next_cb, re);
+        re->xmit_timeout = ctx_new_timeout(re->ctx, xmit_next_cb, re);
         assert(re->xmit_timeout);
     }
-    if (!cb.timeout_is_pending(re->xmit_timeout)) {
-        /* xmit PDU in two seconds */
-        cb.mod_timeout(re->xmit_timeout, 2000);
+    if (!ctx_timeout_is_pending(re->ctx, re->xmit_timeout)) {
+        ctx_mod_timeout(re->ctx, re->xmit_timeout,
+                        nfc_re_get_turnaround(re));
+    }
+}
+
+static void
+init_re(struct nfc_re* re, const struct nfc_re_desc* desc,
+        struct nfc_tag* tag, struct nfcemu_ctx* ctx)
+{
+    assert(re);
+    assert(desc);
+
+    re->ctx = ctx;
+    re->rfproto = desc->rfproto;
+    re->mode = desc->mode;
+    memcpy(re->nfcid1, desc->nfcid1, sizeof(re->nfcid1));
+    memcpy(re->nfcid2, desc->nfcid2, sizeof(re->nfcid2));
+    memcpy(re->nfcid3, desc->nfcid1, sizeof(re->nfcid3));
+    re->id = 0;
+    re->tag = tag;
+    re->xmit_next = 0;
+    re->xmit_timeout = NULL;
+    re->symm_mode = NFC_RE_SYMM_DELAYED;
+    re->lto = NFC_RE_DEFAULT_LTO;
+    re->turnaround = 0;
+    re->rw = NFC_RE_DEFAULT_RW;
+    re->miu = LLCP_MIU_DEFAULT;
+    re->agf = 1;
+    TAILQ_INIT(&re->xmit_q);
+    re->connid = 0;
+    nfc_ring_init(&re->sbuf, NFC_RE_DEFAULT_BUF_LIMIT);
+    nfc_ring_init(&re->rbuf, NFC_RE_DEFAULT_BUF_LIMIT);
+    llcp_dl_map_init(&re->llcp_dl, &ctx->pdu_pool);
+
+    nfc_clear_re(re);
+}
+
+void
+nfc_init_res(struct nfc_re* res, struct nfc_tag* tags,
+             struct nfcemu_ctx* ctx)
+{
+    size_t i;
+
+    assert(res);
+    assert(tags);
+    assert(ctx);
+
+    for (i = 0; i < ARRAY_SIZE(nfc_re_desc); ++i) {
+        const struct nfc_re_desc* desc = nfc_re_desc + i;
+        init_re(res + i, desc, desc->tag < 0 ? NULL : tags + desc->tag, ctx);
+    }
+}
+
+void
+nfc_uninit_re(struct nfc_re* re)
+{
+    assert(re);
+
+    if (re->xmit_timeout) {
+        ctx_free_timeout(re->ctx, re->xmit_timeout);
+        re->xmit_timeout = NULL;
+    }
+    llcp_dl_map_uninit(&re->llcp_dl);
+    nfc_ring_uninit(&re->sbuf);
+    nfc_ring_uninit(&re->rbuf);
+
+    while (!TAILQ_EMPTY(&re->xmit_q)) {
+        struct llcp_pdu_buf* buf = TAILQ_FIRST(&re->xmit_q);
+        TAILQ_REMOVE(&re->xmit_q, buf, entry);
+        llcp_free_pdu_buf(&re->ctx->pdu_pool, buf);
     }
 }
 
 struct nfc_re*
-nfc_get_re_by_id(uint8_t id)
+nfc_get_re_by_id(struct nfcemu_ctx* ctx, uint8_t id)
 {
     struct nfc_re* pos;
     const struct nfc_re* end;
 
+    assert(ctx);
     assert(id);
     assert(id < 255);
 
-    pos = nfc_res;
-    end = nfc_res + sizeof(nfc_res)/sizeof(nfc_res[0]);
+    pos = ctx->res;
+    end = ctx->res + ARRAY_SIZE(ctx->res);
 
     while (pos < end) {
         if (pos->id == id) {
@@ -192,81 +598,110 @@ nfc_get_re_by_id(uint8_t id)
 void
 nfc_clear_re(struct nfc_re* re)
 {
-    size_t dsap, ssap;
+    struct llcp_data_link* dl;
+    size_t i;
 
     assert(re);
 
-    for (dsap = 0; dsap < ARRAY_SIZE(re->llcp_dl); ++dsap) {
-        for (ssap = 0; ssap < ARRAY_SIZE(re->llcp_dl[dsap]); ++ssap) {
-            llcp_init_data_link(re->llcp_dl[dsap]+ssap);
-        }
+    i = 0;
+
+    while ((dl = llcp_dl_map_next(&re->llcp_dl, &i))) {
+        drop_i_pdus(re, dl);
     }
+    llcp_dl_map_clear(&re->llcp_dl);
+    nfc_ring_clear(&re->sbuf);
+    nfc_ring_clear(&re->rbuf);
 
     re->last_dsap = LLCP_SAP_LM;
     re->last_ssap = LLCP_SAP_LM;
+    re->miu_r = LLCP_MIU_DEFAULT;
 }
 
-static ssize_t
-write_buf(size_t* bufsiz, uint8_t* buf, size_t len, const void* data)
+unsigned long
+nfc_re_get_turnaround(const struct nfc_re* re)
 {
-    assert(bufsiz);
-    assert(buf || !*bufsiz);
-    assert(data || !len);
+    assert(re);
 
-    if (len > *bufsiz) {
-        return -1; /* not enough memory */
+    if (re->turnaround) {
+        return re->turnaround;
     }
-
-    memcpy(buf, data, len);
-    *bufsiz += len;
-
-    return len;
+    /* leave a fifth of the link timeout as safety margin */
+    return (re->lto * LLCP_LTO_UNIT_MS * 4) / 5;
 }
 
-static ssize_t
-read_buf(size_t* bufsiz, const uint8_t* buf, size_t len, void* data)
+int
+nfc_re_set_buf_limit(struct nfc_re* re, size_t maxsize)
 {
-    assert(bufsiz);
-    assert(buf || !*bufsiz);
-    assert(data || !len);
+    assert(re);
 
-    if (len < *bufsiz) {
-        return -1; /* not enough memory */
+    if (nfc_ring_len(&re->sbuf) > maxsize ||
+        nfc_ring_len(&re->rbuf) > maxsize) {
+        return -1;
     }
+    nfc_ring_set_maxsize(&re->sbuf, maxsize);
+    nfc_ring_set_maxsize(&re->rbuf, maxsize);
 
-    len = *bufsiz;
-    memcpy(data, buf, len);
-    *bufsiz = 0;
-
-    return len;
+    return 0;
 }
 
 ssize_t
 nfc_re_write_sbuf(struct nfc_re* re, size_t len, const void* data)
 {
     assert(re);
-    return write_buf(&re->sbufsiz, re->sbuf, len, data);
+    return nfc_ring_write(&re->sbuf, len, data);
 }
 
 ssize_t
+nfc_re_writev_sbuf(struct nfc_re* re, const struct iovec* iov,
+                   size_t iovcnt)
+{
+    assert(re);
+    return nfc_ring_writev(&re->sbuf, iov, iovcnt);
+}
+
+size_t
 nfc_re_read_sbuf(struct nfc_re* re, size_t len, void* data)
 {
     assert(re);
-    return read_buf(&re->sbufsiz, re->sbuf, len, data);
+    return nfc_ring_read(&re->sbuf, len, data);
+}
+
+size_t
+nfc_re_readv_sbuf(struct nfc_re* re, const struct iovec* iov,
+                  size_t iovcnt)
+{
+    assert(re);
+    return nfc_ring_readv(&re->sbuf, iov, iovcnt);
 }
 
 ssize_t
 nfc_re_write_rbuf(struct nfc_re* re, size_t len, const void* data)
 {
     assert(re);
-    return write_buf(&re->rbufsiz, re->rbuf, len, data);
+    return nfc_ring_write(&re->rbuf, len, data);
 }
 
 ssize_t
+nfc_re_writev_rbuf(struct nfc_re* re, const struct iovec* iov,
+                   size_t iovcnt)
+{
+    assert(re);
+    return nfc_ring_writev(&re->rbuf, iov, iovcnt);
+}
+
+size_t
 nfc_re_read_rbuf(struct nfc_re* re, size_t len, void* data)
 {
     assert(re);
-    return read_buf(&re->rbufsiz, re->rbuf, len, data);
+    return nfc_ring_read(&re->rbuf, len, data);
+}
+
+size_t
+nfc_re_readv_rbuf(struct nfc_re* re, const struct iovec* iov,
+                  size_t iovcnt)
+{
+    assert(re);
+    return nfc_ring_readv(&re->rbuf, iov, iovcnt);
 }
 
 /*
@@ -284,8 +719,9 @@ update_last_saps(struct nfc_re* re, enum llcp_sap dsap, enum llcp_sap ssap)
     re->last_ssap = ssap;
 }
 
-static size_t (* const llcp_sap_cb[LLCP_NUMBER_OF_SAPS])(struct llcp_data_link*,
-                                                   const uint8_t*, size_t,
+static size_t (* const llcp_sap_cb[LLCP_NUMBER_OF_SAPS])(struct nfc_log*,
+                                                         struct llcp_data_link*,
+                                                         const uint8_t*, size_t,
                                                          struct snep*) = {
     [LLCP_SAP_SNEP] = llcp_sap_snep
 };
@@ -295,24 +731,88 @@ create_dta(void* data, struct nfc_device* nfc, size_t maxlen,
            union nci_packet* dta)
 {
     struct nfc_re* re;
+    uint8_t frame[NFC_MAX_FRAME_LENGTH];
     ssize_t len;
 
     re = data;
     assert(re);
 
-    len = xmit_pdu_or_symm_from_re((struct llcp_pdu*)dta->data.payload, re);
-    return nfc_create_nci_dta(dta, NCI_PBF_END, re->connid, len);
+    len = xmit_pdu_or_symm_from_re((struct llcp_pdu*)frame, re);
+    return nfc_create_nci_dta_frame(nfc, re->connid, frame, len, dta);
 }
 
 static void
 xmit_next_cb(void* opaque)
 {
-    cb.send_dta(create_dta, opaque);
+    struct nfc_re* re = opaque;
+
+    ctx_send_dta(re->ctx, create_dta, re);
+}
+
+/* Uses a pending turn to xmit newly queued PDUs. */
+static void
+kick_xmit(struct nfc_re* re)
+{
+    if (re->xmit_next && !TAILQ_EMPTY(&re->xmit_q)) {
+        ctx_send_dta(re->ctx, create_dta, re);
+        cancel_xmit_timeout(re);
+    }
+}
+
+/* Parses the parameters of CONNECT and CC; [LLCP], Sec 4.5 */
+static void
+parse_dl_params(struct nfc_re* re, struct llcp_data_link* dl,
+                const uint8_t* opt, size_t len)
+{
+    while ((len >= 2) && (len-2 >= opt[1])) {
+        switch (opt[0]) {
+            case LLCP_PARAM_MIUX:
+                if (opt[1] != 2) {
+                    break;
+                }
+                dl->miu_r = LLCP_MIU_DEFAULT +
+                            (((opt[2] & 0x07) << 8) | opt[3]);
+                NFC_D(&re->ctx->log, "LLCP remote MIU size %d", dl->miu_r);
+                break;
+            case LLCP_PARAM_RW:
+                if (opt[1] != 1) {
+                    break;
+                }
+                dl->rw_r = opt[2] & 0x0f;
+                NFC_D(&re->ctx->log, "LLCP remote RW size %d", dl->rw_r);
+                break;
+            case LLCP_PARAM_SN:
+                NFC_D(&re->ctx->log, "requesting LLCP service %.*s", opt[1], (const char*)opt+2);
+                break;
+            default:
+                NFC_I(&re->ctx->log, "ignoring unknown LLCP parameter %d", opt[0]);
+                break;
+        }
+        len -= 2 + opt[1];
+        opt += 2 + opt[1];
+    }
+}
+
+/* Rejects a PDU from the remote. The data link can't be used
+ * until the remote connects again. */
+static size_t
+send_frmr(struct nfc_re* re, struct llcp_data_link* dl,
+          const struct llcp_pdu* llcp, unsigned char flags,
+          struct llcp_pdu* rsp)
+{
+    NFC_I(&re->ctx->log, "LLCP sending FRMR flags=%x", flags);
+
+    drop_i_pdus(re, dl);
+    dl->status = LLCP_DATA_LINK_DISCONNECTED;
+
+    /* switch DSAP and SSAP in outgoing PDU */
+    return llcp_create_pdu_frmr(rsp, llcp->ssap, llcp->dsap, flags,
+                                llcp_ptype(llcp), llcp->info[0], dl);
 }
 
 static size_t
 process_ptype_symm(struct nfc_re* re, const struct llcp_pdu* llcp,
-                   size_t len, uint8_t* consumed, struct llcp_pdu* rsp)
+                   size_t len, size_t* consumed, struct llcp_pdu* rsp)
 {
     assert(re);
     assert(llcp);
@@ -324,124 +824,169 @@ process_ptype_symm(struct nfc_re* re, const struct llcp_pdu* llcp,
     return 0;
 }
 
+/* Parses the parameters of PAX; [LLCP], Sec 4.5 */
 static size_t
-process_ptype_connect(struct nfc_re* re, const struct llcp_pdu* llcp,
-                      size_t len, uint8_t* consumed,
-                      struct llcp_pdu* rsp)
+process_ptype_pax(struct nfc_re* re, const struct llcp_pdu* llcp,
+                  size_t len, size_t* consumed, struct llcp_pdu* rsp)
 {
-    struct llcp_data_link* dl;
     const uint8_t* opt;
 
     assert(re);
     assert(llcp);
     assert(consumed);
-    assert(rsp);
-
-    dl = llcp_init_data_link(re->llcp_dl[llcp->ssap] + llcp->dsap);
-    dl->status = LLCP_DATA_LINK_CONNECTED;
 
-    *consumed = sizeof(*llcp);
-    len -= *consumed;
+    *consumed = len;
 
-    opt = ((const uint8_t*)llcp) + *consumed;
+    opt = llcp->info;
+    len -= sizeof(*llcp);
 
-    while (len >= 2) {
-        len -= 2;
+    while ((len >= 2) && (len-2 >= opt[1])) {
         switch (opt[0]) {
             case LLCP_PARAM_MIUX:
-                if ((opt[1] != 2) || (len < opt[1])) {
-                    continue;
+                if (opt[1] != 2) {
+                    break;
                 }
-                {
-                  const struct llcp_param_miux* param =
-                      (const struct llcp_param_miux*)(opt + 2);
-                  dl->miu = param->miux - 128;
-                }
-                NFC_D("LLCP MIU size=%d", dl->miu);
+                re->miu_r = LLCP_MIU_DEFAULT +
+                            (((opt[2] & 0x07) << 8) | opt[3]);
+                NFC_D(&re->ctx->log, "LLCP remote link MIU size %d", re->miu_r);
                 break;
-            case LLCP_PARAM_RW:
-                if ((opt[1] != 1) || (len < opt[1])) {
-                    continue;
-                }
-                {
-                  const struct llcp_param_rw* param =
-                      (const struct llcp_param_rw*)(opt + 2);
-                  dl->rw_r = param->rw;
-                }
-                NFC_D("LLCP remote RW size %d", dl->rw_r);
-                break;
-            case LLCP_PARAM_SN:
-                if (len < opt[1]) {
-                    continue;
-                }
-                NFC_D("requesting LLCP service %.*s\n", opt[1], (const char*)opt+2);
+            case LLCP_PARAM_VERSION:
+            case LLCP_PARAM_WKS:
+            case LLCP_PARAM_LTO:
+            case LLCP_PARAM_OPT:
                 break;
             default:
-                NFC_D("Ignoring unknown LLCP parameter %d\n", opt[0]);
+                NFC_I(&re->ctx->log, "ignoring unknown LLCP parameter %d", opt[0]);
                 break;
         }
+        len -= 2 + opt[1];
+        opt += 2 + opt[1];
     }
+    return 0;
+}
+
+static size_t
+process_ptype_connect(struct nfc_re* re, const struct llcp_pdu* llcp,
+                      size_t len, size_t* consumed,
+                      struct llcp_pdu* rsp)
+{
+    struct llcp_data_link* dl;
+    const uint8_t* opt;
+
+    assert(re);
+    assert(llcp);
+    assert(consumed);
+    assert(rsp);
+
+    /* the parameters are consumed, too */
+    *consumed = len;
+    len -= sizeof(*llcp);
 
     update_last_saps(re, llcp->ssap, llcp->dsap);
 
+    dl = llcp_dl_map_get(&re->llcp_dl, llcp->ssap, llcp->dsap);
+    if (!dl) {
+        /* switch DSAP and SSAP in outgoing PDU */
+        return llcp_create_pdu_dm(rsp, llcp->ssap, llcp->dsap,
+                                  LLCP_DM_CONNECT_REJECTED);
+    }
+    /* CONNECT resets the data link */
+    drop_i_pdus(re, dl);
+    llcp_clear_data_link(dl);
+    dl->status = LLCP_DATA_LINK_DISCONNECTED;
+    if (llcp_dl_set_local_miu(dl, re->miu) < 0) {
+        return llcp_create_pdu_dm(rsp, llcp->ssap, llcp->dsap,
+                                  LLCP_DM_CONNECT_REJECTED);
+    }
+    dl->rw_l = re->rw;
+    dl->status = LLCP_DATA_LINK_CONNECTED;
+
+    opt = llcp->info;
+    parse_dl_params(re, dl, opt, len);
+
     /* switch DSAP and SSAP in outgoing PDU */
-    return llcp_create_pdu(rsp, llcp->ssap, LLCP_PTYPE_CC, llcp->dsap);
+    len = llcp_create_pdu(rsp, llcp->ssap, LLCP_PTYPE_CC, llcp->dsap);
+    len += llcp_create_param_miux(rsp->info, dl->miu_l);
+    if (dl->rw_l != LLCP_RW_DEFAULT) {
+        len += llcp_create_param_rw(((uint8_t*)rsp) + len, dl->rw_l);
+    }
+    return len;
 }
 
 static size_t
 process_ptype_disc(struct nfc_re* re, const struct llcp_pdu* llcp,
-                   size_t len, uint8_t* consumed,
+                   size_t len, size_t* consumed,
                    struct llcp_pdu* rsp)
 {
     struct llcp_data_link* dl;
 
-    dl = re->llcp_dl[llcp->ssap] + llcp->dsap;
-    dl->status = LLCP_DATA_LINK_DISCONNECTED;
+    dl = llcp_dl_map_find(&re->llcp_dl, llcp->ssap, llcp->dsap);
+    if (dl) {
+        drop_i_pdus(re, dl);
+        dl->status = LLCP_DATA_LINK_DISCONNECTED;
+    }
 
     *consumed = sizeof(*llcp);
 
     update_last_saps(re, llcp->ssap, llcp->dsap);
 
     /* switch DSAP and SSAP in outgoing PDU */
-    return llcp_create_pdu_dm(rsp, llcp->ssap, llcp->dsap, 0);
+    return llcp_create_pdu_dm(rsp, llcp->ssap, llcp->dsap,
+                              LLCP_DM_DISC_RECEIVED);
 }
 
 static size_t
 process_ptype_cc(struct nfc_re* re, const struct llcp_pdu* llcp,
-                 size_t len, uint8_t* consumed,
+                 size_t len, size_t* consumed,
                  struct llcp_pdu* rsp)
 {
     struct llcp_data_link* dl;
 
-    dl = llcp_clear_data_link(re->llcp_dl[llcp->ssap] + llcp->dsap);
-    assert(dl->status == LLCP_DATA_LINK_CONNECTING);
-    dl->status = LLCP_DATA_LINK_CONNECTED;
+    dl = llcp_dl_map_find(&re->llcp_dl, llcp->ssap, llcp->dsap);
+    if (!dl) {
+        NFC_W(&re->ctx->log, "LLCP CC for unknown data link");
+    } else if (dl->status != LLCP_DATA_LINK_CONNECTING) {
+        NFC_W(&re->ctx->log, "LLCP CC for data link in state %d",
+              dl->status);
+    } else {
+        llcp_clear_data_link(dl);
+        if (llcp_dl_set_local_miu(dl, re->miu) < 0) {
+            NFC_W(&re->ctx->log, "LLCP out of memory for data link");
+            drop_i_pdus(re, dl);
+            dl->status = LLCP_DATA_LINK_DISCONNECTED;
+        } else {
+            dl->rw_l = re->rw;
+            dl->status = LLCP_DATA_LINK_CONNECTED;
 
-    /* move DL's pending PDUs to global xmit queue */
-    while (!TAILQ_EMPTY(&dl->xmit_q)) {
-        struct llcp_pdu_buf* buf = TAILQ_FIRST(&dl->xmit_q);
-        TAILQ_REMOVE(&dl->xmit_q, buf, entry);
-        TAILQ_INSERT_TAIL(&re->xmit_q, buf, entry);
+            parse_dl_params(re, dl, llcp->info, len - sizeof(*llcp));
+
+            /* release DL's pending PDUs to global xmit queue */
+            release_i_pdus(re, dl);
+        }
     }
 
     update_last_saps(re, llcp->ssap, llcp->dsap);
 
-    *consumed = sizeof(*llcp) + 1;
+    /* the parameters are consumed, too */
+    *consumed = len;
 
     return 0;
 }
 
 static size_t
 process_ptype_dm(struct nfc_re* re, const struct llcp_pdu* llcp,
-                 size_t len, uint8_t* consumed,
+                 size_t len, size_t* consumed,
                  struct llcp_pdu* rsp)
 {
     struct llcp_data_link* dl;
 
-    NFC_D("LLCP DM, reason=%d\n", llcp->info[0]);
+    NFC_D(&re->ctx->log, "LLCP DM, reason=%d", llcp->info[0]);
 
-    dl = re->llcp_dl[llcp->ssap] + llcp->dsap;
-    dl->status = LLCP_DATA_LINK_DISCONNECTED;
+    dl = llcp_dl_map_find(&re->llcp_dl, llcp->ssap, llcp->dsap);
+    if (dl) {
+        drop_i_pdus(re, dl);
+        dl->status = LLCP_DATA_LINK_DISCONNECTED;
+    }
 
     update_last_saps(re, llcp->ssap, llcp->dsap);
 
@@ -453,8 +998,9 @@ process_ptype_dm(struct nfc_re* re, const struct llcp_pdu* llcp,
 
 static size_t
 process_ptype_frmr(struct nfc_re* re, const struct llcp_pdu* llcp,
-                size_t len, uint8_t* consumed, struct llcp_pdu* rsp)
+                size_t len, size_t* consumed, struct llcp_pdu* rsp)
 {
+    struct llcp_data_link* dl;
     unsigned int flags = (llcp->info[0] >> 4) & 0xf;
     unsigned int ptype =  llcp->info[0] & 0xf;
     unsigned int v_s = (llcp->info[2] >> 4) & 0xf;
@@ -462,9 +1008,19 @@ process_ptype_frmr(struct nfc_re* re, const struct llcp_pdu* llcp,
     unsigned int v_sa = (llcp->info[3] >> 4) & 0xf;
     unsigned int v_ra =  llcp->info[3] & 0xf;
 
-    NFC_D("LLCP FRMR flags=%x ptype=%u sequence=%u v_s=%u v_r=%u v_sa=%u "
+    NFC_I(&re->ctx->log, "LLCP FRMR flags=%x ptype=%u sequence=%u v_s=%u v_r=%u v_sa=%u "
           "v_sr=%u\n", flags, ptype, llcp->info[1], v_s, v_r, v_sa, v_ra);
 
+    dl = llcp_dl_map_find(&re->llcp_dl, llcp->ssap, llcp->dsap);
+    if (dl && (dl->status == LLCP_DATA_LINK_CONNECTED)) {
+        /* The remote's V(R) acknowledges the I PDUs it received;
+         * we send the others again. */
+        if (llcp_dl_nr_is_valid(dl, v_r)) {
+            ack_i_pdus(re, dl, v_r);
+        }
+        retransmit_i_pdus(re, dl);
+    }
+
     update_last_saps(re, llcp->ssap, llcp->dsap);
 
     *consumed = sizeof(*llcp) + 4;
@@ -474,14 +1030,46 @@ process_ptype_frmr(struct nfc_re* re, const struct llcp_pdu* llcp,
 
 static size_t
 process_ptype_i(struct nfc_re* re, const struct llcp_pdu* llcp,
-                size_t len, uint8_t* consumed, struct llcp_pdu* rsp)
+                size_t len, size_t* consumed, struct llcp_pdu* rsp)
 {
     const uint8_t* info;
     struct llcp_data_link* dl;
+    struct llcp_pdu_buf* buf;
+    unsigned char ns, nr;
     ssize_t res;
 
-    dl = re->llcp_dl[llcp->ssap] + llcp->dsap;
-    dl->v_r = (dl->v_r + 1) % 16;
+    update_last_saps(re, llcp->ssap, llcp->dsap);
+
+    /* consume llcp header and sequence numbers */
+    *consumed = sizeof(*llcp) + 1;
+    len -= *consumed;
+
+    dl = llcp_dl_map_find(&re->llcp_dl, llcp->ssap, llcp->dsap);
+    if (!dl || (dl->status != LLCP_DATA_LINK_CONNECTED)) {
+        /* switch DSAP and SSAP in outgoing PDU */
+        return llcp_create_pdu_dm(rsp, llcp->ssap, llcp->dsap,
+                                  LLCP_DM_NO_ACTIVE_CONNECTION);
+    }
+
+    ns = (llcp->info[0] >> 4) & 0x0f;
+    nr = llcp->info[0] & 0x0f;
+
+    if (len > dl->miu_l) {
+        return send_frmr(re, dl, llcp, LLCP_FRMR_I, rsp);
+    }
+
+    /* N(S) has to be the next in sequence and within our
+     * receive window */
+    if ((ns != dl->v_r) ||
+        !(((dl->v_r - dl->v_ra) % LLCP_SEQ_MOD) < dl->rw_l)) {
+        return send_frmr(re, dl, llcp, LLCP_FRMR_S, rsp);
+    }
+    if (!llcp_dl_nr_is_valid(dl, nr)) {
+        return send_frmr(re, dl, llcp, LLCP_FRMR_R, rsp);
+    }
+    ack_i_pdus(re, dl, nr);
+
+    dl->v_r = (dl->v_r + 1) % LLCP_SEQ_MOD;
 
     /* I PDUs transfer messages (i.e., 'Service Data Units' in LLCP
      * speak) over LLCP connections. In our case we hand over the
@@ -489,174 +1077,289 @@ process_ptype_i(struct nfc_re* re, const struct llcp_pdu* llcp,
      * it into the RE's send buffer.
      */
 
-    update_last_saps(re, llcp->ssap, llcp->dsap);
-
-    /* consume llcp header and sequence numbers */
-    *consumed = sizeof(*llcp) + 1;
-    len -= *consumed;
-
     info = ((const uint8_t*)llcp) + *consumed;
-    if (llcp_sap_cb[llcp->dsap]) {
-        /* there's a handler for this SAP, call it and build an LLCP
-         * header if there is a response */
-        res = llcp_sap_cb[llcp->dsap](dl, info, len,
-                                      (struct snep*)rsp->info+1);
-        if (res) {
-            res += llcp_create_pdu_i(rsp, llcp->ssap, llcp->dsap,
-                                     dl->v_s, dl->v_r);
-        }
-    } else {
-        /* copy information field into re->sbuf */
+    if (!llcp_sap_cb[llcp->dsap]) {
+        /* copy information field into re->sbuf; the
+         * acknowledgement goes out with our next turn */
         llcp_dl_write_rbuf(dl, len, info);
-        res = 0;
+        if (dl->sbuf) {
+            /* the remote might ask for more fragments */
+            llcp_snep_process_rsp(&re->ctx->log, dl, info, len);
+            release_i_pdus(re, dl);
+        }
+        return 0;
     }
 
-    return res;
+    /* there's a handler for this SAP, call it and queue an I PDU
+     * if there is a response; SNEP responses have no information */
+    buf = llcp_alloc_pdu_buf(&re->ctx->pdu_pool, LLCP_PDU_BUF_SMALL_SIZE);
+    if (!buf) {
+        NFC_W(&re->ctx->log, "LLCP out of PDU buffers");
+        return 0;
+    }
+    res = llcp_sap_cb[llcp->dsap](&re->ctx->log, dl, info, len,
+                                  (struct snep*)buf->pdu);
+    if (!res) {
+        llcp_free_pdu_buf(&re->ctx->pdu_pool, buf);
+        /* the remote might have asked for more fragments */
+        release_i_pdus(re, dl);
+        return 0;
+    }
+    init_i_pdu_buf(buf, re, dl, res);
+    TAILQ_INSERT_TAIL(&dl->xmit_q, buf, entry);
+
+    release_i_pdus(re, dl);
+
+    /* respond right away, if the window allows it */
+    res = fetch_pdu_from_re(rsp, re);
+
+    return res < 0 ? 0 : res;
 }
 
+/* handles RR and RNR */
 static size_t
-process_ptype_rr(struct nfc_re* re, const struct llcp_pdu* llcp,
-                size_t len, uint8_t* consumed, struct llcp_pdu* rsp)
+process_ack(struct nfc_re* re, const struct llcp_pdu* llcp,
+            int remote_busy, struct llcp_pdu* rsp)
 {
     struct llcp_data_link* dl;
     unsigned int nr;
 
     nr = llcp->info[0] & 0xf;
 
-    NFC_D("LLCP RR N(R)=%d", nr);
+    update_last_saps(re, llcp->ssap, llcp->dsap);
+
+    dl = llcp_dl_map_find(&re->llcp_dl, llcp->ssap, llcp->dsap);
+    if (!dl || (dl->status != LLCP_DATA_LINK_CONNECTED)) {
+        return 0;
+    }
+    if (!llcp_dl_nr_is_valid(dl, nr)) {
+        return send_frmr(re, dl, llcp, LLCP_FRMR_R, rsp);
+    }
+    dl->remote_busy = remote_busy;
+    ack_i_pdus(re, dl, nr);
 
-    dl = re->llcp_dl[llcp->ssap] + llcp->dsap;
-    dl->v_sa = nr;
+    return 0;
+}
 
-    update_last_saps(re, llcp->ssap, llcp->dsap);
+static size_t
+process_ptype_rr(struct nfc_re* re, const struct llcp_pdu* llcp,
+                size_t len, size_t* consumed, struct llcp_pdu* rsp)
+{
+    NFC_D(&re->ctx->log, "LLCP RR N(R)=%d", llcp->info[0] & 0xf);
 
     *consumed = sizeof(*llcp) + 1;
-    return 0;
+
+    return process_ack(re, llcp, 0, rsp);
 }
 
 static size_t
 process_ptype_rnr(struct nfc_re* re, const struct llcp_pdu* llcp,
-                  size_t len, uint8_t* consumed, struct llcp_pdu* rsp)
+                  size_t len, size_t* consumed, struct llcp_pdu* rsp)
 {
-    struct llcp_data_link* dl;
-    unsigned int nr;
+    NFC_D(&re->ctx->log, "LLCP RNR N(R)=%d", llcp->info[0] & 0xf);
 
-    nr = llcp->info[0] & 0xf;
+    *consumed = sizeof(*llcp) + 1;
 
-    NFC_D("LLCP RNR N(R)=%d", nr);
+    return process_ack(re, llcp, 1, rsp);
+}
 
-    dl = re->llcp_dl[llcp->ssap] + llcp->dsap;
-    dl->v_sa = nr;
+/* Decides how to use our turn after processing a PDU from the
+ * host. 'len' is the length of the response so far. Returns the
+ * length of the response to send.
+ */
+static size_t
+schedule_xmit(struct nfc_re* re, size_t len, struct llcp_pdu* rsp)
+{
+    switch (re->symm_mode) {
+        case NFC_RE_SYMM_IMMEDIATE:
+            if (!len) {
+                len = xmit_pdu_or_symm_from_re(rsp, re);
+            }
+            break;
+        case NFC_RE_SYMM_ADAPTIVE:
+            if (!len && TAILQ_EMPTY(&re->xmit_q)) {
+                /* send_pdu_from_re() xmits the next PDU as
+                 * soon as it arrives */
+                re->xmit_next = 1;
+                prepare_xmit_timeout(re, xmit_next_cb);
+                return 0;
+            }
+            if (!len) {
+                len = xmit_pdu_or_symm_from_re(rsp, re);
+            }
+            break;
+        default:
+            re->xmit_next = 1;
+            /* prepare timeout for LLCP SYMM */
+            prepare_xmit_timeout(re, xmit_next_cb);
+            return len;
+    }
+    /* the response used up our turn */
+    re->xmit_next = 0;
+    cancel_xmit_timeout(re);
 
-    update_last_saps(re, llcp->ssap, llcp->dsap);
+    return len;
+}
 
-    *consumed = sizeof(*llcp) + 1;
-    return 0;
+static size_t (* const llcp_ptype_cb[16])(struct nfc_re*,
+                                          const struct llcp_pdu*,
+                                          size_t, size_t*,
+                                          struct llcp_pdu*) = {
+    [LLCP_PTYPE_SYMM] = process_ptype_symm,
+    [LLCP_PTYPE_PAX] = process_ptype_pax,
+    [LLCP_PTYPE_CONNECT] = process_ptype_connect,
+    [LLCP_PTYPE_DISC] = process_ptype_disc,
+    [LLCP_PTYPE_CC] = process_ptype_cc,
+    [LLCP_PTYPE_DM] = process_ptype_dm,
+    [LLCP_PTYPE_FRMR] = process_ptype_frmr,
+    [LLCP_PTYPE_I] = process_ptype_i,
+    [LLCP_PTYPE_RR] = process_ptype_rr,
+    [LLCP_PTYPE_RNR] = process_ptype_rnr
+};
+
+/* Minimum lengths of PDUs with fixed header fields after the
+ * DSAP, PTYPE and SSAP; [LLCP], Sec 4.3 */
+static const size_t llcp_ptype_min_len[16] = {
+    [LLCP_PTYPE_DM] = sizeof(struct llcp_pdu) + 1, /* reason */
+    [LLCP_PTYPE_FRMR] = sizeof(struct llcp_pdu) + 4,
+    [LLCP_PTYPE_I] = sizeof(struct llcp_pdu) + 1, /* sequence */
+    [LLCP_PTYPE_RR] = sizeof(struct llcp_pdu) + 1,
+    [LLCP_PTYPE_RNR] = sizeof(struct llcp_pdu) + 1
+};
+
+/* Processes the PDUs in an AGF PDU one by one. Their responses
+ * go out before any other queued PDU. */
+static size_t
+process_ptype_agf(struct nfc_re* re, const struct llcp_pdu* llcp,
+                  size_t len, size_t* consumed, struct llcp_pdu* rsp)
+{
+    struct llcp_pdu_queue q;
+    const uint8_t* p;
+    size_t left;
+
+    *consumed = len;
+
+    TAILQ_INIT(&q);
+    p = llcp->info;
+    left = len - sizeof(*llcp);
+
+    while (left >= 2) {
+        const struct llcp_pdu* pdu;
+        struct llcp_pdu_buf* buf;
+        size_t pdulen, rsplen;
+        unsigned char ptype;
+        size_t off;
+
+        pdulen = (p[0] << 8) | p[1];
+        if ((pdulen < sizeof(*pdu)) || (pdulen > left-2)) {
+            NFC_W(&re->ctx->log, "LLCP malformed AGF");
+            break;
+        }
+        pdu = (const struct llcp_pdu*)(p+2);
+        p += 2 + pdulen;
+        left -= 2 + pdulen;
+
+        ptype = llcp_ptype(pdu);
+        if ((ptype == LLCP_PTYPE_SYMM) || !llcp_ptype_cb[ptype]) {
+            NFC_I(&re->ctx->log, "LLCP ignoring ptype=%x in AGF", ptype);
+            continue;
+        }
+        if (pdulen < llcp_ptype_min_len[ptype]) {
+            NFC_W(&re->ctx->log, "LLCP short PDU with ptype=%x in AGF", ptype);
+            continue;
+        }
+        rsplen = llcp_ptype_cb[ptype](re, pdu, pdulen, &off, rsp);
+        if (!rsplen) {
+            continue;
+        }
+        buf = llcp_alloc_pdu_buf(&re->ctx->pdu_pool, rsplen);
+        if (!buf) {
+            NFC_W(&re->ctx->log, "LLCP out of PDU buffers");
+            continue;
+        }
+        memcpy(buf->pdu, rsp, rsplen);
+        buf->len = rsplen;
+        TAILQ_INSERT_TAIL(&q, buf, entry);
+    }
+
+    if (TAILQ_EMPTY(&q)) {
+        return 0;
+    }
+    move_pdu_queue(&re->xmit_q, &q);
+    move_pdu_queue(&q, &re->xmit_q);
+
+    /* respond right away */
+    return xmit_pdu_or_symm_from_re(rsp, re);
 }
 
 static size_t
 process_llcp(struct nfc_re* re, const struct llcp_pdu* llcp,
-             size_t len, uint8_t* consumed, struct llcp_pdu* rsp)
-{
-    static size_t (* const process[16])
-        (struct nfc_re*, const struct llcp_pdu*,
-         size_t, uint8_t*, struct llcp_pdu*) = {
-        [LLCP_PTYPE_SYMM] = process_ptype_symm,
-        [LLCP_PTYPE_CONNECT] = process_ptype_connect,
-        [LLCP_PTYPE_DISC] = process_ptype_disc,
-        [LLCP_PTYPE_CC] = process_ptype_cc,
-        [LLCP_PTYPE_DM] = process_ptype_dm,
-        [LLCP_PTYPE_FRMR] = process_ptype_frmr,
-        [LLCP_PTYPE_I] = process_ptype_i,
-        [LLCP_PTYPE_RR] = process_ptype_rr,
-        [LLCP_PTYPE_RNR] = process_ptype_rnr
-    };
-
+             size_t len, size_t* consumed, struct llcp_pdu* rsp)
+{
     unsigned char ptype;
 
     ptype = llcp_ptype(llcp);
 
-    NFC_D("LLCP dsap=%x ptype=%x ssap=%x", llcp->dsap, ptype, llcp->ssap);
+    NFC_D(&re->ctx->log, "LLCP dsap=%x ptype=%x ssap=%x", llcp->dsap, ptype, llcp->ssap);
 
-    assert(process[ptype]);
-
-    len = process[ptype](re, llcp, len, consumed, rsp);
+    if (ptype == LLCP_PTYPE_AGF) {
+        len = process_ptype_agf(re, llcp, len, consumed, rsp);
+    } else {
+        assert(llcp_ptype_cb[ptype]);
+        len = llcp_ptype_cb[ptype](re, llcp, len, consumed, rsp);
+    }
 
     /* we implicitely received send permission */
-    re->xmit_next = 1;
-
-    /* prepare timeout for LLCP SYMM */
-    prepare_xmit_timeout(re, xmit_next_cb);
-
-    return len;
+    return schedule_xmit(re, len, rsp);
 }
 
 size_t
-nfc_re_process_data(struct nfc_re* re, const union nci_packet* dta,
-                    union nci_packet* rsp)
+nfc_re_process_data(struct nfc_re* re, const uint8_t* data, size_t len,
+                    uint8_t* rsp, size_t maxrsp)
 {
-    size_t len;
-    uint8_t off;
+    size_t rsplen;
+    size_t off;
 
     assert(re);
-    assert(dta);
+    assert(data || !len);
     assert(rsp);
 
     /* consume llcp */
 
-    re->connid = dta->data.connid;
-
     switch (re->rfproto) {
         case NCI_RF_PROTOCOL_NFC_DEP:
-            len = process_llcp(re,
-                (const struct llcp_pdu*)dta->data.payload,
-                dta->data.l, &off, (struct llcp_pdu*)rsp->data.payload);
-            if (len) {
-                len = nfc_create_nci_dta(rsp, NCI_PBF_END, re->connid, len);
-            }
+            rsplen = process_llcp(re, (const struct llcp_pdu*)data, len,
+                                  &off, (struct llcp_pdu*)rsp);
             break;
         case NCI_RF_PROTOCOL_T1T:
-            len = process_t1t(re,
-                (const union command_packet*)dta->data.payload,
-                dta->data.l, &off, (union response_packet*)rsp->data.payload);
-            if (len) {
-                len = nfc_create_nci_dta(rsp, NCI_PBF_END, re->connid, len);
-            }
+            rsplen = process_t1t(re, (const union command_packet*)data, len,
+                                 &off, (union response_packet*)rsp);
             break;
         case NCI_RF_PROTOCOL_T2T:
-            len = process_t2t(re,
-                (const union command_packet*)dta->data.payload,
-                dta->data.l, &off, (union response_packet*)rsp->data.payload);
-            if (len) {
-                len = nfc_create_nci_dta(rsp, NCI_PBF_END, re->connid, len);
-            }
+            rsplen = process_t2t(re, (const union command_packet*)data, len,
+                                 &off, (union response_packet*)rsp, maxrsp);
             break;
         case NCI_RF_PROTOCOL_T3T:
-            len = process_t3t(re,
-                (const union command_packet*)dta->data.payload,
-                dta->data.l, &off, (union response_packet*)rsp->data.payload);
-            if (len) {
-                len = nfc_create_nci_dta(rsp, NCI_PBF_END, re->connid, len);
-            }
+            rsplen = process_t3t(re, (const union command_packet*)data, len,
+                                 &off, (union response_packet*)rsp);
             break;
         case NCI_RF_PROTOCOL_ISO_DEP:
-            len = process_t4t(re,
-                (const union command_packet*)dta->data.payload,
-                dta->data.l, &off, (union response_packet*)rsp->data.payload);
-            if (len) {
-                len = nfc_create_nci_dta(rsp, NCI_PBF_END, re->connid, len);
-            }
+            rsplen = process_t4t(re, (const union command_packet*)data, len,
+                                 &off, (union response_packet*)rsp);
             break;
         default:
             assert(0); /* TODO: support other RF protocols */
-            len = 0;
+            rsplen = 0;
             off = 0;
             break;
     }
 
-    /* payload gets stored in RE send buffer */
-    nfc_re_write_sbuf(re, dta->data.l-off, dta->data.payload+off);
-    return len;
+    /* payload gets appended to RE send buffer */
+    if (nfc_re_write_sbuf(re, len-off, data+off) < 0) {
+        NFC_W(&re->ctx->log, "RE send buffer full; dropping %zu bytes",
+              len-off);
+    }
+    return rsplen;
 }
 
 enum {
@@ -781,7 +1484,7 @@ create_activated_ntf_nfc_dep(struct nfc_re* re, uint8_t* act)
     *p++ = NFC_DEP_PP_G; /* PP */
 
     /* LLCP */
-    p += llcp_create_param_tail(p);
+    p += llcp_create_param_tail(p, re->lto, re->miu);
 
     /* ATR_REQ length */
     act[0] = (p-act)-1;
@@ -813,7 +1516,10 @@ nfc_re_create_dta_act(struct nfc_re* re, const void* data,
 
   assert(act);
 
-  dl = re->llcp_dl[LLCP_SAP_SNEP] + LLCP_SAP_SNEP;
+  dl = llcp_dl_map_get(&re->llcp_dl, LLCP_SAP_SNEP, LLCP_SAP_SNEP);
+  if (!dl) {
+    return 0;
+  }
   llcp_len = llcp_create_pdu_i((struct llcp_pdu*)act,
                                LLCP_SAP_SNEP, LLCP_SAP_SNEP,
                                dl->v_s, dl->v_r);
@@ -842,28 +1548,83 @@ struct llcp_connect_param {
         .ssap = (_ssap) \
     }
 
+static ssize_t
+create_connect_pdu(struct llcp_pdu* llcp, const struct nfc_re* re,
+                   unsigned char dsap, unsigned char ssap)
+{
+    size_t len;
+
+    assert(re);
+
+    len = llcp_create_pdu(llcp, dsap, LLCP_PTYPE_CONNECT, ssap);
+    len += llcp_create_param_miux(llcp->info, re->miu);
+    if (re->rw != LLCP_RW_DEFAULT) {
+        len += llcp_create_param_rw(((uint8_t*)llcp) + len, re->rw);
+    }
+    return len;
+}
+
 static ssize_t
 create_connect_dta(void* data, struct llcp_pdu* llcp)
 {
     const struct llcp_connect_param* param;
-    struct llcp_data_link* dl;
 
     param = data;
     assert(param);
 
-    dl = param->re->llcp_dl[param->dsap] + param->ssap;
+    return create_connect_pdu(llcp, param->re, param->dsap, param->ssap);
+}
+
+static int
+defer_connect_dta(void* data, struct llcp_pdu_buf* buf)
+{
+    const struct llcp_connect_param* param;
+
+    param = data;
+    assert(param);
+    assert(buf);
+
+    /* CONNECT doesn't depend on the link state, so we build
+     * it right away */
+    buf->dsap = param->dsap;
+    buf->ssap = param->ssap;
+    buf->len = create_connect_pdu((struct llcp_pdu*)buf->pdu, param->re,
+                                  param->dsap, param->ssap);
+
+    return 0;
+}
+
+static const struct llcp_pdu_builder llcp_connect_builder =
+    LLCP_PDU_BUILDER_INIT(create_connect_dta, defer_connect_dta);
+
+static int
+connect_data_link(struct nfc_re* re, struct llcp_data_link* dl)
+{
+    struct llcp_connect_param param =
+        LLCP_CONNECT_PARAM_INIT(re, dl->dsap, dl->ssap);
+    int res;
 
     assert(dl->status == LLCP_DATA_LINK_DISCONNECTED);
     dl->status = LLCP_DATA_LINK_CONNECTING;
 
-    return llcp_create_pdu(llcp, param->dsap, LLCP_PTYPE_CONNECT, param->ssap);
+    res = send_pdu_from_re(&llcp_connect_builder, &param, re);
+    if (res < 0) {
+        dl->status = LLCP_DATA_LINK_DISCONNECTED;
+    }
+    return res;
 }
 
 int
 nfc_re_send_llcp_connect(struct nfc_re* re, unsigned char dsap, unsigned char ssap)
 {
-    struct llcp_connect_param param = LLCP_CONNECT_PARAM_INIT(re, dsap, ssap);
-    return send_pdu_from_re(create_connect_dta, &param, re);
+    struct llcp_data_link* dl;
+
+    /* data links are created when connecting */
+    dl = llcp_dl_map_get(&re->llcp_dl, dsap, ssap);
+    if (!dl) {
+        return -1;
+    }
+    return connect_data_link(re, dl);
 }
 
 /*
@@ -874,82 +1635,113 @@ struct llcp_i_param {
     struct nfc_re* re;
     unsigned char dsap;
     unsigned char ssap;
+    size_t maxlen;
     ssize_t (*create_snep)(void*, size_t, struct snep*);
     void* data;
 };
 
-#define LLCP_I_PARAM_INIT(_re, _dsap, _ssap, _create_snep, _data) \
+#define LLCP_I_PARAM_INIT(_re, _dsap, _ssap, _maxlen, _create_snep, _data) \
     { \
         .re = (_re), \
         .dsap = (_dsap), \
         .ssap = (_ssap), \
+        .maxlen = (_maxlen), \
         .create_snep = (_create_snep), \
         .data =  (_data) \
     }
 
-static ssize_t
-create_i_pdu(void* data, struct llcp_pdu* llcp)
+/* Creates a SNEP message and queues its first fragment on a data
+ * link. The other fragments follow when the remote asks for them.
+ */
+static int
+queue_snep_on_dl(struct nfc_re* re, struct llcp_data_link* dl,
+                 const struct llcp_i_param* param)
 {
-    const struct llcp_i_param* param;
-    struct llcp_data_link* dl;
-    size_t len;
-    struct snep* snep;
+    struct llcp_pdu_buf* buf;
+    uint8_t* msg;
     ssize_t res;
+    size_t maxlen, len;
 
-    param = data;
-    assert(param);
-
-    dl = param->re->llcp_dl[param->dsap] + param->ssap;
-    len = llcp_create_pdu_i(llcp, param->dsap, param->ssap, dl->v_s, dl->v_r);
+    if (dl->sbuf) {
+        NFC_W(&re->ctx->log, "SNEP request in progress");
+        return -1;
+    }
 
-    snep = (struct snep*)(llcp->info + (len-sizeof(*llcp)));
-    res = param->create_snep(param->data, 200-len, snep);
+    /* The caller's data doesn't outlive the call, so the SNEP
+     * message is created now. Only the LLCP header is deferred. */
+    maxlen = param->maxlen;
+    if (maxlen > LLCP_SNEP_MAX_LENGTH) {
+        maxlen = LLCP_SNEP_MAX_LENGTH;
+    }
+    msg = malloc(maxlen);
+    if (!msg) {
+        return -1;
+    }
+    res = param->create_snep(param->data, maxlen, (struct snep*)msg);
     if (res < 0) {
+        free(msg);
+        return -1;
+    }
+    len = res < dl->miu_r ? res : dl->miu_r;
+
+    buf = alloc_i_pdu_buf(re, dl, msg, len);
+    if (!buf) {
+        free(msg);
         return -1;
     }
-    dl->v_s = (dl->v_s + 1) % 16;
+    TAILQ_INSERT_TAIL(&dl->xmit_q, buf, entry);
+
+    if (len == res) {
+        free(msg);
+    } else {
+        /* keep the rest until the remote responds 'Continue' */
+        uint8_t* sbuf = realloc(msg, res);
+        dl->sbuf = sbuf ? sbuf : msg;
+        dl->slen = res;
+        dl->soff = len;
+        dl->scontinue = 0;
+    }
 
-    return len + res;
+    return 0;
 }
 
 static int
 send_snep_over_llcp(struct nfc_re* re,
-                    enum llcp_sap dsap, enum llcp_sap ssap,
+                    enum llcp_sap dsap, enum llcp_sap ssap, size_t maxlen,
                     ssize_t (*create)(void*, size_t, struct snep*),
                     void* data)
 {
     int res;
     struct llcp_data_link* dl;
     struct llcp_i_param i_param =
-        LLCP_I_PARAM_INIT(re, dsap, ssap, create, data);
+        LLCP_I_PARAM_INIT(re, dsap, ssap, maxlen, create, data);
 
     res = 0;
-    dl = re->llcp_dl[dsap] + ssap;
+    dl = llcp_dl_map_get(&re->llcp_dl, dsap, ssap);
+    if (!dl) {
+        return -1;
+    }
 
     if (dl->status == LLCP_DATA_LINK_DISCONNECTED) {
         /* enqueue request for later delivery and connect first */
-        struct llcp_pdu_buf* buf;
-        struct llcp_connect_param connect_param =
-            LLCP_CONNECT_PARAM_INIT(re, dsap, ssap);
-        buf = llcp_alloc_pdu_buf();
-        if (!buf) {
+        res = queue_snep_on_dl(re, dl, &i_param);
+        if (res < 0) {
             return -1;
         }
-        buf->len = create_i_pdu(&i_param, (struct llcp_pdu*)buf->pdu);
-        TAILQ_INSERT_TAIL(&dl->xmit_q, buf, entry);
         /* on connecting successfully, pending packets will be delivered */
-        res = send_pdu_from_re(create_connect_dta, &connect_param, re);
+        res = connect_data_link(re, dl);
     } else if (dl->status == LLCP_DATA_LINK_CONNECTING) {
         /* connecting in process; only enqueue request for later delivery */
-        struct llcp_pdu_buf* buf = llcp_alloc_pdu_buf();
-        if (!buf) {
+        res = queue_snep_on_dl(re, dl, &i_param);
+    } else if (dl->status == LLCP_DATA_LINK_CONNECTED) {
+        /* normal operation; send a SNEP request as soon as the
+         * remote's receive window allows it */
+        res = queue_snep_on_dl(re, dl, &i_param);
+        if (res < 0) {
             return -1;
         }
-        buf->len = create_i_pdu(&i_param, (struct llcp_pdu*)buf->pdu);
-        TAILQ_INSERT_TAIL(&dl->xmit_q, buf, entry);
-    } else if (dl->status == LLCP_DATA_LINK_CONNECTED) {
-        /* normal operation; send a SNEP request */
-        res = send_pdu_from_re(create_i_pdu, &i_param, re);
+        release_i_pdus(re, dl);
+        kick_xmit(re);
     } else {
         /* don't send a request for disconnecting links */
         assert(dl->status == LLCP_DATA_LINK_DISCONNECTING);
@@ -959,7 +1751,7 @@ send_snep_over_llcp(struct nfc_re* re,
 
 int
 nfc_re_send_snep_put(struct nfc_re* re,
-                     enum llcp_sap dsap, enum llcp_sap ssap,
+                     enum llcp_sap dsap, enum llcp_sap ssap, size_t maxlen,
                      ssize_t (*create_snep)(void*, size_t, struct snep*),
                      void* data)
 {
@@ -970,7 +1762,8 @@ nfc_re_send_snep_put(struct nfc_re* re,
     switch (re->rfproto) {
         case NCI_RF_PROTOCOL_NFC_DEP:
             /* send SNEP over LLCP */
-            res = send_snep_over_llcp(re, dsap, ssap, create_snep, data);
+            res = send_snep_over_llcp(re, dsap, ssap, maxlen, create_snep,
+                                      data);
             break;
         default:
             /* TODO: support over protocols */
@@ -988,10 +1781,10 @@ recv_snep_over_llcp(struct nfc_re* re,
     struct llcp_data_link* dl;
     ssize_t res;
 
-    dl = re->llcp_dl[dsap] + ssap;
+    dl = llcp_dl_map_find(&re->llcp_dl, dsap, ssap);
 
     /* normal operation; process last received SNEP request */
-    assert(dl->status == LLCP_DATA_LINK_CONNECTED);
+    assert(dl && dl->status == LLCP_DATA_LINK_CONNECTED);
 
     res = process(data, dl->rlen, (const struct ndef_rec*)dl->rbuf);
     if (res < 0) {
@@ -1023,3 +1816,112 @@ nfc_re_recv_snep_put(struct nfc_re* re,
     }
     return res;
 }
+
+/*
+ * Snapshots
+ */
+
+void
+nfc_re_snapshot(const struct nfc_re* re, struct nfc_snapshot* snap)
+{
+    assert(re);
+
+    nfc_snapshot_put_u8(snap, re->rfproto);
+    nfc_snapshot_put_u8(snap, re->mode);
+    nfc_snapshot_put_mem(snap, sizeof(re->nfcid1), re->nfcid1);
+    nfc_snapshot_put_mem(snap, sizeof(re->nfcid2), re->nfcid2);
+    nfc_snapshot_put_mem(snap, sizeof(re->nfcid3), re->nfcid3);
+    nfc_snapshot_put_u8(snap, re->id);
+    nfc_snapshot_put_u8(snap, re->last_dsap);
+    nfc_snapshot_put_u8(snap, re->last_ssap);
+    nfc_snapshot_put_u8(snap, re->xmit_next);
+    nfc_snapshot_put_u8(snap, re->symm_mode);
+    nfc_snapshot_put_u8(snap, re->lto);
+    nfc_snapshot_put_u32(snap, re->turnaround);
+    nfc_snapshot_put_u8(snap, re->rw);
+    nfc_snapshot_put_u16(snap, re->miu);
+    nfc_snapshot_put_u16(snap, re->miu_r);
+    nfc_snapshot_put_u8(snap, re->agf);
+    nfc_snapshot_put_u8(snap, re->connid);
+    llcp_dl_map_snapshot(&re->llcp_dl, snap);
+    llcp_pdu_queue_snapshot(&re->xmit_q, snap);
+    nfc_ring_snapshot(&re->sbuf, snap);
+    nfc_ring_snapshot(&re->rbuf, snap);
+}
+
+static int
+restore_re(struct nfc_re* re, struct nfc_snapshot* snap)
+{
+    /* the RE's descriptor sets these once */
+    if ((nfc_snapshot_get_u8(snap) != re->rfproto) ||
+        (nfc_snapshot_get_u8(snap) != re->mode)) {
+        return -1;
+    }
+    nfc_snapshot_get_mem(snap, sizeof(re->nfcid1), re->nfcid1);
+    nfc_snapshot_get_mem(snap, sizeof(re->nfcid2), re->nfcid2);
+    nfc_snapshot_get_mem(snap, sizeof(re->nfcid3), re->nfcid3);
+    re->id = nfc_snapshot_get_u8(snap);
+    re->last_dsap = nfc_snapshot_get_u8(snap);
+    re->last_ssap = nfc_snapshot_get_u8(snap);
+    re->xmit_next = nfc_snapshot_get_u8(snap);
+    re->symm_mode = nfc_snapshot_get_u8(snap);
+    re->lto = nfc_snapshot_get_u8(snap);
+    re->turnaround = nfc_snapshot_get_u32(snap);
+    re->rw = nfc_snapshot_get_u8(snap);
+    re->miu = nfc_snapshot_get_u16(snap);
+    re->miu_r = nfc_snapshot_get_u16(snap);
+    re->agf = nfc_snapshot_get_u8(snap);
+    re->connid = nfc_snapshot_get_u8(snap);
+
+    if (snap->err || (re->last_dsap >= LLCP_NUMBER_OF_SAPS) ||
+        (re->last_ssap >= LLCP_NUMBER_OF_SAPS) ||
+        (re->symm_mode >= NUMBER_OF_NFC_RE_SYMM_MODES) ||
+        (re->miu < LLCP_MIU_DEFAULT) || (re->miu > LLCP_MIU_MAX) ||
+        (re->miu_r < LLCP_MIU_DEFAULT) || (re->miu_r > LLCP_MIU_MAX) ||
+        (re->rw > LLCP_RW_MAX) || (re->connid >= NUMBER_OF_NCI_CONNS)) {
+        return -1;
+    }
+    if ((llcp_dl_map_restore(&re->llcp_dl, snap,
+                             create_queued_i_pdu, re) < 0) ||
+        (llcp_pdu_queue_restore(&re->xmit_q, &re->ctx->pdu_pool, snap,
+                                create_queued_i_pdu, re) < 0) ||
+        (nfc_ring_restore(&re->sbuf, snap) < 0) ||
+        (nfc_ring_restore(&re->rbuf, snap) < 0)) {
+        return -1;
+    }
+    return 0;
+}
+
+void
+nfc_re_reset(struct nfc_re* re)
+{
+    assert(re);
+
+    nfc_clear_re(re);
+
+    while (!TAILQ_EMPTY(&re->xmit_q)) {
+        struct llcp_pdu_buf* buf = TAILQ_FIRST(&re->xmit_q);
+        TAILQ_REMOVE(&re->xmit_q, buf, entry);
+        llcp_free_pdu_buf(&re->ctx->pdu_pool, buf);
+    }
+    re->xmit_next = 0;
+    cancel_xmit_timeout(re);
+}
+
+int
+nfc_re_restore(struct nfc_re* re, struct nfc_snapshot* snap)
+{
+    assert(re);
+
+    nfc_re_reset(re);
+
+    if (restore_re(re, snap) < 0) {
+        nfc_re_reset(re);
+        return -1;
+    }
+    if (re->xmit_next) {
+        /* the link timeout starts over */
+        prepare_xmit_timeout(re, xmit_next_cb);
+    }
+    return 0;
+}
@@ -21,11 +21,14 @@
 #include <nfcemu/types.h>
 #include "llcp.h"
 #include "nfc-rf.h"
+#include "nfc-ring.h"
 
 union nci_packet;
+struct nfcemu_ctx;
 struct nfc_tag;
 struct ndef_rec;
 struct snep;
+struct nfc_snapshot;
 
 /* [DIGITAL], Sec 4.6.3 SENS_RES */
 enum {
@@ -53,8 +56,32 @@ enum {
     SEL_RES_OTHER_TAGS = 0x10
 };
 
+enum {
+    NUMBER_OF_NFC_RES = 6
+};
+
+/* How a remote endpoint uses its turn to send on the LLCP link.
+ * The RE has to xmit a PDU, at least a SYMM, before its link
+ * timeout (LTO) expires. */
+enum nfc_re_symm_mode {
+    /* xmit after the turnaround time */
+    NFC_RE_SYMM_DELAYED = 0,
+    /* xmit a queued PDU or SYMM right away */
+    NFC_RE_SYMM_IMMEDIATE,
+    /* xmit as soon as a PDU is queued; SYMM after the turnaround time */
+    NFC_RE_SYMM_ADAPTIVE,
+    NUMBER_OF_NFC_RE_SYMM_MODES
+};
+
+enum {
+    NFC_RE_DEFAULT_LTO = 250, /* 2.5 s */
+    NFC_RE_DEFAULT_RW = 4,
+    NFC_RE_DEFAULT_BUF_LIMIT = 64 * 1024
+};
+
 /* NFC Remote Endpoint */
 struct nfc_re {
+    struct nfcemu_ctx* ctx;
     enum nci_rf_protocol rfproto;
     enum nci_rf_tech_mode mode;
     char nfcid1[10];
@@ -62,61 +89,97 @@ struct nfc_re {
     char nfcid3[10];
     uint8_t id;
     struct nfc_tag* tag;
-    /* outer array is always remote SAP, inner array is local, emulated SAP */
-    struct llcp_data_link llcp_dl[LLCP_NUMBER_OF_SAPS][LLCP_NUMBER_OF_SAPS];
+    /* data links, keyed by remote SAP and local, emulated SAP */
+    struct llcp_dl_map llcp_dl;
     enum llcp_sap last_dsap; /* last remote SAP */
     enum llcp_sap last_ssap; /* last local SAP */
     int xmit_next; /* true if we are supposed to send the next PDU */
     nfcemu_timeout* xmit_timeout;
+    enum nfc_re_symm_mode symm_mode;
+    uint8_t lto; /* advertised link timeout, in units of LLCP_LTO_UNIT_MS */
+    unsigned long turnaround; /* in ms; 0 to derive it from the LTO */
+    uint8_t rw; /* advertised receive window of new data links */
+    uint16_t miu; /* advertised link MIU, and local MIU of new data links */
+    uint16_t miu_r; /* remote's link MIU; bounds AGF PDUs */
+    int agf; /* true to aggregate queued PDUs */
     struct llcp_pdu_queue xmit_q;
-    uint8_t connid;
-    size_t sbufsiz;
-    size_t rbufsiz;
-    uint8_t sbuf[1024]; /* data written by NFC driver */
-    uint8_t rbuf[1024]; /* data for reading from RE */
+    uint8_t connid; /* logical NCI connection of spontaneous data */
+    struct nfc_ring sbuf; /* data written by NFC driver, until the
+                           * host reads it */
+    struct nfc_ring rbuf; /* data for reading from RE */
 };
 
-#define INIT_NFC_RE(re_, rfproto_, mode_, tag_, nfcid_, nfcid2_, addr_) \
-    re_ = { \
-        .rfproto = rfproto_, \
-        .mode = mode_, \
-        .tag = tag_, \
-        .nfcid1 = nfcid_, \
-        .nfcid2 = nfcid2_, \
-        .nfcid3 = nfcid_, \
-        .id = 0, \
-        .xmit_next = 0, \
-        .xmit_timeout = NULL, \
-        .xmit_q = TAILQ_HEAD_INITIALIZER((addr_)->xmit_q), \
-        .connid = 0, \
-        .sbufsiz = 0, \
-        .rbufsiz = 0 \
-    }
-
-/* predefined NFC Remote Endpoints */
-extern struct nfc_re nfc_res[6];
+void
+nfc_init_res(struct nfc_re* res, struct nfc_tag* tags,
+             struct nfcemu_ctx* ctx);
+
+void
+nfc_uninit_re(struct nfc_re* re);
 
 struct nfc_re*
-nfc_get_re_by_id(uint8_t id);
+nfc_get_re_by_id(struct nfcemu_ctx* ctx, uint8_t id);
 
 void
 nfc_clear_re(struct nfc_re* re);
 
+/* Returns the time in ms that the RE waits before it uses its
+ * turn to send. */
+unsigned long
+nfc_re_get_turnaround(const struct nfc_re* re);
+
+/* Limits the size of the send and receive buffers. Fails if either
+ * buffer already stores more data. */
+int
+nfc_re_set_buf_limit(struct nfc_re* re, size_t maxsize);
+
+/* Writes append to the buffers; reads return up to 'len' bytes. */
 ssize_t
 nfc_re_write_sbuf(struct nfc_re* re, size_t len, const void* data);
 
 ssize_t
+nfc_re_writev_sbuf(struct nfc_re* re, const struct iovec* iov,
+                   size_t iovcnt);
+
+size_t
 nfc_re_read_sbuf(struct nfc_re* re, size_t len, void* data);
 
+size_t
+nfc_re_readv_sbuf(struct nfc_re* re, const struct iovec* iov,
+                  size_t iovcnt);
+
 ssize_t
 nfc_re_write_rbuf(struct nfc_re* re, size_t len, const void* data);
 
 ssize_t
+nfc_re_writev_rbuf(struct nfc_re* re, const struct iovec* iov,
+                   size_t iovcnt);
+
+size_t
 nfc_re_read_rbuf(struct nfc_re* re, size_t len, void* data);
 
 size_t
-nfc_re_process_data(struct nfc_re* re, const union nci_packet* dta,
-                    union nci_packet* rsp);
+nfc_re_readv_rbuf(struct nfc_re* re, const struct iovec* iov,
+                  size_t iovcnt);
+
+/* Stores the RE's link state, queued PDUs and buffers. */
+void
+nfc_re_snapshot(const struct nfc_re* re, struct nfc_snapshot* snap);
+
+/* Clears the RE and drops its queued PDUs. */
+void
+nfc_re_reset(struct nfc_re* re);
+
+/* Replaces the RE's state. On errors, the RE is left reset. */
+int
+nfc_re_restore(struct nfc_re* re, struct nfc_snapshot* snap);
+
+/* Processes a frame from the host and stores the response frame,
+ * of up to NFC_MAX_FRAME_LENGTH bytes, in 'rsp'. Range reads from
+ * tags return at most 'maxrsp' bytes, the max. payload of a data
+ * packet on the host's connection. */
+size_t
+nfc_re_process_data(struct nfc_re* re, const uint8_t* data, size_t len,
+                    uint8_t* rsp, size_t maxrsp);
 
 size_t
 nfc_re_create_rf_intf_activated_ntf_tech(enum nci_rf_tech_mode mode,
@@ -133,9 +196,11 @@ int
 nfc_re_send_llcp_connect(struct nfc_re* re, unsigned char dsap,
                          unsigned char ssap);
 
+/* Sends a SNEP message of up to 'maxlen' bytes, which 'create_snep'
+ * creates. */
 int
 nfc_re_send_snep_put(struct nfc_re* re,
-                     enum llcp_sap dsap, enum llcp_sap ssap,
+                     enum llcp_sap dsap, enum llcp_sap ssap, size_t maxlen,
                      ssize_t (*create_snep)(void*, size_t, struct snep*),
                      void* data);
 
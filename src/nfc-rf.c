@@ -15,7 +15,7 @@
  */
 
 #include <assert.h>
-#include "nfc-debug.h"
+#include "nfc-log.h"
 #include "nfc-rf.h"
 
 void
@@ -28,8 +28,8 @@ nfc_rf_init(struct nfc_rf* rf, enum nci_rf_interface iface, enum nci_rf_tech_mod
 }
 
 enum nfc_rfst
-nfc_rf_state_transition(enum nfc_rfst* rf_state, unsigned long bits,
-                        enum nfc_rfst state)
+nfc_rf_state_transition(struct nfc_log* log, enum nfc_rfst* rf_state,
+                        unsigned long bits, enum nfc_rfst state)
 {
     enum nfc_rfst rfst;
 
@@ -41,7 +41,7 @@ nfc_rf_state_transition(enum nfc_rfst* rf_state, unsigned long bits,
         return NUMBER_OF_NFC_RFSTS;
     }
 
-    NFC_D("rf_state from %d to %d\n", *rf_state, state);
+    NFC_D(log, "rf_state from %d to %d", *rf_state, state);
 
     *rf_state = state;
 
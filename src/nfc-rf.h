@@ -17,6 +17,8 @@
 #ifndef nfc_rf_h
 #define nfc_rf_h
 
+struct nfc_log;
+
 /* [NCI]; Figure 10 */
 enum nfc_rfst {
     NFC_RFST_IDLE = 0,
@@ -77,7 +79,7 @@ void
 nfc_rf_init(struct nfc_rf* rf, enum nci_rf_interface iface, enum nci_rf_tech_mode mode);
 
 enum nfc_rfst
-nfc_rf_state_transition(enum nfc_rfst* rf_state, unsigned long bits,
-                        enum nfc_rfst state);
+nfc_rf_state_transition(struct nfc_log* log, enum nfc_rfst* rf_state,
+                        unsigned long bits, enum nfc_rfst state);
 
 #endif
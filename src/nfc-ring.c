@@ -0,0 +1,299 @@
+/*
+ * Copyright (C) 2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nfc-ring.h"
+#include "nfc-snapshot.h"
+
+void
+nfc_ring_init(struct nfc_ring* ring, size_t maxsize)
+{
+    assert(ring);
+
+    ring->buf = NULL;
+    ring->size = 0;
+    ring->maxsize = maxsize;
+    ring->off = 0;
+    ring->len = 0;
+}
+
+void
+nfc_ring_uninit(struct nfc_ring* ring)
+{
+    assert(ring);
+
+    free(ring->buf);
+    ring->buf = NULL;
+    ring->size = 0;
+    ring->off = 0;
+    ring->len = 0;
+}
+
+void
+nfc_ring_clear(struct nfc_ring* ring)
+{
+    assert(ring);
+
+    ring->off = 0;
+    ring->len = 0;
+}
+
+int
+nfc_ring_set_maxsize(struct nfc_ring* ring, size_t maxsize)
+{
+    assert(ring);
+
+    if (ring->len > maxsize) {
+        return -1;
+    }
+    ring->maxsize = maxsize;
+
+    return 0;
+}
+
+size_t
+nfc_ring_len(const struct nfc_ring* ring)
+{
+    assert(ring);
+
+    return ring->len;
+}
+
+/* Grows the buffer to hold at least 'len' bytes. Stored bytes are
+ * moved to the beginning of the new buffer. */
+static int
+reserve(struct nfc_ring* ring, size_t len)
+{
+    struct iovec iov[2];
+    uint8_t* buf;
+    size_t size, iovcnt;
+
+    if (len <= ring->size) {
+        return 0;
+    }
+    if (len > ring->maxsize) {
+        return -1;
+    }
+
+    size = ring->size ? ring->size : NFC_RING_MIN_SIZE;
+    while (size < len) {
+        size *= 2;
+    }
+    if (size > ring->maxsize) {
+        size = ring->maxsize;
+    }
+
+    buf = malloc(size);
+    if (!buf) {
+        return -1;
+    }
+    iovcnt = nfc_ring_peekv(ring, iov);
+    if (iovcnt > 0) {
+        memcpy(buf, iov[0].iov_base, iov[0].iov_len);
+    }
+    if (iovcnt > 1) {
+        memcpy(buf + iov[0].iov_len, iov[1].iov_base, iov[1].iov_len);
+    }
+    free(ring->buf);
+
+    ring->buf = buf;
+    ring->size = size;
+    ring->off = 0;
+
+    return 0;
+}
+
+static void
+append(struct nfc_ring* ring, size_t len, const uint8_t* data)
+{
+    size_t end, n;
+
+    end = (ring->off + ring->len) % ring->size;
+    n = ring->size - end;
+    if (n > len) {
+        n = len;
+    }
+    memcpy(ring->buf + end, data, n);
+    memcpy(ring->buf, data + n, len - n);
+    ring->len += len;
+}
+
+ssize_t
+nfc_ring_write(struct nfc_ring* ring, size_t len, const void* data)
+{
+    assert(ring);
+    assert(data || !len);
+
+    if (!len) {
+        return 0;
+    }
+    if (len > ring->maxsize - ring->len ||
+        reserve(ring, ring->len + len) < 0) {
+        return -1;
+    }
+    append(ring, len, data);
+
+    return len;
+}
+
+ssize_t
+nfc_ring_writev(struct nfc_ring* ring, const struct iovec* iov,
+                size_t iovcnt)
+{
+    size_t i, len;
+
+    assert(ring);
+    assert(iov || !iovcnt);
+
+    for (len = 0, i = 0; i < iovcnt; ++i) {
+        if (iov[i].iov_len > ring->maxsize - len) {
+            return -1;
+        }
+        len += iov[i].iov_len;
+    }
+    if (!len) {
+        return 0;
+    }
+    if (len > ring->maxsize - ring->len ||
+        reserve(ring, ring->len + len) < 0) {
+        return -1;
+    }
+    for (i = 0; i < iovcnt; ++i) {
+        append(ring, iov[i].iov_len, iov[i].iov_base);
+    }
+
+    return len;
+}
+
+size_t
+nfc_ring_peekv(const struct nfc_ring* ring, struct iovec* iov)
+{
+    size_t n;
+
+    assert(ring);
+    assert(iov);
+
+    if (!ring->len) {
+        return 0;
+    }
+    n = ring->size - ring->off;
+    if (n >= ring->len) {
+        iov[0].iov_base = ring->buf + ring->off;
+        iov[0].iov_len = ring->len;
+        return 1;
+    }
+    iov[0].iov_base = ring->buf + ring->off;
+    iov[0].iov_len = n;
+    iov[1].iov_base = ring->buf;
+    iov[1].iov_len = ring->len - n;
+
+    return 2;
+}
+
+void
+nfc_ring_consume(struct nfc_ring* ring, size_t len)
+{
+    assert(ring);
+    assert(len <= ring->len);
+
+    ring->len -= len;
+    /* restart at the beginning to keep future data contiguous */
+    ring->off = ring->len ? (ring->off + len) % ring->size : 0;
+}
+
+size_t
+nfc_ring_read(struct nfc_ring* ring, size_t len, void* data)
+{
+    struct iovec iov = {
+        .iov_base = data,
+        .iov_len = len
+    };
+
+    assert(data || !len);
+
+    return nfc_ring_readv(ring, &iov, 1);
+}
+
+size_t
+nfc_ring_readv(struct nfc_ring* ring, const struct iovec* iov,
+               size_t iovcnt)
+{
+    size_t i, len;
+
+    assert(ring);
+    assert(iov || !iovcnt);
+
+    for (len = 0, i = 0; i < iovcnt && ring->len; ++i) {
+        uint8_t* data = iov[i].iov_base;
+        size_t off = 0;
+
+        while (off < iov[i].iov_len && ring->len) {
+            size_t n = ring->size - ring->off;
+            if (n > ring->len) {
+                n = ring->len;
+            }
+            if (n > iov[i].iov_len - off) {
+                n = iov[i].iov_len - off;
+            }
+            memcpy(data + off, ring->buf + ring->off, n);
+            nfc_ring_consume(ring, n);
+            off += n;
+        }
+        len += off;
+    }
+
+    return len;
+}
+
+void
+nfc_ring_snapshot(const struct nfc_ring* ring, struct nfc_snapshot* snap)
+{
+    struct iovec iov[2];
+    size_t i, iovcnt;
+
+    assert(ring);
+
+    nfc_snapshot_put_u32(snap, ring->maxsize);
+    nfc_snapshot_put_u32(snap, ring->len);
+
+    iovcnt = nfc_ring_peekv(ring, iov);
+    for (i = 0; i < iovcnt; ++i) {
+        nfc_snapshot_put_mem(snap, iov[i].iov_len, iov[i].iov_base);
+    }
+}
+
+int
+nfc_ring_restore(struct nfc_ring* ring, struct nfc_snapshot* snap)
+{
+    const void* data;
+    size_t maxsize, len;
+
+    assert(ring);
+
+    maxsize = nfc_snapshot_get_u32(snap);
+    len = nfc_snapshot_get_u32(snap);
+    data = nfc_snapshot_get_ptr(snap, len);
+    if (!data || (len > maxsize)) {
+        return -1;
+    }
+
+    nfc_ring_clear(ring);
+    ring->maxsize = maxsize;
+
+    return nfc_ring_write(ring, len, data) < 0 ? -1 : 0;
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef nfc_ring_h
+#define nfc_ring_h
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct nfc_snapshot;
+
+/* A byte FIFO. Writes append to the end, reads take any number of
+ * bytes from the front. The storage is allocated on the first write
+ * and grows on demand, up to 'maxsize' bytes. */
+
+enum {
+    NFC_RING_MIN_SIZE = 256
+};
+
+struct nfc_ring {
+    uint8_t* buf;
+    size_t size; /* allocated bytes */
+    size_t maxsize; /* limit for growing the buffer */
+    size_t off; /* offset of the first byte */
+    size_t len; /* number of stored bytes */
+};
+
+void
+nfc_ring_init(struct nfc_ring* ring, size_t maxsize);
+
+void
+nfc_ring_uninit(struct nfc_ring* ring);
+
+/* Drops all stored bytes, but keeps the storage. */
+void
+nfc_ring_clear(struct nfc_ring* ring);
+
+/* Fails if the ring already stores more than 'maxsize' bytes. */
+int
+nfc_ring_set_maxsize(struct nfc_ring* ring, size_t maxsize);
+
+size_t
+nfc_ring_len(const struct nfc_ring* ring);
+
+/* Appends all bytes or none. Returns the number of appended bytes, or
+ * -1 if the data exceeds the size limit or memory runs out. */
+ssize_t
+nfc_ring_write(struct nfc_ring* ring, size_t len, const void* data);
+
+ssize_t
+nfc_ring_writev(struct nfc_ring* ring, const struct iovec* iov,
+                size_t iovcnt);
+
+/* Removes up to 'len' bytes from the front and returns their number. */
+size_t
+nfc_ring_read(struct nfc_ring* ring, size_t len, void* data);
+
+size_t
+nfc_ring_readv(struct nfc_ring* ring, const struct iovec* iov,
+               size_t iovcnt);
+
+/* Fills in up to two vectors that refer to the stored bytes in place,
+ * and returns how many have been used. The bytes stay in the ring
+ * until nfc_ring_consume() drops them. */
+size_t
+nfc_ring_peekv(const struct nfc_ring* ring, struct iovec* iov);
+
+void
+nfc_ring_consume(struct nfc_ring* ring, size_t len);
+
+void
+nfc_ring_snapshot(const struct nfc_ring* ring, struct nfc_snapshot* snap);
+
+int
+nfc_ring_restore(struct nfc_ring* ring, struct nfc_snapshot* snap);
+
+#endif
@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <string.h>
+#include "nfc-snapshot.h"
+
+void
+nfc_snapshot_init_writer(struct nfc_snapshot* snap, void* buf, size_t len)
+{
+    assert(snap);
+    assert(buf || !len);
+
+    snap->out = buf;
+    snap->in = NULL;
+    snap->len = len;
+    snap->off = 0;
+    snap->err = 0;
+}
+
+void
+nfc_snapshot_init_reader(struct nfc_snapshot* snap,
+                         const void* buf, size_t len)
+{
+    assert(snap);
+    assert(buf || !len);
+
+    snap->out = NULL;
+    snap->in = buf;
+    snap->len = len;
+    snap->off = 0;
+    snap->err = 0;
+}
+
+void
+nfc_snapshot_put_mem(struct nfc_snapshot* snap, size_t len, const void* data)
+{
+    assert(snap);
+    assert(!snap->in);
+    assert(data || !len);
+
+    if (len && (snap->off <= snap->len) && (len <= snap->len - snap->off)) {
+        memcpy(snap->out + snap->off, data, len);
+    }
+    snap->off += len;
+}
+
+static void
+put_le(struct nfc_snapshot* snap, uint32_t value, size_t len)
+{
+    uint8_t p[4];
+    size_t i;
+
+    for (i = 0; i < len; ++i) {
+        p[i] = value >> (8 * i);
+    }
+    nfc_snapshot_put_mem(snap, len, p);
+}
+
+void
+nfc_snapshot_put_u8(struct nfc_snapshot* snap, uint8_t value)
+{
+    put_le(snap, value, 1);
+}
+
+void
+nfc_snapshot_put_u16(struct nfc_snapshot* snap, uint16_t value)
+{
+    put_le(snap, value, 2);
+}
+
+void
+nfc_snapshot_put_u32(struct nfc_snapshot* snap, uint32_t value)
+{
+    put_le(snap, value, 4);
+}
+
+const void*
+nfc_snapshot_get_ptr(struct nfc_snapshot* snap, size_t len)
+{
+    const uint8_t* p;
+
+    assert(snap);
+    assert(snap->in || !snap->len);
+
+    if (snap->err || (len > snap->len - snap->off)) {
+        snap->err = 1;
+        return NULL;
+    }
+    p = snap->in + snap->off;
+    snap->off += len;
+
+    return p;
+}
+
+int
+nfc_snapshot_get_mem(struct nfc_snapshot* snap, size_t len, void* data)
+{
+    const void* p;
+
+    assert(data || !len);
+
+    p = nfc_snapshot_get_ptr(snap, len);
+    if (!p) {
+        return -1;
+    }
+    memcpy(data, p, len);
+
+    return 0;
+}
+
+static uint32_t
+get_le(struct nfc_snapshot* snap, size_t len)
+{
+    const uint8_t* p;
+    uint32_t value;
+    size_t i;
+
+    p = nfc_snapshot_get_ptr(snap, len);
+    if (!p) {
+        return 0;
+    }
+    for (value = 0, i = 0; i < len; ++i) {
+        value |= (uint32_t)p[i] << (8 * i);
+    }
+    return value;
+}
+
+uint8_t
+nfc_snapshot_get_u8(struct nfc_snapshot* snap)
+{
+    return get_le(snap, 1);
+}
+
+uint16_t
+nfc_snapshot_get_u16(struct nfc_snapshot* snap)
+{
+    return get_le(snap, 2);
+}
+
+uint32_t
+nfc_snapshot_get_u32(struct nfc_snapshot* snap)
+{
+    return get_le(snap, 4);
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef nfc_snapshot_h
+#define nfc_snapshot_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A cursor over a snapshot blob. Integers are stored in little
+ * endian. A writer keeps counting when the buffer is full, so that
+ * a first pass over an empty buffer returns the required size. A
+ * reader sets 'err' when it runs past the end; all later reads
+ * return zeros.
+ */
+
+enum {
+    NFC_SNAPSHOT_VERSION = 4,
+    NFC_SNAPSHOT_HEADER_LENGTH = 8
+};
+
+#define NFC_SNAPSHOT_MAGIC "NFCS"
+
+struct nfc_snapshot {
+    uint8_t* out; /* NULL for readers */
+    const uint8_t* in; /* NULL for writers */
+    size_t len;
+    size_t off;
+    int err;
+};
+
+void
+nfc_snapshot_init_writer(struct nfc_snapshot* snap, void* buf, size_t len);
+
+void
+nfc_snapshot_init_reader(struct nfc_snapshot* snap,
+                         const void* buf, size_t len);
+
+void
+nfc_snapshot_put_u8(struct nfc_snapshot* snap, uint8_t value);
+
+void
+nfc_snapshot_put_u16(struct nfc_snapshot* snap, uint16_t value);
+
+void
+nfc_snapshot_put_u32(struct nfc_snapshot* snap, uint32_t value);
+
+void
+nfc_snapshot_put_mem(struct nfc_snapshot* snap, size_t len, const void* data);
+
+uint8_t
+nfc_snapshot_get_u8(struct nfc_snapshot* snap);
+
+uint16_t
+nfc_snapshot_get_u16(struct nfc_snapshot* snap);
+
+uint32_t
+nfc_snapshot_get_u32(struct nfc_snapshot* snap);
+
+int
+nfc_snapshot_get_mem(struct nfc_snapshot* snap, size_t len, void* data);
+
+/* Returns the next 'len' bytes in place, or NULL. */
+const void*
+nfc_snapshot_get_ptr(struct nfc_snapshot* snap, size_t len);
+
+#endif
@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ptr.h"
+#include "nfc-hci.h"
+#include "nfc-stats.h"
+
+struct nfc_stats*
+nfc_stats_create(void)
+{
+    void* stats;
+    int res;
+
+    res = posix_memalign(&stats, NFC_STATS_CACHE_LINE_SIZE,
+                         sizeof(struct nfc_stats));
+    if (res) {
+        errno = res;
+        return NULL;
+    }
+    nfc_stats_reset(stats);
+
+    return stats;
+}
+
+void
+nfc_stats_destroy(struct nfc_stats* stats)
+{
+    free(stats);
+}
+
+void
+nfc_stats_reset(struct nfc_stats* stats)
+{
+    assert(stats);
+
+    memset(stats, 0, sizeof(*stats));
+}
+
+uint64_t
+nfc_stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void
+add_cmd(struct nfc_cmd_stats* cmd, uint64_t ns, int err, int semerr)
+{
+    unsigned int i;
+
+    /* bucket 0 is [0, 256) ns, bucket i is [2^(7+i), 2^(8+i)) ns */
+    if (ns < 256) {
+        i = 0;
+    } else {
+        i = 63 - __builtin_clzll(ns) - 7;
+        if (i >= NFCEMU_CMD_STATS_BUCKETS) {
+            i = NFCEMU_CMD_STATS_BUCKETS - 1;
+        }
+    }
+
+    ++cmd->ncalls;
+    cmd->nerrs += !!err;
+    cmd->nsemerrs += !!semerr;
+    ++cmd->hist[i];
+    cmd->ns += ns;
+}
+
+static int
+nci_gid_index(enum nci_gid gid)
+{
+    switch (gid) {
+        case NCI_GID_CORE:
+            return 0;
+        case NCI_GID_RF:
+            return 1;
+        case NCI_GID_NFCEE:
+            return 2;
+        case NCI_GID_PROP:
+            return 3;
+    }
+    return -1;
+}
+
+void
+nfc_stats_add_nci(struct nfc_stats* stats, enum nfc_fsm_state state,
+                  const union nci_packet* cmd, const union nci_packet* rsp,
+                  size_t len, uint64_t ns)
+{
+    int gid;
+    uint8_t status;
+
+    assert(stats);
+    assert(state < NUMBER_OF_NFC_FSM_STATES);
+    assert(cmd);
+
+    gid = nci_gid_index(cmd->control.gid);
+    if (gid < 0) {
+        return;
+    }
+    /* unanswered commands count as errors */
+    if (len > 3 && rsp->control.mt == NCI_MT_RSP) {
+        status = rsp->control.payload[0];
+    } else if (len) {
+        status = NCI_STATUS_OK;
+    } else {
+        status = NCI_STATUS_REJECTED;
+    }
+
+    add_cmd(&stats->nci[state][gid][cmd->control.oid], ns,
+            status != NCI_STATUS_OK,
+            status == NCI_STATUS_SEMANTIC_ERROR);
+}
+
+void
+nfc_stats_add_hci(struct nfc_stats* stats, enum nfc_fsm_state state,
+                  const union hci_packet* cmd, const union hci_answer* rsp,
+                  size_t len, uint64_t ns)
+{
+    int err;
+
+    assert(stats);
+    assert(state < NUMBER_OF_NFC_FSM_STATES);
+    assert(cmd);
+
+    if (cmd->common.service != HCI_SERVICE_BCM2079x) {
+        return;
+    }
+    if (len >= sizeof(rsp->evt.cmd_complete) &&
+        rsp->evt.common.cmd == HCI_BCM2079x_EVT_CMD_COMPLETE) {
+        err = rsp->evt.cmd_complete.status != HCI_STATUS_OK;
+    } else {
+        err = !len;
+    }
+
+    add_cmd(&stats->hci[state][cmd->common.cmd & ~HCI_MESSAGE_RFU], ns,
+            err, 0);
+}
+
+static size_t
+foreach_cmd(const struct nfc_cmd_stats* cmd, size_t n,
+            enum nfcemu_cmd_type type, unsigned int state, unsigned int gid,
+            void (*func)(void*, const struct nfcemu_cmd_stats*), void* data)
+{
+    size_t i, j, count;
+
+    for (count = 0, i = 0; i < n; ++i) {
+        struct nfcemu_cmd_stats out;
+
+        if (!cmd[i].ncalls) {
+            continue;
+        }
+        out.type = type;
+        out.state = state;
+        out.gid = gid;
+        out.oid = i;
+        out.ncalls = cmd[i].ncalls;
+        out.nerrs = cmd[i].nerrs;
+        out.nsemerrs = cmd[i].nsemerrs;
+        out.ns = cmd[i].ns;
+        for (j = 0; j < ARRAY_SIZE(out.hist); ++j) {
+            out.hist[j] = cmd[i].hist[j];
+        }
+        func(data, &out);
+        ++count;
+    }
+    return count;
+}
+
+size_t
+nfc_stats_foreach(const struct nfc_stats* stats,
+                  void (*func)(void*, const struct nfcemu_cmd_stats*),
+                  void* data)
+{
+    static const uint8_t gid[NUMBER_OF_NFC_STATS_NCI_GIDS] = {
+        NCI_GID_CORE, NCI_GID_RF, NCI_GID_NFCEE, NCI_GID_PROP
+    };
+    size_t state, i, count;
+
+    assert(stats);
+    assert(func);
+
+    count = 0;
+
+    for (state = 0; state < NUMBER_OF_NFC_FSM_STATES; ++state) {
+        for (i = 0; i < NUMBER_OF_NFC_STATS_NCI_GIDS; ++i) {
+            count += foreach_cmd(stats->nci[state][i],
+                                 ARRAY_SIZE(stats->nci[state][i]),
+                                 NFCEMU_CMD_NCI, state, gid[i], func, data);
+        }
+        count += foreach_cmd(stats->hci[state],
+                             ARRAY_SIZE(stats->hci[state]),
+                             NFCEMU_CMD_HCI, state, HCI_SERVICE_BCM2079x,
+                             func, data);
+    }
+    return count;
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef nfc_stats_h
+#define nfc_stats_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <nfcemu/nfcemu.h>
+#include "nfc.h"
+#include "nfc-nci.h"
+
+union hci_packet;
+union hci_answer;
+
+enum {
+    NFC_STATS_CACHE_LINE_SIZE = 64,
+    /* CORE, RF, NFCEE and PROP */
+    NUMBER_OF_NFC_STATS_NCI_GIDS = 4,
+    /* HCI commands without their message-type bits */
+    NUMBER_OF_NFC_STATS_HCI_CMDS = 64
+};
+
+/* Counters of a single command. Each fills exactly one cache line,
+ * so updating them never touches a neighbouring command's counters.
+ */
+struct nfc_cmd_stats {
+    uint32_t ncalls;
+    uint32_t nerrs;
+    uint32_t nsemerrs;
+    uint32_t hist[NFCEMU_CMD_STATS_BUCKETS];
+    uint64_t ns;
+} __attribute__((aligned(NFC_STATS_CACHE_LINE_SIZE)));
+
+/* Per-device statistics, indexed by the controller's FSM state and
+ * the command. */
+struct nfc_stats {
+    struct nfc_cmd_stats nci[NUMBER_OF_NFC_FSM_STATES]
+                            [NUMBER_OF_NFC_STATS_NCI_GIDS]
+                            [NUMBER_OF_NCI_CMDS];
+    struct nfc_cmd_stats hci[NUMBER_OF_NFC_FSM_STATES]
+                            [NUMBER_OF_NFC_STATS_HCI_CMDS];
+};
+
+struct nfc_stats*
+nfc_stats_create(void);
+
+void
+nfc_stats_destroy(struct nfc_stats* stats);
+
+void
+nfc_stats_reset(struct nfc_stats* stats);
+
+/* monotonic time stamp in ns */
+uint64_t
+nfc_stats_now(void);
+
+void
+nfc_stats_add_nci(struct nfc_stats* stats, enum nfc_fsm_state state,
+                  const union nci_packet* cmd, const union nci_packet* rsp,
+                  size_t len, uint64_t ns);
+
+void
+nfc_stats_add_hci(struct nfc_stats* stats, enum nfc_fsm_state state,
+                  const union hci_packet* cmd, const union hci_answer* rsp,
+                  size_t len, uint64_t ns);
+
+/* Calls 'func' for each command that has been processed since
+ * the last reset. Returns the number of calls. */
+size_t
+nfc_stats_foreach(const struct nfc_stats* stats,
+                  void (*func)(void*, const struct nfcemu_cmd_stats*),
+                  void* data);
+
+#endif
@@ -15,10 +15,18 @@
  */
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
-#include "nfc-debug.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "ptr.h"
 #include "nfc.h"
 #include "nfc-re.h"
+#include "nfc-snapshot.h"
 #include "nfc-tag.h"
 
 #define T1T_UID { 0x01, 0x02, 0x03, 0x04, \
@@ -50,9 +58,6 @@ static const uint8_t t1t_cc[4] = { 0xE1, 0x10, 0x0E, 0x00 };
 #define T3T_LN { 0x00, 0x00, 0x00 }       // Actual size of the stored NDEF data in bytes
 #define T3T_CS { 0x00, 0x23 }             // Checksum: Byte0 + Byte1 + ... + Byte 13
 
-/* [Type 4 Tag Operation Specification] */
-static enum t4t_file_select t4t_file_sel = NONE;
-
 /* [T4TOP] Table5 */
 #define T4T_PROPRIETARY_CC { 0x00, 0x0f, 0x20, 0x00, 0x3b, 0x00, 0x34, \
                              0x05, 0x06, 0xE1, 0x04, 0x04, 0x00, 0x00, 0x00 }
@@ -76,24 +81,399 @@ static const uint8_t t4t_ndef_apdu[5] = { 0x00, 0xa4, 0x00, 0x0c, 0x02 };
 static uint8_t NDEF_MESSAGE_TLV = 0x03;
 static uint8_t NDEF_TERMINATOR_TLV = 0xFE;
 
-struct nfc_tag nfc_tags[4] = {
+/* [Type 2 Tag Operation Specification] 2.3 */
+enum {
+    T2T_LOCK_CONTROL_TLV = 0x01,
+    T2T_MEMORY_CONTROL_TLV = 0x02,
+    /* reserved memory in front of the dynamic lock bytes */
+    T2T_RESERVED_SIZE = T2T_BLOCK_SIZE,
+    /* every dynamic lock bit locks 2^3 bytes */
+    T2T_BLPLB = 3,
+    /* a Lock Control TLV and a Memory Control TLV, 5 bytes each */
+    T2T_CONTROL_TLVS_SIZE = 10
+};
+
+static const union nfc_tag_mem nfc_tag_templates[NUMBER_OF_NFC_TAGS] = {
    INIT_NFC_T1T([0], T1T_UID, T1T_RES),
    INIT_NFC_T2T([1], T2T_INTERNAL, T2T_LOCK, T2T_CC),
    INIT_NFC_T3T([2], T3T_V, T3T_R, T3T_W, T3T_NB, T3T_U, T3T_WF, T3T_RW, T3T_LN, T3T_CS),
    INIT_NFC_T4T([3], T4T_PROPRIETARY_CC)
 };
 
+/* shared by the tags of all contexts until they get written to */
+static struct nfcemu_tag_image nfc_tag_template_images[NUMBER_OF_NFC_TAGS] = {
+   INIT_NFC_TAG_IMAGE([T1T], nfc_tag_templates + 0, sizeof(union nfc_t1t)),
+   INIT_NFC_TAG_IMAGE([T2T], nfc_tag_templates + 1, sizeof(union nfc_t2t)),
+   INIT_NFC_TAG_IMAGE([T3T], nfc_tag_templates + 2, sizeof(union nfc_t3t)),
+   INIT_NFC_TAG_IMAGE([T4T], nfc_tag_templates + 3, sizeof(union nfc_t4t))
+};
+
+void
+nfc_init_tags(struct nfc_tag* tags)
+{
+    size_t i;
+
+    assert(tags);
+
+    for (i = 0; i < NUMBER_OF_NFC_TAGS; ++i) {
+        tags[i].type = i;
+        tags[i].t4t_file_sel = NONE;
+        tags[i].t2t_sector = 0;
+        tags[i].t2t_sector_sel = 0;
+        tags[i].capacity = 0;
+        tags[i].img = nfc_tag_image_ref(nfc_tag_template_images + i);
+        tags[i].page = NULL;
+    }
+}
+
 static void
+free_pages(struct nfc_tag* tag)
+{
+    size_t i, npages;
+
+    if (!tag->page) {
+        return;
+    }
+    npages = (tag->img->len + NFC_TAG_PAGE_SIZE - 1) / NFC_TAG_PAGE_SIZE;
+    for (i = 0; i < npages; ++i) {
+        free(tag->page[i]);
+    }
+    free(tag->page);
+    tag->page = NULL;
+}
+
+void
+nfc_uninit_tags(struct nfc_tag* tags)
+{
+    size_t i;
+
+    assert(tags);
+
+    for (i = 0; i < NUMBER_OF_NFC_TAGS; ++i) {
+        free_pages(tags + i);
+        nfc_tag_image_unref(tags[i].img);
+        tags[i].img = NULL;
+    }
+}
+
+/*
+ * Tag memory
+ */
+
+/* allocates an image with 'len' bytes of uninitialized memory */
+static struct nfcemu_tag_image*
+alloc_image(size_t len, uint8_t** mem)
+{
+    struct nfcemu_tag_image* img;
+
+    img = malloc(sizeof(*img) + len);
+    if (!img) {
+        return NULL;
+    }
+    img->nrefs = 1;
+    img->len = len;
+    img->mem = (const uint8_t*)(img + 1);
+    img->release = NULL;
+
+    *mem = (uint8_t*)(img + 1);
+
+    return img;
+}
+
+struct nfcemu_tag_image*
+nfc_tag_image_create(const void* mem, size_t len)
+{
+    struct nfcemu_tag_image* img;
+    uint8_t* p;
+
+    assert(mem || !len);
+
+    img = alloc_image(len, &p);
+    if (!img) {
+        return NULL;
+    }
+    memcpy(p, mem, len);
+
+    return img;
+}
+
+static void
+unmap_image(struct nfcemu_tag_image* img)
+{
+    munmap((void*)img->mem, img->len);
+    free(img);
+}
+
+struct nfcemu_tag_image*
+nfc_tag_image_map(const char* path)
+{
+    struct nfcemu_tag_image* img;
+    struct stat st;
+    void* mem;
+    int fd, err;
+
+    assert(path);
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0) {
+        err = errno;
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+    if (!st.st_size) {
+        /* mmap() refuses empty mappings */
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    /* reads come straight from the page cache; writes go to
+     * private pages of the tag */
+    mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    err = errno;
+    close(fd);
+    if (mem == MAP_FAILED) {
+        errno = err;
+        return NULL;
+    }
+
+    img = malloc(sizeof(*img));
+    if (!img) {
+        munmap(mem, st.st_size);
+        errno = ENOMEM;
+        return NULL;
+    }
+    img->nrefs = 1;
+    img->len = st.st_size;
+    img->mem = mem;
+    img->release = unmap_image;
+
+    return img;
+}
+
+struct nfcemu_tag_image*
+nfc_tag_image_ref(struct nfcemu_tag_image* img)
+{
+    assert(img);
+
+    __atomic_add_fetch(&img->nrefs, 1, __ATOMIC_RELAXED);
+
+    return img;
+}
+
+void
+nfc_tag_image_unref(struct nfcemu_tag_image* img)
+{
+    if (!img) {
+        return;
+    }
+    if (!__atomic_sub_fetch(&img->nrefs, 1, __ATOMIC_ACQ_REL)) {
+        /* template images hold an extra reference and never get here */
+        if (img->release) {
+            img->release(img);
+        } else {
+            free(img);
+        }
+    }
+}
+
+/* tests if a memory size can be addressed by a tag type */
+static int
+valid_len(enum nfc_tag_type type, size_t len)
+{
+    switch (type) {
+        case T1T:
+            return len == sizeof(union nfc_t1t);
+        case T2T:
+            return !(len % T2T_BLOCK_SIZE) &&
+                   (len >= sizeof(union nfc_t2t)) &&
+                   (len <= T2T_MAX_SECTORS * T2T_SECTOR_SIZE);
+        case T3T:
+            /* attribute information block and at least one data block */
+            return !(len % T3T_BLOCK_SIZE) &&
+                   (len >= 2 * T3T_BLOCK_SIZE) &&
+                   (len <= T3T_MAX_BLOCK_NUM * T3T_BLOCK_SIZE);
+        case T4T:
+            /* CC file and an NDEF file with at least NLEN */
+            return (len >= offsetof(struct nfc_t4t_format, data) + 2) &&
+                   (len <= offsetof(struct nfc_t4t_format, data) +
+                           T4T_MAX_NDEF_FILE_SIZE);
+        default:
+            return 0;
+    }
+}
+
+int
+nfc_tag_set_image(struct nfc_tag* tag, struct nfcemu_tag_image* img)
+{
+    assert(tag);
+    assert(img);
+
+    if (!valid_len(tag->type, img->len)) {
+        return -1;
+    }
+    nfc_tag_image_ref(img);
+    free_pages(tag);
+    nfc_tag_image_unref(tag->img);
+    tag->img = img;
+    tag->t2t_sector = 0;
+    tag->t2t_sector_sel = 0;
+
+    return 0;
+}
+
+size_t
+nfc_tag_len(const struct nfc_tag* tag)
+{
+    assert(tag);
+
+    return tag->img->len;
+}
+
+static const uint8_t*
+page_mem(const struct nfc_tag* tag, size_t i)
+{
+    if (tag->page && tag->page[i]) {
+        return tag->page[i];
+    }
+    return tag->img->mem + i * NFC_TAG_PAGE_SIZE;
+}
+
+size_t
+nfc_tag_read(const struct nfc_tag* tag, size_t off, size_t len, void* buf)
+{
+    uint8_t* p;
+    size_t end;
+
+    assert(tag);
+    assert(buf || !len);
+
+    if (off >= tag->img->len) {
+        return 0;
+    }
+    if (len > tag->img->len - off) {
+        len = tag->img->len - off;
+    }
+
+    for (p = buf, end = off + len; off < end;) {
+        size_t pgoff = off % NFC_TAG_PAGE_SIZE;
+        size_t n = NFC_TAG_PAGE_SIZE - pgoff;
+        if (n > end - off) {
+            n = end - off;
+        }
+        memcpy(p, page_mem(tag, off / NFC_TAG_PAGE_SIZE) + pgoff, n);
+        p += n;
+        off += n;
+    }
+
+    return len;
+}
+
+static uint8_t*
+copy_page(struct nfc_tag* tag, size_t i)
+{
+    size_t npages, len;
+
+    npages = (tag->img->len + NFC_TAG_PAGE_SIZE - 1) / NFC_TAG_PAGE_SIZE;
+
+    if (!tag->page) {
+        tag->page = calloc(npages, sizeof(*tag->page));
+        if (!tag->page) {
+            return NULL;
+        }
+    }
+    if (!tag->page[i]) {
+        len = tag->img->len - i * NFC_TAG_PAGE_SIZE;
+        if (len > NFC_TAG_PAGE_SIZE) {
+            len = NFC_TAG_PAGE_SIZE;
+        }
+        tag->page[i] = malloc(NFC_TAG_PAGE_SIZE);
+        if (!tag->page[i]) {
+            return NULL;
+        }
+        memcpy(tag->page[i], tag->img->mem + i * NFC_TAG_PAGE_SIZE, len);
+    }
+    return tag->page[i];
+}
+
+int
+nfc_tag_write(struct nfc_tag* tag, size_t off, size_t len, const void* data)
+{
+    const uint8_t* p;
+    size_t end;
+
+    assert(tag);
+    assert(data || !len);
+
+    if ((off > tag->img->len) || (len > tag->img->len - off)) {
+        return -1;
+    }
+
+    for (p = data, end = off + len; off < end;) {
+        size_t pgoff = off % NFC_TAG_PAGE_SIZE;
+        size_t n = NFC_TAG_PAGE_SIZE - pgoff;
+        uint8_t* page;
+
+        if (n > end - off) {
+            n = end - off;
+        }
+        page = copy_page(tag, off / NFC_TAG_PAGE_SIZE);
+        if (!page) {
+            return -1;
+        }
+        memcpy(page + pgoff, p, n);
+        p += n;
+        off += n;
+    }
+
+    return 0;
+}
+
+struct nfcemu_tag_image*
+nfc_tag_get_image(struct nfc_tag* tag)
+{
+    struct nfcemu_tag_image* img;
+    uint8_t* mem;
+
+    assert(tag);
+
+    if (!tag->page) {
+        return nfc_tag_image_ref(tag->img);
+    }
+
+    img = alloc_image(tag->img->len, &mem);
+    if (!img) {
+        return NULL;
+    }
+    nfc_tag_read(tag, 0, tag->img->len, mem);
+
+    /* the tag shares the new image from now on */
+    free_pages(tag);
+    nfc_tag_image_unref(tag->img);
+    tag->img = nfc_tag_image_ref(img);
+
+    return img;
+}
+
+/*
+ * NDEF data
+ */
+
+static int
 set_t1t_data(struct nfc_tag* tag, const uint8_t* ndef_msg, ssize_t len)
 {
+    uint8_t data[sizeof(((struct nfc_t1t_format*)0)->data)];
     ssize_t offset = 0;
-    uint8_t* data;
 
     assert(tag);
     assert(ndef_msg || !len);
-    assert(len < sizeof(tag->t.t1.format.data));
 
-    data = tag->t.t1.format.data;
+    if (sizeof(t1t_cc) + 2 + len > sizeof(data)) {
+        return -1;
+    }
 
     /* [Type 1 Tag Operation Specificatio] 6.1 NDEF Management */
     memcpy(data + offset, t1t_cc, sizeof(t1t_cc));
@@ -105,72 +485,149 @@ set_t1t_data(struct nfc_tag* tag, const uint8_t* ndef_msg, ssize_t len)
     memcpy(data + offset, ndef_msg, len);
     offset += len;
 
-    data[offset++] = NDEF_TERMINATOR_TLV;
-    memset(data + offset, 0, sizeof(tag->t.t1.format.data) - offset);
+    if (offset < sizeof(data)) {
+        data[offset++] = NDEF_TERMINATOR_TLV;
+    }
+    memset(data + offset, 0, sizeof(data) - offset);
+
+    return nfc_tag_write(tag, offsetof(struct nfc_t1t_format, data),
+                         sizeof(data), data);
 }
 
-static void
+static int
 set_t2t_data(struct nfc_tag* tag, const uint8_t* ndef_msg, ssize_t len)
 {
+    uint8_t data[T2T_MAX_DATA_AREA_SIZE];
+    uint8_t cc[sizeof(((struct nfc_t2t_format*)0)->cc)];
+    size_t size;
     ssize_t offset = 0;
-    uint8_t* data;
 
     assert(tag);
     assert(ndef_msg || !len);
-    assert(len < sizeof(tag->t.t2.format.data));
 
-    data = tag->t.t2.format.data;
+    /* the CC knows the data area's size; the memory may be smaller */
+    nfc_tag_read(tag, offsetof(struct nfc_t2t_format, cc), sizeof(cc), cc);
+    size = cc[2] * 8;
+    if (size > nfc_tag_len(tag) - offsetof(struct nfc_t2t_format, data)) {
+        size = nfc_tag_len(tag) - offsetof(struct nfc_t2t_format, data);
+    }
+    nfc_tag_read(tag, offsetof(struct nfc_t2t_format, data), size, data);
+
+    /* Lock and Memory Control TLVs stay in front of the NDEF TLV */
+    while ((offset + 2 <= size) &&
+           ((data[offset] == T2T_LOCK_CONTROL_TLV) ||
+            (data[offset] == T2T_MEMORY_CONTROL_TLV))) {
+        offset += 2 + data[offset + 1];
+    }
+    /* [Type 2 Tag Operation Specification] 2.3; 3-byte length format
+     * for long messages */
+    if (offset + (len < 0xff ? 2 : 4) + len > size) {
+        return -1;
+    }
 
     data[offset++] = NDEF_MESSAGE_TLV;
-    data[offset++] = len;
+    if (len < 0xff) {
+        data[offset++] = len;
+    } else {
+        data[offset++] = 0xff;
+        data[offset++] = (len >> 8) & 0xff;
+        data[offset++] = len & 0xff;
+    }
 
     memcpy(data + offset, ndef_msg, len);
     offset += len;
 
-    data[offset++] = NDEF_TERMINATOR_TLV;
-    memset(data + offset, 0, sizeof(tag->t.t2.format.data) - offset);
+    if (offset < size) {
+        data[offset++] = NDEF_TERMINATOR_TLV;
+    }
+    memset(data + offset, 0, size - offset);
+
+    return nfc_tag_write(tag, offsetof(struct nfc_t2t_format, data),
+                         size, data);
 }
 
 static void
-set_t3t_data(struct nfc_tag* tag, const uint8_t* ndef_msg, ssize_t len)
+update_t3t_checksum(struct nfc_t3t_attr* hdr)
 {
+    const uint8_t* blk;
     uint16_t cs = 0;
     uint8_t i;
 
+    blk = (const uint8_t*)hdr;
+
+    for (i = 0; i < offsetof(struct nfc_t3t_attr, cs); i++) {
+        cs += blk[i];
+    }
+
+    hdr->cs[0] = (cs >> 8) & 0xff;
+    hdr->cs[1] = cs & 0xff;
+}
+
+static int
+set_t3t_data(struct nfc_tag* tag, const uint8_t* ndef_msg, ssize_t len)
+{
+    struct nfc_t3t_attr hdr;
+
     assert(tag);
     assert(ndef_msg || !len);
-    assert(len < sizeof(tag->t.t3.format.data));
-
-    /* Re-calculate LN & Checksum */
-    tag->t.t3.format.ln[0] = (len >> 16) & 0xff;
-    tag->t.t3.format.ln[1] = (len >> 8) & 0xff;
-    tag->t.t3.format.ln[2] = len & 0xff;
 
-    for (i = 0; i < tag->t.t3.format.cs - &tag->t.t3.format.ver; i++) {
-        cs += tag->t.t3.raw.mem[i];
+    if (len > nfc_tag_len(tag) - offsetof(struct nfc_t3t_format, data)) {
+        return -1;
     }
 
-    tag->t.t3.format.cs[0] = (cs >> 8) & 0xff;
-    tag->t.t3.format.cs[1] = cs & 0xff;
+    /* the attribute information block comes first */
+    nfc_tag_read(tag, 0, sizeof(hdr), &hdr);
+
+    /* Re-calculate LN & Checksum */
+    hdr.ln[0] = (len >> 16) & 0xff;
+    hdr.ln[1] = (len >> 8) & 0xff;
+    hdr.ln[2] = len & 0xff;
+
+    update_t3t_checksum(&hdr);
 
     /* Copy NDEF data, start from BLOCK one */
-    memcpy(tag->t.t3.format.data , ndef_msg, len);
+    if (nfc_tag_write(tag, 0, sizeof(hdr), &hdr) < 0) {
+        return -1;
+    }
+    return nfc_tag_write(tag, offsetof(struct nfc_t3t_format, data),
+                         len, ndef_msg);
 }
 
+/* [T4TOP] Table 5; Maximum NDEF file size in the NDEF File Control TLV */
 static void
+set_t4t_cc_file_size(uint8_t* cc, size_t size)
+{
+    cc[11] = (size >> 8) & 0xff;
+    cc[12] = size & 0xff;
+}
+
+static int
 set_t4t_data(struct nfc_tag* tag, const uint8_t* ndef_msg, ssize_t len)
 {
+    uint8_t cc[] = T4T_NDEF_CC;
+    uint8_t nlen[2];
+    size_t size;
+
     assert(tag);
     assert(ndef_msg || !len);
-    assert(len + 2 < sizeof(tag->t.t4.format.data));
 
-    uint8_t cc[] = T4T_NDEF_CC;
-    memcpy(tag->t.t4.format.cc, cc, sizeof(cc));
+    size = nfc_tag_len(tag) - offsetof(struct nfc_t4t_format, data);
+    if (len + 2 > size) {
+        return -1;
+    }
+    set_t4t_cc_file_size(cc, size);
 
-    tag->t.t4.format.data[0] = (len >> 8) & 0xff;
-    tag->t.t4.format.data[1] = len & 0xff;
+    nlen[0] = (len >> 8) & 0xff;
+    nlen[1] = len & 0xff;
 
-    memcpy(tag->t.t4.format.data + 2 , ndef_msg, len);
+    if ((nfc_tag_write(tag, offsetof(struct nfc_t4t_format, cc),
+                       sizeof(cc), cc) < 0) ||
+        (nfc_tag_write(tag, offsetof(struct nfc_t4t_format, data),
+                       sizeof(nlen), nlen) < 0)) {
+        return -1;
+    }
+    return nfc_tag_write(tag, offsetof(struct nfc_t4t_format, data) + 2,
+                         len, ndef_msg);
 }
 
 int
@@ -178,52 +635,315 @@ nfc_tag_set_data(struct nfc_tag* tag, const uint8_t* ndef_msg, ssize_t len)
 {
     switch (tag->type) {
         case T1T:
-            set_t1t_data(tag, ndef_msg, len);
-            break;
+            return set_t1t_data(tag, ndef_msg, len);
         case T2T:
-            set_t2t_data(tag, ndef_msg, len);
-            break;
+            return set_t2t_data(tag, ndef_msg, len);
         case T3T:
-            set_t3t_data(tag, ndef_msg, len);
-            break;
+            return set_t3t_data(tag, ndef_msg, len);
         case T4T:
-            set_t4t_data(tag, ndef_msg, len);
-            break;
+            return set_t4t_data(tag, ndef_msg, len);
         default:
             assert(0);
             return -1;
     }
+}
+
+/*
+ * Memory layouts
+ */
+
+/* [Type 2 Tag Operation Specification] 2.3.1/2.3.2; control TLVs
+ * address memory as NbrMajorOffsets * 2^MOS + NbrMinorOffsets. */
+static int
+t2t_tlv_position(size_t addr, uint8_t* pos, uint8_t* mos)
+{
+    size_t m, minor;
+
+    for (m = 2; (addr >> m) > 0x0f; ++m) { }
+
+    minor = addr & ((1ul << m) - 1);
+    if ((m > 0x0f) || (minor > 0x0f)) {
+        return -1;
+    }
+    *pos = ((addr >> m) << 4) | minor;
+    *mos = m;
 
     return 0;
 }
 
-int
-nfc_tag_format(struct nfc_tag* tag)
+/* Returns the size of an NDEF TLV for a 'len'-byte message and
+ * of the Terminator TLV behind it. */
+static size_t
+t2t_ndef_tlv_size(size_t len)
 {
-    switch (tag->type) {
+    return (len < 0xff ? 2 : 4) + len + 1;
+}
+
+static struct nfcemu_tag_image*
+create_t2t_image(size_t capacity)
+{
+    static const size_t data_off = offsetof(struct nfc_t2t_format, data);
+    struct nfcemu_tag_image* img;
+    uint8_t rsvd_pos, rsvd_mos, lock_pos, lock_mos;
+    size_t size, nbits, len;
+    uint8_t* mem;
+    uint8_t* p;
+
+    if (capacity > T2T_MAX_DATA_AREA_SIZE) {
+        return NULL;
+    }
+
+    /* grow the data area until the TLVs can address the reserved
+     * memory and the lock bytes behind it */
+    size = (T2T_CONTROL_TLVS_SIZE + t2t_ndef_tlv_size(capacity) + 7) & ~7ul;
+    while ((t2t_tlv_position(data_off + size, &rsvd_pos, &rsvd_mos) < 0) ||
+           (t2t_tlv_position(data_off + size + T2T_RESERVED_SIZE,
+                             &lock_pos, &lock_mos) < 0)) {
+        size += 8;
+    }
+    if (size > T2T_MAX_DATA_AREA_SIZE) {
+        return NULL;
+    }
+
+    /* the static lock bytes cover the first 48 bytes of the data area */
+    nbits = (size - sizeof(((struct nfc_t2t_format*)0)->data) + 7) / 8;
+    len = data_off + size + T2T_RESERVED_SIZE + (nbits + 7) / 8;
+    len = (len + T2T_BLOCK_SIZE - 1) & ~(size_t)(T2T_BLOCK_SIZE - 1);
+
+    img = alloc_image(len, &mem);
+    if (!img) {
+        return NULL;
+    }
+    memset(mem, 0, len);
+    memcpy(mem, nfc_tag_templates + T2T, data_off);
+    mem[offsetof(struct nfc_t2t_format, cc) + 2] = size / 8;
+
+    p = mem + data_off;
+
+    *p++ = T2T_LOCK_CONTROL_TLV;
+    *p++ = 3;
+    *p++ = lock_pos;
+    *p++ = nbits;
+    *p++ = (T2T_BLPLB << 4) | lock_mos;
+
+    *p++ = T2T_MEMORY_CONTROL_TLV;
+    *p++ = 3;
+    *p++ = rsvd_pos;
+    *p++ = T2T_RESERVED_SIZE;
+    *p++ = rsvd_mos;
+
+    return img;
+}
+
+static struct nfcemu_tag_image*
+create_t3t_image(size_t capacity)
+{
+    struct nfcemu_tag_image* img;
+    struct nfc_t3t_attr* hdr;
+    size_t nblocks, len;
+    uint8_t* mem;
+
+    /* NDEF data blocks follow the attribute information block */
+    nblocks = (capacity + T3T_BLOCK_SIZE - 1) / T3T_BLOCK_SIZE;
+    if (nblocks >= T3T_MAX_BLOCK_NUM) {
+        return NULL;
+    }
+    len = (nblocks + 1) * T3T_BLOCK_SIZE;
+
+    img = alloc_image(len, &mem);
+    if (!img) {
+        return NULL;
+    }
+    memset(mem, 0, len);
+    memcpy(mem, nfc_tag_templates + T3T, T3T_BLOCK_SIZE);
+
+    hdr = (struct nfc_t3t_attr*)mem;
+    hdr->nmaxb[0] = (nblocks >> 8) & 0xff;
+    hdr->nmaxb[1] = nblocks & 0xff;
+    update_t3t_checksum(hdr);
+
+    return img;
+}
+
+static struct nfcemu_tag_image*
+create_t4t_image(size_t capacity)
+{
+    static const size_t data_off = offsetof(struct nfc_t4t_format, data);
+    struct nfcemu_tag_image* img;
+    size_t size;
+    uint8_t* mem;
+
+    /* the NDEF file starts with the 2-byte NLEN */
+    if (capacity > T4T_MAX_NDEF_FILE_SIZE - 2) {
+        return NULL;
+    }
+    size = 2 + capacity;
+
+    img = alloc_image(data_off + size, &mem);
+    if (!img) {
+        return NULL;
+    }
+    memset(mem, 0, data_off + size);
+    memcpy(mem, nfc_tag_templates + T4T, data_off);
+    set_t4t_cc_file_size(mem + offsetof(struct nfc_t4t_format, cc), size);
+
+    return img;
+}
+
+static struct nfcemu_tag_image*
+create_image(enum nfc_tag_type type, size_t capacity)
+{
+    assert(type < ARRAY_SIZE(nfc_tag_template_images));
+
+    if (!capacity) {
+        return nfc_tag_image_ref(nfc_tag_template_images + type);
+    }
+
+    switch (type) {
         case T1T:
-            FORMAT_NFC_T1T(tag, T1T_UID, T1T_RES)
-            break;
+            /* dynamic memory requires RSEG and READ8 */
+            return NULL;
         case T2T:
-            FORMAT_NFC_T2T(tag, T2T_INTERNAL, T2T_LOCK, T2T_CC)
-            break;
+            if (t2t_ndef_tlv_size(capacity) <=
+                sizeof(((struct nfc_t2t_format*)0)->data)) {
+                return nfc_tag_image_ref(nfc_tag_template_images + type);
+            }
+            return create_t2t_image(capacity);
         case T3T:
-            FORMAT_NFC_T3T(tag, T3T_V, T3T_R, T3T_W, T3T_NB, T3T_U, T3T_WF, T3T_RW, T3T_LN, T3T_CS)
-            break;
+            return create_t3t_image(capacity);
         case T4T:
-            FORMAT_NFC_T4T(tag, T4T_PROPRIETARY_CC)
-            break;
+            return create_t4t_image(capacity);
         default:
             assert(0);
+            return NULL;
+    }
+}
+
+int
+nfc_tag_format_capacity(struct nfc_tag* tag, size_t capacity)
+{
+    struct nfcemu_tag_image* img;
+    int res;
+
+    assert(tag);
+
+    img = create_image(tag->type, capacity);
+    if (!img) {
+        return -1;
+    }
+    res = nfc_tag_set_image(tag, img);
+    nfc_tag_image_unref(img);
+    if (res < 0) {
+        return -1;
+    }
+    tag->capacity = capacity;
+
+    return 0;
+}
+
+int
+nfc_tag_format(struct nfc_tag* tag)
+{
+    assert(tag);
+
+    /* formatting the default layout shares the template again */
+    return nfc_tag_format_capacity(tag, tag->capacity);
+}
+
+int
+nfc_tag_set_t3t_nb(struct nfc_tag* tag, unsigned long nbr, unsigned long nbw)
+{
+    struct nfc_t3t_attr hdr;
+
+    assert(tag);
+
+    if ((tag->type != T3T) || !nbr || (nbr > T3T_MAX_NBR) ||
+        !nbw || (nbw > T3T_MAX_NBW)) {
+        return -1;
+    }
+
+    nfc_tag_read(tag, 0, sizeof(hdr), &hdr);
+
+    hdr.nbr = nbr;
+    hdr.nbw = nbw;
+    update_t3t_checksum(&hdr);
+
+    return nfc_tag_write(tag, 0, sizeof(hdr), &hdr);
+}
+
+void
+nfc_tag_snapshot(const struct nfc_tag* tag, struct nfc_snapshot* snap)
+{
+    size_t off;
+
+    assert(tag);
+
+    nfc_snapshot_put_u8(snap, tag->type);
+    nfc_snapshot_put_u8(snap, tag->t4t_file_sel);
+    nfc_snapshot_put_u8(snap, tag->t2t_sector);
+    nfc_snapshot_put_u8(snap, tag->t2t_sector_sel);
+    nfc_snapshot_put_u32(snap, tag->capacity);
+    nfc_snapshot_put_u32(snap, tag->img->len);
+    for (off = 0; off < tag->img->len; off += NFC_TAG_PAGE_SIZE) {
+        size_t len = tag->img->len - off;
+        if (len > NFC_TAG_PAGE_SIZE) {
+            len = NFC_TAG_PAGE_SIZE;
+        }
+        nfc_snapshot_put_mem(snap, len, page_mem(tag, off / NFC_TAG_PAGE_SIZE));
+    }
+}
+
+int
+nfc_tag_restore(struct nfc_tag* tag, struct nfc_snapshot* snap)
+{
+    enum nfc_tag_type type;
+    enum t4t_file_select sel;
+    uint8_t sector, sector_sel;
+    const void* mem;
+    size_t capacity, len;
+
+    assert(tag);
+
+    type = nfc_snapshot_get_u8(snap);
+    sel = nfc_snapshot_get_u8(snap);
+    sector = nfc_snapshot_get_u8(snap);
+    sector_sel = nfc_snapshot_get_u8(snap);
+    capacity = nfc_snapshot_get_u32(snap);
+    len = nfc_snapshot_get_u32(snap);
+    mem = nfc_snapshot_get_ptr(snap, len);
+    if (!mem || (type > T4T) || (sel > NDEF_SELECT) || (sector_sel > 1) ||
+        !valid_len(type, len)) {
+        return -1;
+    }
+    tag->type = type;
+
+    if ((tag->img->len == len) && !memcmp(tag->img->mem, mem, len)) {
+        /* unmodified memory keeps sharing the image */
+        free_pages(tag);
+    } else {
+        struct nfcemu_tag_image* img = nfc_tag_image_create(mem, len);
+        int res;
+
+        if (!img) {
             return -1;
+        }
+        res = nfc_tag_set_image(tag, img);
+        nfc_tag_image_unref(img);
+        if (res < 0) {
+            return -1;
+        }
     }
+    tag->t4t_file_sel = sel;
+    tag->t2t_sector = sector;
+    tag->t2t_sector_sel = sector_sel;
+    tag->capacity = capacity;
 
     return 0;
 }
 
 static size_t
 process_t1t_rid(struct nfc_tag* tag, const struct t1t_rid_command* cmd,
-                uint8_t* consumed, struct t1t_rid_response* rsp)
+                size_t* consumed, struct t1t_rid_response* rsp)
 {
     assert(tag);
     assert(cmd);
@@ -233,7 +953,8 @@ process_t1t_rid(struct nfc_tag* tag, const struct t1t_rid_command* cmd,
     rsp->hr[0] = T1T_HRO;
     rsp->hr[1] = T1T_HR1;
 
-    memcpy(rsp->uid, tag->t.t1.format.uid, sizeof(rsp->uid));
+    nfc_tag_read(tag, offsetof(struct nfc_t1t_format, uid),
+                 sizeof(rsp->uid), rsp->uid);
 
     rsp->status = 0;
 
@@ -243,14 +964,14 @@ process_t1t_rid(struct nfc_tag* tag, const struct t1t_rid_command* cmd,
 }
 
 static size_t
-process_t1t_rall(const struct t1t_rall_command* cmd, uint8_t* consumed,
-                 uint8_t* mem, struct t1t_rall_response* rsp)
+process_t1t_rall(const struct t1t_rall_command* cmd, size_t* consumed,
+                 const struct nfc_tag* tag, struct t1t_rall_response* rsp)
 {
-    size_t i;
     size_t offset;
 
     assert(cmd);
     assert(consumed);
+    assert(tag);
     assert(rsp);
 
     offset = 0;
@@ -258,9 +979,7 @@ process_t1t_rall(const struct t1t_rall_command* cmd, uint8_t* consumed,
     rsp->payload[offset++] = T1T_HRO;
     rsp->payload[offset++] = T1T_HR1;
 
-    for (i = 0; i < T1T_STATIC_MEMORY_SIZE ; i++) {
-        rsp->payload[offset++] = mem[i];
-    }
+    nfc_tag_read(tag, 0, T1T_STATIC_MEMORY_SIZE, rsp->payload + offset);
 
     rsp->status = 0;
 
@@ -271,7 +990,7 @@ process_t1t_rall(const struct t1t_rall_command* cmd, uint8_t* consumed,
 
 size_t
 process_t1t(struct nfc_re* re, const union command_packet* cmd,
-            size_t len, uint8_t* consumed, union response_packet* rsp)
+            size_t len, size_t* consumed, union response_packet* rsp)
 {
     assert(cmd);
     assert(rsp);
@@ -281,7 +1000,7 @@ process_t1t(struct nfc_re* re, const union command_packet* cmd,
             assert(re);
             assert(re->tag);
             len = process_t1t_rall(&cmd->rall_cmd, consumed,
-                                   re->tag->t.t1.raw.mem, &rsp->rall_rsp);
+                                   re->tag, &rsp->rall_rsp);
             break;
         case RID_COMMAND:
             assert(re);
@@ -296,24 +1015,25 @@ process_t1t(struct nfc_re* re, const union command_packet* cmd,
 }
 
 static size_t
-process_t2t_read(const struct t2t_read_command* cmd, uint8_t* consumed,
-                 uint8_t* mem, struct t2t_read_response* rsp)
+process_t2t_read(const struct t2t_read_command* cmd, size_t* consumed,
+                 const struct nfc_tag* tag, struct t2t_read_response* rsp)
 {
-    size_t i;
-    size_t offset;
-    size_t max_read;
+    size_t off, len;
 
     assert(cmd);
     assert(consumed);
-    assert(mem);
+    assert(tag);
     assert(rsp);
 
-    offset = cmd->bno * 4;
-    max_read = sizeof(rsp->payload);
-
-    for (i = 0; i < max_read && offset < T2T_STATIC_MEMORY_SIZE; i++, offset++) {
-        rsp->payload[i] = mem[offset];
+    /* reads stay within the selected sector */
+    off = cmd->bno * T2T_BLOCK_SIZE;
+    len = T2T_SECTOR_SIZE - off;
+    if (len > sizeof(rsp->payload)) {
+        len = sizeof(rsp->payload);
     }
+    len = nfc_tag_read(tag, tag->t2t_sector * T2T_SECTOR_SIZE + off,
+                       len, rsp->payload);
+    memset(rsp->payload + len, 0, sizeof(rsp->payload) - len);
     rsp->status = 0;
 
     *consumed = sizeof(struct t2t_read_command);
@@ -321,20 +1041,157 @@ process_t2t_read(const struct t2t_read_command* cmd, uint8_t* consumed,
     return sizeof(struct t2t_read_response);
 }
 
+/* reads 'len' bytes at 'off' of the current sector, followed by the
+ * status byte, or answers with a NACK if the range is not readable */
+static size_t
+read_t2t_range(const struct nfc_tag* tag, size_t off, size_t len,
+               size_t maxrsp, struct t2t_range_read_response* rsp)
+{
+    size_t base;
+
+    base = tag->t2t_sector * T2T_SECTOR_SIZE;
+
+    if ((off + len > T2T_SECTOR_SIZE) ||
+        (base + off + len > nfc_tag_len(tag)) ||
+        (len + 1 > maxrsp)) {
+        rsp->payload[0] = T2T_NACK;
+        rsp->payload[1] = 0;
+        return sizeof(struct t2t_ack_response);
+    }
+    nfc_tag_read(tag, base + off, len, rsp->payload);
+    rsp->payload[len] = 0;
+
+    return len + 1;
+}
+
+static size_t
+process_t2t_fast_read(const struct t2t_fast_read_command* cmd,
+                      size_t* consumed, const struct nfc_tag* tag,
+                      size_t maxrsp, struct t2t_range_read_response* rsp)
+{
+    assert(cmd);
+    assert(consumed);
+    assert(tag);
+    assert(rsp);
+
+    *consumed = sizeof(struct t2t_fast_read_command);
+
+    if (cmd->start > cmd->end) {
+        rsp->payload[0] = T2T_NACK;
+        rsp->payload[1] = 0;
+        return sizeof(struct t2t_ack_response);
+    }
+    return read_t2t_range(tag, cmd->start * T2T_BLOCK_SIZE,
+                          (cmd->end - cmd->start + 1) * T2T_BLOCK_SIZE,
+                          maxrsp, rsp);
+}
+
+static size_t
+process_t2t_read_segment(const struct t2t_read_segment_command* cmd,
+                         size_t* consumed, const struct nfc_tag* tag,
+                         size_t maxrsp, struct t2t_range_read_response* rsp)
+{
+    assert(cmd);
+    assert(consumed);
+    assert(tag);
+    assert(rsp);
+
+    *consumed = sizeof(struct t2t_read_segment_command);
+
+    return read_t2t_range(tag, (cmd->adds >> 4) * T2T_SEGMENT_SIZE,
+                          T2T_SEGMENT_SIZE, maxrsp, rsp);
+}
+
+/* [Digital], Sec 5.6.4; packet 1 */
+static size_t
+process_t2t_sector_select(const struct t2t_sector_select_command* cmd,
+                          size_t* consumed, struct nfc_tag* tag,
+                          struct t2t_ack_response* rsp)
+{
+    assert(cmd);
+    assert(consumed);
+    assert(tag);
+    assert(rsp);
+
+    tag->t2t_sector_sel = cmd->param == 0xff;
+
+    rsp->ack = tag->t2t_sector_sel ? T2T_ACK : T2T_NACK;
+    rsp->status = 0;
+
+    *consumed = sizeof(struct t2t_sector_select_command);
+
+    return sizeof(struct t2t_ack_response);
+}
+
+/* [Digital], Sec 5.6.4; packet 2 */
+static size_t
+process_t2t_sector_select_param(const struct t2t_sector_select_param* cmd,
+                                size_t* consumed, struct nfc_tag* tag,
+                                struct t2t_ack_response* rsp)
+{
+    assert(cmd);
+    assert(consumed);
+    assert(tag);
+    assert(rsp);
+
+    tag->t2t_sector_sel = 0;
+
+    *consumed = sizeof(struct t2t_sector_select_param);
+
+    if (cmd->secno * T2T_SECTOR_SIZE >= nfc_tag_len(tag)) {
+        rsp->ack = T2T_NACK;
+        rsp->status = 0;
+        return sizeof(struct t2t_ack_response);
+    }
+    tag->t2t_sector = cmd->secno;
+
+    /* passive ACK; the tag does not answer */
+    return 0;
+}
+
 size_t
 process_t2t(struct nfc_re* re, const union command_packet* cmd,
-            size_t len, uint8_t* consumed, union response_packet* rsp)
+            size_t len, size_t* consumed, union response_packet* rsp,
+            size_t maxrsp)
 {
     assert(cmd);
     assert(rsp);
 
+    if (re && re->tag && re->tag->t2t_sector_sel) {
+        return process_t2t_sector_select_param(&cmd->sector_select_param,
+                                               consumed, re->tag,
+                                               &rsp->ack_rsp);
+    }
+
     switch (cmd->t2t.cmd) {
         case READ_COMMAND:
             assert(re);
             assert(re->tag);
 
             len = process_t2t_read(&cmd->read_cmd, consumed,
-                                   re->tag->t.t2.raw.mem, &rsp->read_rsp);
+                                   re->tag, &rsp->read_rsp);
+            break;
+        case FAST_READ_COMMAND:
+            assert(re);
+            assert(re->tag);
+
+            len = process_t2t_fast_read(&cmd->fast_read_cmd, consumed,
+                                        re->tag, maxrsp, &rsp->range_read_rsp);
+            break;
+        case READ_SEGMENT_COMMAND:
+            assert(re);
+            assert(re->tag);
+
+            len = process_t2t_read_segment(&cmd->read_segment_cmd, consumed,
+                                           re->tag, maxrsp,
+                                           &rsp->range_read_rsp);
+            break;
+        case SECTOR_SELECT_COMMAND:
+            assert(re);
+            assert(re->tag);
+
+            len = process_t2t_sector_select(&cmd->sector_select_cmd, consumed,
+                                            re->tag, &rsp->ack_rsp);
             break;
         default:
             assert(0);
@@ -344,67 +1201,265 @@ process_t2t(struct nfc_re* re, const union command_packet* cmd,
     return len;
 }
 
+enum {
+    T3T_ATTR_NBR = offsetof(struct nfc_t3t_attr, nbr),
+    T3T_ATTR_NBW = offsetof(struct nfc_t3t_attr, nbw)
+};
+
+/* the limits of a T3T are the ones it announces in its attribute
+ * information block */
 static size_t
-process_t3t_check(const struct t3t_check_command* cmd, uint8_t* consumed,
-                  uint8_t* mem, struct t3t_check_response* rsp) {
-    struct t3t_check_command_tail* tail;
-    uint8_t bidx, i, j;
-    uint32_t bn;
+get_t3t_nb(const struct nfc_tag* tag, size_t off, size_t max)
+{
+    uint8_t nb = 0;
 
-    tail = (struct t3t_check_command_tail*)
-        (cmd->scl + cmd->nsv);
+    nfc_tag_read(tag, off, sizeof(nb), &nb);
 
-    /* [Digital] 5.4 Check Command */
-    for (bidx = 0, i = 0, j = 0; bidx < tail->nbl; bidx++) {
-        if (tail->bl[i] & T3T_BLOCK_LEN_BIT) {
-          /* 2 byte block */
-          bn = tail->bl[i+1];
-          i += 2;
+    if (!nb) {
+        return 1;
+    }
+    return nb < max ? nb : max;
+}
+
+/* blocks of a CHECK or UPDATE command */
+struct t3t_block_list {
+    size_t nbl;
+    uint16_t bn[T3T_MAX_NBR];
+    const uint8_t* data; /* block data of UPDATE */
+};
+
+/* Decodes the service code list and the block list of a CHECK or
+ * UPDATE command from the 'len' bytes at 'cmd'. Returns Status
+ * Flag 2 and stores Status Flag 1 in 'status1'. [Digital] 6.6 */
+static uint8_t
+decode_t3t_block_list(const struct nfc_tag* tag, const uint8_t* cmd,
+                      size_t len, size_t maxnbl, int update,
+                      struct t3t_block_list* bl, size_t* consumed,
+                      uint8_t* status1)
+{
+    size_t off, nsv, i;
+    const uint8_t* scl;
+
+    *status1 = T3T_STATUS1_ERROR;
+
+    off = offsetof(struct t3t_check_command, nsv);
+
+    /* service code list */
+    if (off >= len) {
+        return T3T_STATUS2_ILLEGAL_NUMBER_OF_SERVICES;
+    }
+    nsv = cmd[off++];
+    if (!nsv || (nsv > T3T_MAX_SERVICES) || (off + 2 * nsv > len)) {
+        return T3T_STATUS2_ILLEGAL_NUMBER_OF_SERVICES;
+    }
+    scl = cmd + off;
+    off += 2 * nsv;
+
+    for (i = 0; i < nsv; ++i) {
+        /* little endian */
+        uint16_t sc = scl[2 * i] | scl[2 * i + 1] << 8;
+        if ((sc != T3T_NDEF_SERVICE_RW) &&
+            (update || (sc != T3T_NDEF_SERVICE_RO))) {
+            return T3T_STATUS2_ILLEGAL_SERVICE_CODE;
+        }
+    }
+
+    /* block list */
+    if (off >= len) {
+        return T3T_STATUS2_ILLEGAL_NUMBER_OF_BLOCKS;
+    }
+    bl->nbl = cmd[off++];
+    if (!bl->nbl || (bl->nbl > maxnbl)) {
+        return T3T_STATUS2_ILLEGAL_NUMBER_OF_BLOCKS;
+    }
+
+    for (i = 0; i < bl->nbl; ++i) {
+        uint8_t flags;
+
+        if (off >= len) {
+            return T3T_STATUS2_ILLEGAL_NUMBER_OF_BLOCKS;
+        }
+        flags = cmd[off];
+
+        if (flags & T3T_BLOCK_LEN_BIT) {
+            /* 2 byte block */
+            if (off + 2 > len) {
+                return T3T_STATUS2_ILLEGAL_NUMBER_OF_BLOCKS;
+            }
+            bl->bn[i] = cmd[off + 1];
+            off += 2;
         } else {
-          /* 3 byte block */
-          bn = tail->bl[i+1] << 8 | tail->bl[i+2];
-          i += 3;
+            /* 3 byte block; [FeliCa] block numbers are little endian */
+            if (off + 3 > len) {
+                return T3T_STATUS2_ILLEGAL_NUMBER_OF_BLOCKS;
+            }
+            bl->bn[i] = cmd[off + 2] << 8 | cmd[off + 1];
+            off += 3;
         }
 
-        memcpy(rsp->data + j, mem + bn*T3T_BLOCK_SIZE, T3T_BLOCK_SIZE);
-        j += T3T_BLOCK_SIZE;
+        if (flags & T3T_BLOCK_ACCESS_MODE_MASK) {
+            *status1 = i + 1;
+            return T3T_STATUS2_ILLEGAL_ACCESS_MODE;
+        }
+        if ((flags & T3T_BLOCK_SERVICE_MASK) >= nsv) {
+            *status1 = i + 1;
+            return T3T_STATUS2_ILLEGAL_SERVICE_ORDER;
+        }
+        if ((bl->bn[i] + 1) * T3T_BLOCK_SIZE > nfc_tag_len(tag)) {
+            *status1 = i + 1;
+            return T3T_STATUS2_ILLEGAL_BLOCK_NUMBER;
+        }
     }
 
-    memcpy(rsp->id, cmd->id, sizeof(cmd->id));
-    rsp->status1 = 0x00;
-    rsp->status2 = 0x00;
-    rsp->nbl = tail->nbl;
+    /* block data */
+    bl->data = NULL;
+    if (update) {
+        if (off + bl->nbl * T3T_BLOCK_SIZE > len) {
+            return T3T_STATUS2_ILLEGAL_NUMBER_OF_BLOCKS;
+        }
+        bl->data = cmd + off;
+        off += bl->nbl * T3T_BLOCK_SIZE;
+    }
+
+    *consumed = off;
+    *status1 = 0;
+
+    return T3T_STATUS2_SUCCESS;
+}
+
+static size_t
+create_t3t_status_rsp(const struct t3t_check_command* cmd, uint8_t code,
+                      uint8_t status1, uint8_t status2,
+                      struct t3t_status_response* rsp)
+{
+    rsp->len = sizeof(*rsp);
+    rsp->code = code;
+    memcpy(rsp->id, cmd->id, sizeof(rsp->id));
+    rsp->status1 = status1;
+    rsp->status2 = status2;
+    rsp->status = 0;
+
+    return sizeof(*rsp);
+}
+
+static size_t
+process_t3t_check(const struct t3t_check_command* cmd, size_t len,
+                  size_t* consumed, const struct nfc_tag* tag,
+                  union response_packet* rsp)
+{
+    struct t3t_block_list bl;
+    uint8_t status1, status2;
+    size_t i, off;
+
+    assert(cmd);
+    assert(consumed);
+    assert(tag);
+    assert(rsp);
+
+    /* [Digital] 5.4 Check Command */
+    status2 = decode_t3t_block_list(tag, (const uint8_t*)cmd, len,
+                                    get_t3t_nb(tag, T3T_ATTR_NBR, T3T_MAX_NBR),
+                                    0, &bl, &off, &status1);
+    if (status2 != T3T_STATUS2_SUCCESS) {
+        *consumed = len;
+        return create_t3t_status_rsp(cmd, CHECK_RESPONSE, status1, status2,
+                                     &rsp->t3t_status_rsp);
+    }
+
+    for (i = 0; i < bl.nbl; ++i) {
+        nfc_tag_read(tag, bl.bn[i] * T3T_BLOCK_SIZE, T3T_BLOCK_SIZE,
+                     rsp->check_rsp.data + i * T3T_BLOCK_SIZE);
+    }
+
+    memcpy(rsp->check_rsp.id, cmd->id, sizeof(cmd->id));
+    rsp->check_rsp.status1 = 0x00;
+    rsp->check_rsp.status2 = 0x00;
+    rsp->check_rsp.nbl = bl.nbl;
 
     /* This is status bit */
-    rsp->data[T3T_BLOCK_SIZE * rsp->nbl] = 0x00;
+    rsp->check_rsp.data[T3T_BLOCK_SIZE * bl.nbl] = 0x00;
+
+    rsp->check_rsp.len = sizeof(struct t3t_check_response) +
+                         T3T_BLOCK_SIZE * bl.nbl +
+                         1;
+    rsp->check_rsp.code = CHECK_RESPONSE;
+
+    *consumed = off;
+
+    return rsp->check_rsp.len;
+}
+
+static size_t
+process_t3t_update(const struct t3t_check_command* cmd, size_t len,
+                   size_t* consumed, struct nfc_tag* tag,
+                   struct t3t_status_response* rsp)
+{
+    struct t3t_block_list bl;
+    uint8_t status1, status2;
+    size_t i, off;
+
+    assert(cmd);
+    assert(consumed);
+    assert(tag);
+    assert(rsp);
+
+    /* [Digital] 5.5 Update Command; same layout as Check, followed
+     * by the block data */
+    status2 = decode_t3t_block_list(tag, (const uint8_t*)cmd, len,
+                                    get_t3t_nb(tag, T3T_ATTR_NBW, T3T_MAX_NBW),
+                                    1, &bl, &off, &status1);
+    if (status2 != T3T_STATUS2_SUCCESS) {
+        *consumed = len;
+        return create_t3t_status_rsp(cmd, UPDATE_RESPONSE, status1, status2,
+                                     rsp);
+    }
 
-    rsp->len = sizeof(struct t3t_check_response) +
-               T3T_BLOCK_SIZE * rsp->nbl +
-               1;
-    rsp->code = CHECK_RESPONSE;
+    for (i = 0; i < bl.nbl; ++i) {
+        if (nfc_tag_write(tag, bl.bn[i] * T3T_BLOCK_SIZE, T3T_BLOCK_SIZE,
+                          bl.data + i * T3T_BLOCK_SIZE) < 0) {
+            status1 = i + 1;
+            status2 = T3T_STATUS2_MEMORY_ERROR;
+            break;
+        }
+    }
 
-    *consumed = sizeof(struct t3t_check_command) + 2*cmd->nsv +
-                sizeof(struct t3t_check_command_tail) + i;
+    *consumed = off;
 
-    return rsp->len;
+    return create_t3t_status_rsp(cmd, UPDATE_RESPONSE, status1, status2, rsp);
 }
 
 size_t
 process_t3t(struct nfc_re* re, const union command_packet* cmd,
-            size_t len, uint8_t* consumed, union response_packet* rsp)
+            size_t len, size_t* consumed, union response_packet* rsp)
 {
+    assert(re);
+    assert(re->tag);
     assert(cmd);
     assert(rsp);
 
+    /* the frame's length byte counts itself */
+    if (len && (cmd->t3t.len < len)) {
+        len = cmd->t3t.len;
+    }
+    if (len < sizeof(struct t3t_check_command)) {
+        /* too short for CHECK and UPDATE; there's no IDm to answer to */
+        *consumed = len;
+        return 0;
+    }
+
     switch (cmd->t3t.cmd) {
         case CHECK_COMMAND:
-            len = process_t3t_check(&cmd->check_cmd, consumed,
-                                    re->tag->t.t3.raw.mem, &rsp->check_rsp);
+            len = process_t3t_check(&cmd->check_cmd, len, consumed,
+                                    re->tag, rsp);
             break;
         case UPDATE_COMMAND:
+            len = process_t3t_update(&cmd->check_cmd, len, consumed,
+                                     re->tag, &rsp->t3t_status_rsp);
             break;
         default:
-            assert(0);
+            /* other commands are not supported; cards don't answer */
+            *consumed = len;
+            len = 0;
             break;
     }
 
@@ -412,7 +1467,7 @@ process_t3t(struct nfc_re* re, const union command_packet* cmd,
 }
 
 static size_t
-process_t4t_app_select(const struct t4t_app_sel_command* cmd, uint8_t* consumed,
+process_t4t_app_select(const struct t4t_app_sel_command* cmd, size_t* consumed,
                        struct t4t_app_sel_response* rsp)
 {
     assert(consumed);
@@ -427,13 +1482,15 @@ process_t4t_app_select(const struct t4t_app_sel_command* cmd, uint8_t* consumed,
 }
 
 static size_t
-process_t4t_cc_select(const struct t4t_cc_sel_command* cmd, uint8_t* consumed,
+process_t4t_cc_select(struct nfc_tag* tag,
+                      const struct t4t_cc_sel_command* cmd, size_t* consumed,
                       struct t4t_cc_sel_response* rsp)
 {
+    assert(tag);
     assert(consumed);
     assert(rsp);
 
-    t4t_file_sel = CC_SELECT;
+    tag->t4t_file_sel = CC_SELECT;
 
     // Assume capbility container always exists.
     rsp->sw1 = 0x90;
@@ -445,50 +1502,67 @@ process_t4t_cc_select(const struct t4t_cc_sel_command* cmd, uint8_t* consumed,
 }
 
 static size_t
-process_t4t_read_binary(const struct t4t_rb_command* cmd, uint8_t* consumed,
-                        const struct nfc_t4t_format* mem, struct t4t_rb_response* rsp)
+process_t4t_read_binary(const struct t4t_rb_command* cmd, size_t* consumed,
+                        const struct nfc_tag* tag, struct t4t_rb_response* rsp)
 {
     uint16_t offset;
+    size_t base, size, len;
 
     assert(cmd);
     assert(consumed);
-    assert(mem);
+    assert(tag);
     assert(rsp);
 
     offset = (cmd->p1 & 0xff) << 8 | (cmd->p2 & 0xff);
 
-    switch (t4t_file_sel) {
+    switch (tag->t4t_file_sel) {
         case CC_SELECT:
-            assert(cmd->le + offset <= sizeof(mem->cc));
-            memcpy(rsp->data, mem->cc + offset, cmd->le);
+            base = offsetof(struct nfc_t4t_format, cc);
+            size = sizeof(((struct nfc_t4t_format*)0)->cc);
             break;
         case NDEF_SELECT:
-            assert(cmd->le + offset <= sizeof(mem->data));
-            memcpy(rsp->data, mem->data + offset, cmd->le);
+            base = offsetof(struct nfc_t4t_format, data);
+            size = nfc_tag_len(tag) - base;
             break;
         default:
             assert(0);
+            base = size = 0;
             break;
     }
 
+    *consumed = sizeof(struct t4t_rb_command);
+
+    if (offset > size) {
+        /* [ISO7816-4]; offset outside of the file */
+        rsp->data[0] = 0x6b;
+        rsp->data[1] = 0x00;
+        return 2;
+    }
+    len = size - offset;
+    if (len > cmd->le) {
+        len = cmd->le;
+    }
+    nfc_tag_read(tag, base + offset, len, rsp->data);
+    memset(rsp->data + len, 0, cmd->le - len);
+
     *(rsp->data + cmd->le) = 0x90;
     *(rsp->data + cmd->le + 1) = 0x00;
 
-    *consumed = sizeof(struct t4t_rb_command);
-
     return cmd->le + 2;
 }
 
 static size_t
-process_t4t_ndef_select(const struct t4t_ndef_sel_command* cmd, uint8_t* consumed,
+process_t4t_ndef_select(struct nfc_tag* tag,
+                        const struct t4t_ndef_sel_command* cmd, size_t* consumed,
                         struct t4t_ndef_sel_response* rsp)
 {
+    assert(tag);
     assert(cmd);
     assert(consumed);
     assert(rsp);
 
     if (cmd->data[0] == 0xe1 && cmd->data[1] == 0x04) {
-      t4t_file_sel = NDEF_SELECT;
+      tag->t4t_file_sel = NDEF_SELECT;
 
       rsp->sw1 = 0x90;
       rsp->sw2 = 0x00;
@@ -504,7 +1578,7 @@ process_t4t_ndef_select(const struct t4t_ndef_sel_command* cmd, uint8_t* consume
 
 size_t
 process_t4t(struct nfc_re* re, const union command_packet* cmd,
-            size_t len, uint8_t* consumed, union response_packet* rsp)
+            size_t len, size_t* consumed, union response_packet* rsp)
 {
     assert(cmd);
     assert(rsp);
@@ -513,14 +1587,13 @@ process_t4t(struct nfc_re* re, const union command_packet* cmd,
         len = process_t4t_app_select(&cmd->app_sel_cmd, consumed,
                                      &rsp->app_sel_rsp);
     } else if (memcmp(&cmd->cc_sel_cmd, t4t_cc_apdu, sizeof(t4t_cc_apdu)) == 0) {
-        len = process_t4t_cc_select(&cmd->cc_sel_cmd, consumed,
+        len = process_t4t_cc_select(re->tag, &cmd->cc_sel_cmd, consumed,
                                     &rsp->cc_sel_rsp);
     } else if (memcmp(&cmd->rb_cmd, t4t_rb_apdu, sizeof(t4t_rb_apdu)) == 0) {
-        len = process_t4t_read_binary(&cmd->rb_cmd, consumed,
-                                      &re->tag->t.t4.format,
+        len = process_t4t_read_binary(&cmd->rb_cmd, consumed, re->tag,
                                       (struct t4t_rb_response*)&rsp->cc_sel_rsp);
     } else if (memcmp(t4t_ndef_apdu, t4t_ndef_apdu, sizeof(t4t_ndef_apdu)) == 0) {
-        len = process_t4t_ndef_select(&cmd->ndef_sel_cmd, consumed,
+        len = process_t4t_ndef_select(re->tag, &cmd->ndef_sel_cmd, consumed,
                                       &rsp->ndef_sel_rsp);
     } else {
         assert(0);
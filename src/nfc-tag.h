@@ -21,6 +21,10 @@ enum {
     MAXIMUM_SUPPORTED_TAG_SIZE = 1024
 };
 
+enum {
+    NUMBER_OF_NFC_TAGS = 4
+};
+
 enum nfc_tag_type {
     T1T = 0,
     T2T,
@@ -65,6 +69,14 @@ struct t1t_rid_response {
 enum t2t_command_set {
     READ_SEGMENT_COMMAND = 0x10,
     READ_COMMAND = 0x30,
+    FAST_READ_COMMAND = 0x3a,
+    SECTOR_SELECT_COMMAND = 0xc2
+};
+
+/* [Digital], Sec 5.6; 4-bit acknowledgements */
+enum t2t_ack {
+    T2T_NACK = 0x00,
+    T2T_ACK = 0x0a
 };
 
 struct t2t_common_hdr {
@@ -76,6 +88,41 @@ struct t2t_read_command {
     uint8_t bno;
 };
 
+/* [NTAG21x], Sec 10.3; reads the pages from 'start' to 'end' */
+struct t2t_fast_read_command {
+    uint8_t cmd;
+    uint8_t start;
+    uint8_t end;
+};
+
+/* modelled on the T1T's RSEG; the upper nibble of 'adds' selects
+ * a segment of the current sector */
+struct t2t_read_segment_command {
+    uint8_t cmd;
+    uint8_t adds;
+};
+
+/* the data is followed by the status byte */
+struct t2t_range_read_response {
+    uint8_t payload[0];
+} __attribute__((packed));
+
+/* [Digital], Table53; the sector number follows in a second packet */
+struct t2t_sector_select_command {
+    uint8_t cmd;
+    uint8_t param;
+};
+
+struct t2t_sector_select_param {
+    uint8_t secno;
+    uint8_t rfu[3];
+};
+
+struct t2t_ack_response {
+    uint8_t ack;
+    uint8_t status;
+};
+
 /* [Digital], Table52 */
 struct t2t_read_response {
     uint8_t payload[16];
@@ -103,7 +150,40 @@ enum t3t_response_code {
 };
 
 enum {
-    T3T_BLOCK_LEN_BIT = 0x80
+    T3T_BLOCK_LEN_BIT = 0x80,
+    T3T_BLOCK_ACCESS_MODE_MASK = 0x70,
+    T3T_BLOCK_SERVICE_MASK = 0x0f
+};
+
+/* [Type 3 Tag Operation Specification] 7.1 */
+enum t3t_ndef_service {
+    T3T_NDEF_SERVICE_RW = 0x0009,
+    T3T_NDEF_SERVICE_RO = 0x000b
+};
+
+enum {
+    T3T_MAX_SERVICES = 16,
+    /* CHECK responses and UPDATE commands have a 1-byte length */
+    T3T_MAX_NBR = 15,
+    T3T_MAX_NBW = 13
+};
+
+/* [FeliCa] Status Flag 1 is 0 on success, the position of the
+ * faulty element in the block list, or T3T_STATUS1_ERROR. Status
+ * Flag 2 tells the reason. */
+enum {
+    T3T_STATUS1_ERROR = 0xff
+};
+
+enum t3t_status2 {
+    T3T_STATUS2_SUCCESS = 0x00,
+    T3T_STATUS2_MEMORY_ERROR = 0x70,
+    T3T_STATUS2_ILLEGAL_NUMBER_OF_SERVICES = 0xa1,
+    T3T_STATUS2_ILLEGAL_NUMBER_OF_BLOCKS = 0xa2,
+    T3T_STATUS2_ILLEGAL_SERVICE_ORDER = 0xa3,
+    T3T_STATUS2_ILLEGAL_SERVICE_CODE = 0xa6,
+    T3T_STATUS2_ILLEGAL_ACCESS_MODE = 0xa7,
+    T3T_STATUS2_ILLEGAL_BLOCK_NUMBER = 0xa8
 };
 
 struct t3t_check_command {
@@ -114,11 +194,6 @@ struct t3t_check_command {
     uint16_t scl[];
 } __attribute__((packed));
 
-struct t3t_check_command_tail {
-    uint8_t nbl;
-    uint8_t bl[];
-} __attribute__((packed));
-
 struct t3t_check_response {
     uint8_t len;
     uint8_t code;
@@ -129,6 +204,17 @@ struct t3t_check_response {
     uint8_t data[];
 } __attribute__((packed));
 
+/* response to UPDATE, and to CHECK on errors */
+struct t3t_status_response {
+    uint8_t len;
+    uint8_t code;
+    uint8_t id[8];
+    uint8_t status1;
+    uint8_t status2;
+    /* see struct t2t_read_response */
+    uint8_t status;
+} __attribute__((packed));
+
 enum t4t_file_select{
     NONE,
     CC_SELECT,
@@ -188,7 +274,6 @@ struct t4t_rb_command {
 
 struct t4t_rb_response {
     uint8_t data[0];
-    uint8_t data_tail[];
 } __attribute__((packed));
 
 union command_packet {
@@ -199,6 +284,10 @@ union command_packet {
     struct t1t_rall_command rall_cmd;
     struct t1t_rid_command rid_cmd;
     struct t2t_read_command read_cmd;
+    struct t2t_fast_read_command fast_read_cmd;
+    struct t2t_read_segment_command read_segment_cmd;
+    struct t2t_sector_select_command sector_select_cmd;
+    struct t2t_sector_select_param sector_select_param;
     struct t3t_check_command check_cmd;
     struct t4t_app_sel_command app_sel_cmd;
     struct t4t_cc_sel_command cc_sel_cmd;
@@ -210,7 +299,10 @@ union response_packet {
     struct t1t_rall_response rall_rsp;
     struct t1t_rid_response rid_rsp;
     struct t2t_read_response read_rsp;
+    struct t2t_range_read_response range_read_rsp;
+    struct t2t_ack_response ack_rsp;
     struct t3t_check_response check_rsp;
+    struct t3t_status_response t3t_status_rsp;
     struct t4t_app_sel_response app_sel_rsp;
     struct t4t_cc_sel_response cc_sel_rsp;
     struct t4t_ndef_sel_response ndef_sel_rsp;
@@ -251,6 +343,20 @@ enum {
     T2T_STATIC_MEMORY_SIZE = 64
 };
 
+/* [Type 2 Tag Operation Specification 2.2]
+ * Dynamic Memory Structure. The data area's size is stored in
+ * units of 8 bytes in a single byte of the CC. Dynamic lock bytes
+ * and reserved memory follow the data area; they are announced by
+ * Lock and Memory Control TLVs.
+ */
+enum {
+    T2T_BLOCK_SIZE = 4,
+    T2T_SECTOR_SIZE = 256 * T2T_BLOCK_SIZE,
+    T2T_SEGMENT_SIZE = 128,
+    T2T_MAX_SECTORS = 255,
+    T2T_MAX_DATA_AREA_SIZE = 255 * 8
+};
+
 struct nfc_t2t_raw {
     uint8_t mem[T2T_STATIC_MEMORY_SIZE];
 };
@@ -273,14 +379,17 @@ union nfc_t2t {
 enum {
     T3T_BLOCK_SIZE = 16,
     T3T_BLOCK_NUM = 64,
-    T3T_MEMORY_SIZE = T3T_BLOCK_NUM * T3T_BLOCK_SIZE
+    T3T_MEMORY_SIZE = T3T_BLOCK_NUM * T3T_BLOCK_SIZE,
+    /* block numbers have 16 bits */
+    T3T_MAX_BLOCK_NUM = 0x10000
 };
 
 struct nfc_t3t_raw {
     uint8_t mem[T3T_MEMORY_SIZE];
 };
 
-struct nfc_t3t_format {
+/* [T3TOP] 7.1; the Attribute Information Block is block 0 */
+struct nfc_t3t_attr {
     uint8_t ver;
     uint8_t nbr;
     uint8_t nbw;
@@ -290,6 +399,10 @@ struct nfc_t3t_format {
     uint8_t rwflag;
     uint8_t ln[3];
     uint8_t cs[2];
+} __attribute__((packed));
+
+struct nfc_t3t_format {
+    struct nfc_t3t_attr attr;
     uint8_t data[T3T_BLOCK_NUM - 1][T3T_BLOCK_SIZE];
 } __attribute__((packed));
 
@@ -302,6 +415,10 @@ union nfc_t3t {
  * There is no specific size defined in T3T spec.
  * CC size is defined in [T4TOP4] Table 5.
  */
+enum {
+    T4T_MAX_NDEF_FILE_SIZE = 0x8000
+};
+
 struct nfc_t4t_format {
     uint8_t cc[15];
     uint8_t data[1024];
@@ -311,121 +428,173 @@ union nfc_t4t {
     struct nfc_t4t_format format;
 };
 
+/* memory layouts of the supported tags */
+union nfc_tag_mem {
+    union nfc_t1t t1;
+    union nfc_t2t t2;
+    union nfc_t3t t3;
+    union nfc_t4t t4;
+};
+
+/* An immutable memory image, shared by all tags that have the same
+ * content. Tags keep a reference; the image is freed when the last
+ * one is dropped. Contexts may live in different threads, so the
+ * reference count is atomic.
+ */
+struct nfcemu_tag_image {
+    unsigned long nrefs;
+    size_t len;
+    const uint8_t* mem;
+    /* frees the image; NULL for images allocated with malloc() */
+    void (*release)(struct nfcemu_tag_image* img);
+};
+
+enum {
+    NFC_TAG_PAGE_SIZE = 256
+};
+
+/* A tag's memory is its image plus private copies of the pages that
+ * have been written to; copy-on-write. */
 struct nfc_tag {
     enum nfc_tag_type type;
-    union {
-        union nfc_t1t t1;
-        union nfc_t2t t2;
-        union nfc_t3t t3;
-        union nfc_t4t t4;
-    }t;
-};
-
-#define INIT_NFC_T1T(tag_, uid_, res_) \
-    tag_ = { \
-        .type = T1T, \
-        .t.t1.format.uid = uid_, \
-        .t.t1.format.res = res_ \
-    }
+    /* [Type 4 Tag Operation Specification]; currently selected file */
+    enum t4t_file_select t4t_file_sel;
+    /* [Digital], Sec 5.6.4; currently selected sector, and whether
+     * the second packet of a SECTOR SELECT is expected */
+    uint8_t t2t_sector;
+    uint8_t t2t_sector_sel;
+    /* NDEF capacity of the formatted tag; 0 for the default layout */
+    size_t capacity;
+    struct nfcemu_tag_image* img;
+    /* per-page copies, or NULL for pages that still refer to the
+     * image; allocated on the first write */
+    uint8_t** page;
+};
 
-#define INIT_NFC_T2T(tag_, internal_, lock_, cc_) \
-    tag_ = { \
-        .type = T2T, \
-        .t.t2.format.internal = internal_, \
-        .t.t2.format.lock = lock_, \
-        .t.t2.format.cc = cc_ \
+#define INIT_NFC_T1T(mem_, uid_, res_) \
+    mem_ = { \
+        .t1.format.uid = uid_, \
+        .t1.format.res = res_ \
     }
 
-#define INIT_NFC_T3T(tag_, v_, r_, w_, nb_, u_, wf_, rw_, ln_, cs_) \
-    tag_ = { \
-        .type = T3T, \
-        .t.t3.format.ver = v_, \
-        .t.t3.format.nbr = r_, \
-        .t.t3.format.nbw = w_, \
-        .t.t3.format.nmaxb = nb_, \
-        .t.t3.format.unused = u_, \
-        .t.t3.format.writef = wf_, \
-        .t.t3.format.rwflag = rw_, \
-        .t.t3.format.ln = ln_, \
-        .t.t3.format.cs = cs_, \
+#define INIT_NFC_T2T(mem_, internal_, lock_, cc_) \
+    mem_ = { \
+        .t2.format.internal = internal_, \
+        .t2.format.lock = lock_, \
+        .t2.format.cc = cc_ \
     }
 
-#define INIT_NFC_T4T(tag_, cc_) \
-    tag_ = { \
-        .type = T4T, \
-        .t.t4.format.cc = cc_, \
+#define INIT_NFC_T3T(mem_, v_, r_, w_, nb_, u_, wf_, rw_, ln_, cs_) \
+    mem_ = { \
+        .t3.format.attr.ver = v_, \
+        .t3.format.attr.nbr = r_, \
+        .t3.format.attr.nbw = w_, \
+        .t3.format.attr.nmaxb = nb_, \
+        .t3.format.attr.unused = u_, \
+        .t3.format.attr.writef = wf_, \
+        .t3.format.attr.rwflag = rw_, \
+        .t3.format.attr.ln = ln_, \
+        .t3.format.attr.cs = cs_, \
     }
 
-#define FORMAT_NFC_T1T(tag_, uid_, res_) \
-    { \
-    static const uint8_t uid[] = uid_; \
-    static const uint8_t res[] = res_; \
-    tag_->type = T1T; \
-    memset(tag_->t.t1.format.data, 0, sizeof(tag_->t.t1.format.data)); \
-    memcpy(tag_->t.t1.format.uid, uid, sizeof(uid)); \
-    memcpy(tag_->t.t1.format.res, res, sizeof(res)); \
+#define INIT_NFC_T4T(mem_, cc_) \
+    mem_ = { \
+        .t4.format.cc = cc_, \
     }
 
-#define FORMAT_NFC_T2T(tag_, itl_, lock_, cc_) \
-    { \
-    static const uint8_t itl[] = itl_; \
-    static const uint8_t lock[] = lock_; \
-    static const uint8_t cc[] = cc_; \
-    tag_->type = T2T; \
-    memset(tag_->t.t2.format.data, 0, sizeof(tag_->t.t2.format.data)); \
-    memcpy(tag_->t.t2.format.internal, itl, sizeof(itl)); \
-    memcpy(tag_->t.t2.format.lock, lock, sizeof(lock));   \
-    memcpy(tag_->t.t2.format.cc, cc, sizeof(cc)); \
+#define INIT_NFC_TAG_IMAGE(img_, mem_, len_) \
+    img_ = { \
+        .nrefs = 1, \
+        .len = (len_), \
+        .mem = (const uint8_t*)(mem_) \
     }
 
-#define FORMAT_NFC_T3T(tag_, v_, r_, w_, nb_, u_, wf_, rw_, ln_, cs_) \
-    { \
-    static const uint8_t nb[] = nb_; \
-    static const uint8_t u[] = u_; \
-    static const uint8_t ln[] = ln_; \
-    static const uint8_t cs[] = cs_; \
-    tag_->type = T3T; \
-    memset(tag_->t.t3.format.data, 0, sizeof(tag_->t.t3.format.data)); \
-    tag_->t.t3.format.ver = v_; \
-    tag_->t.t3.format.nbr = r_; \
-    tag_->t.t3.format.nbw = w_; \
-    memcpy(tag_->t.t3.format.nmaxb, nb, sizeof(nb)); \
-    memcpy(tag_->t.t3.format.unused, u, sizeof(u));   \
-    tag_->t.t3.format.writef = wf_; \
-    tag_->t.t3.format.rwflag = rw_; \
-    memcpy(tag_->t.t3.format.ln, ln, sizeof(ln)); \
-    memcpy(tag_->t.t3.format.cs, cs, sizeof(cs)); \
-    }
+void
+nfc_init_tags(struct nfc_tag* tags);
 
-#define FORMAT_NFC_T4T(tag_, cc_) \
-    { \
-    static const uint8_t cc[] = cc_; \
-    tag_->type = T4T; \
-    memset(tag_->t.t4.format.data, 0, sizeof(tag_->t.t4.format.data)); \
-    memcpy(tag_->t.t4.format.cc, cc, sizeof(cc)); \
-    }
+void
+nfc_uninit_tags(struct nfc_tag* tags);
+
+/* Copies 'len' bytes of memory into a new image with one reference. */
+struct nfcemu_tag_image*
+nfc_tag_image_create(const void* mem, size_t len);
+
+/* Maps the file at 'path' read-only as a new image with one reference.
+ * The file must not be truncated while the image exists. */
+struct nfcemu_tag_image*
+nfc_tag_image_map(const char* path);
 
-extern struct nfc_tag nfc_tags[4];
+struct nfcemu_tag_image*
+nfc_tag_image_ref(struct nfcemu_tag_image* img);
+
+void
+nfc_tag_image_unref(struct nfcemu_tag_image* img);
+
+/* Replaces the tag's memory. The image's size must be valid for the
+ * tag's type. */
+int
+nfc_tag_set_image(struct nfc_tag* tag, struct nfcemu_tag_image* img);
+
+/* Returns a reference to an image of the tag's current memory. If
+ * the tag has private pages, they are merged into a new image that
+ * the tag shares from then on. */
+struct nfcemu_tag_image*
+nfc_tag_get_image(struct nfc_tag* tag);
+
+size_t
+nfc_tag_len(const struct nfc_tag* tag);
+
+/* Reads up to 'len' bytes at 'off' and returns their number. */
+size_t
+nfc_tag_read(const struct nfc_tag* tag, size_t off, size_t len, void* buf);
+
+/* Copies the written pages; fails if the range is out of bounds. */
+int
+nfc_tag_write(struct nfc_tag* tag, size_t off, size_t len, const void* data);
 
 int
 nfc_tag_set_data(struct nfc_tag* tag, const uint8_t* ndef_msg, ssize_t len);
 
+/* Formats the tag with the layout for its current capacity. */
 int
 nfc_tag_format(struct nfc_tag* tag);
 
+/* Formats the tag with a layout that holds at least 'capacity' bytes
+ * of NDEF data; 0 selects the default layout. Capacities are rounded
+ * up to what the tag's type can address. */
+int
+nfc_tag_format_capacity(struct nfc_tag* tag, size_t capacity);
+
+/* Sets the number of blocks a T3T reads with one CHECK and writes
+ * with one UPDATE. The values go into the attribute information
+ * block, so formatting restores the defaults. */
+int
+nfc_tag_set_t3t_nb(struct nfc_tag* tag, unsigned long nbr,
+                   unsigned long nbw);
+
+struct nfc_snapshot;
+
+void
+nfc_tag_snapshot(const struct nfc_tag* tag, struct nfc_snapshot* snap);
+
+int
+nfc_tag_restore(struct nfc_tag* tag, struct nfc_snapshot* snap);
+
 size_t
 process_t1t(struct nfc_re* re, const union command_packet* cmd,
-            size_t len, uint8_t* consumed, union response_packet* rsp);
+            size_t len, size_t* consumed, union response_packet* rsp);
 
+/* Range reads return at most 'maxrsp' bytes. */
 size_t
 process_t2t(struct nfc_re* re, const union command_packet* cmd,
-            size_t len, uint8_t* consumed, union response_packet* rsp);
+            size_t len, size_t* consumed, union response_packet* rsp,
+            size_t maxrsp);
 
 size_t
 process_t3t(struct nfc_re* re, const union command_packet* cmd,
-            size_t len, uint8_t* consumed, union response_packet* rsp);
+            size_t len, size_t* consumed, union response_packet* rsp);
 
 size_t
 process_t4t(struct nfc_re* re, const union command_packet* cmd,
-            size_t len, uint8_t* consumed, union response_packet* rsp);
+            size_t len, size_t* consumed, union response_packet* rsp);
 #endif
@@ -0,0 +1,319 @@
+/*
+ * Copyright (C) 2013-2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <assert.h>
+#include "nfc-timer.h"
+
+void
+nfc_timer_wheel_init(struct nfc_timer_wheel* wheel)
+{
+    size_t i, j;
+
+    assert(wheel);
+
+    wheel->now = 0;
+    wheel->tick = 1; /* tick 0 is the current time */
+    TAILQ_INIT(&wheel->due);
+
+    for (i = 0; i < NFC_TIMER_WHEEL_LEVELS; ++i) {
+        wheel->bitmap[i] = 0;
+        for (j = 0; j < NFC_TIMER_WHEEL_SLOTS; ++j) {
+            TAILQ_INIT(&wheel->slot[i][j]);
+        }
+    }
+}
+
+static void
+add_timer(struct nfc_timer_wheel* wheel, struct nfc_timer* timer)
+{
+    uint64_t expires, delta;
+    unsigned int level, slot;
+
+    expires = timer->expires;
+
+    if (expires < wheel->tick) {
+        /* the timer's tick has passed already */
+        timer->level = NFC_TIMER_WHEEL_LEVELS;
+        timer->list = &wheel->due;
+        TAILQ_INSERT_TAIL(timer->list, timer, entry);
+        return;
+    }
+    delta = expires - wheel->tick;
+
+    for (level = 0; level < NFC_TIMER_WHEEL_LEVELS - 1; ++level) {
+        if (delta < (1ull << (NFC_TIMER_WHEEL_BITS * (level + 1)))) {
+            break;
+        }
+    }
+    if (delta >= (1ull << (NFC_TIMER_WHEEL_BITS * NFC_TIMER_WHEEL_LEVELS))) {
+        /* beyond the wheel's range; the timer cascades down again
+         * when the top level comes around */
+        expires = wheel->tick +
+            (1ull << (NFC_TIMER_WHEEL_BITS * NFC_TIMER_WHEEL_LEVELS)) - 1;
+    }
+    slot = (expires >> (NFC_TIMER_WHEEL_BITS * level)) &
+           (NFC_TIMER_WHEEL_SLOTS - 1);
+
+    timer->level = level;
+    timer->slot = slot;
+    timer->list = &wheel->slot[level][slot];
+    TAILQ_INSERT_TAIL(timer->list, timer, entry);
+    wheel->bitmap[level] |= 1ull << slot;
+}
+
+static void
+remove_timer(struct nfc_timer_wheel* wheel, struct nfc_timer* timer)
+{
+    struct nfc_timer_list* list = timer->list;
+
+    TAILQ_REMOVE(list, timer, entry);
+    timer->list = NULL;
+
+    if (TAILQ_EMPTY(list) && timer->level < NFC_TIMER_WHEEL_LEVELS &&
+        list == &wheel->slot[timer->level][timer->slot]) {
+        wheel->bitmap[timer->level] &= ~(1ull << timer->slot);
+    }
+}
+
+/* Moves the timers of a slot one level down. Returns the slot's
+ * index. */
+static unsigned int
+cascade(struct nfc_timer_wheel* wheel, unsigned int level)
+{
+    unsigned int slot;
+    struct nfc_timer_list* list;
+
+    slot = (wheel->tick >> (NFC_TIMER_WHEEL_BITS * level)) &
+           (NFC_TIMER_WHEEL_SLOTS - 1);
+    list = &wheel->slot[level][slot];
+
+    while (!TAILQ_EMPTY(list)) {
+        struct nfc_timer* timer = TAILQ_FIRST(list);
+        remove_timer(wheel, timer);
+        add_timer(wheel, timer);
+    }
+    return slot;
+}
+
+/* Runs the timers of 'list'. Timers that are armed by the callbacks
+ * must not end up in the list we're working on, so we move them
+ * aside first. */
+static size_t
+run_timers(struct nfc_timer_wheel* wheel, struct nfc_timer_list* list)
+{
+    struct nfc_timer_list expired;
+    size_t n;
+
+    TAILQ_INIT(&expired);
+    while (!TAILQ_EMPTY(list)) {
+        struct nfc_timer* timer = TAILQ_FIRST(list);
+        remove_timer(wheel, timer);
+        timer->list = &expired;
+        TAILQ_INSERT_TAIL(&expired, timer, entry);
+    }
+
+    for (n = 0; !TAILQ_EMPTY(&expired); ++n) {
+        struct nfc_timer* timer = TAILQ_FIRST(&expired);
+        remove_timer(wheel, timer);
+        timer->cb(timer->data);
+    }
+    return n;
+}
+
+static size_t
+run_tick(struct nfc_timer_wheel* wheel)
+{
+    unsigned int slot, level;
+
+    slot = wheel->tick & (NFC_TIMER_WHEEL_SLOTS - 1);
+
+    for (level = 1; !slot && level < NFC_TIMER_WHEEL_LEVELS; ++level) {
+        slot = cascade(wheel, level);
+    }
+    slot = wheel->tick & (NFC_TIMER_WHEEL_SLOTS - 1);
+    ++wheel->tick;
+
+    return run_timers(wheel, &wheel->slot[0][slot]);
+}
+
+size_t
+nfc_timer_wheel_advance(struct nfc_timer_wheel* wheel, uint64_t ns)
+{
+    uint64_t last;
+    size_t n;
+
+    assert(wheel);
+
+    wheel->now += ns;
+    last = wheel->now / NFC_TIMER_TICK_NS;
+
+    for (n = 0;;) {
+        unsigned int slot;
+        uint64_t pending, next;
+        size_t i;
+
+        /* due timers come before anything on the wheel */
+        if (!TAILQ_EMPTY(&wheel->due)) {
+            n += run_timers(wheel, &wheel->due);
+            continue;
+        }
+        if (wheel->tick > last) {
+            break;
+        }
+
+        for (pending = 0, i = 0; i < NFC_TIMER_WHEEL_LEVELS; ++i) {
+            pending |= wheel->bitmap[i];
+        }
+        if (!pending) {
+            wheel->tick = last + 1;
+            break;
+        }
+
+        /* jump to the next non-empty slot of level 0, or to
+         * the start of the next round, where we cascade */
+        slot = wheel->tick & (NFC_TIMER_WHEEL_SLOTS - 1);
+        pending = wheel->bitmap[0] >> slot;
+        if (!slot) {
+            next = wheel->tick;
+        } else if (pending) {
+            next = wheel->tick + __builtin_ctzll(pending);
+        } else {
+            next = (wheel->tick | (NFC_TIMER_WHEEL_SLOTS - 1)) + 1;
+        }
+        if (next > last) {
+            wheel->tick = last + 1;
+            break;
+        }
+        wheel->tick = next;
+        n += run_tick(wheel);
+    }
+    return n;
+}
+
+static uint64_t
+earliest_expiry(const struct nfc_timer_list* list)
+{
+    const struct nfc_timer* timer;
+    uint64_t expires = UINT64_MAX;
+
+    TAILQ_FOREACH(timer, list, entry) {
+        if (timer->expires < expires) {
+            expires = timer->expires;
+        }
+    }
+    return expires;
+}
+
+int
+nfc_timer_wheel_next(const struct nfc_timer_wheel* wheel, uint64_t* ns)
+{
+    uint64_t expires;
+    unsigned int level;
+
+    assert(wheel);
+    assert(ns);
+
+    if (!TAILQ_EMPTY(&wheel->due)) {
+        *ns = 0;
+        return 0;
+    }
+    expires = UINT64_MAX;
+
+    /* Slots hold ever later timers in round-robin order, starting at
+     * the current position. The first non-empty slot of each level
+     * thus holds that level's earliest timer. */
+    for (level = 0; level < NFC_TIMER_WHEEL_LEVELS; ++level) {
+        unsigned int shift, cur, first, i;
+
+        shift = NFC_TIMER_WHEEL_BITS * level;
+        cur = (wheel->tick >> shift) & (NFC_TIMER_WHEEL_SLOTS - 1);
+
+        /* Once the current slot of a higher level has been cascaded,
+         * a timer there is one full round ahead. That happens when
+         * we process the first tick of the slot. */
+        first = !!(wheel->tick & ((1ull << shift) - 1));
+
+        for (i = first; i < NFC_TIMER_WHEEL_SLOTS + first; ++i) {
+            unsigned int slot = (cur + i) & (NFC_TIMER_WHEEL_SLOTS - 1);
+            if (wheel->bitmap[level] & (1ull << slot)) {
+                uint64_t e = earliest_expiry(&wheel->slot[level][slot]);
+                if (e < expires) {
+                    expires = e;
+                }
+                break;
+            }
+        }
+        if (!level && cur && cur + i < NFC_TIMER_WHEEL_SLOTS) {
+            break; /* expires in this round; nothing above is earlier */
+        }
+    }
+    if (expires == UINT64_MAX) {
+        return -1;
+    }
+    *ns = expires * NFC_TIMER_TICK_NS - wheel->now;
+
+    return 0;
+}
+
+void
+nfc_timer_init(struct nfc_timer* timer, void (*cb)(void*), void* data)
+{
+    assert(timer);
+    assert(cb);
+
+    timer->list = NULL;
+    timer->expires = 0;
+    timer->level = 0;
+    timer->slot = 0;
+    timer->cb = cb;
+    timer->data = data;
+}
+
+void
+nfc_timer_mod(struct nfc_timer_wheel* wheel, struct nfc_timer* timer,
+              unsigned long ms)
+{
+    assert(wheel);
+    assert(timer);
+
+    if (timer->list) {
+        remove_timer(wheel, timer);
+    }
+    /* round up, so that the timer never fires early */
+    timer->expires = (wheel->now + ms * (uint64_t)NFC_TIMER_TICK_NS +
+                      NFC_TIMER_TICK_NS - 1) / NFC_TIMER_TICK_NS;
+    add_timer(wheel, timer);
+}
+
+void
+nfc_timer_del(struct nfc_timer_wheel* wheel, struct nfc_timer* timer)
+{
+    assert(wheel);
+    assert(timer);
+
+    if (timer->list) {
+        remove_timer(wheel, timer);
+    }
+}
+
+int
+nfc_timer_is_pending(const struct nfc_timer* timer)
+{
+    assert(timer);
+
+    return !!timer->list;
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2013-2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef nfc_timer_h
+#define nfc_timer_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/queue.h>
+
+/* A hierarchical timer wheel with a resolution of 1 ms. Level 0
+ * holds timers that expire within the next 64 ticks, each higher
+ * level covers 64 times the range of the one below. Timers cascade
+ * down a level whenever the lower level wraps around. A bitmap per
+ * level tracks non-empty slots, so advancing the clock jumps over
+ * empty stretches of time.
+ */
+
+enum {
+    NFC_TIMER_TICK_NS = 1000000,
+    NFC_TIMER_WHEEL_BITS = 6,
+    NFC_TIMER_WHEEL_SLOTS = 1 << NFC_TIMER_WHEEL_BITS,
+    NFC_TIMER_WHEEL_LEVELS = 4
+};
+
+struct nfc_timer {
+    TAILQ_ENTRY(nfc_timer) entry;
+    struct nfc_timer_list* list; /* list holding the timer, or NULL */
+    uint64_t expires; /* in ticks */
+    uint8_t level;
+    uint8_t slot;
+    void (*cb)(void*);
+    void* data;
+};
+
+TAILQ_HEAD(nfc_timer_list, nfc_timer);
+
+struct nfc_timer_wheel {
+    uint64_t now; /* in ns */
+    uint64_t tick; /* next tick to process */
+    uint64_t bitmap[NFC_TIMER_WHEEL_LEVELS];
+    struct nfc_timer_list due; /* timers that expired on arrival */
+    struct nfc_timer_list slot[NFC_TIMER_WHEEL_LEVELS]
+                              [NFC_TIMER_WHEEL_SLOTS];
+};
+
+void
+nfc_timer_wheel_init(struct nfc_timer_wheel* wheel);
+
+/* Advances the clock by 'ns' and runs all timers that expire on
+ * the way, in order of expiry. Returns the number of timers run. */
+size_t
+nfc_timer_wheel_advance(struct nfc_timer_wheel* wheel, uint64_t ns);
+
+/* Returns the time until the next timer expires in 'ns', or -1
+ * if no timer is pending. */
+int
+nfc_timer_wheel_next(const struct nfc_timer_wheel* wheel, uint64_t* ns);
+
+void
+nfc_timer_init(struct nfc_timer* timer, void (*cb)(void*), void* data);
+
+/* (Re-)arms the timer to expire 'ms' milliseconds from now. */
+void
+nfc_timer_mod(struct nfc_timer_wheel* wheel, struct nfc_timer* timer,
+              unsigned long ms);
+
+void
+nfc_timer_del(struct nfc_timer_wheel* wheel, struct nfc_timer* timer);
+
+int
+nfc_timer_is_pending(const struct nfc_timer* timer);
+
+#endif
@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "nfc-trace.h"
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int
+flush_trace(struct nfc_trace* trace)
+{
+    size_t off;
+
+    for (off = 0; off < trace->len;) {
+        ssize_t res = write(trace->fd, trace->buf + off, trace->len - off);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        off += res;
+    }
+    trace->len = 0;
+
+    return 0;
+}
+
+struct nfc_trace*
+nfc_trace_open(const char* path)
+{
+    static const uint8_t hdr[NFC_TRACE_FILE_HEADER_LENGTH] = {
+        'N', 'F', 'C', 'T', NFC_TRACE_VERSION, 0, 0, 0
+    };
+    struct nfc_trace* trace;
+
+    assert(path);
+
+    trace = malloc(sizeof(*trace));
+    if (!trace) {
+        return NULL;
+    }
+    trace->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (trace->fd < 0) {
+        int err = errno;
+        free(trace);
+        errno = err;
+        return NULL;
+    }
+    trace->t0 = now_ns();
+
+    memcpy(trace->buf, hdr, sizeof(hdr));
+    trace->len = sizeof(hdr);
+
+    return trace;
+}
+
+int
+nfc_trace_close(struct nfc_trace* trace)
+{
+    int res;
+
+    assert(trace);
+
+    res = flush_trace(trace);
+    if (close(trace->fd) < 0) {
+        res = -1;
+    }
+    free(trace);
+
+    return res;
+}
+
+int
+nfc_trace_writev(struct nfc_trace* trace, enum nfc_trace_type type,
+                 const struct iovec* iov, size_t iovcnt)
+{
+    uint8_t* hdr;
+    uint64_t ts;
+    size_t i, len;
+
+    assert(trace);
+    assert(iov || !iovcnt);
+
+    for (len = 0, i = 0; i < iovcnt; ++i) {
+        len += iov[i].iov_len;
+    }
+    if (len > UINT16_MAX ||
+            NFC_TRACE_RECORD_HEADER_LENGTH + len > sizeof(trace->buf)) {
+        return -1;
+    }
+    if (sizeof(trace->buf) - trace->len <
+            NFC_TRACE_RECORD_HEADER_LENGTH + len) {
+        if (flush_trace(trace) < 0) {
+            return -1;
+        }
+    }
+
+    ts = now_ns() - trace->t0;
+
+    hdr = trace->buf + trace->len;
+    hdr[0] = type;
+    hdr[1] = len;
+    hdr[2] = len >> 8;
+    for (i = 0; i < 8; ++i) {
+        hdr[3 + i] = ts >> (8 * i);
+    }
+    trace->len += NFC_TRACE_RECORD_HEADER_LENGTH;
+
+    for (i = 0; i < iovcnt; ++i) {
+        if (!iov[i].iov_len) {
+            continue;
+        }
+        memcpy(trace->buf + trace->len, iov[i].iov_base, iov[i].iov_len);
+        trace->len += iov[i].iov_len;
+    }
+
+    return 0;
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef nfc_trace_h
+#define nfc_trace_h
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <nfcemu/trace.h>
+
+/* Writes a binary trace of the traffic between host and emulator.
+ * Records are buffered and written out when the buffer runs full. */
+
+enum {
+    NFC_TRACE_BUFFER_SIZE = 64 * 1024
+};
+
+struct nfc_trace {
+    int fd;
+    uint64_t t0; /* start of the trace */
+    size_t len;
+    uint8_t buf[NFC_TRACE_BUFFER_SIZE];
+};
+
+struct nfc_trace*
+nfc_trace_open(const char* path);
+
+int
+nfc_trace_close(struct nfc_trace* trace);
+
+int
+nfc_trace_writev(struct nfc_trace* trace, enum nfc_trace_type type,
+                 const struct iovec* iov, size_t iovcnt);
+
+#endif
@@ -17,13 +17,19 @@
 #include <assert.h>
 #include <string.h>
 #include "ptr.h"
+#include "ctx.h"
 #include "nfc.h"
 #include "nfc-nci.h"
+#include "nfc-re.h"
+#include "nfc-snapshot.h"
 
 void
-nfc_device_init(struct nfc_device* nfc)
+nfc_device_init(struct nfc_device* nfc, struct nfcemu_ctx* ctx)
 {
     assert(nfc);
+    assert(ctx);
+
+    nfc->ctx = ctx;
 
     nfc->state = NFC_FSM_STATE_IDLE;
     nfc->rf_state = NFC_RFST_IDLE;
@@ -42,6 +48,30 @@ nfc_device_init(struct nfc_device* nfc)
     nfc->active_rf = NULL;
 
     memset(nfc->config_id_value, 0, sizeof(nfc->config_id_value));
+
+    nfc->maxctrlpayload = MAX_NCI_PAYLOAD_LENGTH - 1;
+    nfc->maxdtapayload = MAX_NCI_PAYLOAD_LENGTH - 1;
+    nfc->ncredits = NCI_CREDITS_UNLIMITED;
+
+    memset(nfc->conn, 0, sizeof(nfc->conn));
+    nfc_device_reset_conns(nfc);
+
+    nfc_ring_init(&nfc->dta_q, NFC_DTA_QUEUE_LIMIT);
+    nfc->dta_timeout = NULL;
+
+    nfc->stats = NULL;
+}
+
+void
+nfc_device_uninit(struct nfc_device* nfc)
+{
+    assert(nfc);
+
+    if (nfc->dta_timeout) {
+        ctx_free_timeout(nfc->ctx, nfc->dta_timeout);
+        nfc->dta_timeout = NULL;
+    }
+    nfc_ring_uninit(&nfc->dta_q);
 }
 
 void
@@ -75,6 +105,308 @@ nfc_device_incr_id(struct nfc_device* nfc)
     return nfc->id;
 }
 
+void
+nfc_device_open_conn(struct nfc_device* nfc, uint8_t connid,
+                     uint8_t dest, struct nfc_re* re)
+{
+    struct nfc_conn* conn;
+
+    assert(nfc);
+    assert(connid < ARRAY_SIZE(nfc->conn));
+    assert(dest);
+    assert(nfc->maxdtapayload);
+    assert(nfc->ncredits);
+
+    conn = nfc->conn + connid;
+    conn->dest = dest;
+    conn->re = re;
+    conn->maxpayload = nfc->maxdtapayload;
+    conn->maxcredits = nfc->ncredits;
+    conn->ncredits = nfc->ncredits;
+    conn->nconsumed = 0;
+    conn->rdrop = 0;
+    conn->rlen = 0;
+}
+
+void
+nfc_device_close_conn(struct nfc_device* nfc, uint8_t connid)
+{
+    struct nfc_conn* conn;
+
+    assert(nfc);
+    assert(connid < ARRAY_SIZE(nfc->conn));
+
+    conn = nfc->conn + connid;
+    if (conn->re && (conn->re->connid == connid)) {
+        /* the RE falls back to the static RF connection */
+        conn->re->connid = NFC_STATIC_RF_CONNID;
+    }
+    conn->dest = 0;
+    conn->re = NULL;
+    conn->nconsumed = 0;
+    conn->rdrop = 0;
+    conn->rlen = 0;
+}
+
+void
+nfc_device_reset_conns(struct nfc_device* nfc)
+{
+    uint8_t i;
+
+    assert(nfc);
+
+    for (i = 0; i < ARRAY_SIZE(nfc->conn); ++i) {
+        nfc_device_close_conn(nfc, i);
+    }
+    nfc_device_open_conn(nfc, NFC_STATIC_RF_CONNID,
+                         NCI_DEST_REMOTE_NFC_ENDPOINT, NULL);
+}
+
+static ssize_t
+create_queued_dta(void* data, struct nfc_device* nfc, size_t maxlen,
+                  union nci_packet* dta)
+{
+    return nfc_device_dequeue_dta(nfc, dta);
+}
+
+static void
+send_dta_q_cb(void* data)
+{
+    struct nfc_device* nfc;
+    size_t len;
+
+    nfc = data;
+    assert(nfc);
+
+    while ((len = nfc_ring_len(&nfc->dta_q))) {
+        if ((ctx_send_dta(nfc->ctx, create_queued_dta, NULL) < 0) ||
+            (nfc_ring_len(&nfc->dta_q) == len)) {
+            NFC_W(&nfc->ctx->log, "NCI sending queued data failed");
+            nfc_ring_clear(&nfc->dta_q);
+        }
+    }
+}
+
+void
+nfc_device_send_dta_q(struct nfc_device* nfc)
+{
+    assert(nfc);
+
+    if (!nfc->dta_timeout) {
+        nfc->dta_timeout = ctx_new_timeout(nfc->ctx, send_dta_q_cb, nfc);
+        assert(nfc->dta_timeout);
+    }
+    if (!ctx_timeout_is_pending(nfc->ctx, nfc->dta_timeout)) {
+        ctx_mod_timeout(nfc->ctx, nfc->dta_timeout, 0);
+    }
+}
+
+size_t
+nfc_device_dequeue_dta(struct nfc_device* nfc, union nci_packet* dta)
+{
+    size_t len;
+
+    assert(nfc);
+    assert(dta);
+
+    len = nfc_ring_read(&nfc->dta_q, 3, dta);
+    if (!len) {
+        return 0;
+    }
+    if ((len < 3) ||
+        (nfc_ring_read(&nfc->dta_q, dta->data.l,
+                       dta->data.payload) < dta->data.l)) {
+        NFC_W(&nfc->ctx->log, "NCI data queue corrupted");
+        nfc_ring_clear(&nfc->dta_q);
+        return 0;
+    }
+    return 3 + dta->data.l;
+}
+
+enum {
+    NFC_SNAPSHOT_NO_INDEX = 0xff /* stands for a NULL pointer */
+};
+
+static void
+put_re_index(struct nfc_snapshot* snap, const struct nfc_device* nfc,
+             const struct nfc_re* re)
+{
+    nfc_snapshot_put_u8(snap, re ? re - nfc->ctx->res
+                                 : NFC_SNAPSHOT_NO_INDEX);
+}
+
+static int
+get_re_index(struct nfc_snapshot* snap, struct nfc_device* nfc,
+             struct nfc_re** re)
+{
+    uint8_t i = nfc_snapshot_get_u8(snap);
+
+    if (i == NFC_SNAPSHOT_NO_INDEX) {
+        *re = NULL;
+    } else if (i < ARRAY_SIZE(nfc->ctx->res)) {
+        *re = nfc->ctx->res + i;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+void
+nfc_device_snapshot(const struct nfc_device* nfc, struct nfc_snapshot* snap)
+{
+    size_t i;
+
+    assert(nfc);
+
+    nfc_snapshot_put_u8(snap, nfc->state);
+    nfc_snapshot_put_u8(snap, nfc->rf_state);
+    for (i = 0; i < ARRAY_SIZE(nfc->rf); ++i) {
+        nfc_snapshot_put_u8(snap, nfc->rf[i].iface);
+        nfc_snapshot_put_u8(snap, nfc->rf[i].mode);
+    }
+    nfc_snapshot_put_u8(snap, nfc->id);
+    put_re_index(snap, nfc, nfc->active_re);
+    nfc_snapshot_put_u8(snap, nfc->active_rf ? nfc->active_rf - nfc->rf
+                                             : NFC_SNAPSHOT_NO_INDEX);
+    nfc_snapshot_put_mem(snap, sizeof(nfc->config_id_value),
+                         nfc->config_id_value);
+    nfc_snapshot_put_u8(snap, nfc->maxctrlpayload);
+    nfc_snapshot_put_u8(snap, nfc->maxdtapayload);
+    nfc_snapshot_put_u8(snap, nfc->ncredits);
+
+    for (i = 0; i < ARRAY_SIZE(nfc->conn); ++i) {
+        const struct nfc_conn* conn = nfc->conn + i;
+
+        nfc_snapshot_put_u8(snap, conn->dest);
+        if (!conn->dest) {
+            continue;
+        }
+        put_re_index(snap, nfc, conn->re);
+        nfc_snapshot_put_u8(snap, conn->maxpayload);
+        nfc_snapshot_put_u8(snap, conn->maxcredits);
+        nfc_snapshot_put_u8(snap, conn->ncredits);
+        nfc_snapshot_put_u8(snap, conn->nconsumed);
+        nfc_snapshot_put_u8(snap, conn->rdrop);
+        nfc_snapshot_put_u16(snap, conn->rlen);
+        nfc_snapshot_put_mem(snap, conn->rlen, conn->rbuf);
+    }
+    nfc_ring_snapshot(&nfc->dta_q, snap);
+}
+
+/* The connection's limits must be ones that we could have
+ * announced; the data path relies on them. */
+static int
+valid_conn(const struct nfc_conn* conn)
+{
+    if ((conn->dest != NCI_DEST_NFCC_LOOPBACK) &&
+        (conn->dest != NCI_DEST_REMOTE_NFC_ENDPOINT)) {
+        return 0;
+    }
+    if (!conn->maxpayload || !conn->maxcredits || (conn->rdrop > 1)) {
+        return 0;
+    }
+    if (conn->maxcredits == NCI_CREDITS_UNLIMITED) {
+        return 1;
+    }
+    return conn->ncredits + conn->nconsumed <= conn->maxcredits;
+}
+
+static int
+restore_device(struct nfc_device* nfc, struct nfc_snapshot* snap)
+{
+    uint8_t i;
+
+    nfc->state = nfc_snapshot_get_u8(snap);
+    nfc->rf_state = nfc_snapshot_get_u8(snap);
+    if ((nfc->state >= NUMBER_OF_NFC_FSM_STATES) ||
+        (nfc->rf_state >= NUMBER_OF_NFC_RFSTS)) {
+        return -1;
+    }
+    for (i = 0; i < ARRAY_SIZE(nfc->rf); ++i) {
+        nfc->rf[i].iface = nfc_snapshot_get_u8(snap);
+        nfc->rf[i].mode = nfc_snapshot_get_u8(snap);
+    }
+    nfc->id = nfc_snapshot_get_u8(snap);
+    if (get_re_index(snap, nfc, &nfc->active_re) < 0) {
+        return -1;
+    }
+    i = nfc_snapshot_get_u8(snap);
+    if (i == NFC_SNAPSHOT_NO_INDEX) {
+        nfc->active_rf = NULL;
+    } else if (i < ARRAY_SIZE(nfc->rf)) {
+        nfc->active_rf = nfc->rf + i;
+    } else {
+        return -1;
+    }
+    nfc_snapshot_get_mem(snap, sizeof(nfc->config_id_value),
+                         nfc->config_id_value);
+    nfc->maxctrlpayload = nfc_snapshot_get_u8(snap);
+    nfc->maxdtapayload = nfc_snapshot_get_u8(snap);
+    nfc->ncredits = nfc_snapshot_get_u8(snap);
+    if (!nfc->maxctrlpayload || !nfc->maxdtapayload || !nfc->ncredits) {
+        return -1;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(nfc->conn); ++i) {
+        struct nfc_conn* conn = nfc->conn + i;
+
+        conn->dest = nfc_snapshot_get_u8(snap);
+        if (!conn->dest) {
+            continue;
+        }
+        if (get_re_index(snap, nfc, &conn->re) < 0) {
+            return -1;
+        }
+        conn->maxpayload = nfc_snapshot_get_u8(snap);
+        conn->maxcredits = nfc_snapshot_get_u8(snap);
+        conn->ncredits = nfc_snapshot_get_u8(snap);
+        conn->nconsumed = nfc_snapshot_get_u8(snap);
+        conn->rdrop = nfc_snapshot_get_u8(snap);
+        conn->rlen = nfc_snapshot_get_u16(snap);
+        if (!valid_conn(conn) || (conn->rlen > sizeof(conn->rbuf)) ||
+            (nfc_snapshot_get_mem(snap, conn->rlen, conn->rbuf) < 0)) {
+            conn->rlen = 0;
+            return -1;
+        }
+    }
+    if ((nfc_ring_restore(&nfc->dta_q, snap) < 0) ||
+        (nfc_ring_set_maxsize(&nfc->dta_q, NFC_DTA_QUEUE_LIMIT) < 0)) {
+        return -1;
+    }
+    return snap->err ? -1 : 0;
+}
+
+void
+nfc_device_reset(struct nfc_device* nfc)
+{
+    struct nfc_stats* stats;
+
+    assert(nfc);
+
+    /* statistics are not part of the device's state */
+    stats = nfc->stats;
+    nfc_device_uninit(nfc);
+    nfc_device_init(nfc, nfc->ctx);
+    nfc->stats = stats;
+}
+
+int
+nfc_device_restore(struct nfc_device* nfc, struct nfc_snapshot* snap)
+{
+    assert(nfc);
+
+    memset(nfc->conn, 0, sizeof(nfc->conn));
+
+    if (restore_device(nfc, snap) < 0) {
+        nfc_device_reset(nfc);
+        return -1;
+    }
+    if (nfc_ring_len(&nfc->dta_q)) {
+        nfc_device_send_dta_q(nfc);
+    }
+    return 0;
+}
+
 struct nfc_rf*
 nfc_find_rf_by_protocol_and_mode(struct nfc_device* nfc,
                                  enum nci_rf_protocol proto,
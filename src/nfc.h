@@ -22,12 +22,20 @@
 #include <sys/types.h>
 #include <nfcemu/types.h>
 #include "nfc-rf.h"
+#include "nfc-ring.h"
 
+struct nfcemu_ctx;
 struct nfc_re;
+struct nfc_snapshot;
+struct nfc_stats;
 union nci_packet;
 
 enum {
-    NUMBER_OF_SUPPORTED_NCI_RF_INTERFACES = 8
+    NUMBER_OF_SUPPORTED_NCI_RF_INTERFACES = 8,
+    NUMBER_OF_NCI_CONNS = 16, /* Conn IDs have 4 bits */
+    NFC_STATIC_RF_CONNID = 0,
+    NFC_MAX_FRAME_LENGTH = 4096, /* max. length of a reassembled frame */
+    NFC_DTA_QUEUE_LIMIT = 64 * 1024 /* max. length of queued data packets */
 };
 
 enum nfc_fsm_state {
@@ -37,7 +45,28 @@ enum nfc_fsm_state {
     NUMBER_OF_NFC_FSM_STATES
 };
 
+/* A logical NCI connection; [NCI], Sec 4.4. The device keeps
+ * them in a table indexed by Conn ID. */
+struct nfc_conn {
+    uint8_t dest; /* enum nci_dest_type, or 0 if closed */
+    /* the remote endpoint; NULL for the static RF connection,
+     * which follows the active RE */
+    struct nfc_re* re;
+    uint8_t maxpayload; /* max. payload of a data packet */
+    /* [NCI], Sec 4.4.4; NCI_CREDITS_UNLIMITED if flow control
+     * is disabled */
+    uint8_t maxcredits;
+    uint8_t ncredits; /* credits held by the host */
+    uint8_t nconsumed; /* packets consumed, but not yet credited */
+    /* segments of the current frame from the host */
+    int rdrop; /* true if the frame is too long */
+    size_t rlen;
+    uint8_t rbuf[NFC_MAX_FRAME_LENGTH];
+};
+
 struct nfc_device {
+    struct nfcemu_ctx* ctx;
+
     enum nfc_fsm_state state;
     enum nfc_rfst rf_state;
 
@@ -50,10 +79,28 @@ struct nfc_device {
 
     /* stores all config options */
     uint8_t config_id_value[128];
+
+    /* limits we announce to the host */
+    uint8_t maxctrlpayload; /* in CORE_INIT_RSP */
+    uint8_t maxdtapayload; /* for new logical connections */
+    uint8_t ncredits; /* initial credits of new logical connections */
+
+    struct nfc_conn conn[NUMBER_OF_NCI_CONNS];
+
+    /* data packets that follow the current message, such as the
+     * segments of long frames; a timeout sends them to the host */
+    struct nfc_ring dta_q;
+    nfcemu_timeout* dta_timeout;
+
+    /* per-command statistics, or NULL */
+    struct nfc_stats* stats;
 };
 
 void
-nfc_device_init(struct nfc_device* nfc);
+nfc_device_init(struct nfc_device* nfc, struct nfcemu_ctx* ctx);
+
+void
+nfc_device_uninit(struct nfc_device* nfc);
 
 void
 nfc_device_set(struct nfc_device* nfc, size_t off, size_t len,
@@ -66,6 +113,41 @@ nfc_device_get(const struct nfc_device* nfc, size_t off, size_t len,
 uint8_t
 nfc_device_incr_id(struct nfc_device* nfc);
 
+/* Opens a logical connection with the device's current limits. */
+void
+nfc_device_open_conn(struct nfc_device* nfc, uint8_t connid,
+                     uint8_t dest, struct nfc_re* re);
+
+void
+nfc_device_close_conn(struct nfc_device* nfc, uint8_t connid);
+
+/* Closes all logical connections but the static RF connection. */
+void
+nfc_device_reset_conns(struct nfc_device* nfc);
+
+/* Sends the queued data packets after the current message. */
+void
+nfc_device_send_dta_q(struct nfc_device* nfc);
+
+/* Removes the first queued data packet. Returns its length, or 0
+ * if the queue is empty. */
+size_t
+nfc_device_dequeue_dta(struct nfc_device* nfc, union nci_packet* dta);
+
+/* Stores the controller's state and logical connections. REs are
+ * referenced by their index in the context. */
+void
+nfc_device_snapshot(const struct nfc_device* nfc, struct nfc_snapshot* snap);
+
+/* Returns the controller to its power-on state. */
+void
+nfc_device_reset(struct nfc_device* nfc);
+
+/* Replaces the controller's state. On errors, the device is left
+ * reset. */
+int
+nfc_device_restore(struct nfc_device* nfc, struct nfc_snapshot* snap);
+
 struct nfc_rf*
 nfc_find_rf_by_protocol_and_mode(struct nfc_device* nfc,
                                  enum nci_rf_protocol proto, enum nci_rf_tech_mode mode);
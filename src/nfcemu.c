@@ -15,66 +15,498 @@
  */
 
 #include <assert.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdlib.h>
-#include "cb.h"
+#include <string.h>
+#include "ctx.h"
 #include "nfc.h"
 #include "nfc-hci.h"
 #include "nfc-nci.h"
+#include "nfc-snapshot.h"
+#include "nfc-stats.h"
+#include "nfc-timer.h"
+#include "nfc-trace.h"
 #include <nfcemu/nfcemu.h>
 
-int
-nfcemu_init(void (*log_msg)(const char* fmtstr, ...),
-            void (*log_err)(const char* fmtstr, ...),
-            nfcemu_timeout* (*new_timeout)(void (*cb)(void*), void* data),
-            void (*mod_timeout)(nfcemu_timeout* t, unsigned long ms),
-            void (*del_timeout)(nfcemu_timeout* t),
-            int (*timeout_is_pending)(nfcemu_timeout* t),
-            int (*send_ntf)(ssize_t (*create)(void*, struct nfc_device*,
-                                              size_t, union nci_packet*),
-                            void* data),
-            int (*send_dta)(ssize_t (*create)(void*, struct nfc_device*,
-                                              size_t, union nci_packet*),
-                            void* data),
-            int (*recv_dta)(ssize_t (*handle)(void*, struct nfc_device*),
-                            void* data))
-{
-  assert(new_timeout);
-  assert(mod_timeout);
-  assert(del_timeout);
-  assert(timeout_is_pending);
+struct nfcemu_ctx*
+nfcemu_ctx_create(void* opaque,
+                  void (*log_msg)(const char* fmtstr, ...),
+                  void (*log_err)(const char* fmtstr, ...),
+                  nfcemu_timeout* (*new_timeout)(void (*cb)(void*),
+                                                 void* data),
+                  void (*mod_timeout)(nfcemu_timeout* t, unsigned long ms),
+                  void (*del_timeout)(nfcemu_timeout* t),
+                  int (*timeout_is_pending)(nfcemu_timeout* t),
+                  int (*send_ntf)(void* opaque,
+                                  ssize_t (*create)(void*,
+                                                    struct nfc_device*,
+                                                    size_t,
+                                                    union nci_packet*),
+                                  void* data),
+                  int (*send_dta)(void* opaque,
+                                  ssize_t (*create)(void*,
+                                                    struct nfc_device*,
+                                                    size_t,
+                                                    union nci_packet*),
+                                  void* data),
+                  int (*recv_dta)(void* opaque,
+                                  ssize_t (*handle)(void*,
+                                                    struct nfc_device*),
+                                  void* data))
+{
+  struct nfcemu_ctx* ctx;
+
+  /* either all timeout callbacks, or none */
+  assert(!new_timeout == !mod_timeout);
+  assert(!new_timeout == !del_timeout);
+  assert(!new_timeout == !timeout_is_pending);
   assert(send_ntf);
   assert(send_dta);
   assert(recv_dta);
 
-  cb.log_msg = log_msg;
-  cb.log_err = log_err;
-  cb.new_timeout = new_timeout;
-  cb.mod_timeout = mod_timeout;
-  cb.del_timeout = del_timeout;
-  cb.timeout_is_pending = timeout_is_pending;
-  cb.send_ntf = send_ntf;
-  cb.send_dta = send_dta;
-  cb.recv_dta = recv_dta;
+  ctx = malloc(sizeof(*ctx));
+  if (!ctx) {
+    return NULL;
+  }
+
+  ctx->cb.log_msg = log_msg;
+  ctx->cb.log_err = log_err;
+  ctx->cb.new_timeout = new_timeout;
+  ctx->cb.mod_timeout = mod_timeout;
+  ctx->cb.del_timeout = del_timeout;
+  ctx->cb.timeout_is_pending = timeout_is_pending;
+  ctx->cb.send_ntf = send_ntf;
+  ctx->cb.send_dta = send_dta;
+  ctx->cb.recv_dta = recv_dta;
+  ctx->opaque = opaque;
+  ctx->trace = NULL;
+  ctx->timers = NULL;
+
+  if (!new_timeout) {
+    ctx->timers = malloc(sizeof(*ctx->timers));
+    if (!ctx->timers) {
+      free(ctx);
+      return NULL;
+    }
+    nfc_timer_wheel_init(ctx->timers);
+  }
+
+  nfc_log_init(&ctx->log, NFC_LOG_DEFAULT_LEVEL);
+  llcp_pdu_pool_init(&ctx->pdu_pool, LLCP_PDU_POOL_DEFAULT_CAP, &ctx->log);
+  nfc_init_tags(ctx->tags);
+  nfc_init_res(ctx->res, ctx->tags, ctx);
+
+  return ctx;
+}
+
+void
+nfcemu_ctx_destroy(struct nfcemu_ctx* ctx)
+{
+  size_t i;
+
+  assert(ctx);
+
+  for (i = 0; i < NUMBER_OF_NFC_RES; ++i) {
+    nfc_uninit_re(ctx->res + i);
+  }
+  nfc_uninit_tags(ctx->tags);
+  llcp_pdu_pool_uninit(&ctx->pdu_pool);
+  if (ctx->trace) {
+    nfc_trace_close(ctx->trace);
+  }
+  free(ctx->timers);
+  free(ctx);
+}
+
+void*
+nfcemu_ctx_get_opaque(const struct nfcemu_ctx* ctx)
+{
+  assert(ctx);
+
+  return ctx->opaque;
+}
+
+struct nfcemu_tag_image*
+nfcemu_tag_image_create(const void* mem, size_t len)
+{
+  return nfc_tag_image_create(mem, len);
+}
+
+struct nfcemu_tag_image*
+nfcemu_tag_image_map(const char* path)
+{
+  assert(path);
+
+  return nfc_tag_image_map(path);
+}
+
+void
+nfcemu_tag_image_unref(struct nfcemu_tag_image* img)
+{
+  nfc_tag_image_unref(img);
+}
+
+static struct nfc_tag*
+get_tag(struct nfcemu_ctx* ctx, unsigned long re)
+{
+  if (re >= NUMBER_OF_NFC_RES) {
+    return NULL;
+  }
+  return ctx->res[re].tag;
+}
+
+int
+nfcemu_ctx_set_tag_image(struct nfcemu_ctx* ctx, unsigned long re,
+                         struct nfcemu_tag_image* img)
+{
+  struct nfc_tag* tag;
+
+  assert(ctx);
+  assert(img);
+
+  tag = get_tag(ctx, re);
+  if (!tag) {
+    return -1;
+  }
+  return nfc_tag_set_image(tag, img);
+}
+
+struct nfcemu_tag_image*
+nfcemu_ctx_get_tag_image(struct nfcemu_ctx* ctx, unsigned long re)
+{
+  struct nfc_tag* tag;
+
+  assert(ctx);
+
+  tag = get_tag(ctx, re);
+  if (!tag) {
+    return NULL;
+  }
+  return nfc_tag_get_image(tag);
+}
+
+int
+nfcemu_ctx_format_tag(struct nfcemu_ctx* ctx, unsigned long re,
+                      size_t capacity)
+{
+  struct nfc_tag* tag;
+
+  assert(ctx);
 
+  tag = get_tag(ctx, re);
+  if (!tag) {
+    return -1;
+  }
+  return nfc_tag_format_capacity(tag, capacity);
+}
+
+int
+nfcemu_ctx_set_tag_ndef(struct nfcemu_ctx* ctx, unsigned long re,
+                        const void* msg, size_t len)
+{
+  struct nfc_tag* tag;
+
+  assert(ctx);
+  assert(msg || !len);
+
+  tag = get_tag(ctx, re);
+  if (!tag || (len > SSIZE_MAX)) {
+    return -1;
+  }
+  return nfc_tag_set_data(tag, msg, len);
+}
+
+ssize_t
+nfcemu_ctx_read_re_data(struct nfcemu_ctx* ctx, unsigned long re,
+                        void* buf, size_t len)
+{
+  assert(ctx);
+  assert(buf || !len);
+
+  if ((re >= NUMBER_OF_NFC_RES) || (len > SSIZE_MAX)) {
+    return -1;
+  }
+  return nfc_re_read_sbuf(ctx->res + re, len, buf);
+}
+
+ssize_t
+nfcemu_ctx_readv_re_data(struct nfcemu_ctx* ctx, unsigned long re,
+                         const struct iovec* iov, size_t iovcnt)
+{
+  assert(ctx);
+  assert(iov || !iovcnt);
+
+  if (re >= NUMBER_OF_NFC_RES) {
+    return -1;
+  }
+  return nfc_re_readv_sbuf(ctx->res + re, iov, iovcnt);
+}
+
+void
+nfcemu_ctx_set_pdu_pool_cap(struct nfcemu_ctx* ctx, size_t cap)
+{
+  assert(ctx);
+
+  ctx->pdu_pool.cap = cap;
+}
+
+void
+nfcemu_ctx_get_pdu_pool_stats(const struct nfcemu_ctx* ctx,
+                              struct nfcemu_pdu_pool_stats* stats)
+{
+  assert(ctx);
+  assert(stats);
+
+  stats->cap = ctx->pdu_pool.cap;
+  stats->nbufs = ctx->pdu_pool.nbufs;
+  stats->nused = ctx->pdu_pool.nused;
+  stats->hwm = ctx->pdu_pool.hwm;
+  stats->nfails = ctx->pdu_pool.nfails;
+}
+
+void
+nfcemu_ctx_set_log_level(struct nfcemu_ctx* ctx, enum nfcemu_log_level level)
+{
+  assert(ctx);
+
+  nfc_log_set_level(&ctx->log, level);
+}
+
+enum nfcemu_log_level
+nfcemu_ctx_get_log_level(const struct nfcemu_ctx* ctx)
+{
+  assert(ctx);
+
+  return nfc_log_get_level(&ctx->log);
+}
+
+size_t
+nfcemu_ctx_drain_log(struct nfcemu_ctx* ctx,
+                     void (*func)(void* data, enum nfcemu_log_level level,
+                                  uint64_t ts, const char* msg),
+                     void* data, size_t n)
+{
+  assert(ctx);
+
+  return nfc_log_drain(&ctx->log, func, data, n);
+}
+
+size_t
+nfcemu_advance_time(struct nfcemu_ctx* ctx, uint64_t ns)
+{
+  assert(ctx);
+  assert(ctx->timers);
+
+  return nfc_timer_wheel_advance(ctx->timers, ns);
+}
+
+int
+nfcemu_next_timeout(const struct nfcemu_ctx* ctx, uint64_t* ns)
+{
+  assert(ctx);
+  assert(ctx->timers);
+
+  return nfc_timer_wheel_next(ctx->timers, ns);
+}
+
+size_t
+nfcemu_advance_to_next_timeout(struct nfcemu_ctx* ctx)
+{
+  uint64_t ns;
+
+  assert(ctx);
+  assert(ctx->timers);
+
+  if (nfc_timer_wheel_next(ctx->timers, &ns) < 0) {
+    return 0;
+  }
+  return nfc_timer_wheel_advance(ctx->timers, ns);
+}
+
+uint64_t
+nfcemu_get_time(const struct nfcemu_ctx* ctx)
+{
+  assert(ctx);
+  assert(ctx->timers);
+
+  return ctx->timers->now;
+}
+
+int
+nfcemu_ctx_start_trace(struct nfcemu_ctx* ctx, const char* path)
+{
+  assert(ctx);
+  assert(path);
+
+  nfcemu_ctx_stop_trace(ctx);
+
+  ctx->trace = nfc_trace_open(path);
+  if (!ctx->trace) {
+    NFC_E(&ctx->log, "opening trace %s failed: %d (%s)", path, errno,
+          strerror(errno));
+    return -1;
+  }
   return 0;
 }
 
+int
+nfcemu_ctx_stop_trace(struct nfcemu_ctx* ctx)
+{
+  int res;
+
+  assert(ctx);
+
+  if (!ctx->trace) {
+    return 0;
+  }
+  res = nfc_trace_close(ctx->trace);
+  ctx->trace = NULL;
+
+  return res;
+}
+
+static void
+tracev(struct nfcemu_ctx* ctx, enum nfc_trace_type type,
+       const struct iovec* iov, size_t iovcnt)
+{
+  if (nfc_trace_writev(ctx->trace, type, iov, iovcnt) < 0) {
+    ctx->cb.log_err("KO: writing trace failed; tracing stopped\r\n");
+    nfcemu_ctx_stop_trace(ctx);
+  }
+}
+
+static void
+trace(struct nfcemu_ctx* ctx, enum nfc_trace_type type,
+      const void* data, size_t len)
+{
+  struct iovec iov = {
+    .iov_base = (void*)data,
+    .iov_len = len
+  };
+
+  tracev(ctx, type, &iov, 1);
+}
+
 void
-nfcemu_uninit()
+ctx_trace_cmdline(struct nfcemu_ctx* ctx, enum nfc_trace_cmdline cmd,
+                  const char* args)
+{
+  uint8_t c = cmd;
+  struct iovec iov[2] = {
+    { .iov_base = &c, .iov_len = 1 },
+    { .iov_base = (void*)args, .iov_len = args ? strlen(args) : 0 }
+  };
+
+  assert(ctx);
+
+  if (ctx->trace) {
+    tracev(ctx, NFC_TRACE_CMDLINE, iov, 2);
+  }
+}
+
+struct trace_create_param {
+  struct nfcemu_ctx* ctx;
+  enum nfc_trace_type type;
+  ssize_t (*create)(void*, struct nfc_device*, size_t, union nci_packet*);
+  void* data;
+};
+
+static ssize_t
+trace_create(void* data, struct nfc_device* nfc, size_t maxlen,
+             union nci_packet* pkt)
+{
+  const struct trace_create_param* param = data;
+  ssize_t len;
+
+  len = param->create(param->data, nfc, maxlen, pkt);
+
+  /* a packet's creator might have queued all of its packets and
+   * return 0; those are recorded when they are sent */
+  if (len > 0) {
+    NFC_D(&param->ctx->log, "sending %s length=%zd hdr=%02x%02x%02x",
+          param->type == NFC_TRACE_NTF ? "NTF" : "DTA", len,
+          ((const uint8_t*)pkt)[0], ((const uint8_t*)pkt)[1],
+          ((const uint8_t*)pkt)[2]);
+    if (param->ctx->trace) {
+      trace(param->ctx, param->type, pkt, len);
+    }
+  }
+  return len;
+}
+
+int
+ctx_send_ntf(struct nfcemu_ctx* ctx,
+             ssize_t (*create)(void*, struct nfc_device*, size_t,
+                               union nci_packet*),
+             void* data)
 {
-  return;
+  struct trace_create_param param = {
+    .ctx = ctx,
+    .type = NFC_TRACE_NTF,
+    .create = create,
+    .data = data
+  };
+
+  assert(ctx);
+
+  if (!ctx->trace && !NFC_LOG_ENABLED(&ctx->log, NFCEMU_LOG_DEBUG)) {
+    return ctx->cb.send_ntf(ctx->opaque, create, data);
+  }
+  return ctx->cb.send_ntf(ctx->opaque, trace_create, &param);
+}
+
+int
+ctx_send_dta(struct nfcemu_ctx* ctx,
+             ssize_t (*create)(void*, struct nfc_device*, size_t,
+                               union nci_packet*),
+             void* data)
+{
+  struct trace_create_param param = {
+    .ctx = ctx,
+    .type = NFC_TRACE_DTA,
+    .create = create,
+    .data = data
+  };
+
+  assert(ctx);
+
+  if (!ctx->trace && !NFC_LOG_ENABLED(&ctx->log, NFCEMU_LOG_DEBUG)) {
+    return ctx->cb.send_dta(ctx->opaque, create, data);
+  }
+  return ctx->cb.send_dta(ctx->opaque, trace_create, &param);
+}
+
+int
+ctx_recv_dta(struct nfcemu_ctx* ctx,
+             ssize_t (*handle)(void*, struct nfc_device*),
+             void* data)
+{
+  assert(ctx);
+
+  return ctx->cb.recv_dta(ctx->opaque, handle, data);
 }
 
 struct nfc_device*
-nfc_device_create()
+nfc_device_create(struct nfcemu_ctx* ctx)
 {
   struct nfc_device* nfc;
 
+  assert(ctx);
+
   nfc = malloc(sizeof(*nfc));
   if (!nfc) {
     return NULL;
   }
-  nfc_device_init(nfc);
+  nfc_device_init(nfc, ctx);
+
+  nfc->stats = nfc_stats_create();
+  if (!nfc->stats) {
+    NFC_E(&ctx->log, "allocating statistics failed: %d (%s)", errno,
+          strerror(errno));
+    free(nfc);
+    return NULL;
+  }
 
   return nfc;
 }
@@ -84,16 +516,147 @@ nfc_device_destroy(struct nfc_device* nfc)
 {
   assert(nfc);
 
+  nfc_device_uninit(nfc);
+  nfc_stats_destroy(nfc->stats);
   free(nfc);
 }
 
+static ssize_t
+trace_delivery(void* data, union nci_packet* pkt)
+{
+  struct nfcemu_ctx* ctx = data;
+  ssize_t len;
+
+  len = ctx->trace_delivery.func(ctx->trace_delivery.data, pkt);
+
+  if (len > 0 && ctx->trace) {
+    trace(ctx, NFC_TRACE_DELIVERY, pkt, len);
+  }
+  return len;
+}
+
 int
 nfc_device_process_nci_msg(struct nfc_device* nfc,
                            const uint8_t* cmd, uint8_t* rsp,
                            struct nfc_delivery_cb* cb)
 {
-  return nfc_process_nci_msg((const union nci_packet*)cmd, nfc,
-                             (union nci_packet*)rsp, cb);
+  struct nfcemu_ctx* ctx;
+  size_t len;
+
+  assert(nfc);
+
+  ctx = nfc->ctx;
+
+  if (ctx->trace) {
+    trace(ctx, NFC_TRACE_NCI_MSG, cmd, 3 + cmd[2]);
+  }
+
+  len = nfc_process_nci_msg((const union nci_packet*)cmd, nfc,
+                            (union nci_packet*)rsp, cb);
+
+  NFC_D(&ctx->log, "NCI response length=%zu", len);
+
+  if (ctx->trace) {
+    trace(ctx, NFC_TRACE_NCI_RSP, rsp, len);
+    if (cb->func) {
+      /* the host calls the delivery callback after sending
+       * the response; we record the packet it creates */
+      ctx->trace_delivery = *cb;
+      cb->func = trace_delivery;
+      cb->data = ctx;
+    }
+  }
+  return len;
+}
+
+static void
+nci_ring_put(struct nfc_nci_ring* ring, const void* data, size_t len)
+{
+  size_t off, n;
+
+  assert(ring->size - (ring->tail - ring->head) >= len);
+
+  off = ring->tail % ring->size;
+  n = ring->size - off;
+  if (n > len) {
+    n = len;
+  }
+  memcpy(ring->buf + off, data, n);
+  memcpy(ring->buf, (const uint8_t*)data + n, len - n);
+  ring->tail += len;
+}
+
+/* Returns how many bytes a packet can produce: a response and
+ * a notification, or the segments of a frame and the credits
+ * notification for the last data packet of a frame. */
+static size_t
+max_nci_output(const struct nfc_device* nfc, const union nci_packet* pkt)
+{
+  const struct nfc_conn* conn;
+  size_t nsegs;
+
+  if (pkt->data.mt != NCI_MT_DTA) {
+    return 2 * MAX_NCI_PACKET_LENGTH;
+  }
+  conn = nfc->conn + pkt->data.connid;
+  if (!conn->dest) {
+    return 0;
+  } else if (pkt->data.pbf == NCI_PBF_SEG) {
+    return MAX_NCI_PACKET_LENGTH; /* the frame is incomplete */
+  }
+  nsegs = (NFC_MAX_FRAME_LENGTH + conn->maxpayload - 1) / conn->maxpayload;
+
+  return NFC_MAX_FRAME_LENGTH + 3 * nsegs + MAX_NCI_PACKET_LENGTH;
+}
+
+size_t
+nfc_device_process_nci_batch(struct nfc_device* nfc,
+                             const struct iovec* in, size_t n,
+                             struct nfc_nci_ring* out)
+{
+  size_t i;
+
+  assert(nfc);
+  assert(in || !n);
+  assert(out);
+  assert(out->buf || !out->size);
+  assert(out->tail - out->head <= out->size);
+
+  for (i = 0; i < n; ++i) {
+    const uint8_t* cmd = in[i].iov_base;
+    struct nfc_delivery_cb cb = {
+      .type = NO_BUF,
+      .data = NULL,
+      .func = NULL
+    };
+    union nci_packet rsp;
+    ssize_t len;
+
+    if (in[i].iov_len < 3 || in[i].iov_len < 3u + cmd[2]) {
+      break; /* truncated packet */
+    }
+    /* queued data packets come out after this packet's output */
+    if (out->size - (out->tail - out->head) <
+        nfc_ring_len(&nfc->dta_q) +
+        max_nci_output(nfc, (const union nci_packet*)cmd)) {
+      break;
+    }
+
+    len = nfc_device_process_nci_msg(nfc, cmd, (uint8_t*)&rsp, &cb);
+    nci_ring_put(out, &rsp, len);
+
+    if (cb.func) {
+      len = cb.func(cb.data, &rsp);
+      if (len > 0) {
+        nci_ring_put(out, &rsp, len);
+      }
+    }
+    while ((len = nfc_device_dequeue_dta(nfc, &rsp)) > 0) {
+      nci_ring_put(out, &rsp, len);
+    }
+  }
+
+  return i;
 }
 
 int
@@ -101,6 +664,208 @@ nfc_device_process_hci_msg(struct nfc_device* nfc,
                            const uint8_t* cmd, uint8_t* rsp,
                            struct nfc_delivery_cb* cb)
 {
-  return nfc_process_hci_cmd((const union hci_packet*)cmd, nfc,
-                             (union hci_answer*)rsp);
+  struct nfcemu_ctx* ctx;
+  size_t len;
+
+  assert(nfc);
+
+  ctx = nfc->ctx;
+
+  if (ctx->trace) {
+    trace(ctx, NFC_TRACE_HCI_MSG, cmd, 3 + cmd[2]);
+  }
+
+  len = nfc_process_hci_cmd((const union hci_packet*)cmd, nfc,
+                            (union hci_answer*)rsp);
+
+  if (ctx->trace) {
+    trace(ctx, NFC_TRACE_HCI_RSP, rsp, len);
+  }
+  return len;
+}
+
+struct get_cmd_stats_param {
+  struct nfcemu_cmd_stats* stats;
+  size_t n;
+  size_t i;
+};
+
+static void
+get_cmd_stats(void* data, const struct nfcemu_cmd_stats* stats)
+{
+  struct get_cmd_stats_param* param = data;
+
+  if (param->i < param->n) {
+    param->stats[param->i++] = *stats;
+  }
+}
+
+size_t
+nfc_device_get_cmd_stats(const struct nfc_device* nfc,
+                         struct nfcemu_cmd_stats* stats, size_t n)
+{
+  struct get_cmd_stats_param param = {
+    .stats = stats,
+    .n = n,
+    .i = 0
+  };
+
+  assert(nfc);
+  assert(stats || !n);
+
+  if (!nfc->stats) {
+    return 0;
+  }
+  return nfc_stats_foreach(nfc->stats, get_cmd_stats, &param);
+}
+
+void
+nfc_device_reset_cmd_stats(struct nfc_device* nfc)
+{
+  assert(nfc);
+
+  if (nfc->stats) {
+    nfc_stats_reset(nfc->stats);
+  }
+}
+
+size_t
+nfcemu_snapshot(const struct nfc_device* nfc, void* buf, size_t len)
+{
+  static const uint8_t hdr[NFC_SNAPSHOT_HEADER_LENGTH] = {
+    'N', 'F', 'C', 'S', NFC_SNAPSHOT_VERSION,
+    NUMBER_OF_NFC_RES, NUMBER_OF_NFC_TAGS, 0
+  };
+  const struct nfcemu_ctx* ctx;
+  struct nfc_snapshot snap;
+  size_t i;
+
+  assert(nfc);
+
+  ctx = nfc->ctx;
+
+  nfc_snapshot_init_writer(&snap, buf, len);
+  nfc_snapshot_put_mem(&snap, sizeof(hdr), hdr);
+
+  nfc_device_snapshot(nfc, &snap);
+  for (i = 0; i < NUMBER_OF_NFC_RES; ++i) {
+    nfc_re_snapshot(ctx->res + i, &snap);
+  }
+  for (i = 0; i < NUMBER_OF_NFC_TAGS; ++i) {
+    nfc_tag_snapshot(ctx->tags + i, &snap);
+  }
+
+  return snap.off;
+}
+
+int
+nfcemu_restore(struct nfc_device* nfc, const void* buf, size_t len)
+{
+  struct nfcemu_ctx* ctx;
+  struct nfc_snapshot snap;
+  const uint8_t* hdr;
+  size_t i;
+  int res;
+
+  assert(nfc);
+
+  ctx = nfc->ctx;
+
+  nfc_snapshot_init_reader(&snap, buf, len);
+
+  hdr = nfc_snapshot_get_ptr(&snap, NFC_SNAPSHOT_HEADER_LENGTH);
+  if (!hdr || memcmp(hdr, NFC_SNAPSHOT_MAGIC, 4) ||
+      (hdr[4] != NFC_SNAPSHOT_VERSION) || (hdr[5] != NUMBER_OF_NFC_RES) ||
+      (hdr[6] != NUMBER_OF_NFC_TAGS)) {
+    NFC_E(&ctx->log, "invalid snapshot");
+    return -1;
+  }
+
+  res = nfc_device_restore(nfc, &snap);
+  for (i = 0; !res && (i < NUMBER_OF_NFC_RES); ++i) {
+    res = nfc_re_restore(ctx->res + i, &snap);
+  }
+  for (i = 0; !res && (i < NUMBER_OF_NFC_TAGS); ++i) {
+    res = nfc_tag_restore(ctx->tags + i, &snap);
+  }
+  if (!res && (snap.off != len)) {
+    res = -1; /* trailing garbage */
+  }
+  if (res < 0) {
+    NFC_E(&ctx->log, "restoring snapshot failed at offset %zu", snap.off);
+    nfc_device_reset(nfc);
+    for (i = 0; i < NUMBER_OF_NFC_RES; ++i) {
+      nfc_re_reset(ctx->res + i);
+    }
+    return -1;
+  }
+
+  return 0;
+}
+
+nfcemu_timeout*
+ctx_new_timeout(struct nfcemu_ctx* ctx, void (*cb)(void*), void* data)
+{
+  struct nfc_timer* timer;
+
+  assert(ctx);
+
+  if (!ctx->timers) {
+    return ctx->cb.new_timeout(cb, data);
+  }
+  timer = malloc(sizeof(*timer));
+  if (!timer) {
+    return NULL;
+  }
+  nfc_timer_init(timer, cb, data);
+
+  return timer;
+}
+
+void
+ctx_mod_timeout(struct nfcemu_ctx* ctx, nfcemu_timeout* t, unsigned long ms)
+{
+  assert(ctx);
+
+  if (!ctx->timers) {
+    ctx->cb.mod_timeout(t, ms);
+    return;
+  }
+  nfc_timer_mod(ctx->timers, t, ms);
+}
+
+void
+ctx_del_timeout(struct nfcemu_ctx* ctx, nfcemu_timeout* t)
+{
+  assert(ctx);
+
+  if (!ctx->timers) {
+    ctx->cb.del_timeout(t);
+    return;
+  }
+  nfc_timer_del(ctx->timers, t);
+}
+
+int
+ctx_timeout_is_pending(struct nfcemu_ctx* ctx, nfcemu_timeout* t)
+{
+  assert(ctx);
+
+  if (!ctx->timers) {
+    return ctx->cb.timeout_is_pending(t);
+  }
+  return nfc_timer_is_pending(t);
+}
+
+void
+ctx_free_timeout(struct nfcemu_ctx* ctx, nfcemu_timeout* t)
+{
+  assert(ctx);
+
+  /* the host's timeouts have no destructor */
+  ctx_del_timeout(ctx, t);
+
+  if (ctx->timers) {
+    free(t);
+  }
 }
@@ -69,6 +69,9 @@ snep_create_msg(struct snep* snep, enum snep_msg msg, uint32_t len);
 size_t
 snep_create_req_put(struct snep* snep, uint32_t len);
 
+size_t
+snep_create_rsp_continue(struct snep* snep);
+
 size_t
 snep_create_rsp_success(struct snep* snep, uint32_t len);
 
@@ -84,4 +87,7 @@ snep_create_rsp_not_implemented(struct snep* snep);
 size_t
 snep_create_rsp_unsupported_version(struct snep* snep);
 
+size_t
+snep_create_rsp_reject(struct snep* snep);
+
 #endif
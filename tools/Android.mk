@@ -0,0 +1,78 @@
+#
+# Copyright (C) 2014  Mozilla Foundation
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+LOCAL_PATH := $(call my-dir)
+
+#
+# Benchmark
+#
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := host-stub.c \
+                   nfcemu-bench.c
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../include
+LOCAL_STATIC_LIBRARIES := libnfcemu
+# count the emulator's allocations
+LOCAL_LDFLAGS := -Wl,--wrap=malloc \
+                 -Wl,--wrap=calloc \
+                 -Wl,--wrap=realloc \
+                 -Wl,--wrap=free
+LOCAL_LDLIBS := -lrt
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE := nfcemu-bench
+include $(BUILD_HOST_EXECUTABLE)
+
+#
+# Trace replay
+#
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := host-stub.c \
+                   nfcemu-replay.c
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../include
+LOCAL_STATIC_LIBRARIES := libnfcemu
+LOCAL_LDLIBS := -lrt
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE := nfcemu-replay
+include $(BUILD_HOST_EXECUTABLE)
+
+#
+# Snapshot tests
+#
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := host-stub.c \
+                   nfcemu-snapshot-test.c
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../include
+LOCAL_STATIC_LIBRARIES := libnfcemu
+LOCAL_LDLIBS := -lrt
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE := nfcemu-snapshot-test
+include $(BUILD_HOST_EXECUTABLE)
+
+#
+# SNEP tests
+#
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := host-stub.c \
+                   nfcemu-snep-test.c
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../include
+LOCAL_STATIC_LIBRARIES := libnfcemu
+LOCAL_LDLIBS := -lrt
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE := nfcemu-snep-test
+include $(BUILD_HOST_EXECUTABLE)
@@ -0,0 +1,234 @@
+/*
+ * Copyright (C) 2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include "host-stub.h"
+
+static void
+log_msg(const char* fmt, ...)
+{
+    /* debug output is dropped */
+}
+
+static void
+log_err(const char* fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+/*
+ * I/O
+ */
+
+static void
+deliver(struct host_stub* host, enum nfc_trace_type type,
+        const uint8_t* pkt, size_t len)
+{
+    if (host->recv) {
+        host->recv(host->recv_data, type, pkt, len);
+    }
+}
+
+static int
+recv_packet(struct host_stub* host, enum nfc_trace_type type,
+            unsigned long* npkts,
+            ssize_t (*create)(void*, struct nfc_device*, size_t,
+                              union nci_packet*),
+            void* data)
+{
+    ssize_t len;
+
+    len = create(data, host->nfc, sizeof(host->out),
+                 (union nci_packet*)host->out);
+    if (len < 0) {
+        return -1;
+    } else if (len > 0) {
+        /* Creating a packet returns 0 if the packet has been
+         * queued behind others; keep the last packet we got. */
+        host->outlen = len;
+        ++*npkts;
+        deliver(host, type, host->out, len);
+    }
+
+    return 0;
+}
+
+static int
+send_ntf(void* opaque,
+         ssize_t (*create)(void*, struct nfc_device*, size_t,
+                           union nci_packet*),
+         void* data)
+{
+    struct host_stub* host = opaque;
+
+    return recv_packet(host, NFC_TRACE_NTF, &host->nntfs, create, data);
+}
+
+static int
+send_dta(void* opaque,
+         ssize_t (*create)(void*, struct nfc_device*, size_t,
+                           union nci_packet*),
+         void* data)
+{
+    struct host_stub* host = opaque;
+
+    return recv_packet(host, NFC_TRACE_DTA, &host->ndtas, create, data);
+}
+
+static int
+recv_dta(void* opaque,
+         ssize_t (*handle)(void*, struct nfc_device*),
+         void* data)
+{
+    struct host_stub* host = opaque;
+
+    return handle(data, host->nfc) < 0 ? -1 : 0;
+}
+
+/*
+ * Host stub
+ */
+
+int
+host_stub_init(struct host_stub* host)
+{
+    assert(host);
+
+    memset(host, 0, sizeof(*host));
+
+    host->ctx = nfcemu_ctx_create(host, log_msg, log_err,
+                                  NULL, NULL, NULL, NULL,
+                                  send_ntf, send_dta, recv_dta);
+    if (!host->ctx) {
+        return -1;
+    }
+    host->nfc = nfc_device_create(host->ctx);
+    if (!host->nfc) {
+        nfcemu_ctx_destroy(host->ctx);
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+host_stub_uninit(struct host_stub* host)
+{
+    assert(host);
+
+    nfc_device_destroy(host->nfc);
+    nfcemu_ctx_destroy(host->ctx);
+}
+
+void
+host_stub_advance(struct host_stub* host, uint64_t ns)
+{
+    assert(host);
+
+    nfcemu_advance_time(host->ctx, ns);
+    host->now += ns;
+}
+
+ssize_t
+host_stub_send_nci(struct host_stub* host, const uint8_t* pkt, size_t len)
+{
+    /* The controller may look at a full packet's worth of bytes,
+     * so we hand over a padded copy. The same goes for HCI. */
+    uint8_t cmd[MAX_NCI_PACKET_LENGTH];
+    struct nfc_delivery_cb cb = {
+        .type = NO_BUF,
+        .data = NULL,
+        .func = NULL
+    };
+    ssize_t res;
+
+    assert(host);
+    assert(pkt);
+    assert(len <= sizeof(cmd));
+
+    memcpy(cmd, pkt, len);
+    memset(cmd + len, 0, sizeof(cmd) - len);
+
+    res = nfc_device_process_nci_msg(host->nfc, cmd, host->out, &cb);
+    if (res < 0) {
+        return -1;
+    }
+    host->outlen = res;
+    deliver(host, NFC_TRACE_NCI_RSP, host->out, res);
+
+    if (cb.func) {
+        res = cb.func(cb.data, (union nci_packet*)host->out);
+        if (res < 0) {
+            return -1;
+        }
+        if (res > 0) {
+            host->outlen = res;
+            ++host->nntfs;
+            deliver(host, NFC_TRACE_DELIVERY, host->out, res);
+        }
+    }
+
+    return host->outlen;
+}
+
+ssize_t
+host_stub_send_hci(struct host_stub* host, const uint8_t* pkt, size_t len)
+{
+    uint8_t cmd[MAX_NCI_PACKET_LENGTH];
+    ssize_t res;
+
+    assert(host);
+    assert(pkt);
+    assert(len <= sizeof(cmd));
+
+    memcpy(cmd, pkt, len);
+    memset(cmd + len, 0, sizeof(cmd) - len);
+
+    res = nfc_device_process_hci_msg(host->nfc, cmd, host->out, NULL);
+    if (res < 0) {
+        return -1;
+    }
+    host->outlen = res;
+    deliver(host, NFC_TRACE_HCI_RSP, host->out, res);
+
+    return host->outlen;
+}
+
+int
+host_stub_run_cmd(struct host_stub* host,
+                  int (*cmd)(struct nfcemu_ctx*, char*), const char* args)
+{
+    char buf[256];
+
+    assert(host);
+    assert(cmd);
+    assert(!args || strlen(args) < sizeof(buf));
+
+    if (!args) {
+        return cmd(host->ctx, NULL);
+    }
+    /* handlers tokenize their arguments in place */
+    strcpy(buf, args);
+
+    return cmd(host->ctx, buf);
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef host_stub_h
+#define host_stub_h
+
+#include <stdint.h>
+#include <nfcemu/nfcemu.h>
+#include <nfcemu/trace.h>
+
+/* An in-process host for running the emulator without goldfish. It
+ * leaves the timeouts to the emulator's timer wheel and runs it in
+ * virtual time: timeouts only fire when the clock is advanced by
+ * host_stub_advance().
+ */
+
+struct host_stub {
+    struct nfcemu_ctx* ctx;
+    struct nfc_device* nfc;
+    uint64_t now; /* virtual clock in ns */
+    unsigned long nntfs; /* notifications sent by the controller */
+    unsigned long ndtas; /* data packets sent by the controller */
+    size_t outlen;
+    uint8_t out[MAX_NCI_PACKET_LENGTH]; /* last packet from the controller */
+    /* optional; sees every packet from the controller, including
+     * empty responses, as one of the emulator's trace types */
+    void (*recv)(void* data, enum nfc_trace_type type,
+                 const uint8_t* pkt, size_t len);
+    void* recv_data;
+};
+
+int
+host_stub_init(struct host_stub* host);
+
+void
+host_stub_uninit(struct host_stub* host);
+
+/* Advances the virtual clock and runs all timeouts that expire. */
+void
+host_stub_advance(struct host_stub* host, uint64_t ns);
+
+/* Sends an NCI packet to the controller. The response, and a
+ * notification if any, end up in host->out. Returns the length
+ * of the last packet received, or -1 on errors.
+ */
+ssize_t
+host_stub_send_nci(struct host_stub* host, const uint8_t* pkt, size_t len);
+
+/* Sends an HCI command to the controller; the response ends up
+ * in host->out. */
+ssize_t
+host_stub_send_hci(struct host_stub* host, const uint8_t* pkt, size_t len);
+
+/* Runs a command-line handler, such as nfc_cmd_nci(). 'args'
+ * may be NULL. */
+int
+host_stub_run_cmd(struct host_stub* host,
+                  int (*cmd)(struct nfcemu_ctx*, char*), const char* args);
+
+#endif
@@ -0,0 +1,622 @@
+/*
+ * Copyright (C) 2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* End-to-end benchmark for libnfcemu. Each scenario drives the
+ * emulator through the in-process host stub, with timeouts running
+ * on the stub's virtual clock. Allocations are counted by wrapping
+ * the allocator at link time (-Wl,--wrap=malloc, etc.).
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <nfcemu/cmdline.h>
+#include "host-stub.h"
+
+/*
+ * Allocation counting
+ */
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t nmemb, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+void __real_free(void* ptr);
+
+static unsigned long nallocs;
+
+void*
+__wrap_malloc(size_t size)
+{
+    ++nallocs;
+    return __real_malloc(size);
+}
+
+void*
+__wrap_calloc(size_t nmemb, size_t size)
+{
+    ++nallocs;
+    return __real_calloc(nmemb, size);
+}
+
+void*
+__wrap_realloc(void* ptr, size_t size)
+{
+    ++nallocs;
+    return __real_realloc(ptr, size);
+}
+
+void
+__wrap_free(void* ptr)
+{
+    __real_free(ptr);
+}
+
+/*
+ * Statistics
+ */
+
+enum {
+    BENCH_MAX_OPS = 16
+};
+
+/* latencies of one kind of operation, in ns */
+struct bench_op {
+    const char* name;
+    size_t n;
+    size_t cap;
+    uint32_t* ns;
+};
+
+struct bench {
+    struct host_stub host;
+    int verbose;
+    unsigned long nmsgs; /* NCI packets exchanged with the controller */
+    unsigned long nerrs;
+    size_t nops;
+    struct bench_op op[BENCH_MAX_OPS];
+};
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static struct bench_op*
+get_op(struct bench* b, const char* name)
+{
+    size_t i;
+
+    for (i = 0; i < b->nops; ++i) {
+        if (b->op[i].name == name || !strcmp(b->op[i].name, name)) {
+            return b->op + i;
+        }
+    }
+    assert(b->nops < BENCH_MAX_OPS);
+
+    b->op[b->nops].name = name;
+    b->op[b->nops].n = 0;
+
+    return b->op + b->nops++;
+}
+
+static void
+record(struct bench* b, const char* name, uint64_t ns)
+{
+    struct bench_op* op = get_op(b, name);
+
+    if (op->n == op->cap) {
+        /* counted allocations; they are amortized over time */
+        size_t cap = op->cap ? op->cap * 2 : 1024;
+        uint32_t* p = __real_realloc(op->ns, cap * sizeof(*p));
+        if (!p) {
+            return;
+        }
+        op->ns = p;
+        op->cap = cap;
+    }
+    op->ns[op->n++] = ns > UINT32_MAX ? UINT32_MAX : ns;
+}
+
+static void
+dump(const struct bench* b, const char* tag, const uint8_t* p, size_t len)
+{
+    size_t i;
+
+    if (!b->verbose) {
+        return;
+    }
+    printf("%s:", tag);
+    for (i = 0; i < len; ++i) {
+        printf(" %02x", p[i]);
+    }
+    printf("\n");
+}
+
+/*
+ * Operations
+ */
+
+static void
+nci(struct bench* b, const char* name, const uint8_t* pkt, size_t len)
+{
+    unsigned long nntfs, ndtas;
+    uint64_t t0;
+    ssize_t res;
+
+    nntfs = b->host.nntfs;
+    ndtas = b->host.ndtas;
+
+    dump(b, "CMD", pkt, len);
+
+    t0 = now_ns();
+    res = host_stub_send_nci(&b->host, pkt, len);
+    record(b, name, now_ns() - t0);
+
+    if (res < 0) {
+        ++b->nerrs;
+        return;
+    }
+    dump(b, "RSP", b->host.out, res);
+
+    b->nmsgs += 1 + (res > 0) +
+                (b->host.nntfs - nntfs) + (b->host.ndtas - ndtas);
+}
+
+#define NCI(_b, _name, ...) \
+    do { \
+        static const uint8_t pkt_[] = { __VA_ARGS__ }; \
+        nci((_b), (_name), pkt_, sizeof(pkt_)); \
+    } while (0)
+
+static void
+cmd(struct bench* b, const char* name,
+    int (*func)(struct nfcemu_ctx*, char*), const char* args)
+{
+    unsigned long nntfs, ndtas;
+    uint64_t t0;
+    int res;
+
+    nntfs = b->host.nntfs;
+    ndtas = b->host.ndtas;
+
+    t0 = now_ns();
+    res = host_stub_run_cmd(&b->host, func, args);
+    record(b, name, now_ns() - t0);
+
+    if (res < 0) {
+        ++b->nerrs;
+        return;
+    }
+    if (b->host.nntfs != nntfs || b->host.ndtas != ndtas) {
+        dump(b, "OUT", b->host.out, b->host.outlen);
+    }
+    b->nmsgs += (b->host.nntfs - nntfs) + (b->host.ndtas - ndtas);
+}
+
+/* lets the virtual clock run, so that pending LLCP PDUs go out */
+static void
+tick(struct bench* b, const char* name, uint64_t ms)
+{
+    unsigned long ndtas;
+    uint64_t t0;
+
+    ndtas = b->host.ndtas;
+
+    t0 = now_ns();
+    host_stub_advance(&b->host, ms * 1000000ull);
+    record(b, name, now_ns() - t0);
+
+    if (b->host.ndtas != ndtas) {
+        dump(b, "DTA", b->host.out, b->host.outlen);
+    }
+    b->nmsgs += b->host.ndtas - ndtas;
+}
+
+/*
+ * Scenarios
+ */
+
+static void
+nci_init(struct bench* b)
+{
+    NCI(b, "CORE_RESET", 0x20, 0x00, 0x01, 0x01);
+    NCI(b, "CORE_INIT", 0x20, 0x01, 0x00);
+    NCI(b, "CORE_SET_CONFIG", 0x20, 0x02, 0x04, 0x01, 0x30, 0x01, 0x00);
+}
+
+static void
+rf_discover(struct bench* b)
+{
+    /* poll for NFC-A and NFC-F */
+    NCI(b, "RF_DISCOVER",
+        0x21, 0x03, 0x05, 0x02, 0x00, 0x01, 0x02, 0x01);
+}
+
+static void
+rf_deactivate_idle(struct bench* b)
+{
+    NCI(b, "RF_DEACTIVATE", 0x21, 0x06, 0x01, 0x00);
+}
+
+static void
+rf_deactivate_discovery(struct bench* b)
+{
+    NCI(b, "RF_DEACTIVATE", 0x21, 0x06, 0x01, 0x03);
+}
+
+static void
+activate_re(struct bench* b, unsigned long i)
+{
+    static const char* const args[] = {
+        "rf_intf_activated_ntf 0",
+        "rf_intf_activated_ntf 1",
+        "rf_intf_activated_ntf 2",
+        "rf_intf_activated_ntf 3",
+        "rf_intf_activated_ntf 4",
+        "rf_intf_activated_ntf 5"
+    };
+    assert(i < sizeof(args)/sizeof(args[0]));
+
+    cmd(b, "activate", nfc_cmd_nci, args[i]);
+}
+
+static void
+setup_discovery(struct bench* b)
+{
+    nci_init(b);
+}
+
+static void
+run_discovery(struct bench* b)
+{
+    rf_discover(b);
+    rf_deactivate_idle(b);
+}
+
+static void
+setup_activation(struct bench* b)
+{
+    nci_init(b);
+    rf_discover(b);
+}
+
+static void
+run_activation(struct bench* b)
+{
+    unsigned long i;
+
+    for (i = 0; i < 6; ++i) {
+        activate_re(b, i);
+        rf_deactivate_discovery(b);
+    }
+}
+
+static void
+setup_t1t(struct bench* b)
+{
+    setup_activation(b);
+    activate_re(b, 2);
+}
+
+static void
+run_t1t(struct bench* b)
+{
+    NCI(b, "T1T_RID", 0x00, 0x00, 0x04, 0x78, 0x00, 0x00, 0x00);
+    NCI(b, "T1T_RALL", 0x00, 0x00, 0x01, 0x00);
+}
+
+static void
+setup_t2t(struct bench* b)
+{
+    setup_activation(b);
+    cmd(b, "tag", nfc_cmd_tag, "set 3 [0,1,VA,,Zm9vYmFy]");
+    activate_re(b, 3);
+}
+
+static void
+run_t2t(struct bench* b)
+{
+    NCI(b, "T2T_READ", 0x00, 0x00, 0x02, 0x30, 0x00);
+    NCI(b, "T2T_READ", 0x00, 0x00, 0x02, 0x30, 0x04);
+    NCI(b, "T2T_READ", 0x00, 0x00, 0x02, 0x30, 0x08);
+    NCI(b, "T2T_READ", 0x00, 0x00, 0x02, 0x30, 0x0c);
+}
+
+static void
+setup_t3t(struct bench* b)
+{
+    setup_activation(b);
+    cmd(b, "tag", nfc_cmd_tag, "set 4 [0,1,VA,,Zm9vYmFy]");
+    activate_re(b, 4);
+}
+
+static void
+run_t3t(struct bench* b)
+{
+    /* CHECK of the attribute block and the first data block */
+    NCI(b, "T3T_CHECK", 0x00, 0x00, 0x10,
+        0x10, 0x06, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
+        0x01, 0x0b, 0x00, 0x01, 0x80, 0x00);
+    NCI(b, "T3T_CHECK", 0x00, 0x00, 0x10,
+        0x10, 0x06, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
+        0x01, 0x0b, 0x00, 0x01, 0x80, 0x01);
+}
+
+static void
+setup_t4t(struct bench* b)
+{
+    setup_activation(b);
+    cmd(b, "tag", nfc_cmd_tag, "set 5 [0,1,VA,,Zm9vYmFy]");
+    activate_re(b, 5);
+}
+
+static void
+run_t4t(struct bench* b)
+{
+    NCI(b, "T4T_SELECT_APP", 0x00, 0x00, 0x0d,
+        0x00, 0xa4, 0x04, 0x00, 0x07, 0xd2, 0x76, 0x00, 0x00, 0x85,
+        0x01, 0x01, 0x00);
+    NCI(b, "T4T_SELECT_CC", 0x00, 0x00, 0x07,
+        0x00, 0xa4, 0x00, 0x0c, 0x02, 0xe1, 0x03);
+    NCI(b, "T4T_READ_BINARY", 0x00, 0x00, 0x05,
+        0x00, 0xb0, 0x00, 0x00, 0x0f);
+    NCI(b, "T4T_SELECT_NDEF", 0x00, 0x00, 0x07,
+        0x00, 0xa4, 0x00, 0x0c, 0x02, 0xe1, 0x04);
+    NCI(b, "T4T_READ_BINARY", 0x00, 0x00, 0x05,
+        0x00, 0xb0, 0x00, 0x00, 0x02);
+    NCI(b, "T4T_READ_BINARY", 0x00, 0x00, 0x05,
+        0x00, 0xb0, 0x00, 0x02, 0x0d);
+}
+
+/* LLCP PDUs from the guest's SAP 0x20 to the RE's SNEP server */
+#define LLCP_SYMM 0x00, 0x00
+#define LLCP_CONNECT_SNEP 0x11, 0x20
+#define LLCP_DISC_SNEP 0x11, 0x60
+
+static void
+setup_llcp(struct bench* b)
+{
+    setup_activation(b);
+    activate_re(b, 0);
+    NCI(b, "LLCP_SYMM", 0x00, 0x00, 0x02, LLCP_SYMM);
+}
+
+static void
+run_llcp_connect(struct bench* b)
+{
+    NCI(b, "LLCP_CONNECT", 0x00, 0x00, 0x02, LLCP_CONNECT_SNEP);
+    NCI(b, "LLCP_DISC", 0x00, 0x00, 0x02, LLCP_DISC_SNEP);
+}
+
+static void
+setup_snep_put(struct bench* b)
+{
+    setup_llcp(b);
+    NCI(b, "LLCP_CONNECT", 0x00, 0x00, 0x02, LLCP_CONNECT_SNEP);
+}
+
+static void
+run_snep_put(struct bench* b)
+{
+    /* SNEP PUT of a text record "x" */
+    NCI(b, "SNEP_PUT", 0x00, 0x00, 0x11,
+        0x13, 0x20, 0x00,
+        0x10, 0x02, 0x00, 0x00, 0x00, 0x08,
+        0xd1, 0x01, 0x04, 0x54, 0x02, 0x65, 0x6e, 0x78);
+}
+
+static void
+run_snep_push(struct bench* b)
+{
+    /* the RE connects to the guest's SNEP server and sends
+     * a PUT request; the guest answers with SYMM PDUs */
+    cmd(b, "snep", nfc_cmd_snep, "put 4 32 [0,1,VA,,Zm9v]");
+    NCI(b, "LLCP_SYMM", 0x00, 0x00, 0x02, LLCP_SYMM);
+    tick(b, "xmit", 2000);
+    /* CC from the guest's SNEP server */
+    NCI(b, "LLCP_CC", 0x00, 0x00, 0x02, 0x81, 0x84);
+    tick(b, "xmit", 2000);
+    NCI(b, "LLCP_SYMM", 0x00, 0x00, 0x02, LLCP_SYMM);
+    /* DISC from the guest's SNEP server */
+    NCI(b, "LLCP_DISC", 0x00, 0x00, 0x02, 0x81, 0x44);
+    tick(b, "xmit", 2000);
+}
+
+struct scenario {
+    const char* name;
+    void (*setup)(struct bench*);
+    void (*run)(struct bench*);
+};
+
+static const struct scenario scenarios[] = {
+    { "nci-init", NULL, nci_init },
+    { "discovery", setup_discovery, run_discovery },
+    { "activation", setup_activation, run_activation },
+    { "t1t-read", setup_t1t, run_t1t },
+    { "t2t-read", setup_t2t, run_t2t },
+    { "t3t-read", setup_t3t, run_t3t },
+    { "t4t-read", setup_t4t, run_t4t },
+    { "llcp-connect", setup_llcp, run_llcp_connect },
+    { "snep-put", setup_snep_put, run_snep_put },
+    { "snep-push", setup_llcp, run_snep_push }
+};
+
+/*
+ * Reporting
+ */
+
+static int
+cmp_u32(const void* lhs, const void* rhs)
+{
+    uint32_t l = *(const uint32_t*)lhs;
+    uint32_t r = *(const uint32_t*)rhs;
+
+    return (l > r) - (l < r);
+}
+
+static uint32_t
+percentile(const struct bench_op* op, unsigned int p)
+{
+    return op->ns[(op->n - 1) * p / 100];
+}
+
+static void
+report(const struct scenario* s, struct bench* b,
+       unsigned long iters, uint64_t ns, unsigned long allocs)
+{
+    size_t i;
+
+    printf("%-12s %8lu iters %10.0f msgs/s %8.2f allocs/iter %lu errors\n",
+           s->name, iters, b->nmsgs * 1e9 / (ns ? ns : 1),
+           (double)allocs / iters, b->nerrs);
+
+    for (i = 0; i < b->nops; ++i) {
+        struct bench_op* op = b->op + i;
+        if (!op->n) {
+            continue;
+        }
+        qsort(op->ns, op->n, sizeof(*op->ns), cmp_u32);
+        printf("  %-18s %8zu  p50 %6u  p90 %6u  p99 %6u  max %8u ns\n",
+               op->name, op->n, percentile(op, 50), percentile(op, 90),
+               percentile(op, 99), op->ns[op->n - 1]);
+    }
+}
+
+static int
+run_scenario(const struct scenario* s, unsigned long iters, int verbose)
+{
+    struct bench b;
+    unsigned long i, allocs;
+    uint64_t t0, ns;
+    size_t j;
+
+    memset(&b, 0, sizeof(b));
+    b.verbose = verbose;
+
+    if (host_stub_init(&b.host) < 0) {
+        fprintf(stderr, "%s: cannot create emulator\n", s->name);
+        return -1;
+    }
+    if (s->setup) {
+        s->setup(&b);
+    }
+
+    /* only the scenario's iterations are measured */
+    for (j = 0; j < b.nops; ++j) {
+        b.op[j].n = 0;
+    }
+    b.nmsgs = 0;
+    allocs = nallocs;
+
+    t0 = now_ns();
+    for (i = 0; i < iters; ++i) {
+        s->run(&b);
+    }
+    ns = now_ns() - t0;
+
+    report(s, &b, iters, ns, nallocs - allocs);
+
+    host_stub_uninit(&b.host);
+    for (j = 0; j < b.nops; ++j) {
+        __real_free(b.op[j].ns);
+    }
+
+    return b.nerrs ? -1 : 0;
+}
+
+static void
+usage(const char* argv0)
+{
+    size_t i;
+
+    fprintf(stderr, "usage: %s [-n iterations] [-v] [scenario ...]\n"
+                    "scenarios:", argv0);
+    for (i = 0; i < sizeof(scenarios)/sizeof(scenarios[0]); ++i) {
+        fprintf(stderr, " %s", scenarios[i].name);
+    }
+    fprintf(stderr, "\n");
+}
+
+int
+main(int argc, char* argv[])
+{
+    unsigned long iters;
+    int verbose, opt, res;
+    size_t i;
+
+    iters = 10000;
+    verbose = 0;
+
+    while ((opt = getopt(argc, argv, "n:v")) != -1) {
+        switch (opt) {
+            case 'n':
+                iters = strtoul(optarg, NULL, 0);
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (!iters) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for (opt = optind; opt < argc; ++opt) {
+        for (i = 0; i < sizeof(scenarios)/sizeof(scenarios[0]); ++i) {
+            if (!strcmp(argv[opt], scenarios[i].name)) {
+                break;
+            }
+        }
+        if (i == sizeof(scenarios)/sizeof(scenarios[0])) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    res = 0;
+
+    for (i = 0; i < sizeof(scenarios)/sizeof(scenarios[0]); ++i) {
+        int j;
+
+        if (optind < argc) {
+            for (j = optind; j < argc; ++j) {
+                if (!strcmp(argv[j], scenarios[i].name)) {
+                    break;
+                }
+            }
+            if (j == argc) {
+                continue;
+            }
+        }
+        if (run_scenario(scenarios + i, iters, verbose) < 0) {
+            res = -1;
+        }
+    }
+
+    return res < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
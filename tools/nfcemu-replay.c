@@ -0,0 +1,427 @@
+/*
+ * Copyright (C) 2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Replays a trace recorded with nfcemu_ctx_start_trace(). The host's
+ * packets and commands are fed into a fresh emulator through the
+ * host stub, and everything the emulator sends back is compared to
+ * the recorded answers. The stub's virtual clock follows the records'
+ * timestamps, so timeouts fire at the same points as in the recorded
+ * session.
+ */
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <nfcemu/cmdline.h>
+#include "host-stub.h"
+
+enum {
+    REPLAY_MAX_PENDING = 64
+};
+
+/* a packet from the emulator that has not been matched yet */
+struct replay_pkt {
+    enum nfc_trace_type type;
+    size_t len;
+    uint8_t buf[MAX_NCI_PACKET_LENGTH];
+};
+
+struct replay {
+    struct host_stub host;
+    int verbose;
+    unsigned long nmsgs; /* packets exchanged with the controller */
+    int overflow;
+    size_t head, npending;
+    struct replay_pkt pending[REPLAY_MAX_PENDING];
+};
+
+struct trace_record {
+    enum nfc_trace_type type;
+    size_t len;
+    uint64_t ts;
+    const uint8_t* data;
+    size_t off; /* offset in the trace file */
+};
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static const char*
+type_name(enum nfc_trace_type type)
+{
+    switch (type) {
+        case NFC_TRACE_NCI_MSG:
+            return "NCI-MSG";
+        case NFC_TRACE_HCI_MSG:
+            return "HCI-MSG";
+        case NFC_TRACE_CMDLINE:
+            return "CMDLINE";
+        case NFC_TRACE_NCI_RSP:
+            return "NCI-RSP";
+        case NFC_TRACE_HCI_RSP:
+            return "HCI-RSP";
+        case NFC_TRACE_DELIVERY:
+            return "DELIVERY";
+        case NFC_TRACE_NTF:
+            return "NTF";
+        case NFC_TRACE_DTA:
+            return "DTA";
+    }
+    return "unknown";
+}
+
+static void
+dump(FILE* f, const char* tag, enum nfc_trace_type type,
+     const uint8_t* p, size_t len)
+{
+    size_t i;
+
+    fprintf(f, "%s %s:", tag, type_name(type));
+    for (i = 0; i < len; ++i) {
+        fprintf(f, " %02x", p[i]);
+    }
+    fprintf(f, "\n");
+}
+
+/*
+ * Trace parsing
+ */
+
+static int
+check_header(const uint8_t* p, size_t len)
+{
+    if (len < NFC_TRACE_FILE_HEADER_LENGTH ||
+        memcmp(p, NFC_TRACE_MAGIC, 4)) {
+        fprintf(stderr, "not a trace file\n");
+        return -1;
+    }
+    if (p[4] != NFC_TRACE_VERSION) {
+        fprintf(stderr, "unsupported trace version %u\n", p[4]);
+        return -1;
+    }
+    return 0;
+}
+
+/* Returns 1 if a record has been parsed, 0 at the end of the trace
+ * and -1 on errors. */
+static int
+next_record(const uint8_t* p, size_t len, size_t* off,
+            struct trace_record* rec)
+{
+    const uint8_t* hdr;
+    size_t i;
+
+    if (*off == len) {
+        return 0;
+    }
+    if (len - *off < NFC_TRACE_RECORD_HEADER_LENGTH) {
+        fprintf(stderr, "truncated record header at offset %zu\n", *off);
+        return -1;
+    }
+    hdr = p + *off;
+
+    rec->off = *off;
+    rec->type = hdr[0];
+    rec->len = hdr[1] | (hdr[2] << 8);
+    for (rec->ts = 0, i = 0; i < 8; ++i) {
+        rec->ts |= (uint64_t)hdr[3 + i] << (8 * i);
+    }
+    rec->data = hdr + NFC_TRACE_RECORD_HEADER_LENGTH;
+
+    if (len - *off - NFC_TRACE_RECORD_HEADER_LENGTH < rec->len) {
+        fprintf(stderr, "truncated record at offset %zu\n", *off);
+        return -1;
+    }
+    *off += NFC_TRACE_RECORD_HEADER_LENGTH + rec->len;
+
+    return 1;
+}
+
+/*
+ * Replay
+ */
+
+static void
+recv_pkt(void* data, enum nfc_trace_type type,
+         const uint8_t* pkt, size_t len)
+{
+    struct replay* r = data;
+    struct replay_pkt* out;
+
+    if (r->npending == REPLAY_MAX_PENDING) {
+        r->overflow = 1;
+        return;
+    }
+    assert(len <= sizeof(out->buf));
+
+    out = r->pending + (r->head + r->npending) % REPLAY_MAX_PENDING;
+    out->type = type;
+    out->len = len;
+    memcpy(out->buf, pkt, len);
+    ++r->npending;
+    ++r->nmsgs;
+
+    if (r->verbose) {
+        dump(stdout, "<", type, pkt, len);
+    }
+}
+
+static void
+advance_to(struct replay* r, uint64_t ts)
+{
+    if (ts > r->host.now) {
+        host_stub_advance(&r->host, ts - r->host.now);
+    }
+}
+
+static int
+send_input(struct replay* r, const struct trace_record* rec)
+{
+    static int (* const cmd[])(struct nfcemu_ctx*, char*) = {
+        [NFC_TRACE_CMDLINE_SNEP] = nfc_cmd_snep,
+        [NFC_TRACE_CMDLINE_NCI] = nfc_cmd_nci,
+        [NFC_TRACE_CMDLINE_LLCP] = nfc_cmd_llcp,
+        [NFC_TRACE_CMDLINE_TAG] = nfc_cmd_tag,
+        [NFC_TRACE_CMDLINE_STATS] = nfc_cmd_stats,
+        [NFC_TRACE_CMDLINE_LOG] = nfc_cmd_log
+    };
+    char args[256];
+
+    if (r->verbose) {
+        dump(stdout, ">", rec->type, rec->data, rec->len);
+    }
+
+    switch (rec->type) {
+        case NFC_TRACE_NCI_MSG:
+            if (rec->len > MAX_NCI_PACKET_LENGTH) {
+                break;
+            }
+            ++r->nmsgs;
+            host_stub_send_nci(&r->host, rec->data, rec->len);
+            return 0;
+        case NFC_TRACE_HCI_MSG:
+            if (rec->len > MAX_NCI_PACKET_LENGTH) {
+                break;
+            }
+            ++r->nmsgs;
+            host_stub_send_hci(&r->host, rec->data, rec->len);
+            return 0;
+        case NFC_TRACE_CMDLINE:
+            if (!rec->len || rec->data[0] >= sizeof(cmd)/sizeof(cmd[0]) ||
+                rec->len > sizeof(args)) {
+                break;
+            }
+            memcpy(args, rec->data + 1, rec->len - 1);
+            args[rec->len - 1] = '\0';
+            host_stub_run_cmd(&r->host, cmd[rec->data[0]],
+                              rec->len > 1 ? args : NULL);
+            return 0;
+        default:
+            break;
+    }
+    fprintf(stderr, "invalid record at offset %zu\n", rec->off);
+    return -1;
+}
+
+static int
+check_output(struct replay* r, const struct trace_record* rec)
+{
+    const struct replay_pkt* out;
+
+    if (!r->npending) {
+        /* the packet may come from a timeout */
+        advance_to(r, rec->ts);
+    }
+    if (!r->npending) {
+        fprintf(stderr, "offset %zu: missing packet\n", rec->off);
+        dump(stderr, "expected", rec->type, rec->data, rec->len);
+        return -1;
+    }
+    out = r->pending + r->head;
+
+    if (out->type != rec->type || out->len != rec->len ||
+        memcmp(out->buf, rec->data, rec->len)) {
+        fprintf(stderr, "offset %zu: packets differ\n", rec->off);
+        dump(stderr, "expected", rec->type, rec->data, rec->len);
+        dump(stderr, "received", out->type, out->buf, out->len);
+        return -1;
+    }
+    r->head = (r->head + 1) % REPLAY_MAX_PENDING;
+    --r->npending;
+
+    return 0;
+}
+
+static int
+replay_session(struct replay* r, const uint8_t* p, size_t len)
+{
+    struct trace_record rec;
+    size_t off;
+    int res;
+
+    off = NFC_TRACE_FILE_HEADER_LENGTH;
+
+    while ((res = next_record(p, len, &off, &rec)) > 0) {
+        if (rec.type & 0x80) {
+            res = check_output(r, &rec);
+        } else {
+            advance_to(r, rec.ts);
+            res = send_input(r, &rec);
+        }
+        if (res < 0) {
+            return -1;
+        }
+        if (r->overflow) {
+            fprintf(stderr, "offset %zu: too many unexpected packets\n",
+                    rec.off);
+            return -1;
+        }
+    }
+    if (res < 0) {
+        return -1;
+    }
+    if (r->npending) {
+        const struct replay_pkt* out = r->pending + r->head;
+        fprintf(stderr, "%zu unexpected packet(s) at end of trace\n",
+                r->npending);
+        dump(stderr, "received", out->type, out->buf, out->len);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+replay(const uint8_t* p, size_t len, unsigned long sessions, int verbose)
+{
+    static struct replay r;
+    unsigned long i, nmsgs;
+    uint64_t t0, ns;
+
+    nmsgs = 0;
+    t0 = now_ns();
+
+    for (i = 0; i < sessions; ++i) {
+        int res;
+
+        memset(&r, 0, sizeof(r));
+        r.verbose = verbose && !i;
+
+        if (host_stub_init(&r.host) < 0) {
+            fprintf(stderr, "failed to create emulator\n");
+            return -1;
+        }
+        r.host.recv = recv_pkt;
+        r.host.recv_data = &r;
+
+        res = replay_session(&r, p, len);
+        nmsgs += r.nmsgs;
+
+        host_stub_uninit(&r.host);
+
+        if (res < 0) {
+            fprintf(stderr, "replay failed in session %lu\n", i + 1);
+            return -1;
+        }
+    }
+    ns = now_ns() - t0;
+
+    printf("%lu sessions, %lu msgs in %.3f ms: "
+           "%.0f sessions/s, %.0f msgs/s\n",
+           sessions, nmsgs, ns / 1e6,
+           ns ? sessions * 1e9 / ns : 0.0, ns ? nmsgs * 1e9 / ns : 0.0);
+
+    return 0;
+}
+
+static void
+usage(const char* argv0)
+{
+    fprintf(stderr, "usage: %s [-n sessions] [-v] trace\n", argv0);
+}
+
+int
+main(int argc, char* argv[])
+{
+    unsigned long sessions;
+    int verbose, opt, fd, res;
+    struct stat st;
+    void* p;
+
+    sessions = 1;
+    verbose = 0;
+
+    while ((opt = getopt(argc, argv, "n:v")) != -1) {
+        switch (opt) {
+            case 'n':
+                sessions = strtoul(optarg, NULL, 0);
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (!sessions || optind + 1 != argc) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    fd = open(argv[optind], O_RDONLY);
+    if (fd < 0) {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+    if (fstat(fd, &st) < 0) {
+        perror("fstat");
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    if (!st.st_size) {
+        fprintf(stderr, "not a trace file\n");
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        return EXIT_FAILURE;
+    }
+
+    res = check_header(p, st.st_size);
+    if (!res) {
+        res = replay(p, st.st_size, sessions, verbose);
+    }
+    munmap(p, st.st_size);
+
+    return res < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
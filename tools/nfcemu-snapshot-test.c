@@ -0,0 +1,281 @@
+/*
+ * Copyright (C) 2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Tests for nfcemu_snapshot() and nfcemu_restore(). A host stub
+ * drives the emulator into a state with open connections, queued
+ * LLCP PDUs and formatted tags, and takes a snapshot of it. The
+ * snapshot has to survive a round trip unchanged. Truncated blobs
+ * have to be rejected, and corrupted ones must neither crash the
+ * emulator on restore nor on the traffic that follows.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <nfcemu/cmdline.h>
+#include "host-stub.h"
+
+struct test {
+    int verbose;
+    unsigned long nerrs;
+};
+
+static void
+fail(struct test* t, const char* fmt, size_t arg)
+{
+    ++t->nerrs;
+    fprintf(stderr, "FAIL: ");
+    fprintf(stderr, fmt, arg);
+    fprintf(stderr, "\n");
+}
+
+static int
+init_host(struct host_stub* host)
+{
+    if (host_stub_init(host) < 0) {
+        return -1;
+    }
+    /* restoring broken blobs logs lots of errors */
+    nfcemu_ctx_set_log_level(host->ctx, NFCEMU_LOG_NONE);
+
+    return 0;
+}
+
+static void
+nci(struct host_stub* host, const uint8_t* pkt, size_t len)
+{
+    host_stub_send_nci(host, pkt, len);
+    host_stub_advance(host, 0);
+}
+
+#define NCI(_host, ...) \
+    do { \
+        static const uint8_t pkt_[] = { __VA_ARGS__ }; \
+        nci((_host), pkt_, sizeof(pkt_)); \
+    } while (0)
+
+/* Runs a command-line handler on a modifiable copy of 'args'. */
+static int
+cmd(struct host_stub* host, int (*func)(struct nfcemu_ctx*, char*),
+    const char* args)
+{
+    char buf[512];
+
+    snprintf(buf, sizeof(buf), "%s", args);
+
+    return func(host->ctx, buf);
+}
+
+/* Leaves something in most parts of the snapshot. */
+static void
+setup(struct host_stub* host)
+{
+    static const uint8_t ndef[] = {
+        0xd1, 0x01, 0x04, 0x54, 0x02, 'e', 'n', 'x'
+    };
+
+    nfcemu_ctx_format_tag(host->ctx, 3, 1024);
+    nfcemu_ctx_set_tag_ndef(host->ctx, 3, ndef, sizeof(ndef));
+
+    cmd(host, nfc_cmd_llcp, "symm 0 immediate");
+    cmd(host, nfc_cmd_llcp, "miu 0 1024");
+
+    NCI(host, 0x20, 0x00, 0x01, 0x01); /* CORE_RESET_CMD */
+    NCI(host, 0x20, 0x01, 0x00); /* CORE_INIT_CMD */
+    NCI(host, 0x21, 0x03, 0x05, 0x02, 0x00, 0x01, 0x02, 0x01);
+    cmd(host, nfc_cmd_nci, "rf_intf_activated_ntf 0");
+
+    /* a long SNEP message whose fragments wait for 'Continue' */
+    cmd(host, nfc_cmd_snep,
+        "put 4 32 [0,1,VA,,QUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFB"
+        "QUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFB"
+        "QUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFB"
+        "QUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFB"
+        "QUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFB]");
+    NCI(host, 0x00, 0x00, 0x02, 0x00, 0x00); /* SYMM */
+
+    /* a loopback connection and the first segment of a frame */
+    NCI(host, 0x20, 0x04, 0x02, 0x01, 0x00);
+    NCI(host, 0x11, 0x00, 0x04, 'a', 'b', 'c', 'd');
+}
+
+/* Exchanges a few packets on the restored state. */
+static void
+traffic(struct host_stub* host)
+{
+    NCI(host, 0x00, 0x00, 0x02, 0x00, 0x00); /* SYMM */
+    NCI(host, 0x00, 0x00, 0x06, 0x81, 0x84, 0x02, 0x02, 0x07, 0xff);
+    NCI(host, 0x01, 0x00, 0x02, 'e', 'f');
+    NCI(host, 0x20, 0x05, 0x01, 0x01); /* CORE_CONN_CLOSE_CMD */
+    host_stub_advance(host, 1000000000ull);
+    NCI(host, 0x21, 0x06, 0x01, 0x00); /* RF_DEACTIVATE_CMD */
+    host_stub_advance(host, 1000000000ull);
+}
+
+static uint8_t*
+snapshot(struct host_stub* host, size_t* len)
+{
+    uint8_t* buf;
+
+    *len = nfcemu_snapshot(host->nfc, NULL, 0);
+    buf = malloc(*len);
+    if (!buf) {
+        return NULL;
+    }
+    if (nfcemu_snapshot(host->nfc, buf, *len) != *len) {
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+/* A restored snapshot has to produce the same snapshot again. */
+static void
+test_round_trip(struct test* t, struct host_stub* host,
+                const uint8_t* blob, size_t len)
+{
+    uint8_t* buf;
+    size_t buflen;
+
+    if (nfcemu_restore(host->nfc, blob, len) < 0) {
+        fail(t, "restoring a snapshot of %zu bytes", len);
+        return;
+    }
+    buf = snapshot(host, &buflen);
+    if (!buf || (buflen != len) || memcmp(buf, blob, len)) {
+        fail(t, "round trip changed the snapshot of %zu bytes", len);
+    }
+    free(buf);
+}
+
+static void
+test_truncated(struct test* t, struct host_stub* host,
+               const uint8_t* blob, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; ++i) {
+        /* a copy of the exact length lets ASan catch overreads */
+        uint8_t* buf = malloc(i ? i : 1);
+        if (!buf) {
+            fail(t, "out of memory at length %zu", i);
+            return;
+        }
+        memcpy(buf, blob, i);
+        if (!nfcemu_restore(host->nfc, buf, i)) {
+            fail(t, "accepted a snapshot truncated to %zu bytes", i);
+        }
+        free(buf);
+    }
+}
+
+static void
+test_corrupted(struct test* t, struct host_stub* host,
+               const uint8_t* blob, size_t len)
+{
+    static const uint8_t flip[] = { 0x01, 0x80, 0xff };
+    unsigned long nrestored;
+    uint8_t* buf;
+    size_t i, j;
+
+    buf = malloc(len);
+    if (!buf) {
+        fail(t, "out of memory at length %zu", len);
+        return;
+    }
+    memcpy(buf, blob, len);
+
+    for (nrestored = 0, i = 0; i < len; ++i) {
+        for (j = 0; j < sizeof(flip); ++j) {
+            buf[i] ^= flip[j];
+            if (!nfcemu_restore(host->nfc, buf, len)) {
+                /* the state may be odd, but it has to work */
+                uint8_t* p;
+                size_t plen;
+
+                ++nrestored;
+                traffic(host);
+                p = snapshot(host, &plen);
+                if (!p) {
+                    fail(t, "no snapshot after corrupting byte %zu", i);
+                }
+                free(p);
+            }
+            buf[i] ^= flip[j];
+        }
+    }
+    if (t->verbose) {
+        printf("%lu of %zu corrupted snapshots restored\n",
+               nrestored, len * sizeof(flip));
+    }
+    free(buf);
+}
+
+int
+main(int argc, char* argv[])
+{
+    struct test t;
+    struct host_stub host, host2;
+    uint8_t* blob;
+    size_t len;
+
+    t.verbose = (argc > 1) && !strcmp(argv[1], "-v");
+    t.nerrs = 0;
+
+    if (init_host(&host) < 0) {
+        fprintf(stderr, "creating the host stub failed\n");
+        return EXIT_FAILURE;
+    }
+    if (init_host(&host2) < 0) {
+        fprintf(stderr, "creating the host stub failed\n");
+        host_stub_uninit(&host);
+        return EXIT_FAILURE;
+    }
+
+    setup(&host);
+    blob = snapshot(&host, &len);
+    if (!blob) {
+        fprintf(stderr, "taking the snapshot failed\n");
+        host_stub_uninit(&host2);
+        host_stub_uninit(&host);
+        return EXIT_FAILURE;
+    }
+    if (t.verbose) {
+        printf("snapshot of %zu bytes\n", len);
+    }
+
+    /* into the same device and into a fresh one */
+    test_round_trip(&t, &host, blob, len);
+    test_round_trip(&t, &host2, blob, len);
+
+    test_truncated(&t, &host2, blob, len);
+    test_round_trip(&t, &host2, blob, len);
+
+    test_corrupted(&t, &host2, blob, len);
+    test_round_trip(&t, &host2, blob, len);
+
+    free(blob);
+    host_stub_uninit(&host2);
+    host_stub_uninit(&host);
+
+    if (t.nerrs) {
+        printf("%lu snapshot tests failed\n", t.nerrs);
+        return EXIT_FAILURE;
+    }
+    printf("snapshot tests passed\n");
+
+    return EXIT_SUCCESS;
+}
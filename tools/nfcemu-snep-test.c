@@ -0,0 +1,254 @@
+/*
+ * Copyright (C) 2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Tests for 'snep put'. A host stub plays the SNEP server on the
+ * other side of the LLCP link. It accepts the connection, answers
+ * the first fragment with 'Continue', collects the I PDUs and parses
+ * the NDEF message from the reassembled SNEP request. The record's
+ * payload is longer than 255 bytes, so it needs a 4-byte PAYLOAD
+ * LENGTH field.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <nfcemu/cmdline.h>
+#include "host-stub.h"
+
+enum {
+    PAYLOAD_LENGTH = 300,
+    SNEP_HEADER_LENGTH = 6,
+    SNEP_SERVER_SAP = 4,
+    CLIENT_SAP = 32,
+    MAX_ROUNDS = 32
+};
+
+struct snep_host {
+    struct host_stub host;
+    /* last LLCP PDU from the controller */
+    size_t pdulen;
+    uint8_t pdu[MAX_NCI_PACKET_LENGTH];
+    /* reassembled SNEP request */
+    size_t msglen;
+    uint8_t msg[1024];
+};
+
+static void
+recv_pkt(void* data, enum nfc_trace_type type, const uint8_t* pkt, size_t len)
+{
+    struct snep_host* sh = data;
+
+    /* data packets on the static RF connection carry LLCP PDUs */
+    if ((len < 5) || (pkt[0] & 0xef)) {
+        return;
+    }
+    sh->pdulen = len - 3;
+    memcpy(sh->pdu, pkt + 3, sh->pdulen);
+}
+
+static void
+send_llcp(struct snep_host* sh, const uint8_t* pdu, size_t len)
+{
+    uint8_t pkt[MAX_NCI_PACKET_LENGTH];
+
+    pkt[0] = 0x00;
+    pkt[1] = 0x00;
+    pkt[2] = len;
+    memcpy(pkt + 3, pdu, len);
+
+    sh->pdulen = 0;
+    host_stub_send_nci(&sh->host, pkt, len + 3);
+    host_stub_advance(&sh->host, 0);
+}
+
+static void
+nci(struct host_stub* host, const uint8_t* pkt, size_t len)
+{
+    host_stub_send_nci(host, pkt, len);
+    host_stub_advance(host, 0);
+}
+
+#define NCI(_host, ...) \
+    do { \
+        static const uint8_t pkt_[] = { __VA_ARGS__ }; \
+        nci((_host), pkt_, sizeof(pkt_)); \
+    } while (0)
+
+/* Runs a command-line handler on a modifiable copy of 'args'. */
+static int
+cmd(struct host_stub* host, int (*func)(struct nfcemu_ctx*, char*),
+    const char* args)
+{
+    char buf[512];
+
+    snprintf(buf, sizeof(buf), "%s", args);
+
+    return func(host->ctx, buf);
+}
+
+static int
+msg_complete(const struct snep_host* sh)
+{
+    const uint8_t* m = sh->msg;
+
+    return (sh->msglen >= SNEP_HEADER_LENGTH) &&
+           (sh->msglen >= SNEP_HEADER_LENGTH +
+                          (((size_t)m[2] << 24) | (m[3] << 16) |
+                           (m[4] << 8) | m[5]));
+}
+
+/* Answers the controller's LLCP PDUs until the SNEP request is
+ * complete. Returns 0 on success, or -1 otherwise. */
+static int
+run_server(struct snep_host* sh)
+{
+    static const uint8_t symm[] = { 0x00, 0x00 };
+    static const uint8_t cc[] = {
+        (CLIENT_SAP << 2) | 0x01, 0x80 | SNEP_SERVER_SAP
+    };
+    unsigned long i;
+
+    send_llcp(sh, symm, sizeof(symm));
+
+    for (i = 0; (i < MAX_ROUNDS) && !msg_complete(sh); ++i) {
+        const uint8_t* pdu = sh->pdu;
+        unsigned char ptype;
+
+        if (sh->pdulen < 2) {
+            send_llcp(sh, symm, sizeof(symm));
+            continue;
+        }
+        ptype = ((pdu[0] & 0x03) << 2) | (pdu[1] >> 6);
+
+        if (ptype == 0x4) { /* CONNECT */
+            send_llcp(sh, cc, sizeof(cc));
+        } else if (ptype == 0xc) { /* I */
+            size_t len = sh->pdulen - 3;
+            uint8_t nr = ((pdu[2] >> 4) + 1) & 0x0f;
+
+            if (sh->msglen + len > sizeof(sh->msg)) {
+                return -1;
+            }
+            memcpy(sh->msg + sh->msglen, pdu + 3, len);
+            sh->msglen += len;
+
+            if ((sh->msglen == len) && !msg_complete(sh)) {
+                /* first fragment; request the rest with 'Continue' */
+                const uint8_t i_pdu[] = {
+                    (CLIENT_SAP << 2) | 0x03, SNEP_SERVER_SAP, nr,
+                    0x10, 0x80, 0x00, 0x00, 0x00, 0x00
+                };
+                send_llcp(sh, i_pdu, sizeof(i_pdu));
+            } else {
+                const uint8_t rr[] = {
+                    (CLIENT_SAP << 2) | 0x03, 0x40 | SNEP_SERVER_SAP, nr
+                };
+                send_llcp(sh, rr, sizeof(rr));
+            }
+        } else {
+            send_llcp(sh, symm, sizeof(symm));
+        }
+    }
+    return msg_complete(sh) ? 0 : -1;
+}
+
+/* Parses the SNEP PUT request's only NDEF record. Returns the
+ * payload length, or -1 on errors. */
+static long
+parse_put(const struct snep_host* sh, const uint8_t** payload)
+{
+    const uint8_t* rec = sh->msg + SNEP_HEADER_LENGTH;
+    size_t reclen = sh->msglen - SNEP_HEADER_LENGTH;
+    size_t tlen, plen;
+
+    if ((sh->msg[1] != 0x02) || (reclen < 6)) {
+        return -1; /* no PUT request */
+    }
+    if (rec[0] & 0x10) {
+        return -1; /* SR flag set */
+    }
+    tlen = rec[1];
+    plen = ((size_t)rec[2] << 24) | (rec[3] << 16) | (rec[4] << 8) | rec[5];
+    if (6 + tlen + plen != reclen) {
+        return -1;
+    }
+    *payload = rec + 6 + tlen;
+
+    return plen;
+}
+
+int
+main(void)
+{
+    struct snep_host* sh;
+    char args[512];
+    const uint8_t* payload;
+    long plen;
+    size_t i;
+    int res;
+
+    sh = calloc(1, sizeof(*sh));
+    if (!sh) {
+        return EXIT_FAILURE;
+    }
+    if (host_stub_init(&sh->host) < 0) {
+        fprintf(stderr, "creating the host stub failed\n");
+        free(sh);
+        return EXIT_FAILURE;
+    }
+    sh->host.recv = recv_pkt;
+    sh->host.recv_data = sh;
+
+    cmd(&sh->host, nfc_cmd_llcp, "symm 0 immediate");
+
+    NCI(&sh->host, 0x20, 0x00, 0x01, 0x01); /* CORE_RESET_CMD */
+    NCI(&sh->host, 0x20, 0x01, 0x00); /* CORE_INIT_CMD */
+    NCI(&sh->host, 0x21, 0x03, 0x05, 0x02, 0x00, 0x01, 0x02, 0x01);
+    cmd(&sh->host, nfc_cmd_nci, "rf_intf_activated_ntf 0");
+
+    /* 'QUJD' decodes to 'ABC' */
+    res = snprintf(args, sizeof(args), "put %d %d [0,1,VA,,",
+                   SNEP_SERVER_SAP, CLIENT_SAP);
+    for (i = 0; i < PAYLOAD_LENGTH / 3; ++i) {
+        res += snprintf(args + res, sizeof(args) - res, "QUJD");
+    }
+    snprintf(args + res, sizeof(args) - res, "]");
+
+    res = nfc_cmd_snep(sh->host.ctx, args);
+    if (!res) {
+        res = run_server(sh);
+    }
+    if (!res) {
+        plen = parse_put(sh, &payload);
+        res = (plen == PAYLOAD_LENGTH) ? 0 : -1;
+    }
+    for (i = 0; !res && (i < PAYLOAD_LENGTH); ++i) {
+        if (payload[i] != "ABC"[i % 3]) {
+            res = -1;
+        }
+    }
+
+    host_stub_uninit(&sh->host);
+    free(sh);
+
+    if (res < 0) {
+        printf("SNEP tests failed\n");
+        return EXIT_FAILURE;
+    }
+    printf("SNEP tests passed\n");
+
+    return EXIT_SUCCESS;
+}